@@ -106,13 +106,8 @@ let package = Package(
         .target(
             name: "Blake3",
             path: "blake3",
-            exclude: ["blake3_sse2.c", "blake3_neon.c"],
-            publicHeadersPath: ".",
-            cSettings: [
-                .define("BLAKE3_NO_SSE41", to: "1"),
-                .define("BLAKE3_NO_AVX512", to: "1"),
-                .define("BLAKE3_NO_AVX2", to: "1"),
-            ]
+            exclude: ["blake3_sse2.c", "blake3_sse41.c", "blake3_avx2.c", "blake3_avx512.c", "blake3_neon.c"],
+            publicHeadersPath: "."
         ),
 
         .target(
@@ -122,9 +117,15 @@ let package = Package(
             publicHeadersPath: "."
         ),
 
+        .target(
+            name: "XxHash",
+            path: "xxhash",
+            publicHeadersPath: "."
+        ),
+
         .target(
             name: "FingerprintLib",
-            dependencies: ["Common", "GlobCpp", "GlobOverlap", "Blake3", "FastCrc32", "Yyjson", "YyjsonCpp"],
+            dependencies: ["Common", "GlobCpp", "GlobOverlap", "Blake3", "FastCrc32", "XxHash", "Yyjson", "YyjsonCpp"],
             path: "fingerprint",
             exclude: ["main.cpp"],
             cxxSettings: [
@@ -0,0 +1,19 @@
+// The kernel is compiled with its instruction set enabled for this translation
+// unit only, so the library as a whole keeps the baseline x86_64 target and
+// blake3_dispatch.c calls into the kernel only after cpuid reports support.
+#if defined( __x86_64__ )
+	#include <immintrin.h>
+	#include "blake3_impl.h"
+	#if defined( __clang__ )
+		#pragma clang attribute push (__attribute__((target("avx512f,avx512vl"))), apply_to = function)
+	#else
+		#pragma GCC push_options
+		#pragma GCC target("avx512f,avx512vl")
+	#endif
+	#include "blake3_avx512.c"
+	#if defined( __clang__ )
+		#pragma clang attribute pop
+	#else
+		#pragma GCC pop_options
+	#endif
+#endif
@@ -1,8 +1,40 @@
 #if defined( __arm64__ )
 	#include "ab_neon_eor3_crc32c_v9s3x2e_s3.c"
 #elif defined( __x86_64__ )
-    #include <crc32intrin.h>
+	#include <crc32intrin.h>
+	#include <stdatomic.h>
+
+	// The SSE4.2 kernel runs on every supported x86_64 CPU and stays the fallback.
+	// crc32c_avx512.c is picked at runtime on CPUs with AVX-512F and VPCLMULQDQ.
+	#define crc32_impl crc32c_sse42_impl
 	#include "ab_sse_crc32c_v4s3x3k4096e.c"
+	#undef crc32_impl
+
+	uint32_t crc32c_avx512_impl(uint32_t crc0, const char* buf, size_t len);
+
+	typedef uint32_t (*crc32_kernel_fn)(uint32_t crc0, const char* buf, size_t len);
+
+	static uint32_t crc32_resolve(uint32_t crc0, const char* buf, size_t len);
+
+	// Resolved on the first call. Threads racing on it store the same value.
+	static _Atomic(crc32_kernel_fn) g_crc32_kernel = crc32_resolve;
+
+	// Darwin enables the AVX-512 register state lazily on first use, so xgetbv alone
+	// under-reports it there; __builtin_cpu_supports accounts for that.
+	static uint32_t crc32_resolve(uint32_t crc0, const char* buf, size_t len)
+	{
+		crc32_kernel_fn kernel = crc32c_sse42_impl;
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq"))
+			kernel = crc32c_avx512_impl;
+		atomic_store_explicit(&g_crc32_kernel, kernel, memory_order_relaxed);
+		return kernel(crc0, buf, len);
+	}
+
+	uint32_t crc32_impl(uint32_t crc0, const char* buf, size_t len)
+	{
+		return atomic_load_explicit(&g_crc32_kernel, memory_order_relaxed)(crc0, buf, len);
+	}
 #else
 	#error Unsupported architecure
 #endif
@@ -0,0 +1,106 @@
+/* CRC32C folding with 512-bit VPCLMULQDQ, for x86_64 CPUs with AVX-512F and */
+/* VPCLMULQDQ (Ice Lake and later). Not generated: it is the folding scheme of */
+/* the corsix kernels widened to four zmm accumulators, 256 bytes per iteration. */
+/* */
+/* Compiled as its own translation unit with the instruction set enabled for */
+/* this file only; crc32c_arch.c calls it after checking the CPU supports it. */
+/* Fold constants are x^(8n+31) and x^(8n-33) mod P (bit-reflected) for a fold */
+/* distance of n bytes, the same form as the generated kernels use. */
+/* MIT licensed */
+
+#if defined(__x86_64__)
+
+#include <stddef.h>
+#include <stdint.h>
+#include <immintrin.h>
+
+#if defined(__clang__)
+#pragma clang attribute push (__attribute__((target("sse4.2,pclmul,avx512f,vpclmulqdq"))), apply_to = function)
+#else
+#pragma GCC push_options
+#pragma GCC target("sse4.2,pclmul,avx512f,vpclmulqdq")
+#endif
+
+#define CRC_AINLINE static __inline __attribute__((always_inline))
+#define CRC_EXPORT extern
+
+#define clmul_lo(a, b) (_mm512_clmulepi64_epi128((a), (b), 0))
+#define clmul_hi(a, b) (_mm512_clmulepi64_epi128((a), (b), 17))
+
+/* Fold one accumulator forward by the distance k was built for and add data. */
+CRC_AINLINE __m512i fold_xor(__m512i x, __m512i k, __m512i data) {
+  return _mm512_ternarylogic_epi64(clmul_lo(x, k), clmul_hi(x, k), data, 0x96);
+}
+
+CRC_AINLINE __m512i fold_k(uint32_t lo, uint32_t hi) {
+  return _mm512_broadcast_i32x4(_mm_setr_epi32(lo, 0, hi, 0));
+}
+
+CRC_EXPORT uint32_t crc32c_avx512_impl(uint32_t crc0, const char* buf, size_t len) {
+  crc0 = ~crc0;
+  for (; len && ((uintptr_t)buf & 7); --len) {
+    crc0 = _mm_crc32_u8(crc0, *buf++);
+  }
+  if (len >= 512) {
+    /* Align the vector loads to cache lines. */
+    for (; (uintptr_t)buf & 63; buf += 8, len -= 8) {
+      crc0 = _mm_crc32_u64(crc0, *(const uint64_t*)buf);
+    }
+    __m512i x0 = _mm512_loadu_si512((const void*)buf);
+    __m512i x1 = _mm512_loadu_si512((const void*)(buf + 64));
+    __m512i x2 = _mm512_loadu_si512((const void*)(buf + 128));
+    __m512i x3 = _mm512_loadu_si512((const void*)(buf + 192));
+    __m512i k;
+    x0 = _mm512_xor_si512(x0, _mm512_castsi128_si512(_mm_cvtsi32_si128(crc0)));
+    k = fold_k(0xdcb17aa4, 0xb9e02b86);
+    buf += 256;
+    len -= 256;
+    /* Main loop. */
+    while (len >= 256) {
+      x0 = fold_xor(x0, k, _mm512_loadu_si512((const void*)buf));
+      x1 = fold_xor(x1, k, _mm512_loadu_si512((const void*)(buf + 64)));
+      x2 = fold_xor(x2, k, _mm512_loadu_si512((const void*)(buf + 128)));
+      x3 = fold_xor(x3, k, _mm512_loadu_si512((const void*)(buf + 192)));
+      buf += 256;
+      len -= 256;
+    }
+    /* Reduce x0 ... x3 to just x0. */
+    k = fold_k(0x6992cea2, 0x0d3b6092);
+    x0 = fold_xor(x0, k, x2);
+    x1 = fold_xor(x1, k, x3);
+    k = fold_k(0x740eef02, 0x9e4addf8);
+    x0 = fold_xor(x0, k, x1);
+    /* Remaining whole 64 byte blocks. */
+    for (; len >= 64; buf += 64, len -= 64) {
+      x0 = fold_xor(x0, k, _mm512_loadu_si512((const void*)buf));
+    }
+    /* Reduce the four 128 bit lanes of x0 to one: lanes 0 ... 2 are folded by */
+    /* 48, 32 and 16 bytes onto lane 3. */
+    k = _mm512_setr_epi32(0x1c291d04, 0, 0xddc0152b, 0,
+                          0x3da6d0cb, 0, 0xba4fc28e, 0,
+                          0xf20c0dfe, 0, 0x493c7d27, 0,
+                          0, 0, 0, 0);
+    __m512i y0 = _mm512_ternarylogic_epi64(clmul_lo(x0, k), clmul_hi(x0, k),
+                                           _mm512_maskz_mov_epi64(0xc0, x0), 0x96);
+    __m256i y1 = _mm256_xor_si256(_mm512_castsi512_si256(y0), _mm512_extracti64x4_epi64(y0, 1));
+    __m128i x = _mm_xor_si128(_mm256_castsi256_si128(y1), _mm256_extracti128_si256(y1, 1));
+    /* Reduce 128 bits to 32 bits, and multiply by x^32. */
+    crc0 = _mm_crc32_u64(0, _mm_extract_epi64(x, 0));
+    crc0 = _mm_crc32_u64(crc0, _mm_extract_epi64(x, 1));
+  }
+  for (; len >= 8; buf += 8, len -= 8) {
+    crc0 = _mm_crc32_u64(crc0, *(const uint64_t*)buf);
+  }
+  for (; len; --len) {
+    crc0 = _mm_crc32_u8(crc0, *buf++);
+  }
+  return ~crc0;
+}
+
+#if defined(__clang__)
+#pragma clang attribute pop
+#else
+#pragma GCC pop_options
+#endif
+
+#endif
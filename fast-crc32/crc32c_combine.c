@@ -0,0 +1,63 @@
+#include <stddef.h>
+#include <stdint.h>
+
+// CRC32C of a concatenation from the CRCs of its parts, so that ranges of one
+// buffer can be checksummed independently and merged into the same value
+// crc32_impl() returns for the whole buffer:
+//
+//   crc32_impl(0, A || B) == crc32c_combine(crc32_impl(0, A), crc32_impl(0, B), len(B))
+//
+// Appending len(B) bytes multiplies the CRC of A by x^(8 * len(B)) modulo the
+// (reflected) Castagnoli polynomial; the pre- and post-inversion crc32_impl
+// applies cancel out in the xor. Same technique as zlib's crc32_combine(),
+// O(log len) GF(2) multiplications with no tables, independent of which
+// architecture-specific crc32_impl was compiled.
+
+#define CRC32C_POLY 0x82F63B78u
+
+// a * b modulo the polynomial, both in reflected bit order (x^0 is the high bit)
+static uint32_t multmodp(uint32_t a, uint32_t b)
+{
+	uint32_t m = (uint32_t)1 << 31;
+	uint32_t p = 0;
+	for (;;)
+	{
+		if (a & m)
+		{
+			p ^= b;
+			if ((a & (m - 1)) == 0)
+				break;
+		}
+		m >>= 1;
+		b = (b & 1) ? ((b >> 1) ^ CRC32C_POLY) : (b >> 1);
+	}
+	return p;
+}
+
+// x^(8 * len) modulo the polynomial
+static uint32_t x8nmodp(size_t len)
+{
+	uint32_t p = (uint32_t)1 << 31;    // x^0
+	uint32_t x8k = (uint32_t)1 << 23;  // x^8: one byte
+	while (len != 0)
+	{
+		if (len & 1)
+			p = multmodp(x8k, p);
+		len >>= 1;
+		x8k = multmodp(x8k, x8k);
+	}
+	return p;
+}
+
+uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b)
+{
+	return multmodp(x8nmodp(len_b), crc_a) ^ crc_b;
+}
+
+// CRC32C of len zero bytes, the same as crc32_impl(0, zeros, len) without the zeros:
+// the register starts all ones (the pre-inversion) and each zero byte multiplies it
+// by x^8. Lets the holes of a sparse file be checksummed without reading them.
+uint32_t crc32c_zeros(size_t len)
+{
+	return ~multmodp(x8nmodp(len), 0xFFFFFFFFu);
+}
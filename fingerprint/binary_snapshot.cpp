@@ -0,0 +1,424 @@
+//
+//  binary_snapshot.cpp
+//  fingerprint
+//
+
+#include "binary_snapshot.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <new>
+
+#include "CFObj.h"
+#include "CFStr.h"
+#include "CFArr.h"
+#include "CFDict.h"
+
+extern "C" uint32_t crc32_impl(uint32_t crc0, const char* buf, size_t len);
+
+using namespace fpsnap;
+
+static uint32_t algorithm_tag(FileHashAlgorithm algorithm) noexcept
+{
+    if (algorithm == FileHashAlgorithm::CRC32C)
+        return kAlgoCrc32c;
+    if (algorithm == FileHashAlgorithm::XXH3)
+        return kAlgoXxh3;
+    return kAlgoBlake3;
+}
+
+static FileHashAlgorithm algorithm_from_tag(uint32_t tag) noexcept
+{
+    if (tag == kAlgoCrc32c)
+        return FileHashAlgorithm::CRC32C;
+    if (tag == kAlgoXxh3)
+        return FileHashAlgorithm::XXH3;
+    return FileHashAlgorithm::BLAKE3;
+}
+
+bool is_binary_snapshot_path(const std::string& path) noexcept
+{
+    std::string ext = std::filesystem::path(path).extension().string();
+    std::transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+    return ext == ".fpsnap";
+}
+
+// ---------------------------------------------------------------------------
+// params blob: for each of input_paths, glob_patterns, regex_patterns and
+// exclude_patterns a uint32 count followed by that many strings, then the
+// timestamp string. A string is a uint32 length followed by its bytes.
+// ---------------------------------------------------------------------------
+
+static void append_u32(std::string& out, uint32_t value) noexcept
+{
+    out.append((const char*)&value, sizeof(value));
+}
+
+static void append_param_string(std::string& out, const std::string& value) noexcept
+{
+    append_u32(out, (uint32_t)value.size());
+    out.append(value);
+}
+
+static std::string encode_params(const SnapshotMetadata& metadata) noexcept
+{
+    std::string params;
+    for (const auto* list : { &metadata.input_paths, &metadata.glob_patterns,
+                              &metadata.regex_patterns, &metadata.exclude_patterns })
+    {
+        append_u32(params, (uint32_t)list->size());
+        for (const auto& value : *list)
+            append_param_string(params, value);
+    }
+    append_param_string(params, metadata.snapshot_timestamp);
+    return params;
+}
+
+static bool decode_params(const char* data, size_t size, SnapshotMetadata& metadata) noexcept
+{
+    size_t pos = 0;
+    auto read_u32 = [&](uint32_t& value)
+    {
+        if (size - pos < sizeof(value))
+            return false;
+        memcpy(&value, data + pos, sizeof(value));
+        pos += sizeof(value);
+        return true;
+    };
+    auto read_string = [&](std::string& value)
+    {
+        uint32_t len = 0;
+        if (!read_u32(len) || (size - pos < len))
+            return false;
+        value.assign(data + pos, len);
+        pos += len;
+        return true;
+    };
+
+    for (auto* list : { &metadata.input_paths, &metadata.glob_patterns,
+                        &metadata.regex_patterns, &metadata.exclude_patterns })
+    {
+        uint32_t count = 0;
+        if (!read_u32(count))
+            return false;
+        for (uint32_t i = 0; i < count; i++)
+        {
+            std::string value;
+            if (!read_string(value))
+                return false;
+            list->push_back(std::move(value));
+        }
+    }
+    return read_string(metadata.snapshot_timestamp);
+}
+
+// ---------------------------------------------------------------------------
+// Writer
+// ---------------------------------------------------------------------------
+
+int save_binary_snapshot(const std::string& path,
+                         const SnapshotMetadata& metadata,
+                         const std::vector<std::pair<std::string, FileInfo>>& files,
+                         const std::vector<std::pair<std::string, uint64_t>>& directories) noexcept
+{
+    if (path.empty())
+    {
+        std::cerr << "Error: snapshot path is empty\n";
+        return EXIT_FAILURE;
+    }
+
+    try
+    {
+        std::vector<SnapFileRecord> file_records;
+        file_records.reserve(files.size());
+        std::string strings;
+
+        for (const auto& [file_path, info] : files)
+        {
+            if (info.is_nonexistent()) continue;
+
+            SnapFileRecord record = {};
+            record.path_offset = strings.size();
+            record.path_len = (uint32_t)file_path.size();
+            record.mode = (uint32_t)info.mode;
+            record.hash = (metadata.hash_algorithm == FileHashAlgorithm::CRC32C) ? (uint64_t)info.hash.crc32c : info.hash.blake3;
+            record.size = (int64_t)info.size;
+            record.inode = (uint64_t)info.inode;
+            record.mtime_ns = info.mtime_ns;
+            file_records.push_back(record);
+            strings.append(file_path);
+        }
+
+        std::vector<SnapDirectoryRecord> directory_records;
+        directory_records.reserve(directories.size());
+        for (const auto& [dir_path, dir_hash] : directories)
+        {
+            SnapDirectoryRecord record = {};
+            record.path_offset = strings.size();
+            record.path_len = (uint32_t)dir_path.size();
+            record.hash = dir_hash;
+            directory_records.push_back(record);
+            strings.append(dir_path);
+        }
+
+        std::string params = encode_params(metadata);
+
+        SnapHeader header = {};
+        header.magic = kHeaderMagic;
+        header.version = kFormatVersion;
+        header.hash_algorithm = algorithm_tag(metadata.hash_algorithm);
+        header.fingerprint_mode = (uint32_t)metadata.fingerprint_mode;
+        header.fingerprint = metadata.fingerprint;
+        header.file_count = file_records.size();
+        header.directory_count = directory_records.size();
+        header.params_size = params.size();
+        header.strings_size = strings.size();
+
+        std::string out;
+        out.reserve(sizeof(header) + file_records.size() * sizeof(SnapFileRecord)
+                    + directory_records.size() * sizeof(SnapDirectoryRecord)
+                    + params.size() + strings.size() + sizeof(SnapTrailer));
+        out.append((const char*)&header, sizeof(header));
+        out.append((const char*)file_records.data(), file_records.size() * sizeof(SnapFileRecord));
+        out.append((const char*)directory_records.data(), directory_records.size() * sizeof(SnapDirectoryRecord));
+        out.append(params);
+        out.append(strings);
+
+        SnapTrailer trailer = {};
+        trailer.magic = kTrailerMagic;
+        trailer.crc32c = crc32_impl(0, out.data(), out.size());
+        out.append((const char*)&trailer, sizeof(trailer));
+
+        std::ofstream outfile(path, std::ios::out | std::ios::binary);
+        if (outfile.fail())
+        {
+            std::cerr << "Error: cannot open snapshot file for writing: " << path << "\n";
+            return EXIT_FAILURE;
+        }
+
+        outfile.write(out.data(), out.size());
+        if (outfile.fail())
+        {
+            std::cerr << "Error: failed to write snapshot file: " << path << "\n";
+            return EXIT_FAILURE;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Error: save_binary_snapshot failed with exception: " << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+// ---------------------------------------------------------------------------
+// Reader
+// ---------------------------------------------------------------------------
+
+static std::atomic<bool> s_verify_snapshot_checksum { false };
+
+void set_verify_snapshot_checksum(bool verify) noexcept
+{
+    s_verify_snapshot_checksum.store(verify, std::memory_order_relaxed);
+}
+
+std::unique_ptr<MappedSnapshot> MappedSnapshot::open(const std::string& path) noexcept
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        std::cerr << "Error: cannot open snapshot file: " << path << "\n";
+        return nullptr;
+    }
+
+    struct stat st;
+    if ((fstat(fd, &st) != 0) || (st.st_size < (off_t)(sizeof(SnapHeader) + sizeof(SnapTrailer))))
+    {
+        close(fd);
+        std::cerr << "Error: snapshot file is truncated: " << path << "\n";
+        return nullptr;
+    }
+
+    size_t map_size = (size_t)st.st_size;
+    void* base = mmap(nullptr, map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+    {
+        std::cerr << "Error: cannot map snapshot file: " << path << "\n";
+        return nullptr;
+    }
+
+    std::unique_ptr<MappedSnapshot> snapshot(new (std::nothrow) MappedSnapshot());
+    if (snapshot == nullptr)
+    {
+        munmap(base, map_size);
+        return nullptr;
+    }
+    snapshot->_map_base = base;
+    snapshot->_map_size = map_size;
+
+    const char* bytes = (const char*)base;
+    const SnapHeader* header = (const SnapHeader*)bytes;
+    if ((header->magic != kHeaderMagic) || (header->version != kFormatVersion)
+        || (header->hash_algorithm > kAlgoXxh3)
+        || (header->fingerprint_mode > (uint32_t)FingerprintOptions::HashTree))
+    {
+        std::cerr << "Error: not a fingerprint binary snapshot (or an unsupported version): " << path << "\n";
+        return nullptr;
+    }
+
+    // every size is checked against what is left of the file before it is used, so
+    // absurd counts cannot overflow the sum
+    uint64_t remaining = map_size - sizeof(SnapHeader) - sizeof(SnapTrailer);
+    bool sizes_valid = (header->file_count <= remaining / sizeof(SnapFileRecord));
+    if (sizes_valid)
+    {
+        remaining -= header->file_count * sizeof(SnapFileRecord);
+        sizes_valid = (header->directory_count <= remaining / sizeof(SnapDirectoryRecord));
+    }
+    if (sizes_valid)
+    {
+        remaining -= header->directory_count * sizeof(SnapDirectoryRecord);
+        sizes_valid = (header->params_size <= remaining) && (header->strings_size == remaining - header->params_size);
+    }
+    if (!sizes_valid)
+    {
+        std::cerr << "Error: snapshot file sizes are inconsistent: " << path << "\n";
+        return nullptr;
+    }
+
+    SnapTrailer trailer;
+    memcpy(&trailer, bytes + map_size - sizeof(SnapTrailer), sizeof(trailer));
+    if ((trailer.magic != kTrailerMagic)
+        || (s_verify_snapshot_checksum.load(std::memory_order_relaxed)
+            && (trailer.crc32c != crc32_impl(0, bytes, map_size - sizeof(SnapTrailer)))))
+    {
+        std::cerr << "Error: snapshot file checksum mismatch: " << path << "\n";
+        return nullptr;
+    }
+
+    const char* cursor = bytes + sizeof(SnapHeader);
+    snapshot->_header = header;
+    snapshot->_files = (const SnapFileRecord*)cursor;
+    cursor += header->file_count * sizeof(SnapFileRecord);
+    snapshot->_directories = (const SnapDirectoryRecord*)cursor;
+    cursor += header->directory_count * sizeof(SnapDirectoryRecord);
+    const char* params = cursor;
+    cursor += header->params_size;
+    snapshot->_strings = cursor;
+    snapshot->_strings_size = header->strings_size;
+
+    SnapshotMetadata& metadata = snapshot->_metadata;
+    metadata.hash_algorithm = algorithm_from_tag(header->hash_algorithm);
+    metadata.fingerprint_mode = (FingerprintOptions)header->fingerprint_mode;
+    metadata.fingerprint = header->fingerprint;
+    if (!decode_params(params, (size_t)header->params_size, metadata))
+    {
+        std::cerr << "Error: snapshot file parameters are malformed: " << path << "\n";
+        return nullptr;
+    }
+
+    return snapshot;
+}
+
+MappedSnapshot::~MappedSnapshot()
+{
+    if (_map_base != nullptr)
+        munmap(_map_base, _map_size);
+}
+
+std::string MappedSnapshot::format_hash(uint64_t hash) const noexcept
+{
+    char hash_hex[32];
+    if (_header->hash_algorithm == kAlgoCrc32c)
+        std::snprintf(hash_hex, sizeof(hash_hex), "%08x", (uint32_t)hash);
+    else
+        std::snprintf(hash_hex, sizeof(hash_hex), "%016llx", (unsigned long long)hash);
+    return hash_hex;
+}
+
+static CFMutableArr cfarray_from_strings(const std::vector<std::string>& vec) noexcept
+{
+    CFMutableArr arr((CFIndex)vec.size());
+    for (const auto& s : vec)
+        arr.AppendValue(CFStr(s));
+    return arr;
+}
+
+CFMutableDictionaryRef MappedSnapshot::copy_as_cfdict() const noexcept
+{
+    CFMutableDict root_dict;
+    CFMutableDict params_dict;
+
+    params_dict.SetValue(CFSTR("input_paths"),      cfarray_from_strings(_metadata.input_paths));
+    params_dict.SetValue(CFSTR("glob_patterns"),    cfarray_from_strings(_metadata.glob_patterns));
+    params_dict.SetValue(CFSTR("regex_patterns"),   cfarray_from_strings(_metadata.regex_patterns));
+    params_dict.SetValue(CFSTR("exclude_patterns"), cfarray_from_strings(_metadata.exclude_patterns));
+    params_dict.SetValue(CFSTR("hash_algorithm"), CFStr(hash_algorithm_name(_metadata.hash_algorithm)));
+
+    CFStringRef fp_mode = CFSTR("default");
+    switch (_metadata.fingerprint_mode)
+    {
+        case FingerprintOptions::HashAbsolutePaths: fp_mode = CFSTR("absolute"); break;
+        case FingerprintOptions::HashRelativePaths: fp_mode = CFSTR("relative"); break;
+        case FingerprintOptions::HashTree: fp_mode = CFSTR("tree"); break;
+        default: fp_mode = CFSTR("default"); break;
+    }
+    params_dict.SetValue(CFSTR("fingerprint_mode"), fp_mode);
+
+    char fp_hex[32];
+    std::snprintf(fp_hex, sizeof(fp_hex), "%016llx", (unsigned long long)_header->fingerprint);
+    params_dict.SetValue(CFSTR("fingerprint"), CFStr(std::string_view(fp_hex)));
+    if (!_metadata.snapshot_timestamp.empty())
+        params_dict.SetValue(CFSTR("snapshot_timestamp"), CFStr(_metadata.snapshot_timestamp));
+
+    root_dict.SetValue(CFSTR("fingerprint_params"), (CFMutableDictionaryRef)params_dict);
+
+    CFMutableArr files_arr((CFIndex)file_count());
+    for (size_t i = 0; i < file_count(); i++)
+    {
+        const SnapFileRecord& record = _files[i];
+        CFMutableDict file_dict;
+        file_dict.SetValue(CFSTR("path"), CFStr(path_of(record)));
+        file_dict.SetValue(CFSTR("hash"), CFStr(format_hash(record.hash)));
+        file_dict.SetValue(CFSTR("inode"),    (int64_t)record.inode);
+        file_dict.SetValue(CFSTR("size"),     record.size);
+        file_dict.SetValue(CFSTR("mtime_ns"), record.mtime_ns);
+
+        char mode_oct[16];
+        std::snprintf(mode_oct, sizeof(mode_oct), "%04o", record.mode & 07777);
+        file_dict.SetValue(CFSTR("mode"), CFStr(std::string_view(mode_oct)));
+
+        files_arr.AppendValue(file_dict);
+    }
+    root_dict.SetValue(CFSTR("files"), (CFMutableArrayRef)files_arr);
+
+    if (directory_count() > 0)
+    {
+        CFMutableArr directories_arr((CFIndex)directory_count());
+        for (size_t i = 0; i < directory_count(); i++)
+        {
+            CFMutableDict dir_dict;
+            dir_dict.SetValue(CFSTR("path"), CFStr(path_of(_directories[i])));
+            char hash_hex[32];
+            std::snprintf(hash_hex, sizeof(hash_hex), "%016llx", (unsigned long long)_directories[i].hash);
+            dir_dict.SetValue(CFSTR("hash"), CFStr(std::string_view(hash_hex)));
+            directories_arr.AppendValue(dir_dict);
+        }
+        root_dict.SetValue(CFSTR("directories"), (CFMutableArrayRef)directories_arr);
+    }
+
+    return root_dict.Detach();
+}
@@ -6,21 +6,11 @@
 //
 
 #include "dispatch_queues_helper.h"
+#include "ReadBufferPool.h"
 
 #include <unistd.h>
 #include <sys/sysctl.h>
 
-static dispatch_group_t s_all_tasks_group = nullptr;
-static dispatch_once_t s_all_tasks_token;
-
-dispatch_group_t get_all_tasks_group() noexcept
-{
-    dispatch_once(&s_all_tasks_token, ^{
-        s_all_tasks_group = dispatch_group_create();
-    });
-    return s_all_tasks_group;
-}
-
 static int get_physical_core_count()
 {
     // POSIX: online logical cores (fastest, works everywhere)
@@ -41,6 +31,47 @@ static int get_physical_core_count()
     return 8; // sane default
 }
 
+static int s_hash_jobs = 0;
+static int s_io_depth = 0;
+static size_t s_buffer_memory = 0;
+
+// Readers block on the buffer pool while hashers drain it, so every blocked reader holds a
+// GCD worker thread. Staying well below the worker thread limit (64) leaves threads for the
+// hashers that release the buffers.
+static constexpr int kMaxIoDepth = 48;
+
+void set_pipeline_limits(int hash_jobs, int io_depth, size_t buffer_memory) noexcept
+{
+    s_hash_jobs = hash_jobs;
+    s_io_depth = (io_depth > kMaxIoDepth) ? kMaxIoDepth : io_depth;
+    s_buffer_memory = buffer_memory;
+}
+
+int get_hash_jobs() noexcept
+{
+    return (s_hash_jobs > 0) ? s_hash_jobs : get_physical_core_count();
+}
+
+int get_io_depth() noexcept
+{
+    // reads mostly wait on the device, so by default keep more of them in flight than there are cores
+    if (s_io_depth > 0)
+        return s_io_depth;
+    int depth = 2 * get_physical_core_count();
+    return (depth > kMaxIoDepth) ? kMaxIoDepth : depth;
+}
+
+ReadBufferPool& get_read_buffer_pool() noexcept
+{
+    static dispatch_once_t once;
+    static ReadBufferPool* pool;
+    dispatch_once(&once, ^{
+        size_t memory = (s_buffer_memory > 0) ? s_buffer_memory : (64 * 1024 * 1024);
+        pool = new ReadBufferPool(memory / ReadBufferPool::kReadBufferSize);
+    });
+    return *pool;
+}
+
 dispatch_queue_t get_cpu_gate_queue() noexcept
 {
     static dispatch_once_t once;
@@ -56,12 +87,44 @@ dispatch_semaphore_t get_concurrency_semaphore() noexcept
     static dispatch_once_t once;
     static dispatch_semaphore_t cpu_count_semaphopre;
     dispatch_once(&once, ^{
-        int cores = get_physical_core_count();           // e.g. 8 on M2, 10 on M3 Pro
+        int cores = get_hash_jobs();           // e.g. 8 on M2, 10 on M3 Pro
         cpu_count_semaphopre = dispatch_semaphore_create(cores);         // 1:1 with NEON units
     });
     return cpu_count_semaphopre;
 }
 
+dispatch_queue_t get_io_gate_queue() noexcept
+{
+    static dispatch_once_t once;
+    static dispatch_queue_t queue;
+    dispatch_once(&once, ^{
+        queue = dispatch_queue_create("serial.io.gate", DISPATCH_QUEUE_SERIAL);
+    });
+    return queue;
+}
+
+dispatch_semaphore_t get_io_depth_semaphore() noexcept
+{
+    static dispatch_once_t once;
+    static dispatch_semaphore_t io_depth_semaphore;
+    dispatch_once(&once, ^{
+        io_depth_semaphore = dispatch_semaphore_create(get_io_depth());
+    });
+    return io_depth_semaphore;
+}
+
+static dispatch_queue_t s_concurrent_file_reading_queue = nullptr;
+static dispatch_once_t s_concurrent_file_reading_once_token;
+
+dispatch_queue_t get_file_reading_queue() noexcept
+{
+    dispatch_once(&s_concurrent_file_reading_once_token, ^{
+        s_concurrent_file_reading_queue = dispatch_queue_create("concurrent.file.reading", DISPATCH_QUEUE_CONCURRENT);
+    });
+
+    return s_concurrent_file_reading_queue;
+}
+
 
 static dispatch_queue_t s_concurrent_file_processing_queue = nullptr;
 static dispatch_once_t s_concurrent_file_processing_once_token;
@@ -8,16 +8,21 @@
 #include <iostream>
 #include <filesystem>
 #include <fstream>
+#include <iterator>
 #include <memory>
+#include <new>
 #include <regex>
 #include <ctime>
 #include <map>
+#include <set>
+#include <string_view>
 #include <unordered_map>
 
 #include <CoreFoundation/CoreFoundation.h>
 
 #include <assert.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/mman.h>
 #include <sys/attr.h>
 #include <sys/xattr.h>
@@ -30,8 +35,11 @@
 #include "fingerprint.h"
 #include "FileInfo.h"
 #include "FileHashing.h"
+#include "FileHashDedup.h"
+#include "ReadBufferPool.h"
 #include "dispatch_queues_helper.h"
 #include "json_serialization.h"
+#include "binary_snapshot.h"
 #include "yyjson.hpp"
 #include "CFObj.h"
 #include "CFType.h"
@@ -39,44 +47,133 @@
 #include "CFArr.h"
 #include "CFDict.h"
 
-// g_hash, g_verbose and the per-file hashing/xattr helpers come from FileHashing.h
-extern XattrMode g_xattr_mode;
-extern double g_traversal_time;
+// g_verbose and the per-file hashing/xattr helpers come from FileHashing.h
 
-std::atomic_bool s_exiting = false;
-std::atomic_int s_result = EXIT_SUCCESS;
+// Hashed files are appended to a shard owned by the worker thread that hashed them:
+// no lock, no shared cache line and no heap-allocated block per file, unlike posting
+// every file to the serial mutation queue. A thread registers its shard with a session
+// once, on the mutation queue; the session owns it and frees it when it is destroyed.
+struct MatchedFilesShard
+{
+    std::vector<std::pair<std::string, FileInfo>> files;
+    uint64_t append_ns = 0; // only measured with g_verbose
+};
+
+// Everything one fingerprinting run owns. The worker pool it schedules on is process-wide.
+struct FingerprintSessionState
+{
+    const uint64_t id; // unique for the process lifetime, never reused
+    const FileHashAlgorithm hash_algorithm;
+    const XattrMode xattr_mode;
+
+    // all tasks of the session are added to this group so wait_for_all_tasks can wait for them
+    dispatch_group_t task_group;
+
+    std::atomic_bool exiting = false;
+    std::atomic_int result = EXIT_SUCCESS;
+
+    // all matched files, filled from the per-thread shards by merge_matched_files_shards()
+    // once all dispatched tasks finished - only then it is safe to access
+    std::vector<std::pair<std::string, FileInfo>> all_matched_files;
+
+    // this is a shared container that must be mutated only on serial shared_container_mutation_queue
+    std::vector<std::unique_ptr<MatchedFilesShard>> matched_files_shards;
+    FingerprintSession::MatchedFilesStats matched_files_stats {};
+
+    // files already hashed in this session by (device, inode, size, mtime, ctime), so
+    // hard links and paths matched more than once are read only once
+    FileHashDedup hash_dedup;
+
+    // this is a shared container for search directories that must be mutated only on serial shared_container_mutation_queue
+    std::unordered_set<std::string> search_bases;
 
-// this is a shared container that must be mutated only on serial shared_container_mutation_queue
-static std::vector<std::pair<std::string, FileInfo>> s_all_matched_files;
+    // directory hashes of the FingerprintOptions::HashTree computation, sorted by path;
+    // saved in snapshots so compare_snapshots can skip unchanged subtrees
+    std::vector<std::pair<std::string, uint64_t>> directory_hashes;
 
-// this is a shared container for search directories that must be mutated only on serial shared_container_mutation_queue
-static std::unordered_set<std::string> s_search_bases;
+    std::atomic<double> traversal_time = 0.0;
+
+    FingerprintSessionState(uint64_t session_id, FileHashAlgorithm algorithm, XattrMode mode) noexcept
+        : id(session_id), hash_algorithm(algorithm), xattr_mode(mode), task_group(dispatch_group_create())
+    {
+    }
+
+    ~FingerprintSessionState()
+    {
+        dispatch_release(task_group);
+    }
+};
+
+// A worker thread serves every session that has tasks in flight, so it remembers its shard
+// for the last few sessions it appended to. Session ids are never reused: the entry of a
+// destroyed session can never match again. A thread evicted from the cache while its session
+// is still running just registers a second shard, which the merge treats like any other.
+struct ThreadShardCacheEntry
+{
+    uint64_t session_id = 0;
+    MatchedFilesShard* shard = nullptr;
+};
+
+static constexpr size_t kThreadShardCacheSize = 4;
+static thread_local ThreadShardCacheEntry t_shard_cache[kThreadShardCacheSize];
+static thread_local size_t t_shard_cache_next = 0;
+
+static std::atomic<uint64_t> s_next_session_id = 1;
+
+std::unique_ptr<FingerprintSession>
+FingerprintSession::create(FileHashAlgorithm hash_algorithm, XattrMode xattr_mode) noexcept
+{
+    std::unique_ptr<FingerprintSessionState> state(
+        new (std::nothrow) FingerprintSessionState(s_next_session_id++, hash_algorithm, xattr_mode));
+    if (state == nullptr)
+    {
+        return nullptr;
+    }
+
+    return std::unique_ptr<FingerprintSession>(new (std::nothrow) FingerprintSession(std::move(state)));
+}
+
+FingerprintSession::FingerprintSession(std::unique_ptr<FingerprintSessionState> state) noexcept
+    : _state(std::move(state))
+{
+}
+
+FingerprintSession::~FingerprintSession()
+{
+    // tasks capture the state; none may outlive it
+    cancel();
+    wait_for_all_tasks();
+}
+
+FileHashAlgorithm
+FingerprintSession::get_hash_algorithm() const noexcept
+{
+    return _state->hash_algorithm;
+}
 
 void
-fingerprint::set_exiting() noexcept
+FingerprintSession::cancel() noexcept
 {
-    s_exiting = true;
+    _state->exiting = true;
+    _state->result = EXIT_FAILURE;
 }
 
 static inline __attribute__((always_inline))
-bool is_exiting() noexcept
+bool is_exiting(const FingerprintSessionState* session) noexcept
 {
-    return s_exiting;
+    return session->exiting;
 }
 
 int
-fingerprint::get_result() noexcept
+FingerprintSession::get_result() const noexcept
 {
-    return s_result;
+    return _state->result;
 }
 
-void
-fingerprint::reset() noexcept
+double
+FingerprintSession::get_traversal_time() const noexcept
 {
-    s_all_matched_files.clear();
-    s_search_bases.clear();
-    s_exiting = false;
-    s_result = EXIT_SUCCESS;
+    return _state->traversal_time;
 }
 
 static bool path_exists_literal(const std::string& path) noexcept
@@ -112,98 +209,474 @@ static std::vector<std::string> split_path_components(const std::string& path) n
     return components;
 }
 
-static inline __attribute__((always_inline))
-void add_to_matched_files(std::string path, FileInfo info)
+static MatchedFilesShard* register_matched_files_shard(FingerprintSessionState* session) noexcept
 {
-    dispatch_queue_t shared_container_mutation_queue = get_shared_container_mutation_queue();
-    dispatch_group_t task_group = get_all_tasks_group();
-    
-    // shared_container_mutation_queue is a serial queue, allowing only one task at a time
-    dispatch_group_async(task_group, shared_container_mutation_queue, ^{
-        if (is_exiting()) { return; }
+    __block MatchedFilesShard* shard = new (std::nothrow) MatchedFilesShard();
+    if (shard == nullptr)
+    {
+        return nullptr;
+    }
 
+    dispatch_sync(get_shared_container_mutation_queue(), ^{
         try
         {
-            s_all_matched_files.emplace_back(std::move(path), std::move(info));
+            session->matched_files_shards.emplace_back(shard);
         }
         catch (const std::exception& e)
         {
             std::cerr << "operation failed with exception:" << e.what() << '\n';
-            s_result = EXIT_FAILURE;
+            delete shard;
+            shard = nullptr;
         }
     });
 
+    if (shard != nullptr)
+    {
+        t_shard_cache[t_shard_cache_next] = { session->id, shard };
+        t_shard_cache_next = (t_shard_cache_next + 1) % kThreadShardCacheSize;
+    }
+    return shard;
+}
+
+static inline __attribute__((always_inline))
+MatchedFilesShard* get_thread_shard(FingerprintSessionState* session) noexcept
+{
+    for (const ThreadShardCacheEntry& entry : t_shard_cache)
+    {
+        if (entry.session_id == session->id)
+            return entry.shard;
+    }
+    return register_matched_files_shard(session);
+}
+
+static inline __attribute__((always_inline))
+void add_to_matched_files(FingerprintSessionState* session, std::string path, FileInfo info)
+{
+    if (is_exiting(session)) { return; }
+
+    MatchedFilesShard* shard = get_thread_shard(session);
+    if (shard == nullptr)
+    {
+        session->result = EXIT_FAILURE;
+        return;
+    }
+
+    uint64_t start_ns = g_verbose ? clock_gettime_nsec_np(CLOCK_UPTIME_RAW) : 0;
+    try
+    {
+        shard->files.emplace_back(std::move(path), std::move(info));
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "operation failed with exception:" << e.what() << '\n';
+        session->result = EXIT_FAILURE;
+    }
+
+    if (g_verbose)
+    {
+        shard->append_ns += clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start_ns;
+    }
+}
+
+// Verbose only: replays the appends of files[first..] the way they were made before the
+// shards, one block per file posted to the serial mutation queue, and returns the seconds
+// that took. One producer, no hashing around it and no reallocation, so it is what that
+// queue cost at the least; under the workers' contention it cost more. The entries end
+// where they started.
+static double time_serial_queue_collection(std::vector<std::pair<std::string, FileInfo>>& files,
+                                           size_t first) noexcept
+{
+    std::vector<std::pair<std::string, FileInfo>> replayed;
+    try
+    {
+        // reserved, so that the blocks only ever move and cannot throw
+        replayed.reserve(files.size() - first);
+    }
+    catch (const std::exception&)
+    {
+        return 0.0;
+    }
+    std::vector<std::pair<std::string, FileInfo>>* replayed_ptr = &replayed;
+
+    dispatch_queue_t shared_container_mutation_queue = get_shared_container_mutation_queue();
+    dispatch_group_t replay_group = dispatch_group_create();
+    uint64_t start_ns = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+    for (size_t i = first; i < files.size(); i++)
+    {
+        std::pair<std::string, FileInfo>* entry = &files[i];
+        dispatch_group_async(replay_group, shared_container_mutation_queue, ^{
+            replayed_ptr->emplace_back(std::move(entry->first), std::move(entry->second));
+        });
+    }
+    dispatch_group_wait(replay_group, DISPATCH_TIME_FOREVER);
+    uint64_t elapsed_ns = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start_ns;
+    dispatch_release(replay_group);
+
+    std::move(replayed.begin(), replayed.end(), files.begin() + (std::ptrdiff_t)first);
+    return (double)elapsed_ns / 1e9;
 }
 
+// Moves the content of all shards into all_matched_files. Must be called only after
+// all dispatched tasks finished; the group wait orders the workers' appends before it.
+// Calling it again without new tasks in between is a no-op.
+static void merge_matched_files_shards(FingerprintSessionState* session) noexcept
+{
+    uint64_t start_ns = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+    std::vector<std::pair<std::string, FileInfo>>& all_matched_files = session->all_matched_files;
+    FingerprintSession::MatchedFilesStats& stats = session->matched_files_stats;
 
-static void process_matched_file_async(std::string path, FileInfo info) noexcept
+    size_t total = all_matched_files.size();
+    size_t used_shards = 0;
+    for (const auto& shard : session->matched_files_shards)
+    {
+        total += shard->files.size();
+        used_shards += shard->files.empty() ? 0 : 1;
+    }
+
+    const size_t first_merged = all_matched_files.size();
+    if (total == first_merged)
+    {
+        return;
+    }
+
+    try
+    {
+        all_matched_files.reserve(total);
+        for (const auto& shard : session->matched_files_shards)
+        {
+            std::move(shard->files.begin(), shard->files.end(), std::back_inserter(all_matched_files));
+            shard->files.clear();
+            stats.append_time += (double)shard->append_ns / 1e9;
+            shard->append_ns = 0;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "operation failed with exception:" << e.what() << '\n';
+        session->result = EXIT_FAILURE;
+    }
+
+    stats.file_count = all_matched_files.size();
+    stats.shard_count += used_shards;
+    stats.merge_time += (double)(clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - start_ns) / 1e9;
+
+    if (g_verbose)
+    {
+        stats.serial_queue_time += time_serial_queue_collection(all_matched_files, first_merged);
+    }
+}
+
+FingerprintSession::MatchedFilesStats
+FingerprintSession::get_matched_files_stats() const noexcept
+{
+    FingerprintSession::MatchedFilesStats stats = _state->matched_files_stats;
+    FileHashDedup::Stats dedup = _state->hash_dedup.stats();
+    stats.dedup_file_count = dedup.files;
+    stats.dedup_bytes = dedup.bytes;
+    return stats;
+}
+
+// Applies the session's xattr mode before hashing. Returns true when the file content must be hashed;
+// write_xattr tells whether the computed hash should be memoized afterwards.
+static bool apply_xattr_policy(const FingerprintSessionState* session, const std::string& path, FileInfo& fileInfo, bool& write_xattr) noexcept
 {
-    dispatch_group_t task_group = get_all_tasks_group();
+    bool needs_hash = true;
+    write_xattr = false;
+
+    if (session->xattr_mode == XattrMode::Clear)
+    {
+        clear_xattr_fileinfo(path, fileInfo, session->hash_algorithm);
+        // force recompute, don't write
+    }
+    else if (session->xattr_mode == XattrMode::On)
+    {
+        // Only here do we try to read and possibly skip hashing
+        bool cache_hit = read_xattr_fileinfo(path, fileInfo, session->hash_algorithm);
+        if (cache_hit)
+        {
+            needs_hash = false;
+            write_xattr = false;  // nothing to do
+        }
+        else
+        {
+            needs_hash = true;
+            write_xattr = true;   // cache miss, compute and store
+        }
+    }
+    else if (session->xattr_mode == XattrMode::Refresh)
+    {
+        // Force recompute, write result back
+        needs_hash = true;
+        write_xattr = true;
+    }
+    else // Off
+    {
+        needs_hash = true;
+        write_xattr = false;
+    }
+
+    return needs_hash;
+}
+
+static void finish_matched_file(FingerprintSessionState* session, std::string path, FileInfo fileInfo, bool write_xattr, bool hashed) noexcept
+{
+    // Never memoize a hash that was not computed: the 0 left behind by a failed
+    // read would be trusted by every later run, here and in replay's cache, which
+    // shares this xattr namespace and FileInfoCore layout.
+    if (write_xattr && hashed)
+    {
+        write_xattr_fileinfo(path, fileInfo, session->hash_algorithm);
+    }
+
+    // completes the other paths of this file that claimed it while it was being hashed
+    session->hash_dedup.publish(fileInfo, hashed);
+
+    add_to_matched_files(session, std::move(path), std::move(fileInfo));
+}
+
+// Hasher stage: runs work on queue once a hashing slot is free and releases the slot when work returns.
+// Waiting happens on the serial cpu gate queue so only one thread is ever parked on the semaphore.
+static void dispatch_hash_task(FingerprintSessionState* session, dispatch_queue_t queue, dispatch_block_t work) noexcept
+{
+    dispatch_group_t task_group = session->task_group;
 
     dispatch_group_async(task_group, get_cpu_gate_queue(), ^{
         dispatch_semaphore_t cpu_limit_semaphore = get_concurrency_semaphore();
         dispatch_semaphore_wait(cpu_limit_semaphore, DISPATCH_TIME_FOREVER);
 
-        dispatch_group_async(task_group, get_file_processing_queue(), ^{
-            
-            FileInfo fileInfo = info;
+        dispatch_group_async(task_group, queue, ^{
+            work();
+            dispatch_semaphore_signal(cpu_limit_semaphore);
+        });
+    });
+}
+
+// A file streamed from the reader to the hasher stage in ReadBufferPool pieces.
+// The running hash state is touched only by the hasher, on hash_queue: a per-file serial
+// queue when the file has several pieces so they are hashed in order, the concurrent
+// file processing queue when it has one.
+struct PipelinedFile
+{
+    FingerprintSessionState* session = nullptr;
+    std::string path;
+    FileInfo info;
+    bool write_xattr = false;
+    bool failed = false;
+    uint32_t crc32c = 0;
+    blake3_hasher blake3;
+    XXH3_state_t xxh3;
+    dispatch_queue_t hash_queue = nullptr;
+    bool owns_hash_queue = false;
+};
+
+static void hash_piece(PipelinedFile& file, const char* buffer, size_t len) noexcept
+{
+    if (file.session->hash_algorithm == FileHashAlgorithm::CRC32C)
+    {
+        file.crc32c = crc32_impl(file.crc32c, buffer, len);
+    }
+    else if (file.session->hash_algorithm == FileHashAlgorithm::XXH3)
+    {
+        XXH3_64bits_update(&file.xxh3, buffer, len);
+    }
+    else
+    {
+        blake3_hasher_update(&file.blake3, buffer, len);
+    }
+}
+
+static void finish_pipelined_file(PipelinedFile& file) noexcept
+{
+    bool hashed = !file.failed;
+    if (hashed)
+    {
+        if (file.session->hash_algorithm == FileHashAlgorithm::CRC32C)
+        {
+            file.info.hash.crc32c = file.crc32c;
+        }
+        else if (file.session->hash_algorithm == FileHashAlgorithm::XXH3)
+        {
+            file.info.hash.xxh3 = XXH3_64bits_digest(&file.xxh3);
+        }
+        else
+        {
+            blake3_hasher_finalize(&file.blake3, (uint8_t*)&file.info.hash.blake3, 8);
+        }
+    }
+
+    finish_matched_file(file.session, std::move(file.path), file.info, file.write_xattr, hashed);
 
-            bool needs_hash = true;
-            bool write_xattr = false;
+    if (file.owns_hash_queue)
+    {
+        dispatch_release(file.hash_queue); // the queue stays alive until this block returns
+    }
+}
 
-            if (g_xattr_mode == XattrMode::Clear)
+// read() exactly len bytes, retrying short and interrupted reads. A file that shrank since
+// it was stat-ed fails here and is reported as not hashed, same as a failed read.
+static bool read_fully(int fd, char* buffer, size_t len) noexcept
+{
+    while (len > 0)
+    {
+        ssize_t count = read(fd, buffer, len);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (count == 0)
+            return false;
+
+        buffer += count;
+        len -= (size_t)count;
+    }
+    return true;
+}
+
+// Reader stage body for a regular file below kHashMmapThreshold: reads it into pooled buffers
+// and hands every piece to the hasher stage as soon as it is filled, so the next read overlaps
+// hashing of the previous piece. Blocking on the pool is what caps the pipeline's memory.
+static void read_pipelined_file(std::shared_ptr<PipelinedFile> file) noexcept
+{
+    int fd = open(file->path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        finish_matched_file(file->session, std::move(file->path), file->info, file->write_xattr, false);
+        return;
+    }
+
+    const size_t size = (size_t)file->info.size;
+    if (size > ReadBufferPool::kReadBufferSize)
+    {
+        file->hash_queue = dispatch_queue_create_with_target("serial.file.hashing", DISPATCH_QUEUE_SERIAL,
+                                                             get_file_processing_queue());
+        file->owns_hash_queue = true;
+    }
+    else
+    {
+        file->hash_queue = get_file_processing_queue();
+    }
+
+    for (size_t offset = 0; offset < size; offset += ReadBufferPool::kReadBufferSize)
+    {
+        size_t len = std::min(ReadBufferPool::kReadBufferSize, size - offset);
+        char* buffer = get_read_buffer_pool().acquire();
+        bool read_ok = (buffer != nullptr) && read_fully(fd, buffer, len);
+        bool last_piece = !read_ok || (offset + len == size);
+
+        dispatch_hash_task(file->session, file->hash_queue, ^{
+            if (read_ok && !file->failed)
             {
-                clear_xattr_fileinfo(path, fileInfo);
-                // force recompute, don't write
+                hash_piece(*file, buffer, len);
             }
-            else if (g_xattr_mode == XattrMode::On)
+            else
             {
-                // Only here do we try to read and possibly skip hashing
-                bool cache_hit = read_xattr_fileinfo(path, fileInfo);
-                if (cache_hit)
-                {
-                    needs_hash = false;
-                    write_xattr = false;  // nothing to do
-                }
-                else
-                {
-                    needs_hash = true;
-                    write_xattr = true;   // cache miss, compute and store
-                }
+                file->failed = true;
             }
-            else if (g_xattr_mode == XattrMode::Refresh)
+
+            if (buffer != nullptr)
             {
-                // Force recompute, write result back
-                needs_hash = true;
-                write_xattr = true;
+                get_read_buffer_pool().release(buffer);
             }
-            else // Off
+
+            if (last_piece)
             {
-                needs_hash = true;
-                write_xattr = false;
+                finish_pipelined_file(*file);
             }
+        });
+
+        if (!read_ok) { break; }
+    }
+
+    close(fd);
+}
 
-            bool hashed = true;
-            if (needs_hash)
+// Two stage pipeline (see set_pipeline_limits in dispatch_queues_helper.h):
+// - the reader stage, bounded by the io depth, does everything that waits on the storage:
+//   the xattr lookup, open and read into ReadBufferPool buffers
+// - the hasher stage, bounded by the hash jobs, only hashes filled buffers
+// so a cold-cache read never holds a hashing slot and buffered content never exceeds the pool.
+// Files at or above kHashMmapThreshold are mapped and hashed by the hasher stage as before,
+// in parallel ranges from kParallelHashThreshold on; their reads are page faults.
+static void process_matched_file_async(FingerprintSessionState* session, std::string path, FileInfo info) noexcept
+{
+    dispatch_group_t task_group = session->task_group;
+
+    dispatch_group_async(task_group, get_io_gate_queue(), ^{
+        dispatch_semaphore_t io_limit_semaphore = get_io_depth_semaphore();
+        dispatch_semaphore_wait(io_limit_semaphore, DISPATCH_TIME_FOREVER);
+
+        dispatch_group_async(task_group, get_file_reading_queue(), ^{
+
+            auto file = std::make_shared<PipelinedFile>();
+            file->session = session;
+            file->path = path;
+            file->info = info;
+
+            // Another path of the same file was hashed, or is being hashed, in this session:
+            // take its hash rather than reading the content again. Checked before the xattr
+            // so a hard link costs neither a read nor a getxattr.
+            FileHashDedup::Claim claim = session->hash_dedup.claim(file->info, [session, file] {
+                return [session, file](bool /*ok*/, uint64_t hash) {
+                    // a failed owner leaves the same hash it would have left here
+                    file->info.hash.blake3 = hash;
+                    add_to_matched_files(session, std::move(file->path), std::move(file->info));
+                };
+            });
+
+            if (claim == FileHashDedup::Claim::Done)
+            {
+                add_to_matched_files(session, std::move(file->path), std::move(file->info));
+                dispatch_semaphore_signal(io_limit_semaphore);
+                return;
+            }
+            if (claim == FileHashDedup::Claim::Waiting)
             {
-                hashed = compute_file_hash(path, fileInfo);
+                dispatch_semaphore_signal(io_limit_semaphore);
+                return;
             }
 
-            // Never memoize a hash that was not computed: the 0 left behind by a failed
-            // read would be trusted by every later run, here and in replay's cache, which
-            // shares this xattr namespace and FileInfoCore layout.
-            if (write_xattr && hashed)
+            bool needs_hash = apply_xattr_policy(session, file->path, file->info, file->write_xattr);
+
+            if (!needs_hash)
             {
-                write_xattr_fileinfo(path, fileInfo);
+                session->hash_dedup.publish(file->info, true);
+                add_to_matched_files(session, std::move(file->path), std::move(file->info));
             }
-            
-            add_to_matched_files(std::move(path), std::move(fileInfo));
-            dispatch_semaphore_signal(cpu_limit_semaphore);
+            else if (file->info.is_regular_file() && (file->info.size > 0) && (file->info.size < kHashMmapThreshold))
+            {
+                if (session->hash_algorithm == FileHashAlgorithm::BLAKE3)
+                {
+                    blake3_hasher_init(&file->blake3);
+                }
+                else if (session->hash_algorithm == FileHashAlgorithm::XXH3)
+                {
+                    XXH3_64bits_reset(&file->xxh3);
+                }
+                read_pipelined_file(file);
+            }
+            else if (file->info.is_regular_file() && (file->info.size >= kHashMmapThreshold))
+            {
+                dispatch_hash_task(session, get_file_processing_queue(), ^{
+                    bool hashed = compute_file_hash(file->path, file->info, session->hash_algorithm);
+                    finish_matched_file(session, std::move(file->path), file->info, file->write_xattr, hashed);
+                });
+            }
+            else
+            {
+                // symlinks, empty and non-existent files: at most one readlink, nothing worth a hashing slot
+                bool hashed = compute_file_hash(file->path, file->info, session->hash_algorithm);
+                finish_matched_file(session, std::move(file->path), file->info, file->write_xattr, hashed);
+            }
+
+            dispatch_semaphore_signal(io_limit_semaphore);
         });
     });
 }
 
-static void process_matched_file(const std::string &path, struct stat *statp) noexcept
+static void process_matched_file(FingerprintSessionState* session, const std::string &path, struct stat *statp) noexcept
 {
     if (statp == nullptr)
     {
@@ -212,13 +685,12 @@ static void process_matched_file(const std::string &path, struct stat *statp) no
     }
 
     FileInfo info(*statp);
-    process_matched_file_async(path, std::move(info));
+    process_matched_file_async(session, path, std::move(info));
 }
 
 // Process pre-constructed FileInfo entries for individual files
 // expected to be called on directory_traversal_queue
-void
-fingerprint::process_files_internal(const std::vector<std::pair<std::string, FileInfo>>& files) noexcept
+static void process_files_internal(FingerprintSessionState* session, const std::vector<std::pair<std::string, FileInfo>>& files) noexcept
 {
     if (files.empty())
     {
@@ -227,9 +699,9 @@ fingerprint::process_files_internal(const std::vector<std::pair<std::string, Fil
     
     for (const auto& [path, info] : files)
     {
-        if (is_exiting()) { break; }
+        if (is_exiting(session)) { break; }
         
-        process_matched_file_async(path, info);
+        process_matched_file_async(session, path, info);
     }
 }
 
@@ -307,15 +779,28 @@ bool is_path_under_directory(const std::string& start_dir, const std::string& pa
     return !rel.empty() && !rel.native().starts_with("..");
 }
 
+struct TraversalRoot;
+
+// expected to be called on directory_traversal_queue
+static int find_files_internal(FingerprintSessionState* session,
+                               std::string search_dir,
+                               const std::unordered_set<std::string>& glob_patterns,
+                               const std::unordered_set<std::string>& regex_patterns,
+                               const std::unordered_set<std::string>& exclude_patterns = {}) noexcept;
+
+// walks search root's subtree at walk_root, handing further subtrees to idle traversal workers
+static int walk_search_subtree(const std::shared_ptr<TraversalRoot>& root, const std::string& walk_root) noexcept;
+
 // Main entry point - separates directories from files
 int
-fingerprint::find_and_process_paths(const std::unordered_set<std::string>& paths,
-                                    const std::unordered_set<std::string>& glob_patterns,
-                                    const std::unordered_set<std::string>& regex_patterns,
-                                    const std::unordered_set<std::string>& exclude_patterns) noexcept
+FingerprintSession::find_and_process_paths(const std::unordered_set<std::string>& paths,
+                                           const std::unordered_set<std::string>& glob_patterns,
+                                           const std::unordered_set<std::string>& regex_patterns,
+                                           const std::unordered_set<std::string>& exclude_patterns) noexcept
 {
+    FingerprintSessionState* session = _state.get();
     dispatch_queue_t directory_traversal_queue = get_directory_traversal_queue();
-    dispatch_group_t task_group = get_all_tasks_group();
+    dispatch_group_t task_group = session->task_group;
 
     // Collect files with their FileInfo for batch processing
     std::vector<std::pair<std::string, FileInfo>> files;
@@ -326,8 +811,8 @@ fingerprint::find_and_process_paths(const std::unordered_set<std::string>& paths
     if (ec)
     {
         std::cerr << "Error: cannot get current directory: " << ec.message() << '\n';
-        s_result = EXIT_FAILURE;
-        return s_result;
+        session->result = EXIT_FAILURE;
+        return session->result;
     }
 
     CompiledExcludes compiled_excludes = compile_excludes(exclude_patterns);
@@ -359,8 +844,8 @@ fingerprint::find_and_process_paths(const std::unordered_set<std::string>& paths
                 // Dispatch directory traversal immediately
                 std::string dir_path = abs_str;
                 dispatch_group_async(task_group, directory_traversal_queue, ^{
-                    if (is_exiting()) { return; }
-                    __unused int find_result = find_files_internal(dir_path, glob_patterns, regex_patterns, exclude_patterns);
+                    if (is_exiting(session)) { return; }
+                    __unused int find_result = find_files_internal(session, dir_path, glob_patterns, regex_patterns, exclude_patterns);
                 });
             }
             else if (S_ISLNK(st.st_mode))
@@ -388,8 +873,8 @@ fingerprint::find_and_process_paths(const std::unordered_set<std::string>& paths
                         }
                         std::string dir_path = path;  // Copy the path for capture
                         dispatch_group_async(task_group, directory_traversal_queue, ^{
-                            if (is_exiting()) { return; }
-                            __unused int find_result = find_files_internal(dir_path, glob_patterns, regex_patterns, exclude_patterns);
+                            if (is_exiting(session)) { return; }
+                            __unused int find_result = find_files_internal(session, dir_path, glob_patterns, regex_patterns, exclude_patterns);
                         });
                     }
                     else
@@ -434,22 +919,24 @@ fingerprint::find_and_process_paths(const std::unordered_set<std::string>& paths
     if (!files.empty())
     {
         dispatch_group_async(task_group, directory_traversal_queue, ^{
-            if (is_exiting()) { return; }
-            process_files_internal(files);
+            if (is_exiting(session)) { return; }
+            process_files_internal(session, files);
         });
     }
     
-    return s_result;
+    return session->result;
 }
 
 
 int
-fingerprint::find_and_process_globbed_paths(const std::unordered_set<std::string>& paths,
-                                             const std::unordered_set<std::string>& exclude_patterns) noexcept
+FingerprintSession::find_and_process_globbed_paths(const std::unordered_set<std::string>& paths,
+                                                   const std::unordered_set<std::string>& exclude_patterns) noexcept
 {
     if (paths.empty())
         return EXIT_SUCCESS;
 
+    FingerprintSessionState* session = _state.get();
+
     std::unordered_set<std::string> plain_paths;
     std::unordered_map<std::string, std::unordered_set<std::string>> dir_to_globs;
 
@@ -458,13 +945,13 @@ fingerprint::find_and_process_globbed_paths(const std::unordered_set<std::string
     if (ec)
     {
         std::cerr << "Error: cannot get current directory: " << ec.message() << '\n';
-        s_result = EXIT_FAILURE;
-        return s_result;
+        session->result = EXIT_FAILURE;
+        return session->result;
     }
 
     for (const auto& path : paths)
     {
-        if (is_exiting()) return s_result;
+        if (is_exiting(session)) return session->result;
 
         if (path_exists_literal(path))
         {
@@ -477,7 +964,7 @@ fingerprint::find_and_process_globbed_paths(const std::unordered_set<std::string
         {
             // No glob characters and does not exist
             std::cerr << "error: declared file does not exist: " << path << '\n';
-            s_result = EXIT_FAILURE;
+            session->result = EXIT_FAILURE;
             return EXIT_FAILURE;
         }
 
@@ -532,7 +1019,7 @@ fingerprint::find_and_process_globbed_paths(const std::unordered_set<std::string
         {
             std::cerr << "error: glob base directory does not exist: " << dir_part 
                       << " (from pattern: " << path << ")\n";
-            s_result = EXIT_FAILURE;
+            session->result = EXIT_FAILURE;
             return EXIT_FAILURE;
         }
 
@@ -548,7 +1035,7 @@ fingerprint::find_and_process_globbed_paths(const std::unordered_set<std::string
         if (!is_well_formed_pattern)
         {
             std::cerr << "error: malformed glob pattern: " << glob_part << "\n";
-            s_result = EXIT_FAILURE;
+            session->result = EXIT_FAILURE;
             return EXIT_FAILURE;
         }
         
@@ -570,42 +1057,64 @@ fingerprint::find_and_process_globbed_paths(const std::unordered_set<std::string
     if (!dir_to_globs.empty())
     {
         dispatch_queue_t directory_traversal_queue = get_directory_traversal_queue();
-        dispatch_group_t task_group = get_all_tasks_group();
+        dispatch_group_t task_group = session->task_group;
 
         for (const auto& [search_dir_ref, globs_ref] : dir_to_globs)
         {
-            if (is_exiting()) break;
+            if (is_exiting(session)) break;
 
             std::string search_dir = search_dir_ref;
             std::unordered_set<std::string> globs = globs_ref;
             std::unordered_set<std::string> excludes = exclude_patterns;
 
             dispatch_group_async(task_group, directory_traversal_queue, ^{
-                if (is_exiting()) return;
-                __unused int find_result = find_files_internal(search_dir, globs, {}, excludes);
+                if (is_exiting(session)) return;
+                __unused int find_result = find_files_internal(session, search_dir, globs, {}, excludes);
             });
         }
     }
 
-    return s_result;
+    return session->result;
 }
 
+// One search root shared by all the subtree walks its traversal is split into.
+// The pattern sets are kept rather than their compiled form: glob matching keeps state
+// in the compiled automaton, so every concurrent walk compiles its own.
+struct TraversalRoot
+{
+    FingerprintSessionState* session = nullptr;
+    std::string search_dir;
+    dev_t device = 0;
+    std::unordered_set<std::string> glob_patterns;
+    std::unordered_set<std::string> regex_patterns;
+    std::unordered_set<std::string> exclude_patterns;
+    dispatch_group_t walk_group = nullptr; // all subtree walks of this root
+    struct timeval time_start {};
+};
+
+// Subtree walks queued or running across all roots of all sessions: the traversal workers are
+// shared like the rest of the pool. A walk hands a subdirectory to the pool
+// only while this is below the number of hashing jobs, otherwise it descends itself: idle
+// capacity takes subtrees over, and a tree of millions of directories does not become
+// millions of fts_open calls.
+static std::atomic_int s_pending_subtree_walks = 0;
+
 // fts_read() is a solid choice for directory traversal —
 // iterative, no stack-depth risk, exposes stat without a second syscall.
 // https://blog.tempel.org/2019/04/dir-read-performance.html
 
-int
-fingerprint::find_files_internal(std::string search_dir,
-                                 const std::unordered_set<std::string>& glob_patterns,
-                                 const std::unordered_set<std::string>& regex_patterns,
-                                 const std::unordered_set<std::string>& exclude_patterns) noexcept
+static int find_files_internal(FingerprintSessionState* session,
+                               std::string search_dir,
+                               const std::unordered_set<std::string>& glob_patterns,
+                               const std::unordered_set<std::string>& regex_patterns,
+                               const std::unordered_set<std::string>& exclude_patterns) noexcept
 {
     assert(search_dir.size() > 0);
 
-    if (is_exiting())
+    if (is_exiting(session))
     {
-        s_result = EXIT_FAILURE;
-        return s_result;
+        session->result = EXIT_FAILURE;
+        return session->result;
     }
 
     // Remove possible trailing slash – makes relative-path calculation safe
@@ -625,37 +1134,113 @@ fingerprint::find_files_internal(std::string search_dir,
     // walked by another concurrent call — bail out to break cross-directory symlink cycles.
     __block bool already_visited = false;
     dispatch_sync(get_shared_container_mutation_queue(), ^{
-        already_visited = !s_search_bases.emplace(search_dir).second;
+        already_visited = !session->search_bases.emplace(search_dir).second;
     });
     if (already_visited)
         return EXIT_SUCCESS;
 
-    struct timeval time_start;
-    struct timeval time_end;
-    ::gettimeofday(&time_start, nullptr);
+    std::shared_ptr<TraversalRoot> root;
+    try
+    {
+        root = std::make_shared<TraversalRoot>();
+        root->session = session;
+        root->search_dir = search_dir;
+        root->glob_patterns = glob_patterns;
+        root->regex_patterns = regex_patterns;
+        root->exclude_patterns = exclude_patterns;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "operation failed with exception:" << e.what() << '\n';
+        session->result = EXIT_FAILURE;
+        return session->result;
+    }
+
+    ::gettimeofday(&root->time_start, nullptr);
+
+    // FTS_XDEV reference: subtrees on another device are left to the walk that finds them
+    struct stat root_stat;
+    root->device = (lstat(search_dir.c_str(), &root_stat) == 0) ? root_stat.st_dev : 0;
+    root->walk_group = dispatch_group_create();
+
+    int result = walk_search_subtree(root, search_dir);
+
+    // The traversal of this root ends when the last of its subtree walks does
+    dispatch_group_t task_group = session->task_group;
+    dispatch_group_enter(task_group);
+    dispatch_group_notify(root->walk_group, get_directory_traversal_queue(), ^{
+        struct timeval time_end;
+        ::gettimeofday(&time_end, nullptr);
+        root->session->traversal_time = (double)time_end.tv_sec + (double)time_end.tv_usec/(1000.0 * 1000.0) -
+                           ((double)root->time_start.tv_sec + (double)root->time_start.tv_usec/(1000.0 * 1000.0));
+        dispatch_release(root->walk_group);
+        dispatch_group_leave(task_group);
+    });
+
+    return result;
+}
+
+// Walks walk_root, which is root->search_dir itself or a subdirectory handed out by another
+// walk of the same root. Matching, exclusion and symlink chain handling are all relative to
+// root->search_dir, so the matched set does not depend on how the tree was split.
+static int walk_search_subtree(const std::shared_ptr<TraversalRoot>& root, const std::string& walk_root) noexcept
+{
+    FingerprintSessionState* session = root->session;
+
+    if (is_exiting(session))
+    {
+        session->result = EXIT_FAILURE;
+        return session->result;
+    }
 
-    std::vector<Glob> compiled_globs = compile_globs(glob_patterns);
-    std::vector<Regex> compiled_regexes = compile_regexes(regex_patterns);
+    const std::string& search_dir = root->search_dir;
+    CompiledExcludes compiled_excludes = compile_excludes(root->exclude_patterns);
+    std::vector<Glob> compiled_globs = compile_globs(root->glob_patterns);
+    std::vector<Regex> compiled_regexes = compile_regexes(root->regex_patterns);
 
     // FTS_XDEV: stay on the same filesystem.
     // FTS_PHYSICAL: report symlinks as FTS_SL/FTS_SLNONE so we can resolve
     //               chains that lead outside search_dir ourselves.
     FileMatchedBlock on_match = ^(const char* abs_path, struct stat* statp) {
-        process_matched_file(abs_path, statp);
+        process_matched_file(session, abs_path, statp);
+    };
+
+    const int max_pending_walks = get_hash_jobs();
+    DirectoryFoundBlock on_directory = ^bool(const char* abs_path, struct stat* statp) {
+        // a mount point stays in this walk, where FTS_XDEV reports it and does not descend
+        if ((statp == nullptr) || (statp->st_dev != root->device) || is_exiting(session))
+            return false;
+
+        if (s_pending_subtree_walks.fetch_add(1) >= max_pending_walks)
+        {
+            s_pending_subtree_walks--;
+            return false;
+        }
+
+        std::string subdir = abs_path;
+        std::shared_ptr<TraversalRoot> shared_root = root;
+        dispatch_group_enter(shared_root->walk_group);
+        dispatch_group_async(session->task_group, get_directory_traversal_queue(), ^{
+            __unused int r = walk_search_subtree(shared_root, subdir);
+            s_pending_subtree_walks--;
+            dispatch_group_leave(shared_root->walk_group);
+        });
+        return true;
     };
 
     std::vector<std::string> symlinks;
     int result = walk_directory(search_dir, compiled_globs, compiled_regexes,
-                                compiled_excludes, on_match, &symlinks, FTS_XDEV);
+                                compiled_excludes, on_match, &symlinks, FTS_XDEV,
+                                on_directory, &walk_root);
 
-    if (is_exiting())
+    if (is_exiting(session))
         result = EXIT_FAILURE;
 
     // Follow symlink chains that lead outside search_dir.
     // compiled_excludes/compiled_globs are alive here (stack-local) — no block capture needed.
     for (const auto& sym_path_str : symlinks)
     {
-        if (is_exiting())
+        if (is_exiting(session))
         {
             result = EXIT_FAILURE;
             break;
@@ -675,90 +1260,257 @@ fingerprint::find_files_internal(std::string search_dir,
                     if (g_verbose)
                         std::cerr << "Symlink chain leads to directory: " << path << '\n';
                     std::string dir_path = path;
-                    std::unordered_set<std::string> excludes_copy = exclude_patterns;
-                    dispatch_group_async(get_all_tasks_group(), get_directory_traversal_queue(), ^{
-                        if (is_exiting())
+                    std::shared_ptr<TraversalRoot> shared_root = root;
+                    dispatch_group_async(session->task_group, get_directory_traversal_queue(), ^{
+                        if (is_exiting(session))
                             return;
-                        __unused int r = find_files_internal(dir_path, glob_patterns,
-                                                              regex_patterns, excludes_copy);
+                        __unused int r = find_files_internal(session, dir_path, shared_root->glob_patterns,
+                                                              shared_root->regex_patterns, shared_root->exclude_patterns);
                     });
                 }
                 else
                 {
                     if (compiled_globs.empty() || matches_any_glob(path.c_str(), compiled_globs))
-                        process_matched_file_async(path, info);
+                        process_matched_file_async(session, path, info);
                 }
             }
         }
     }
 
-    ::gettimeofday(&time_end, nullptr);
-    g_traversal_time = (double)time_end.tv_sec + (double)time_end.tv_usec/(1000.0 * 1000.0) -
-                       ((double)time_start.tv_sec + (double)time_start.tv_usec/(1000.0 * 1000.0));
-
     if (result != 0)
-        s_result = result;
-    
+        session->result = result;
+
     return result;
 }
 
 
-void
-fingerprint::wait_for_all_tasks() noexcept
+void
+FingerprintSession::wait_for_all_tasks() noexcept
+{
+    dispatch_group_wait(_state->task_group, DISPATCH_TIME_FOREVER);
+}
+
+static inline __attribute__((always_inline)) std::string get_path_for_fingerprint(const FingerprintSessionState* session, const std::string& abs_path, FingerprintOptions options)
+{
+    if (options == FingerprintOptions::HashRelativePaths)
+    {
+        std::string best_rel;
+        size_t best_len = 0;
+
+        for (const auto& base : session->search_bases) {
+            if (abs_path.starts_with(base) && base.size() > best_len) {
+                std::string rel = abs_path.substr(base.size());
+                if (!rel.empty() && rel[0] == '/')
+                    rel.erase(0, 1);
+                best_len = base.size();
+                best_rel = std::move(rel);
+            }
+        }
+        return best_rel.empty() ? abs_path : best_rel;
+    }
+
+    return abs_path; // fallback for HashAbsolutePaths or Default (which does not use it)
+}
+
+
+// file paths usually are more diverse at the end than the beginning
+// esitmate is 40-60% less comparison work needed if we sort with reverse comparator
+
+struct ReversePathComparator
+{
+    bool operator()(const std::string& a, const std::string& b) const
+    {
+        size_t i = a.size();
+        size_t j = b.size();
+
+        while (i > 0 && j > 0)
+        {
+            if (a[--i] != b[--j])
+            {
+                return a[i] < b[j];
+            }
+        }
+        return i > 0;  // a longer than b with common suffix: a > b
+    }
+};
+
+
+
+// Forward path order in which the entries of every directory are contiguous and sorted
+// by name: '/' compares lower than any other byte, so "a/x" sorts before "a.txt" just as
+// the entry "a" sorts before "a.txt" in their common directory.
+struct TreePathComparator
+{
+    bool operator()(const std::string& a, const std::string& b) const
+    {
+        size_t common = std::min(a.size(), b.size());
+        for (size_t i = 0; i < common; i++)
+        {
+            if (a[i] != b[i])
+            {
+                unsigned char ca = (a[i] == '/') ? 0 : (unsigned char)a[i];
+                unsigned char cb = (b[i] == '/') ? 0 : (unsigned char)b[i];
+                return ca < cb;
+            }
+        }
+        return a.size() < b.size();
+    }
+};
+
+// one directory entry: name, '\0', type ('f' or 'd'), 8-byte little-endian hash
+static inline __attribute__((always_inline))
+void hash_tree_entry(blake3_hasher* hasher, const char* name, size_t name_len, char type, uint64_t hash) noexcept
+{
+    blake3_hasher_update(hasher, name, name_len);
+    uint8_t tail[2 + sizeof(uint64_t)] = { 0, (uint8_t)type };
+    memcpy(tail + 2, &hash, sizeof(hash));
+    blake3_hasher_update(hasher, tail, sizeof(tail));
+}
+
+// The rest of a file entry in a recorded directory hash: size, mtime and permission bits,
+// the fields --compare reports besides the content hash. A subtree whose recorded hash is
+// unchanged then has nothing to report, so compare can skip it without changing its output.
+static inline __attribute__((always_inline))
+void hash_tree_file_metadata(blake3_hasher* hasher, const FileInfo& info) noexcept
+{
+    uint64_t fields[3] = { (uint64_t)info.size, (uint64_t)info.mtime_ns, (uint64_t)(info.mode & 07777) };
+    blake3_hasher_update(hasher, fields, sizeof(fields));
+}
+
+static inline __attribute__((always_inline))
+uint64_t finalize_tree_hash(blake3_hasher* hasher) noexcept
+{
+    uint64_t hash = 0;
+    blake3_hasher_finalize(hasher, (uint8_t*)&hash, sizeof(hash));
+    return hash;
+}
+
+// deepest directory that contains both directories, on a path component boundary
+static std::string common_directory(const std::string& a, const std::string& b) noexcept
 {
-    dispatch_group_wait(get_all_tasks_group(), DISPATCH_TIME_FOREVER);
+    size_t limit = std::min(a.size(), b.size());
+    size_t n = 0;
+    while ((n < limit) && (a[n] == b[n]))
+        n++;
+    if (((n == a.size()) || (a[n] == '/')) && ((n == b.size()) || (b[n] == '/')))
+        return a.substr(0, n);
+    size_t slash = a.rfind('/', n);
+    return a.substr(0, (slash == std::string::npos) ? 0 : slash);
 }
 
-static inline __attribute__((always_inline)) std::string get_path_for_fingerprint(const std::string& abs_path, FingerprintOptions options)
+// Merkle fingerprint over all_matched_files (already free of duplicates). With the
+// files in TreePathComparator order, every directory is entered once and finished before
+// its next sibling, so one pass with a stack of open directory hashers builds the tree
+// without materializing it.
+//
+// Each directory is hashed twice. The content hash covers names and contents only and
+// rolls up into the fingerprint. The recorded hash also covers each file's metadata (see
+// hash_tree_file_metadata) and is the one stored in directory_hashes for snapshots.
+static uint64_t compute_tree_fingerprint(FingerprintSessionState* session) noexcept
 {
-    if (options == FingerprintOptions::HashRelativePaths)
-    {
-        std::string best_rel;
-        size_t best_len = 0;
+    std::vector<std::pair<std::string, FileInfo>>& all_matched_files = session->all_matched_files;
+    std::vector<std::pair<std::string, uint64_t>>& directory_hashes = session->directory_hashes;
 
-        for (const auto& base : s_search_bases) {
-            if (abs_path.starts_with(base) && base.size() > best_len) {
-                std::string rel = abs_path.substr(base.size());
-                if (!rel.empty() && rel[0] == '/')
-                    rel.erase(0, 1);
-                best_len = base.size();
-                best_rel = std::move(rel);
-            }
-        }
-        return best_rel.empty() ? abs_path : best_rel;
+    std::sort(all_matched_files.begin(), all_matched_files.end(),
+              [](const auto& a, const auto& b) { return TreePathComparator{}(a.first, b.first); });
+
+    directory_hashes.clear();
+
+    const std::string* first_path = nullptr;
+    const std::string* last_path = nullptr;
+    for (const auto& [path, info] : all_matched_files)
+    {
+        if (info.is_nonexistent())
+            continue;
+        if (first_path == nullptr)
+            first_path = &path;
+        last_path = &path;
     }
 
-    return abs_path; // fallback for HashAbsolutePaths or Default (which does not use it)
-}
+    struct OpenDirectory
+    {
+        blake3_hasher content;
+        blake3_hasher recorded;
+    };
 
+    OpenDirectory root_directory;
+    blake3_hasher_init(&root_directory.content);
+    blake3_hasher_init(&root_directory.recorded);
+    if (first_path == nullptr)
+        return finalize_tree_hash(&root_directory.content);
 
-// file paths usually are more diverse at the end than the beginning
-// esitmate is 40-60% less comparison work needed if we sort with reverse comparator
+    // paths are absolute, so the root of "/f" is "" - recorded as "/"
+    std::string current = common_directory(first_path->substr(0, first_path->rfind('/')),
+                                           last_path->substr(0, last_path->rfind('/')));
+    const std::string root = current;
+    std::vector<OpenDirectory> open_directories;
+    open_directories.push_back(root_directory);
 
-struct ReversePathComparator
-{
-    bool operator()(const std::string& a, const std::string& b) const
+    auto close_innermost = [&]()
     {
-        size_t i = a.size();
-        size_t j = b.size();
+        uint64_t content_hash = finalize_tree_hash(&open_directories.back().content);
+        uint64_t recorded_hash = finalize_tree_hash(&open_directories.back().recorded);
+        open_directories.pop_back();
+        directory_hashes.emplace_back(current, recorded_hash);
+        size_t slash = current.rfind('/');
+        const char* name = current.data() + slash + 1;
+        size_t name_len = current.size() - slash - 1;
+        hash_tree_entry(&open_directories.back().content, name, name_len, 'd', content_hash);
+        hash_tree_entry(&open_directories.back().recorded, name, name_len, 'd', recorded_hash);
+        current.resize(slash);
+    };
 
-        while (i > 0 && j > 0)
+    for (const auto& [path, info] : all_matched_files)
+    {
+        if (info.is_nonexistent())
+            continue;
+
+        size_t slash = path.rfind('/');
+        while ((open_directories.size() > 1)
+               && !((slash >= current.size()) && (path.compare(0, current.size(), current) == 0)
+                    && ((slash == current.size()) || (path[current.size()] == '/'))))
         {
-            if (a[--i] != b[--j])
-            {
-                return a[i] < b[j];
-            }
+            close_innermost();
         }
-        return i > 0;  // a longer than b with common suffix: a > b
+
+        while (current.size() < slash)
+        {
+            current.assign(path, 0, path.find('/', current.size() + 1));
+            OpenDirectory directory;
+            blake3_hasher_init(&directory.content);
+            blake3_hasher_init(&directory.recorded);
+            open_directories.push_back(directory);
+        }
+
+        uint64_t file_hash = (session->hash_algorithm == FileHashAlgorithm::CRC32C) ? (uint64_t)info.hash.crc32c : info.hash.blake3;
+        const char* name = path.data() + slash + 1;
+        size_t name_len = path.size() - slash - 1;
+        hash_tree_entry(&open_directories.back().content, name, name_len, 'f', file_hash);
+        hash_tree_entry(&open_directories.back().recorded, name, name_len, 'f', file_hash);
+        hash_tree_file_metadata(&open_directories.back().recorded, info);
     }
-};
 
+    while (open_directories.size() > 1)
+        close_innermost();
 
+    uint64_t root_hash = finalize_tree_hash(&open_directories.back().content);
+    directory_hashes.emplace_back(root.empty() ? std::string("/") : root,
+                                  finalize_tree_hash(&open_directories.back().recorded));
+
+    std::sort(directory_hashes.begin(), directory_hashes.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+    return root_hash;
+}
 
 uint64_t
-fingerprint::sort_and_compute_fingerprint(FingerprintOptions fingerprintOptions) noexcept
+FingerprintSession::sort_and_compute_fingerprint(FingerprintOptions fingerprintOptions) noexcept
 {
-    std::sort(s_all_matched_files.begin(), s_all_matched_files.end(), [](const auto& x, const auto& y) {
+    FingerprintSessionState* session = _state.get();
+    std::vector<std::pair<std::string, FileInfo>>& all_matched_files = session->all_matched_files;
+
+    merge_matched_files_shards(session);
+
+    std::sort(all_matched_files.begin(), all_matched_files.end(), [](const auto& x, const auto& y) {
         return ReversePathComparator{}(x.first, y.first);
     });
 
@@ -767,26 +1519,29 @@ fingerprint::sort_and_compute_fingerprint(FingerprintOptions fingerprintOptions)
     
     // Remove duplicates - keep first occurrence of each unique path
     // After sorting, duplicates will be adjacent
-    auto last = std::unique(s_all_matched_files.begin(), s_all_matched_files.end(),
+    auto last = std::unique(all_matched_files.begin(), all_matched_files.end(),
                            [](const auto& a, const auto& b) {
                                return a.first == b.first;  // Compare paths
                            });
     
     // Erase the duplicate entries
-    if (last != s_all_matched_files.end())
+    if (last != all_matched_files.end())
     {
-        size_t duplicate_count = std::distance(last, s_all_matched_files.end());
+        size_t duplicate_count = std::distance(last, all_matched_files.end());
         if (g_verbose)
         {
             std::cerr << "Removed " << duplicate_count << " duplicate path(s)\n";
         }
-        s_all_matched_files.erase(last, s_all_matched_files.end());
+        all_matched_files.erase(last, all_matched_files.end());
     }
 
+    if (fingerprintOptions == FingerprintOptions::HashTree)
+        return compute_tree_fingerprint(session);
+
     blake3_hasher hasher;
     blake3_hasher_init(&hasher);
 
-    for (const auto& [path, info] : s_all_matched_files)
+    for (const auto& [path, info] : all_matched_files)
     {
         // Skip non-existent files with sentinel hashes
         if (info.inode == 0 && info.size == 0 && info.mtime_ns == 0)
@@ -795,11 +1550,11 @@ fingerprint::sort_and_compute_fingerprint(FingerprintOptions fingerprintOptions)
         // Include path only if requested
         if (fingerprintOptions != FingerprintOptions::Default)
         {
-            std::string path_to_hash = get_path_for_fingerprint(path, fingerprintOptions);
+            std::string path_to_hash = get_path_for_fingerprint(session, path, fingerprintOptions);
             blake3_hasher_update(&hasher, path_to_hash.data(), path_to_hash.size() + 1); // +1 for trailing '\0'
         }
 
-        if (g_hash == FileHashAlgorithm::CRC32C)
+        if (session->hash_algorithm == FileHashAlgorithm::CRC32C)
             blake3_hasher_update(&hasher, &info.hash.crc32c, sizeof(info.hash.crc32c));
         else
             blake3_hasher_update(&hasher, &info.hash.blake3, sizeof(info.hash.blake3));
@@ -811,23 +1566,25 @@ fingerprint::sort_and_compute_fingerprint(FingerprintOptions fingerprintOptions)
     return *(const uint64_t*)output;
 }
 
-void fingerprint::list_matched_files() noexcept
+void FingerprintSession::list_matched_files() noexcept
 {
+    std::vector<std::pair<std::string, FileInfo>>& all_matched_files = _state->all_matched_files;
+
     // Sort in natural forward order
-    std::sort(s_all_matched_files.begin(), s_all_matched_files.end(),
+    std::sort(all_matched_files.begin(), all_matched_files.end(),
               [](const auto& a, const auto& b) { return a.first < b.first; });
 
     std::string out;
-    out.reserve(s_all_matched_files.size() * 128); // a guestimate of max chars per line
+    out.reserve(all_matched_files.size() * 128); // a guestimate of max chars per line
 
-    for (const auto& [path, info] : s_all_matched_files)
+    for (const auto& [path, info] : all_matched_files)
     {
         if (info.is_nonexistent()) continue;
 
         char line[PATH_MAX + 64];
         int len;
 
-        if (g_hash == FileHashAlgorithm::CRC32C)
+        if (_state->hash_algorithm == FileHashAlgorithm::CRC32C)
             len = std::snprintf(line, sizeof(line), "%08x\t%s\n",
                                 info.hash.crc32c, path.c_str());
         else
@@ -856,6 +1613,7 @@ static CFMutableDict load_tsv_as_cfdict(const std::string& path) noexcept
     }
 
     CFMutableArr files_arr;
+    CFMutableArr directories_arr;
 
     std::string line;
     bool first_line = true;
@@ -870,6 +1628,17 @@ static CFMutableDict load_tsv_as_cfdict(const std::string& path) noexcept
         }
 
         size_t tab1 = line.find('\t');
+        if ((tab1 != std::string::npos) && (tab1 > 0) && (line[tab1 - 1] == '/')
+            && (line.find('\t', tab1 + 1) == std::string::npos))
+        {
+            // tree mode directory row
+            CFMutableDict dir_dict;
+            dir_dict.SetValue(CFSTR("path"), CFStr(line.substr(0, (tab1 > 1) ? tab1 - 1 : tab1)));
+            dir_dict.SetValue(CFSTR("hash"), CFStr(line.substr(tab1 + 1)));
+            directories_arr.AppendValue(dir_dict);
+            continue;
+        }
+
         size_t tab2 = line.find('\t', tab1 + 1);
         size_t tab3 = line.find('\t', tab2 + 1);
         size_t tab4 = line.find('\t', tab3 + 1);
@@ -892,15 +1661,38 @@ static CFMutableDict load_tsv_as_cfdict(const std::string& path) noexcept
     }
 
     root_dict.SetValue(CFSTR("files"), (CFMutableArrayRef)files_arr);
+    if (directories_arr.GetCount() > 0)
+        root_dict.SetValue(CFSTR("directories"), (CFMutableArrayRef)directories_arr);
 
     return root_dict;
 }
 
 static void compare_metadata(CFDictionaryRef snap1, CFDictionaryRef snap2, FileHashAlgorithm& hash_algorithm) noexcept;
 static bool compare_files(CFDictionaryRef snap1, CFDictionaryRef snap2, FileHashAlgorithm hash_algorithm) noexcept;
+static void compare_binary_metadata(const MappedSnapshot& snap1, const MappedSnapshot& snap2, FileHashAlgorithm& hash_algorithm) noexcept;
+static bool compare_binary_files(const MappedSnapshot& snap1, const MappedSnapshot& snap2, FileHashAlgorithm hash_algorithm) noexcept;
 
 int fingerprint::compare_snapshots(const std::string& path1, const std::string& path2) noexcept
 {
+    // two binary snapshots are compared straight from their mappings; any other
+    // combination goes through CFDictionary, the binary side converted on load
+    if (is_binary_snapshot_path(path1) && is_binary_snapshot_path(path2))
+    {
+        std::unique_ptr<MappedSnapshot> mapped1 = MappedSnapshot::open(path1);
+        if (mapped1 == nullptr)
+            return EXIT_FAILURE;
+
+        std::unique_ptr<MappedSnapshot> mapped2 = MappedSnapshot::open(path2);
+        if (mapped2 == nullptr)
+            return EXIT_FAILURE;
+
+        FileHashAlgorithm hash_algorithm = FileHashAlgorithm::UNKNOWN;
+        compare_binary_metadata(*mapped1, *mapped2, hash_algorithm);
+        bool found_diff = compare_binary_files(*mapped1, *mapped2, hash_algorithm);
+
+        return found_diff ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
+
     CFObj<CFMutableDictionaryRef> snap1(load_snapshot(path1));
     if (snap1 == nullptr)
         return EXIT_FAILURE;
@@ -916,26 +1708,29 @@ int fingerprint::compare_snapshots(const std::string& path1, const std::string&
     return found_diff ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
-int fingerprint::save_snapshot_tsv(const std::string& path, const SnapshotMetadata& metadata) noexcept
+int FingerprintSession::save_snapshot_tsv(const std::string& path, const SnapshotMetadata& metadata) noexcept
 {
+    FingerprintSessionState* session = _state.get();
+    std::vector<std::pair<std::string, FileInfo>>& all_matched_files = session->all_matched_files;
+
     if (path.empty())
     {
         std::cerr << "Error: snapshot path is empty\n";
         return EXIT_FAILURE;
     }
 
-    std::sort(s_all_matched_files.begin(), s_all_matched_files.end(),
+    std::sort(all_matched_files.begin(), all_matched_files.end(),
               [](const auto& a, const auto& b) { return a.first < b.first; });
 
     std::string out;
-    out.reserve(s_all_matched_files.size() * 128);
+    out.reserve(all_matched_files.size() * 128);
 
-    const char* hash_column = (g_hash == FileHashAlgorithm::CRC32C) ? "crc32c" : "blake3";
+    const char* hash_column = hash_algorithm_name(session->hash_algorithm);
     out += "path\t";
     out += hash_column;
     out += "\tsize\tinode\tmtime_ns\tmode\n";
 
-    for (const auto& [file_path, info] : s_all_matched_files)
+    for (const auto& [file_path, info] : all_matched_files)
     {
         if (info.is_nonexistent()) continue;
 
@@ -943,7 +1738,7 @@ int fingerprint::save_snapshot_tsv(const std::string& path, const SnapshotMetada
         int len;
 
         char hash_hex[32];
-        if (g_hash == FileHashAlgorithm::CRC32C)
+        if (session->hash_algorithm == FileHashAlgorithm::CRC32C)
             std::snprintf(hash_hex, sizeof(hash_hex), "%08x", info.hash.crc32c);
         else
             std::snprintf(hash_hex, sizeof(hash_hex), "%016llx", (unsigned long long)info.hash.blake3);
@@ -959,6 +1754,17 @@ int fingerprint::save_snapshot_tsv(const std::string& path, const SnapshotMetada
         out.append(line, len);
     }
 
+    // tree mode: "dir/<tab>hash" rows after the files; loaders without directory
+    // support skip them as incomplete rows
+    for (const auto& [dir_path, dir_hash] : session->directory_hashes)
+    {
+        char line[PATH_MAX + 32];
+        const char* slash = (dir_path.back() == '/') ? "" : "/";
+        int len = std::snprintf(line, sizeof(line), "%s%s\t%016llx\n",
+                                dir_path.c_str(), slash, (unsigned long long)dir_hash);
+        out.append(line, len);
+    }
+
     std::ofstream outfile(path, std::ios::out | std::ios::binary);
     if (outfile.fail())
     {
@@ -985,8 +1791,11 @@ static CFMutableArr cfarray_from_strings(const std::vector<std::string>& vec) no
     return arr;
 }
 
-static CFMutableDict build_snapshot_dictionary(const SnapshotMetadata& metadata) noexcept
+static CFMutableDict build_snapshot_dictionary(const FingerprintSessionState* session, const SnapshotMetadata& metadata) noexcept
 {
+    const std::vector<std::pair<std::string, FileInfo>>& all_matched_files = session->all_matched_files;
+    const std::vector<std::pair<std::string, uint64_t>>& directory_hashes = session->directory_hashes;
+
     CFMutableDict root_dict;
     CFMutableDict params_dict;
 
@@ -995,15 +1804,14 @@ static CFMutableDict build_snapshot_dictionary(const SnapshotMetadata& metadata)
     params_dict.SetValue(CFSTR("regex_patterns"),  cfarray_from_strings(metadata.regex_patterns));
     params_dict.SetValue(CFSTR("exclude_patterns"), cfarray_from_strings(metadata.exclude_patterns));
 
-    CFStringRef hash_algo = (metadata.hash_algorithm == FileHashAlgorithm::CRC32C) ?
-        CFSTR("crc32c") : CFSTR("blake3");
-    params_dict.SetValue(CFSTR("hash_algorithm"), hash_algo);
+    params_dict.SetValue(CFSTR("hash_algorithm"), CFStr(hash_algorithm_name(metadata.hash_algorithm)));
 
     CFStringRef fp_mode = CFSTR("default");
     switch (metadata.fingerprint_mode)
     {
         case FingerprintOptions::HashAbsolutePaths: fp_mode = CFSTR("absolute"); break;
         case FingerprintOptions::HashRelativePaths: fp_mode = CFSTR("relative"); break;
+        case FingerprintOptions::HashTree: fp_mode = CFSTR("tree"); break;
         default: fp_mode = CFSTR("default"); break;
     }
     params_dict.SetValue(CFSTR("fingerprint_mode"), fp_mode);
@@ -1017,8 +1825,8 @@ static CFMutableDict build_snapshot_dictionary(const SnapshotMetadata& metadata)
 
     root_dict.SetValue(CFSTR("fingerprint_params"), (CFMutableDictionaryRef)params_dict);
 
-    CFMutableArr files_arr((CFIndex)s_all_matched_files.size());
-    for (const auto& [file_path, info] : s_all_matched_files)
+    CFMutableArr files_arr((CFIndex)all_matched_files.size());
+    for (const auto& [file_path, info] : all_matched_files)
     {
         if (info.is_nonexistent()) continue;
 
@@ -1026,7 +1834,7 @@ static CFMutableDict build_snapshot_dictionary(const SnapshotMetadata& metadata)
         file_dict.SetValue(CFSTR("path"), CFStr(file_path));
 
         char hash_hex[32];
-        if (g_hash == FileHashAlgorithm::CRC32C)
+        if (session->hash_algorithm == FileHashAlgorithm::CRC32C)
             std::snprintf(hash_hex, sizeof(hash_hex), "%08x", info.hash.crc32c);
         else
             std::snprintf(hash_hex, sizeof(hash_hex), "%016llx", (unsigned long long)info.hash.blake3);
@@ -1045,13 +1853,32 @@ static CFMutableDict build_snapshot_dictionary(const SnapshotMetadata& metadata)
 
     root_dict.SetValue(CFSTR("files"), (CFMutableArrayRef)files_arr);
 
+    if (!directory_hashes.empty())
+    {
+        CFMutableArr directories_arr((CFIndex)directory_hashes.size());
+        for (const auto& [dir_path, dir_hash] : directory_hashes)
+        {
+            CFMutableDict dir_dict;
+            dir_dict.SetValue(CFSTR("path"), CFStr(dir_path));
+            char hash_hex[32];
+            std::snprintf(hash_hex, sizeof(hash_hex), "%016llx", (unsigned long long)dir_hash);
+            dir_dict.SetValue(CFSTR("hash"), CFStr(std::string_view(hash_hex)));
+            directories_arr.AppendValue(dir_dict);
+        }
+        root_dict.SetValue(CFSTR("directories"), (CFMutableArrayRef)directories_arr);
+    }
+
     return root_dict;
 }
 
 // Parallel JSON builder: emits the same shape as build_snapshot_dictionary,
 // but directly into a yyjson MutableDoc — bypassing CFDictionary entirely.
-static void build_snapshot_json(const SnapshotMetadata& metadata, Json::MutableDoc& doc) noexcept
+static void build_snapshot_json(const FingerprintSessionState* session, const SnapshotMetadata& metadata, Json::MutableDoc& doc) noexcept
 {
+    const std::vector<std::pair<std::string, FileInfo>>& all_matched_files = session->all_matched_files;
+    const std::vector<std::pair<std::string, uint64_t>>& directory_hashes = session->directory_hashes;
+
+
     auto arr_from_strings = [&](const std::vector<std::string>& vec) {
         Json::MutableVal arr = doc.new_arr();
         for (const auto& s : vec)
@@ -1067,7 +1894,7 @@ static void build_snapshot_json(const SnapshotMetadata& metadata, Json::MutableD
     doc.obj_add(params, "regex_patterns",   arr_from_strings(metadata.regex_patterns));
     doc.obj_add(params, "exclude_patterns", arr_from_strings(metadata.exclude_patterns));
 
-    const char* hash_algo = (metadata.hash_algorithm == FileHashAlgorithm::CRC32C) ? "crc32c" : "blake3";
+    const char* hash_algo = hash_algorithm_name(metadata.hash_algorithm);
     doc.obj_add(params, "hash_algorithm", doc.new_str(hash_algo));
 
     const char* fp_mode = "default";
@@ -1075,6 +1902,7 @@ static void build_snapshot_json(const SnapshotMetadata& metadata, Json::MutableD
     {
         case FingerprintOptions::HashAbsolutePaths: fp_mode = "absolute"; break;
         case FingerprintOptions::HashRelativePaths: fp_mode = "relative"; break;
+        case FingerprintOptions::HashTree: fp_mode = "tree"; break;
         default: fp_mode = "default"; break;
     }
     doc.obj_add(params, "fingerprint_mode", doc.new_str(fp_mode));
@@ -1089,7 +1917,7 @@ static void build_snapshot_json(const SnapshotMetadata& metadata, Json::MutableD
     doc.obj_add(root, "fingerprint_params", params);
 
     Json::MutableVal files_arr = doc.new_arr();
-    for (const auto& [file_path, info] : s_all_matched_files)
+    for (const auto& [file_path, info] : all_matched_files)
     {
         if (info.is_nonexistent()) continue;
 
@@ -1097,7 +1925,7 @@ static void build_snapshot_json(const SnapshotMetadata& metadata, Json::MutableD
         doc.obj_add(file_obj, "path", doc.new_str(file_path));
 
         char hash_hex[32];
-        if (g_hash == FileHashAlgorithm::CRC32C)
+        if (session->hash_algorithm == FileHashAlgorithm::CRC32C)
             std::snprintf(hash_hex, sizeof(hash_hex), "%08x", info.hash.crc32c);
         else
             std::snprintf(hash_hex, sizeof(hash_hex), "%016llx", (unsigned long long)info.hash.blake3);
@@ -1115,21 +1943,38 @@ static void build_snapshot_json(const SnapshotMetadata& metadata, Json::MutableD
     }
     doc.obj_add(root, "files", files_arr);
 
+    if (!directory_hashes.empty())
+    {
+        Json::MutableVal directories_arr = doc.new_arr();
+        for (const auto& [dir_path, dir_hash] : directory_hashes)
+        {
+            Json::MutableVal dir_obj = doc.new_obj();
+            doc.obj_add(dir_obj, "path", doc.new_str(dir_path));
+            char hash_hex[32];
+            std::snprintf(hash_hex, sizeof(hash_hex), "%016llx", (unsigned long long)dir_hash);
+            doc.obj_add(dir_obj, "hash", doc.new_str(hash_hex));
+            doc.arr_append(directories_arr, dir_obj);
+        }
+        doc.obj_add(root, "directories", directories_arr);
+    }
+
     doc.set_root(root);
 }
 
-int fingerprint::save_snapshot_plist(const std::string& path, const SnapshotMetadata& metadata) noexcept
+int FingerprintSession::save_snapshot_plist(const std::string& path, const SnapshotMetadata& metadata) noexcept
 {
+    std::vector<std::pair<std::string, FileInfo>>& all_matched_files = _state->all_matched_files;
+
     if (path.empty())
     {
         std::cerr << "Error: snapshot path is empty\n";
         return EXIT_FAILURE;
     }
 
-    std::sort(s_all_matched_files.begin(), s_all_matched_files.end(),
+    std::sort(all_matched_files.begin(), all_matched_files.end(),
               [](const auto& a, const auto& b) { return a.first < b.first; });
 
-    CFMutableDict root_dict = build_snapshot_dictionary(metadata);
+    CFMutableDict root_dict = build_snapshot_dictionary(_state.get(), metadata);
 
     CFErrorRef error = nullptr;
     CFObj<CFDataRef> plist_data(CFPropertyListCreateData(kCFAllocatorDefault, root_dict,
@@ -1165,24 +2010,36 @@ int fingerprint::save_snapshot_plist(const std::string& path, const SnapshotMeta
     return EXIT_SUCCESS;
 }
 
-int fingerprint::save_snapshot_json(const std::string& path, const SnapshotMetadata& metadata) noexcept
+int FingerprintSession::save_snapshot_json(const std::string& path, const SnapshotMetadata& metadata) noexcept
 {
+    std::vector<std::pair<std::string, FileInfo>>& all_matched_files = _state->all_matched_files;
+
     if (path.empty())
     {
         std::cerr << "Error: snapshot path is empty\n";
         return EXIT_FAILURE;
     }
 
-    std::sort(s_all_matched_files.begin(), s_all_matched_files.end(),
+    std::sort(all_matched_files.begin(), all_matched_files.end(),
               [](const auto& a, const auto& b) { return a.first < b.first; });
 
     Json::MutableDoc doc;
-    build_snapshot_json(metadata, doc);
+    build_snapshot_json(_state.get(), metadata, doc);
 
     return write_json_doc_to_file(doc, path.c_str());
 }
 
-int fingerprint::save_snapshot(const std::string& path, const SnapshotMetadata& metadata) noexcept
+int FingerprintSession::save_snapshot_binary(const std::string& path, const SnapshotMetadata& metadata) noexcept
+{
+    std::vector<std::pair<std::string, FileInfo>>& all_matched_files = _state->all_matched_files;
+
+    std::sort(all_matched_files.begin(), all_matched_files.end(),
+              [](const auto& a, const auto& b) { return a.first < b.first; });
+
+    return save_binary_snapshot(path, metadata, all_matched_files, _state->directory_hashes);
+}
+
+int FingerprintSession::save_snapshot(const std::string& path, const SnapshotMetadata& metadata) noexcept
 {
     std::filesystem::path snap(path);
     std::string ext = snap.extension().string();
@@ -1200,10 +2057,14 @@ int fingerprint::save_snapshot(const std::string& path, const SnapshotMetadata&
     {
         return save_snapshot_plist(path, metadata);
     }
+    else if (ext == ".fpsnap")
+    {
+        return save_snapshot_binary(path, metadata);
+    }
     else
     {
         std::cerr << "Error: unsupported snapshot format: " << ext << "\n";
-        std::cerr << "       Supported formats: .tsv, .json, .plist (or no extension)\n";
+        std::cerr << "       Supported formats: .tsv, .json, .plist, .fpsnap (or no extension)\n";
         return EXIT_FAILURE;
     }
 }
@@ -1254,30 +2115,26 @@ static bool sort_snapshot_files(CFMutableDictionaryRef snapshotRef) noexcept
     if (count == 0)
         return true;
 
-    std::vector<CFDictionaryRef> files;
+    // byte order of the UTF-8 paths, the order of .fpsnap records, which compare_files
+    // relies on to merge-join the two arrays
+    std::vector<std::pair<std::string, CFDictionaryRef>> files;
     files.reserve(count);
     for (CFIndex i = 0; i < count; i++)
     {
         CFDictionaryRef file_dict = nullptr;
-        if (files_array.GetValueAtIndex(i, file_dict))
-            files.push_back(file_dict);
+        if (!files_array.GetValueAtIndex(i, file_dict))
+            continue;
+        CFStringRef path_str = nullptr;
+        CFDict(file_dict).GetValue(CFSTR("path"), path_str);
+        files.emplace_back((path_str != nullptr) ? CFStr::ToString(path_str) : std::string(), file_dict);
     }
 
     std::sort(files.begin(), files.end(),
-              [](CFDictionaryRef a, CFDictionaryRef b)
-              {
-                  CFDict da(a), db(b);
-                  CFStringRef path_a_str = nullptr;
-                  CFStringRef path_b_str = nullptr;
-                  if (!da.GetValue(CFSTR("path"), path_a_str)
-                      || !db.GetValue(CFSTR("path"), path_b_str))
-                      return false;
-                  return CFStringCompare(path_a_str, path_b_str, 0) < 0;
-              });
+              [](const auto& a, const auto& b) { return a.first < b.first; });
 
     CFMutableArr sorted_arr(count);
-    for (CFDictionaryRef f : files)
-        sorted_arr.AppendValue(f);
+    for (const auto& [path, file_dict] : files)
+        sorted_arr.AppendValue(file_dict);
 
     snapshot.SetValue(CFSTR("files"), (CFMutableArrayRef)sorted_arr);
     return true;
@@ -1298,6 +2155,13 @@ CFMutableDictionaryRef fingerprint::load_snapshot(const std::string& path) noexc
         return snapshot.Detach();
     }
 
+    if (ext == ".fpsnap")
+    {
+        // records are stored sorted by path already
+        std::unique_ptr<MappedSnapshot> mapped = MappedSnapshot::open(path);
+        return (mapped != nullptr) ? mapped->copy_as_cfdict() : nullptr;
+    }
+
     if (ext == ".json")
     {
         CFMutableDict snapshot = load_json_file_as_cfdict(path.c_str());
@@ -1430,12 +2294,7 @@ static void compare_metadata(CFDictionaryRef snap1Ref, CFDictionaryRef snap2Ref,
         bool same_hash_algorithms = (CFStringCompare(hash1, hash2, 0) == kCFCompareEqualTo);
         if (same_hash_algorithms)
         {
-            if (CFStringCompare(hash1, CFSTR("crc32c"), 0) == kCFCompareEqualTo)
-                hash_algorithm = FileHashAlgorithm::CRC32C;
-            else if (CFStringCompare(hash1, CFSTR("blake3"), 0) == kCFCompareEqualTo)
-                hash_algorithm = FileHashAlgorithm::BLAKE3;
-            else
-                hash_algorithm = FileHashAlgorithm::UNKNOWN;
+            hash_algorithm = hash_algorithm_from_name(CFStr::ToString(hash1));
         }
         else
         {
@@ -1472,27 +2331,111 @@ static bool compare_files(CFDictionaryRef snap1Ref, CFDictionaryRef snap2Ref, Fi
         || !snap2.GetValue(CFSTR("files"), files2_arr_ref))
         return false;
 
-    auto index_files = [](CFArrayRef arrRef, std::map<std::string, CFDictionaryRef>& out)
+    // load_snapshot sorts "files" by path bytes, so the two arrays are merge-joined like
+    // the records of compare_binary_files; paths are converted only where they are visited
+    CFArr files1(files1_arr_ref);
+    CFArr files2(files2_arr_ref);
+    CFIndex count1 = files1.GetCount();
+    CFIndex count2 = files2.GetCount();
+
+    auto file_at = [](const CFArr& files, CFIndex index) -> CFDictionaryRef
+    {
+        CFDictionaryRef file_dict = nullptr;
+        files.GetValueAtIndex(index, file_dict);
+        return file_dict;
+    };
+
+    auto path_at = [&](const CFArr& files, CFIndex index) -> std::string
+    {
+        CFStringRef path_cf = nullptr;
+        CFDictionaryRef file_dict = file_at(files, index);
+        if ((file_dict == nullptr) || !CFDict(file_dict).GetValue(CFSTR("path"), path_cf))
+            return std::string();
+        return CFStr::ToString(path_cf);
+    };
+
+    auto index_directories = [](CFArrayRef arrRef, std::map<std::string, CFDictionaryRef>& out)
     {
         CFArr arr(arrRef);
         CFIndex count = arr.GetCount();
         for (CFIndex i = 0; i < count; i++)
         {
-            CFDictionaryRef file_dict = nullptr;
-            if (!arr.GetValueAtIndex(i, file_dict))
+            CFDictionaryRef dir_dict = nullptr;
+            if (!arr.GetValueAtIndex(i, dir_dict))
                 continue;
-            CFDict dict(file_dict);
+            CFDict dict(dir_dict);
             CFStringRef path_cf = nullptr;
             if (!dict.GetValue(CFSTR("path"), path_cf))
                 continue;
-            out[CFStr::ToString(path_cf)] = file_dict;
+            out[CFStr::ToString(path_cf)] = dir_dict;
+        }
+    };
+
+    // Tree snapshots: a directory whose recorded hash is the same in both holds the same
+    // names, contents, sizes, mtimes and modes, so its files are not compared one by one.
+    // Only the topmost such directories are kept, as "dir/" prefixes: the files under one
+    // are a contiguous range of the sorted arrays.
+    std::set<std::string> unchanged_prefixes;
+    CFArrayRef dirs1_arr_ref = nullptr;
+    CFArrayRef dirs2_arr_ref = nullptr;
+    if ((hash_algorithm != FileHashAlgorithm::MISMATCH)
+        && snap1.GetValue(CFSTR("directories"), dirs1_arr_ref)
+        && snap2.GetValue(CFSTR("directories"), dirs2_arr_ref))
+    {
+        std::map<std::string, CFDictionaryRef> dirs1;
+        std::map<std::string, CFDictionaryRef> dirs2;
+        index_directories(dirs1_arr_ref, dirs1);
+        index_directories(dirs2_arr_ref, dirs2);
+
+        std::unordered_set<std::string> unchanged;
+        for (const auto& [dir_path, dir1] : dirs1)
+        {
+            auto it = dirs2.find(dir_path);
+            if (it == dirs2.end())
+                continue;
+            CFStringRef hash1 = nullptr, hash2 = nullptr;
+            CFDict(dir1).GetValue(CFSTR("hash"), hash1);
+            CFDict(it->second).GetValue(CFSTR("hash"), hash2);
+            if ((hash1 != nullptr) && (hash2 != nullptr) && (CFStringCompare(hash1, hash2, 0) == kCFCompareEqualTo))
+                unchanged.insert(dir_path);
+        }
+
+        // every directory between the root and the files is recorded, so a directory
+        // inside an unchanged one has its parent in the set
+        for (const std::string& dir_path : unchanged)
+        {
+            size_t slash = dir_path.rfind('/');
+            std::string parent = (slash == 0) ? std::string("/") : dir_path.substr(0, slash);
+            if ((dir_path == "/") || (slash == std::string::npos) || (unchanged.count(parent) == 0))
+                unchanged_prefixes.insert((dir_path == "/") ? dir_path : dir_path + "/");
+        }
+    }
+
+    // index past the unchanged subtree containing path, the path of files[index], or index
+    // when there is none
+    auto skip_unchanged = [&](const CFArr& files, CFIndex count, CFIndex index, const std::string& path) -> CFIndex
+    {
+        auto prefix = unchanged_prefixes.upper_bound(path);
+        if (prefix == unchanged_prefixes.begin())
+            return index;
+        --prefix;
+        if (!path.starts_with(*prefix))
+            return index;
+        std::string range_end = *prefix;
+        range_end.back() = '/' + 1;
+        CFIndex low = index + 1, high = count;
+        while (low < high)
+        {
+            CFIndex middle = low + (high - low) / 2;
+            if (path_at(files, middle) < range_end)
+                low = middle + 1;
+            else
+                high = middle;
         }
+        return low;
     };
 
-    std::map<std::string, CFDictionaryRef> files1;
-    std::map<std::string, CFDictionaryRef> files2;
-    index_files(files1_arr_ref, files1);
-    index_files(files2_arr_ref, files2);
+    size_t skipped_files = 0;
 
     if (hash_algorithm == FileHashAlgorithm::MISMATCH)
     {
@@ -1503,10 +2446,32 @@ static bool compare_files(CFDictionaryRef snap1Ref, CFDictionaryRef snap2Ref, Fi
 
     bool found_diff = false;
 
-    for (const auto& [path, file1] : files1)
+    CFIndex j = 0;
+    std::string path2;
+    CFIndex path2_index = -1;
+    for (CFIndex i = 0; i < count1; )
     {
-        auto it = files2.find(path);
-        if (it == files2.end())
+        std::string path = path_at(files1, i);
+        CFIndex subtree_end = unchanged_prefixes.empty() ? i : skip_unchanged(files1, count1, i, path);
+        if (subtree_end != i)
+        {
+            skipped_files += (size_t)(subtree_end - i);
+            i = subtree_end;
+            continue;
+        }
+
+        for (; j < count2; j++)
+        {
+            if (path2_index != j)
+            {
+                path2 = path_at(files2, j);
+                path2_index = j;
+            }
+            if (!(path2 < path))
+                break;
+        }
+
+        if ((j == count2) || (path2 != path))
         {
             std::cout << path << "\n";
             std::cout << "\tremoved\n\n";
@@ -1514,22 +2479,25 @@ static bool compare_files(CFDictionaryRef snap1Ref, CFDictionaryRef snap2Ref, Fi
         }
         else
         {
-            CFDict file1Dict(file1);
-            CFDict file2Dict(it->second);
+            CFDict file1Dict(file_at(files1, i));
+            CFDict file2Dict(file_at(files2, j));
             bool file_modified = false;
             std::string details;
 
             if (hash_algorithm != FileHashAlgorithm::MISMATCH) // hashes are the same
             {
-                const char* hash_name = (hash_algorithm == FileHashAlgorithm::CRC32C) ? "crc32c" : "blake3";
+                // TSV snapshots do not record which algorithm produced their hashes
+                std::string hash_label = (hash_algorithm == FileHashAlgorithm::UNKNOWN)
+                                       ? std::string("hash")
+                                       : std::string(hash_algorithm_name(hash_algorithm)) + " hash";
                 CFStringRef hash1 = nullptr, hash2 = nullptr;
                 file1Dict.GetValue(CFSTR("hash"), hash1);
                 file2Dict.GetValue(CFSTR("hash"), hash2);
                 if ((hash1 != nullptr) && (hash2 != nullptr) && (CFStringCompare(hash1, hash2, 0) != 0))
                 {
                     details += "\t";
-                    details += hash_name;
-                    details += " hash:\n";
+                    details += hash_label;
+                    details += ":\n";
                     details += "\t\told: " + CFStr::ToString(hash1) + "\n";
                     details += "\t\tnew: " + CFStr::ToString(hash2) + "\n";
                     file_modified = true;
@@ -1576,16 +2544,287 @@ static bool compare_files(CFDictionaryRef snap1Ref, CFDictionaryRef snap2Ref, Fi
                 found_diff = true;
             }
         }
+        i++;
+    }
+
+    CFIndex i = 0;
+    std::string path1;
+    CFIndex path1_index = -1;
+    for (CFIndex k = 0; k < count2; )
+    {
+        std::string path = path_at(files2, k);
+        CFIndex subtree_end = unchanged_prefixes.empty() ? k : skip_unchanged(files2, count2, k, path);
+        if (subtree_end != k)
+        {
+            k = subtree_end;
+            continue;
+        }
+
+        for (; i < count1; i++)
+        {
+            if (path1_index != i)
+            {
+                path1 = path_at(files1, i);
+                path1_index = i;
+            }
+            if (!(path1 < path))
+                break;
+        }
+
+        if ((i == count1) || (path1 != path))
+        {
+            std::cout << path << "\n";
+            std::cout << "\tadded\n\n";
+            found_diff = true;
+        }
+        k++;
+    }
+
+    if (g_verbose && !unchanged_prefixes.empty())
+    {
+        std::cout << "Skipped " << skipped_files << " file(s) in " << unchanged_prefixes.size()
+                  << " unchanged subtree(s)\n";
+    }
+
+    if (!found_diff)
+    {
+        std::cout << "File contents are identical\n";
+    }
+
+    return found_diff;
+}
+
+static const char* fingerprint_mode_name(FingerprintOptions mode) noexcept
+{
+    switch (mode)
+    {
+        case FingerprintOptions::HashAbsolutePaths: return "absolute";
+        case FingerprintOptions::HashRelativePaths: return "relative";
+        case FingerprintOptions::HashTree: return "tree";
+        default: return "default";
+    }
+}
+
+static void print_param_change(const char* name, const std::string& old_value, const std::string& new_value) noexcept
+{
+    std::cout << "\t" << name << ":\n\t\told: " << old_value << "\n\t\tnew: " << new_value << "\n";
+}
+
+// Same report as compare_metadata, from the binary headers
+static void compare_binary_metadata(const MappedSnapshot& snap1, const MappedSnapshot& snap2, FileHashAlgorithm& hash_algorithm) noexcept
+{
+    const SnapshotMetadata& meta1 = snap1.metadata();
+    const SnapshotMetadata& meta2 = snap2.metadata();
+
+    std::cout << "Fingerprint runs:\n";
+
+    if (!meta1.snapshot_timestamp.empty() && !meta2.snapshot_timestamp.empty()
+        && (meta1.snapshot_timestamp != meta2.snapshot_timestamp))
+    {
+        print_param_change("snapshot time", meta1.snapshot_timestamp, meta2.snapshot_timestamp);
+    }
+
+    if (meta1.fingerprint != meta2.fingerprint)
+    {
+        char fp1[32], fp2[32];
+        std::snprintf(fp1, sizeof(fp1), "%016llx", (unsigned long long)meta1.fingerprint);
+        std::snprintf(fp2, sizeof(fp2), "%016llx", (unsigned long long)meta2.fingerprint);
+        print_param_change("fingerprint", fp1, fp2);
+    }
+
+    if (meta1.hash_algorithm == meta2.hash_algorithm)
+    {
+        hash_algorithm = meta1.hash_algorithm;
+    }
+    else
+    {
+        hash_algorithm = FileHashAlgorithm::MISMATCH; // marker for non-matching hashes
+        print_param_change("hash algorithm", hash_algorithm_name(meta1.hash_algorithm), hash_algorithm_name(meta2.hash_algorithm));
+    }
+
+    if (meta1.fingerprint_mode != meta2.fingerprint_mode)
+        print_param_change("fingerprint mode", fingerprint_mode_name(meta1.fingerprint_mode), fingerprint_mode_name(meta2.fingerprint_mode));
+
+    std::cout << "\n";
+}
+
+// Same report as compare_files, as a streaming merge-join of the two sorted record arrays:
+// no per-file allocation and no index. Removed and modified files are reported in a first
+// pass over snap1 and added files in a second pass over snap2, the order compare_files uses.
+static bool compare_binary_files(const MappedSnapshot& snap1, const MappedSnapshot& snap2, FileHashAlgorithm hash_algorithm) noexcept
+{
+    using fpsnap::SnapFileRecord;
+    using fpsnap::SnapDirectoryRecord;
+
+    // Tree snapshots: the topmost directories whose hashes match in both, as "dir/"
+    // prefixes. See compare_files.
+    std::vector<std::string> unchanged_prefixes;
+    if ((hash_algorithm != FileHashAlgorithm::MISMATCH)
+        && (snap1.directory_count() > 0) && (snap2.directory_count() > 0))
+    {
+        std::unordered_set<std::string_view> unchanged;
+        const SnapDirectoryRecord* dirs1 = snap1.directories();
+        const SnapDirectoryRecord* dirs2 = snap2.directories();
+        size_t i = 0, j = 0;
+        while ((i < snap1.directory_count()) && (j < snap2.directory_count()))
+        {
+            std::string_view path1 = snap1.path_of(dirs1[i]);
+            std::string_view path2 = snap2.path_of(dirs2[j]);
+            int order = path1.compare(path2);
+            if (order < 0)
+                i++;
+            else if (order > 0)
+                j++;
+            else
+            {
+                if (dirs1[i].hash == dirs2[j].hash)
+                    unchanged.insert(path1);
+                i++;
+                j++;
+            }
+        }
+
+        for (std::string_view dir_path : unchanged)
+        {
+            size_t slash = dir_path.rfind('/');
+            std::string_view parent = (slash == 0) ? std::string_view("/") : dir_path.substr(0, slash);
+            if ((dir_path == "/") || (slash == std::string_view::npos) || (unchanged.count(parent) == 0))
+                unchanged_prefixes.push_back((dir_path == "/") ? std::string(dir_path) : std::string(dir_path) + "/");
+        }
+        std::sort(unchanged_prefixes.begin(), unchanged_prefixes.end());
+    }
+
+    // index past the unchanged subtree containing files[index], or index when there is none
+    auto skip_unchanged = [&](const MappedSnapshot& snap, size_t index) -> size_t
+    {
+        const SnapFileRecord* files = snap.files();
+        std::string_view path = snap.path_of(files[index]);
+        auto prefix = std::upper_bound(unchanged_prefixes.begin(), unchanged_prefixes.end(), path,
+                                       [](std::string_view value, const std::string& element) { return value < element; });
+        if (prefix == unchanged_prefixes.begin())
+            return index;
+        --prefix;
+        if (!path.starts_with(*prefix))
+            return index;
+        std::string range_end = *prefix;
+        range_end.back() = '/' + 1;
+        const SnapFileRecord* end = std::lower_bound(files + index, files + snap.file_count(), range_end,
+                                                     [&](const SnapFileRecord& record, const std::string& value)
+                                                     { return snap.path_of(record) < std::string_view(value); });
+        return (size_t)(end - files);
+    };
+
+    if (hash_algorithm == FileHashAlgorithm::MISMATCH)
+    {
+        std::cout << "WARNING: Hash algorithms differ between snapshots.\n";
+        std::cout << "File content hashes are not comparable - ignoring hash differences.\n";
+        std::cout << "Only reporting additions, removals, size, and modification date changes.\n\n";
+    }
+
+    const SnapFileRecord* files1 = snap1.files();
+    const SnapFileRecord* files2 = snap2.files();
+    size_t count1 = snap1.file_count();
+    size_t count2 = snap2.file_count();
+    bool found_diff = false;
+    size_t skipped_files = 0;
+
+    size_t j = 0;
+    for (size_t i = 0; i < count1; )
+    {
+        size_t subtree_end = unchanged_prefixes.empty() ? i : skip_unchanged(snap1, i);
+        if (subtree_end != i)
+        {
+            skipped_files += subtree_end - i;
+            i = subtree_end;
+            continue;
+        }
+
+        std::string_view path = snap1.path_of(files1[i]);
+        while ((j < count2) && (snap2.path_of(files2[j]) < path))
+            j++;
+
+        if ((j == count2) || (snap2.path_of(files2[j]) != path))
+        {
+            std::cout << path << "\n";
+            std::cout << "\tremoved\n\n";
+            found_diff = true;
+            i++;
+            continue;
+        }
+
+        const SnapFileRecord& file1 = files1[i];
+        const SnapFileRecord& file2 = files2[j];
+        std::string details;
+
+        if ((hash_algorithm != FileHashAlgorithm::MISMATCH) && (file1.hash != file2.hash))
+        {
+            details += "\t";
+            details += hash_algorithm_name(hash_algorithm);
+            details += " hash:\n";
+            details += "\t\told: " + snap1.format_hash(file1.hash) + "\n";
+            details += "\t\tnew: " + snap2.format_hash(file2.hash) + "\n";
+        }
+
+        if (file1.size != file2.size)
+        {
+            details += "\tsize:\n";
+            details += "\t\told: " + std::to_string(file1.size) + "\n";
+            details += "\t\tnew: " + std::to_string(file2.size) + "\n";
+        }
+
+        if (file1.mtime_ns != file2.mtime_ns)
+        {
+            details += "\tmodification time:\n";
+            details += "\t\told: " + format_mtime(file1.mtime_ns) + "\n";
+            details += "\t\tnew: " + format_mtime(file2.mtime_ns) + "\n";
+        }
+
+        if ((file1.mode & 07777) != (file2.mode & 07777))
+        {
+            char mode1[16], mode2[16];
+            std::snprintf(mode1, sizeof(mode1), "%04o", file1.mode & 07777);
+            std::snprintf(mode2, sizeof(mode2), "%04o", file2.mode & 07777);
+            details += "\tmode:\n";
+            details += std::string("\t\told: ") + mode1 + "\n";
+            details += std::string("\t\tnew: ") + mode2 + "\n";
+        }
+
+        if (!details.empty())
+        {
+            std::cout << path << "\n";
+            std::cout << details << "\n";
+            found_diff = true;
+        }
+        i++;
     }
 
-    for (const auto& [path, file2] : files2)
+    size_t i = 0;
+    for (size_t k = 0; k < count2; )
     {
-        if (files1.find(path) == files1.end())
+        size_t subtree_end = unchanged_prefixes.empty() ? k : skip_unchanged(snap2, k);
+        if (subtree_end != k)
+        {
+            k = subtree_end;
+            continue;
+        }
+
+        std::string_view path = snap2.path_of(files2[k]);
+        while ((i < count1) && (snap1.path_of(files1[i]) < path))
+            i++;
+
+        if ((i == count1) || (snap1.path_of(files1[i]) != path))
         {
             std::cout << path << "\n";
             std::cout << "\tadded\n\n";
             found_diff = true;
         }
+        k++;
+    }
+
+    if (g_verbose && !unchanged_prefixes.empty())
+    {
+        std::cout << "Skipped " << skipped_files << " file(s) in " << unchanged_prefixes.size()
+                  << " unchanged subtree(s)\n";
     }
 
     if (!found_diff)
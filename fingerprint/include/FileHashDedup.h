@@ -0,0 +1,253 @@
+//
+//  FileHashDedup.h
+//  fingerprint
+//
+//  Run-scoped memo of content hashes by file identity, so a file reached under
+//  several paths in one run - hard links, one file matched by two globs, a header
+//  listed by every task of a playlist - is read and hashed once.
+//
+//  The key is everything a stat says about the content: device, inode, size, mtime
+//  and ctime. Two paths with equal keys name the same bytes for as long as the key
+//  holds; a file rewritten during the run gets a new key and is hashed again.
+//  Only non-empty regular files take part: a symlink hashes its own target string
+//  and an empty file has nothing to read.
+//
+//  The first path of an identity owns it: it hashes the file however it normally
+//  would (xattr or sidecar hit included) and publishes the outcome. Paths that claim
+//  the identity meanwhile wait for that outcome instead of reading the file again.
+//  A failed hash is not kept: its waiters fail with it, and the next claim hashes
+//  the file afresh.
+//
+
+#pragma once
+
+#include <sys/types.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "FileInfo.h"
+
+class FileHashDedup
+{
+public:
+    enum class Claim
+    {
+        Owner,   // hash the file, then publish() the outcome
+        Done,    // hashed earlier in this run, info.hash is filled in
+        Waiting, // being hashed by its owner, the waiter runs when it is published
+        Failed   // the owner's hash failed while this path waited for it
+    };
+
+    // Called once the owner publishes: ok tells whether the hash was computed, hash is
+    // the owner's whole 8-byte hash slot (see FileInfoCore::hash).
+    using Waiter = std::function<void(bool ok, uint64_t hash)>;
+
+    struct Stats
+    {
+        size_t files = 0;   // paths that took another path's hash instead of reading
+        uint64_t bytes = 0; // the content those paths did not read
+    };
+
+    FileHashDedup() = default;
+    FileHashDedup(const FileHashDedup&) = delete;
+    FileHashDedup& operator=(const FileHashDedup&) = delete;
+
+    // Non-blocking claim for the asynchronous engine: when the file is being hashed,
+    // make_waiter() builds the Waiter to run at publish time. It is only called then,
+    // so the common first claim allocates no callback.
+    template <typename MakeWaiter>
+    Claim claim(FileInfo& info, MakeWaiter&& make_waiter)
+    {
+        if (!is_eligible(info))
+            return Claim::Owner;
+
+        const Key key = make_key(info);
+        Shard& shard = shard_for(key);
+        std::lock_guard<std::mutex> guard(shard.mutex);
+        try
+        {
+            auto [it, inserted] = shard.entries.try_emplace(key);
+            if (inserted)
+            {
+                it->second.generation = ++shard.next_generation;
+                return Claim::Owner;
+            }
+
+            if (it->second.done)
+            {
+                info.hash.blake3 = it->second.hash;
+                count_saved(info);
+                return Claim::Done;
+            }
+
+            it->second.waiters.push_back(make_waiter());
+            return Claim::Waiting;
+        }
+        catch (const std::exception&)
+        {
+            // out of memory: hash this path on its own, as if there were no memo
+            return Claim::Owner;
+        }
+    }
+
+    // Blocking claim for synchronous callers: waits for an owner on another thread
+    // instead of leaving a Waiter. Never returns Waiting.
+    Claim claim(FileInfo& info)
+    {
+        if (!is_eligible(info))
+            return Claim::Owner;
+
+        const Key key = make_key(info);
+        Shard& shard = shard_for(key);
+        std::unique_lock<std::mutex> lock(shard.mutex);
+        auto it = shard.entries.find(key);
+        if (it == shard.entries.end())
+        {
+            try
+            {
+                it = shard.entries.try_emplace(key).first;
+                it->second.generation = ++shard.next_generation;
+            }
+            catch (const std::exception&)
+            {
+                // out of memory: hash this path on its own, as if there were no memo
+            }
+            return Claim::Owner;
+        }
+
+        // an owner's entry is only ever marked done or erased, so its generation tells
+        // this waiter whether an entry found after the wait is still the one it waited on
+        const uint64_t generation = it->second.generation;
+        while (!it->second.done)
+        {
+            shard.published.wait(lock);
+            it = shard.entries.find(key);
+            if ((it == shard.entries.end()) || (it->second.generation != generation))
+                return Claim::Failed;
+        }
+
+        info.hash.blake3 = it->second.hash;
+        count_saved(info);
+        return Claim::Done;
+    }
+
+    // Publishes the owner's outcome and runs the waiters it collected, on the calling
+    // thread. info.hash must be final. A no-op for a file that claim() did not track.
+    void publish(const FileInfo& info, bool ok)
+    {
+        if (!is_eligible(info))
+            return;
+
+        const Key key = make_key(info);
+        Shard& shard = shard_for(key);
+        std::vector<Waiter> waiters;
+        {
+            std::lock_guard<std::mutex> guard(shard.mutex);
+            auto it = shard.entries.find(key);
+            if ((it == shard.entries.end()) || it->second.done)
+                return;
+
+            waiters.swap(it->second.waiters);
+            if (ok)
+            {
+                it->second.done = true;
+                it->second.hash = info.hash.blake3;
+            }
+            else
+            {
+                shard.entries.erase(it);
+            }
+        }
+        shard.published.notify_all();
+
+        for (Waiter& waiter : waiters)
+        {
+            if (ok)
+                count_saved(info);
+            waiter(ok, info.hash.blake3);
+        }
+    }
+
+    Stats stats() const noexcept
+    {
+        return { _saved_files.load(std::memory_order_relaxed), _saved_bytes.load(std::memory_order_relaxed) };
+    }
+
+private:
+    struct Key
+    {
+        dev_t dev;
+        ino_t inode;
+        off_t size;
+        int64_t mtime_ns;
+        int64_t ctime_ns;
+
+        bool operator==(const Key& other) const noexcept
+        {
+            return (inode == other.inode) && (dev == other.dev) && (size == other.size) &&
+                   (mtime_ns == other.mtime_ns) && (ctime_ns == other.ctime_ns);
+        }
+    };
+
+    struct KeyHash
+    {
+        size_t operator()(const Key& key) const noexcept
+        {
+            uint64_t h = (uint64_t)key.inode * 0x9E3779B97F4A7C15ULL;
+            h ^= ((uint64_t)key.dev + (uint64_t)key.mtime_ns + (h << 6) + (h >> 2));
+            h ^= ((uint64_t)key.ctime_ns + (uint64_t)key.size * 0xC2B2AE3D27D4EB4FULL + (h << 6) + (h >> 2));
+            return (size_t)(h ^ (h >> 29));
+        }
+    };
+
+    struct Entry
+    {
+        bool done = false;
+        uint64_t hash = 0;
+        uint64_t generation = 0;
+        std::vector<Waiter> waiters;
+    };
+
+    // Worker threads claim files in parallel, so the map is split to keep them off one lock.
+    static constexpr size_t kShardCount = 32;
+
+    struct Shard
+    {
+        std::mutex mutex;
+        std::condition_variable published;
+        std::unordered_map<Key, Entry, KeyHash> entries;
+        uint64_t next_generation = 0;
+    };
+
+    static bool is_eligible(const FileInfo& info) noexcept
+    {
+        return info.is_regular_file() && (info.size > 0) && (info.inode != 0);
+    }
+
+    static Key make_key(const FileInfo& info) noexcept
+    {
+        return { info.dev, info.inode, info.size, info.mtime_ns, info.ctime_ns };
+    }
+
+    Shard& shard_for(const Key& key) noexcept
+    {
+        return _shards[(KeyHash()(key) >> 7) % kShardCount];
+    }
+
+    void count_saved(const FileInfo& info) noexcept
+    {
+        _saved_files.fetch_add(1, std::memory_order_relaxed);
+        _saved_bytes.fetch_add((uint64_t)info.size, std::memory_order_relaxed);
+    }
+
+    Shard _shards[kShardCount];
+    std::atomic<size_t> _saved_files = 0;
+    std::atomic<uint64_t> _saved_bytes = 0;
+};
@@ -11,7 +11,27 @@
 #include <sys/stat.h>
 #include <cstdint>
 
-// the structure persisted in xattr for "public.fingerprint.crc32c" or "public.fingerprint.blake3"
+// Darwin and Linux name the nanosecond stat timestamps differently
+inline int64_t stat_mtime_ns(const struct stat& st) noexcept
+{
+#if defined(__APPLE__)
+    return (int64_t)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec;
+#else
+    return (int64_t)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+#endif
+}
+
+inline int64_t stat_ctime_ns(const struct stat& st) noexcept
+{
+#if defined(__APPLE__)
+    return (int64_t)st.st_ctimespec.tv_sec * 1000000000LL + st.st_ctimespec.tv_nsec;
+#else
+    return (int64_t)st.st_ctim.tv_sec * 1000000000LL + st.st_ctim.tv_nsec;
+#endif
+}
+
+// the structure persisted in xattr for "public.fingerprint.crc32c", "public.fingerprint.blake3"
+// or "public.fingerprint.xxh3"
 struct FileInfoCore
 {
     ino_t    inode;      // 8 bytes
@@ -25,6 +45,8 @@ struct FileInfoCore
             uint32_t reserved; // 4 bytes, always 0
         };
         uint64_t blake3;       // 8 bytes, low 64 bits of blake3
+        uint64_t xxh3;         // 8 bytes, xxh3-64; the same slot, so code that formats or
+                               // compares "the 64-bit hash" may read either member
     } hash;
 };
 
@@ -54,11 +76,11 @@ struct FileInfo : public FileInfoCore
     explicit FileInfo(const struct stat& st) noexcept
         : FileInfoCore { .inode = st.st_ino,
                          .size = st.st_size,
-                         .mtime_ns = (int64_t)st.st_mtimespec.tv_sec * 1000000000LL + st.st_mtimespec.tv_nsec,
+                         .mtime_ns = stat_mtime_ns(st),
                          .hash = {0} },
           mode(st.st_mode),
           dev(st.st_dev),
-          ctime_ns((int64_t)st.st_ctimespec.tv_sec * 1000000000LL + st.st_ctimespec.tv_nsec)
+          ctime_ns(stat_ctime_ns(st))
     {
     }
 
@@ -0,0 +1,238 @@
+//
+//  ParallelHashing.h
+//  fingerprint
+//
+//  Hashing one large buffer on several cores with a result bit-identical to a
+//  single pass, so a tree with a few multi-GB files does not wait on one core
+//  while the other hashing slots sit idle - and so existing xattr records,
+//  sidecar stores and manifests stay valid.
+//
+//  The buffer is cut into fixed ranges that are hashed concurrently and then
+//  combined:
+//  - CRC32C: each range is checksummed on its own and the range CRCs are
+//    folded left to right with crc32c_combine() (fast-crc32/crc32c_combine.c).
+//  - BLAKE3: the range size is a power-of-two number of 1 KiB chunks, so every
+//    range but the last is one complete subtree of the BLAKE3 tree. Each range
+//    yields its subtree chaining value, hashed with its absolute chunk counter,
+//    and the range CVs are merged into the same left-balanced tree the
+//    streaming hasher builds, finishing with the ROOT compression.
+//
+//  A caller that knows some ranges are all zeros - the holes of a sparse file,
+//  see find_zero_ranges() in FileHashing.h - passes them as zero_ranges, and
+//  those ranges are hashed without touching the buffer: CRC32C in O(log n)
+//  with crc32c_zeros(), BLAKE3 from one static zero chunk.
+//
+
+#pragma once
+
+#include <dispatch/dispatch.h>
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <new>
+
+#include "blake3.h"
+
+extern "C" uint32_t crc32_impl(uint32_t crc0, const char* buf, size_t len);
+extern "C" uint32_t crc32c_combine(uint32_t crc_a, uint32_t crc_b, size_t len_b);
+extern "C" uint32_t crc32c_zeros(size_t len);
+
+// The chunk/parent/root entry points of the vendored blake3 (blake3_impl.h), declared
+// here instead of including that header: it defines INLINE, IV and the flag names as
+// plain identifiers, which would leak into every file that includes FileHashing.h.
+extern "C" void blake3_compress_in_place(uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+                                         uint8_t block_len, uint64_t counter, uint8_t flags);
+extern "C" void blake3_compress_xof(const uint32_t cv[8], const uint8_t block[BLAKE3_BLOCK_LEN],
+                                    uint8_t block_len, uint64_t counter, uint8_t flags, uint8_t out[64]);
+extern "C" void blake3_hash_many(const uint8_t *const *inputs, size_t num_inputs, size_t blocks,
+                                 const uint32_t key[8], uint64_t counter, bool increment_counter,
+                                 uint8_t flags, uint8_t flags_start, uint8_t flags_end, uint8_t *out);
+
+// 4096 BLAKE3 chunks. Must stay a power-of-two multiple of BLAKE3_CHUNK_LEN for the
+// range CVs to be nodes of the BLAKE3 tree.
+inline constexpr size_t kParallelHashRangeSize = 4 * 1024 * 1024;
+static_assert((kParallelHashRangeSize % BLAKE3_CHUNK_LEN) == 0, "range must be whole chunks");
+static_assert(((kParallelHashRangeSize / BLAKE3_CHUNK_LEN) & (kParallelHashRangeSize / BLAKE3_CHUNK_LEN - 1)) == 0,
+              "range must be a power-of-two number of chunks");
+
+// Below 4 ranges a single pass is already a few milliseconds and fanning out buys nothing.
+// Mapped files below it (see kHashMmapThreshold in FileHashing.h) are hashed in one pass.
+inline constexpr size_t kParallelHashThreshold = 4 * kParallelHashRangeSize;
+
+inline constexpr uint32_t kBlake3IV[8] = {
+    0x6A09E667UL, 0xBB67AE85UL, 0x3C6EF372UL, 0xA54FF53AUL,
+    0x510E527FUL, 0x9B05688CUL, 0x1F83D9ABUL, 0x5BE0CD19UL
+};
+
+// blake3_impl.h enum blake3_flags
+inline constexpr uint8_t kBlake3ChunkStart = 1 << 0;
+inline constexpr uint8_t kBlake3ChunkEnd = 1 << 1;
+inline constexpr uint8_t kBlake3Parent = 1 << 2;
+inline constexpr uint8_t kBlake3Root = 1 << 3;
+
+// Stands in for every chunk of a range known to be zeros.
+inline constexpr uint8_t kBlake3ZeroChunk[BLAKE3_CHUNK_LEN] = {};
+
+// Both supported architectures are little-endian, so a CV's words and its
+// serialized bytes are the same memory.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "BLAKE3 CV serialization assumes little-endian");
+
+inline __attribute__((always_inline))
+void blake3_parent_cv(const uint8_t left[BLAKE3_OUT_LEN], const uint8_t right[BLAKE3_OUT_LEN],
+                      uint8_t out[BLAKE3_OUT_LEN]) noexcept
+{
+    uint8_t block[BLAKE3_BLOCK_LEN];
+    memcpy(block, left, BLAKE3_OUT_LEN);
+    memcpy(block + BLAKE3_OUT_LEN, right, BLAKE3_OUT_LEN);
+    uint32_t cv[8];
+    memcpy(cv, kBlake3IV, sizeof(cv));
+    blake3_compress_in_place(cv, block, BLAKE3_BLOCK_LEN, 0, kBlake3Parent);
+    memcpy(out, cv, BLAKE3_OUT_LEN);
+}
+
+// Chaining value (never the root) of the BLAKE3 subtree over input[0, len), whose first
+// chunk is chunk number chunk_counter of the whole input. A null input stands for len
+// zero bytes. Full chunks go through
+// blake3_hash_many in batches, so the SIMD kernels do the bulk of the work. Chunk CVs
+// are merged with the reference implementation's stack: merge while the local chunk
+// count is even, then fold right to left, which is BLAKE3's left-balanced tree for
+// any length.
+inline
+void blake3_subtree_cv(const uint8_t *input, size_t len, uint64_t chunk_counter,
+                       uint8_t out[BLAKE3_OUT_LEN]) noexcept
+{
+    constexpr size_t kBatch = 16;
+    constexpr size_t kChunkBlocks = BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN;
+
+    uint8_t stack[BLAKE3_MAX_DEPTH + 1][BLAKE3_OUT_LEN];
+    size_t stack_len = 0;
+    uint64_t chunks_done = 0;
+
+    auto push_chunk_cv = [&](const uint8_t *chunk_cv)
+    {
+        uint8_t cv[BLAKE3_OUT_LEN];
+        memcpy(cv, chunk_cv, BLAKE3_OUT_LEN);
+        uint64_t total = ++chunks_done;
+        while ((total & 1) == 0)
+        {
+            stack_len--;
+            blake3_parent_cv(stack[stack_len], cv, cv);
+            total >>= 1;
+        }
+        memcpy(stack[stack_len], cv, BLAKE3_OUT_LEN);
+        stack_len++;
+    };
+
+    size_t full_chunks = len / BLAKE3_CHUNK_LEN;
+    const uint8_t *chunk_ptrs[kBatch];
+    uint8_t chunk_cvs[kBatch * BLAKE3_OUT_LEN];
+    for (size_t first = 0; first < full_chunks; first += kBatch)
+    {
+        size_t count = (full_chunks - first < kBatch) ? (full_chunks - first) : kBatch;
+        for (size_t i = 0; i < count; i++)
+            chunk_ptrs[i] = (input != nullptr) ? input + (first + i) * BLAKE3_CHUNK_LEN : kBlake3ZeroChunk;
+        blake3_hash_many(chunk_ptrs, count, kChunkBlocks, kBlake3IV, chunk_counter + first, true,
+                         0, kBlake3ChunkStart, kBlake3ChunkEnd, chunk_cvs);
+        for (size_t i = 0; i < count; i++)
+            push_chunk_cv(chunk_cvs + i * BLAKE3_OUT_LEN);
+    }
+
+    size_t tail_len = len - full_chunks * BLAKE3_CHUNK_LEN;
+    if (tail_len > 0)
+    {
+        uint32_t cv[8];
+        memcpy(cv, kBlake3IV, sizeof(cv));
+        for (size_t offset = 0; offset < tail_len; offset += BLAKE3_BLOCK_LEN)
+        {
+            size_t block_len = (tail_len - offset < BLAKE3_BLOCK_LEN) ? (tail_len - offset) : BLAKE3_BLOCK_LEN;
+            uint8_t block[BLAKE3_BLOCK_LEN] = {};
+            if (input != nullptr)
+                memcpy(block, input + full_chunks * BLAKE3_CHUNK_LEN + offset, block_len);
+            uint8_t flags = 0;
+            if (offset == 0)
+                flags |= kBlake3ChunkStart;
+            if (offset + block_len == tail_len)
+                flags |= kBlake3ChunkEnd;
+            blake3_compress_in_place(cv, block, (uint8_t)block_len, chunk_counter + full_chunks, flags);
+        }
+        push_chunk_cv((const uint8_t *)cv);
+    }
+
+    uint8_t cv[BLAKE3_OUT_LEN];
+    memcpy(cv, stack[stack_len - 1], BLAKE3_OUT_LEN);
+    for (size_t i = stack_len - 1; i > 0; i--)
+        blake3_parent_cv(stack[i - 1], cv, cv);
+    memcpy(out, cv, BLAKE3_OUT_LEN);
+}
+
+// Same digest as blake3_hasher_update + blake3_hasher_finalize over the whole buffer.
+// Requires size > kParallelHashRangeSize (at least two ranges, so the root is a parent
+// node). Ranges flagged in zero_ranges, if given, are hashed as zeros without reading the
+// buffer. Returns false only when the per-range scratch cannot be allocated; the caller
+// then hashes in a single pass.
+inline
+bool blake3_parallel_hash(const uint8_t *buffer, size_t size, uint8_t *out, size_t out_len,
+                          const bool *zero_ranges = nullptr) noexcept
+{
+    size_t range_count = (size + kParallelHashRangeSize - 1) / kParallelHashRangeSize;
+    std::unique_ptr<uint8_t[]> cv_storage(new (std::nothrow) uint8_t[range_count * BLAKE3_OUT_LEN]);
+    if ((cv_storage == nullptr) || (range_count < 2) || (out_len > 64))
+        return false;
+
+    uint8_t *cvs = cv_storage.get();
+    dispatch_apply(range_count, DISPATCH_APPLY_AUTO, ^(size_t i) {
+        size_t offset = i * kParallelHashRangeSize;
+        size_t len = ((size - offset) < kParallelHashRangeSize) ? (size - offset) : kParallelHashRangeSize;
+        const uint8_t *input = ((zero_ranges != nullptr) && zero_ranges[i]) ? nullptr : buffer + offset;
+        blake3_subtree_cv(input, len, offset / BLAKE3_CHUNK_LEN, cvs + i * BLAKE3_OUT_LEN);
+    });
+
+    // Merge adjacent pairs level by level, carrying an odd last CV up unmerged. Every
+    // range but the last is a complete aligned subtree, so this is the same tree the
+    // single-pass hasher builds. Stop at two: the last merge is the ROOT compression.
+    size_t count = range_count;
+    while (count > 2)
+    {
+        size_t pairs = count / 2;
+        for (size_t j = 0; j < pairs; j++)
+            blake3_parent_cv(cvs + (2 * j) * BLAKE3_OUT_LEN, cvs + (2 * j + 1) * BLAKE3_OUT_LEN, cvs + j * BLAKE3_OUT_LEN);
+        if ((count & 1) != 0)
+            memmove(cvs + pairs * BLAKE3_OUT_LEN, cvs + (count - 1) * BLAKE3_OUT_LEN, BLAKE3_OUT_LEN);
+        count = pairs + (count & 1);
+    }
+
+    uint8_t root_out[64];
+    blake3_compress_xof(kBlake3IV, cvs, BLAKE3_BLOCK_LEN, 0, kBlake3Parent | kBlake3Root, root_out);
+    memcpy(out, root_out, out_len);
+    return true;
+}
+
+// Same value as crc32_impl(0, buffer, size). Ranges flagged in zero_ranges, if given, are
+// checksummed as zeros without reading the buffer. Returns false only when the per-range
+// scratch cannot be allocated.
+inline
+bool crc32c_parallel_hash(const char *buffer, size_t size, uint32_t *out, const bool *zero_ranges = nullptr) noexcept
+{
+    size_t range_count = (size + kParallelHashRangeSize - 1) / kParallelHashRangeSize;
+    std::unique_ptr<uint32_t[]> crc_storage(new (std::nothrow) uint32_t[range_count]);
+    if (crc_storage == nullptr)
+        return false;
+
+    uint32_t *crcs = crc_storage.get();
+    dispatch_apply(range_count, DISPATCH_APPLY_AUTO, ^(size_t i) {
+        size_t offset = i * kParallelHashRangeSize;
+        size_t len = ((size - offset) < kParallelHashRangeSize) ? (size - offset) : kParallelHashRangeSize;
+        crcs[i] = ((zero_ranges != nullptr) && zero_ranges[i]) ? crc32c_zeros(len) : crc32_impl(0, buffer + offset, len);
+    });
+
+    uint32_t crc = crcs[0];
+    for (size_t i = 1; i < range_count; i++)
+    {
+        size_t offset = i * kParallelHashRangeSize;
+        size_t len = ((size - offset) < kParallelHashRangeSize) ? (size - offset) : kParallelHashRangeSize;
+        crc = crc32c_combine(crc, crcs[i], len);
+    }
+    *out = crc;
+    return true;
+}
@@ -0,0 +1,85 @@
+//
+//  ReadBufferPool.h
+//  fingerprint
+//
+//  Fixed pool of reusable, page-aligned read buffers shared by the reader and
+//  hasher stages of the file processing pipeline (see process_matched_file_async).
+//
+//  The pool is the hard memory cap of the pipeline: a reader takes a buffer before
+//  it reads and the hasher gives it back after hashing it, so at most
+//  buffer_count * kReadBufferSize bytes of file content are in flight no matter
+//  how many reads are outstanding or how large the files are. Buffers are
+//  allocated on first use and then recycled, so a small tree never pays for the
+//  whole pool and a large one does not malloc/free a buffer per file.
+//
+
+#pragma once
+
+#include <dispatch/dispatch.h>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <mutex>
+#include <vector>
+
+class ReadBufferPool
+{
+public:
+    // 1 MiB: a whole BLAKE3 subtree of 1024 chunks and large enough for one read to
+    // cover most source files. Files larger than this are streamed piece by piece.
+    static constexpr size_t kReadBufferSize = 1024 * 1024;
+
+    explicit ReadBufferPool(size_t buffer_count) noexcept
+        : _buffer_count(buffer_count < 2 ? 2 : buffer_count)
+        , _available(dispatch_semaphore_create((long)_buffer_count))
+    {
+        _free.reserve(_buffer_count);
+    }
+
+    ReadBufferPool(const ReadBufferPool&) = delete;
+    ReadBufferPool& operator=(const ReadBufferPool&) = delete;
+
+    size_t buffer_count() const noexcept { return _buffer_count; }
+
+    // Blocks until a buffer is free. Returns nullptr only when a new buffer cannot be
+    // allocated; the slot is given back in that case so the pool does not shrink.
+    char* acquire() noexcept
+    {
+        dispatch_semaphore_wait(_available, DISPATCH_TIME_FOREVER);
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            if (!_free.empty())
+            {
+                char* buffer = _free.back();
+                _free.pop_back();
+                return buffer;
+            }
+        }
+
+        // page alignment keeps each read on whole pages of the unified buffer cache
+        void* buffer = nullptr;
+        if (posix_memalign(&buffer, (size_t)getpagesize(), kReadBufferSize) != 0)
+        {
+            dispatch_semaphore_signal(_available);
+            return nullptr;
+        }
+        return static_cast<char*>(buffer);
+    }
+
+    void release(char* buffer) noexcept
+    {
+        {
+            std::lock_guard<std::mutex> guard(_mutex);
+            _free.push_back(buffer);
+        }
+        dispatch_semaphore_signal(_available);
+    }
+
+private:
+    const size_t _buffer_count;
+    dispatch_semaphore_t _available;
+    std::mutex _mutex;
+    std::vector<char*> _free; // capacity reserved up front, push_back never allocates
+};
@@ -0,0 +1,166 @@
+//
+//  binary_snapshot.h
+//  fingerprint
+//
+//  Compact binary snapshot (.fpsnap) for fingerprint -s / -c.
+//
+//  TSV, JSON and plist snapshots are parsed into a CFDictionary of one CFDictionary
+//  per file before a comparison can start, which for millions of files is seconds of
+//  parsing and gigabytes of CF objects. A .fpsnap file is instead mapped as is:
+//
+//    SnapHeader | file_count * SnapFileRecord | directory_count * SnapDirectoryRecord
+//               | params | strings | SnapTrailer
+//
+//  - file and directory records are fixed-width and sorted by path (byte order), so
+//    two snapshots are compared with a streaming merge-join over the two mappings
+//  - paths live in the strings blob, referenced by offset and length
+//  - params holds the SnapshotMetadata lists and the timestamp
+//  - the trailer carries a crc32c over everything before it
+//
+//  Opening costs one mmap and no allocation per file. It checks the header, that the
+//  section sizes add up to the file size, and the trailer magic, which catches a
+//  truncated or foreign file without reading the records. The crc32c pass over the
+//  whole file is what catches a flipped bit, and it reads every page of it, so for a
+//  snapshot of millions of files it costs as much as the comparison: it runs only when
+//  set_verify_snapshot_checksum(true) was called (fingerprint --verify-snapshot).
+//  Skipping it is memory-safe: path_of() bounds-checks every path reference.
+//  Byte order is native: a snapshot from a machine of the other byte order fails the
+//  magic check. JSON and plist remain the export formats.
+//
+
+#pragma once
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "fingerprint.h"
+#include "FileInfo.h"
+
+namespace fpsnap
+{
+
+constexpr uint64_t kHeaderMagic = 0x01504E5350414E53ULL;  // "SNAPSNP\1" little-endian
+constexpr uint64_t kTrailerMagic = 0x01544E5350414E53ULL; // "SNAPSNT\1" little-endian
+constexpr uint32_t kFormatVersion = 1;
+
+constexpr uint32_t kAlgoCrc32c = 0;
+constexpr uint32_t kAlgoBlake3 = 1;
+constexpr uint32_t kAlgoXxh3 = 2;
+
+struct SnapHeader
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t hash_algorithm;   // kAlgoCrc32c, kAlgoBlake3 or kAlgoXxh3
+    uint32_t fingerprint_mode; // FingerprintOptions
+    uint32_t reserved;
+    uint64_t fingerprint;
+    uint64_t file_count;
+    uint64_t directory_count;  // tree mode only, 0 otherwise
+    uint64_t params_size;
+    uint64_t strings_size;
+};
+
+struct SnapFileRecord
+{
+    uint64_t path_offset; // into the strings blob
+    uint32_t path_len;
+    uint32_t mode;
+    uint64_t hash;        // crc32c zero-extended, the low 64 bits of blake3, or xxh3
+    int64_t  size;
+    uint64_t inode;
+    int64_t  mtime_ns;
+};
+
+struct SnapDirectoryRecord
+{
+    uint64_t path_offset;
+    uint32_t path_len;
+    uint32_t reserved;
+    uint64_t hash;
+};
+
+struct SnapTrailer
+{
+    uint64_t magic;
+    uint32_t crc32c; // over bytes [0, file size - sizeof(SnapTrailer))
+    uint32_t reserved;
+};
+
+static_assert(sizeof(SnapHeader) == 64, "SnapHeader must stay 64 bytes");
+static_assert(sizeof(SnapFileRecord) == 48, "SnapFileRecord must stay 48 bytes");
+static_assert(sizeof(SnapDirectoryRecord) == 24, "SnapDirectoryRecord must stay 24 bytes");
+static_assert(sizeof(SnapTrailer) == 16, "SnapTrailer must stay 16 bytes");
+
+} // namespace fpsnap
+
+// ".fpsnap", case-insensitive
+bool is_binary_snapshot_path(const std::string& path) noexcept;
+
+// files must be sorted by path and directories too (as left by the snapshot writers and
+// compute_tree_fingerprint). Nonexistent-file sentinels are skipped like in the other formats.
+// Returns EXIT_SUCCESS or EXIT_FAILURE; errors are reported to stderr.
+int save_binary_snapshot(const std::string& path,
+                         const SnapshotMetadata& metadata,
+                         const std::vector<std::pair<std::string, FileInfo>>& files,
+                         const std::vector<std::pair<std::string, uint64_t>>& directories) noexcept;
+
+// Process-wide, off by default; set before the first MappedSnapshot::open.
+void set_verify_snapshot_checksum(bool verify) noexcept;
+
+class MappedSnapshot
+{
+public:
+    // nullptr, with the reason on stderr, when the file cannot be mapped or fails validation
+    // (the full checksum only under set_verify_snapshot_checksum)
+    static std::unique_ptr<MappedSnapshot> open(const std::string& path) noexcept;
+
+    ~MappedSnapshot();
+
+    MappedSnapshot(const MappedSnapshot&) = delete;
+    MappedSnapshot& operator=(const MappedSnapshot&) = delete;
+
+    const fpsnap::SnapHeader& header() const noexcept { return *_header; }
+    const SnapshotMetadata& metadata() const noexcept { return _metadata; }
+
+    const fpsnap::SnapFileRecord* files() const noexcept { return _files; }
+    size_t file_count() const noexcept { return (size_t)_header->file_count; }
+
+    const fpsnap::SnapDirectoryRecord* directories() const noexcept { return _directories; }
+    size_t directory_count() const noexcept { return (size_t)_header->directory_count; }
+
+    // empty for a record whose path lies outside the strings blob
+    template <typename Record>
+    std::string_view path_of(const Record& record) const noexcept
+    {
+        if ((record.path_offset > _strings_size) || (record.path_len > _strings_size - record.path_offset))
+            return {};
+        return std::string_view(_strings + record.path_offset, record.path_len);
+    }
+
+    // "%08x" for crc32c, "%016llx" for blake3 and xxh3, as in the text formats
+    std::string format_hash(uint64_t hash) const noexcept;
+
+    // same dictionary shape load_snapshot returns for the text formats, for comparing
+    // a binary snapshot with a text one. +1 retained, nullptr on failure.
+    CFMutableDictionaryRef copy_as_cfdict() const noexcept;
+
+private:
+    MappedSnapshot() noexcept = default;
+
+    void* _map_base = nullptr;
+    size_t _map_size = 0;
+    const fpsnap::SnapHeader* _header = nullptr;
+    const fpsnap::SnapFileRecord* _files = nullptr;
+    const fpsnap::SnapDirectoryRecord* _directories = nullptr;
+    const char* _strings = nullptr;
+    uint64_t _strings_size = 0;
+    SnapshotMetadata _metadata;
+};
@@ -8,18 +8,40 @@
 #pragma once
 #include <dispatch/dispatch.h>
 
-// all tasks must be added to a group so we can wait for all to finish at the end
-dispatch_group_t get_all_tasks_group() noexcept;
+#include <cstddef>
+
+class ReadBufferPool;
+
+// The queues, semaphores and buffer pool below are the process-wide worker pool shared by
+// all fingerprint sessions. Each FingerprintSession adds its tasks to a dispatch group of its own.
 
 // concurrent directory traversal queue for the long running readdir task (only single one in current design)
 dispatch_queue_t get_directory_traversal_queue() noexcept;
 
+// File processing is a two stage pipeline: readers fill buffers from ReadBufferPool
+// and hashers consume them. The stages are sized independently so a slow disk or
+// network volume can keep many reads in flight without taking hashing slots.
+// Must be called before the first task is dispatched; 0 keeps the default:
+//   hash_jobs     - concurrent hashing tasks, default: number of cores
+//   io_depth      - concurrent file reads, default: 2 x number of cores
+//   buffer_memory - bytes of file content in flight (rounded down to whole buffers), default: 64 MB
+void set_pipeline_limits(int hash_jobs, int io_depth, size_t buffer_memory) noexcept;
+int get_hash_jobs() noexcept;
+int get_io_depth() noexcept;
+ReadBufferPool& get_read_buffer_pool() noexcept;
+
 // CPU gate queue and its counting semaphore is limiting the number
 // of concurrent tasks to the number of cores because the hashing
 // algorithms use ARM NEON for SIMD
 dispatch_queue_t get_cpu_gate_queue() noexcept;
 dispatch_semaphore_t get_concurrency_semaphore() noexcept;
 
+// IO gate queue and its counting semaphore limit the number of files being read at once;
+// the reads themselves run on the concurrent file reading queue
+dispatch_queue_t get_io_gate_queue() noexcept;
+dispatch_semaphore_t get_io_depth_semaphore() noexcept;
+dispatch_queue_t get_file_reading_queue() noexcept;
+
 // concurrent queue to dispatch file processing tasks to
 dispatch_queue_t get_file_processing_queue() noexcept;
 
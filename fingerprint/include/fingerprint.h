@@ -6,6 +6,9 @@
 //
 
 #pragma once
+#include <memory>
+#include <string>
+#include <string_view>
 #include <unordered_set>
 #include <vector>
 #include <CoreFoundation/CoreFoundation.h>
@@ -18,9 +21,31 @@ enum class FileHashAlgorithm
     MISMATCH = -1,
     UNKNOWN,
     CRC32C,
-    BLAKE3
+    BLAKE3,
+    XXH3    // XXH3-64: fast like crc32c but with a full 64-bit result. Not cryptographic, meant for caching
 };
 
+// "crc32c", "blake3" or "xxh3": the spelling accepted by --hash and --cache-hash and recorded in snapshots
+inline const char* hash_algorithm_name(FileHashAlgorithm algorithm) noexcept
+{
+    switch (algorithm)
+    {
+        case FileHashAlgorithm::CRC32C: return "crc32c";
+        case FileHashAlgorithm::BLAKE3: return "blake3";
+        case FileHashAlgorithm::XXH3:   return "xxh3";
+        default:                        return "unknown";
+    }
+}
+
+// FileHashAlgorithm::UNKNOWN for anything but the names above
+inline FileHashAlgorithm hash_algorithm_from_name(std::string_view name) noexcept
+{
+    if (name == "crc32c") return FileHashAlgorithm::CRC32C;
+    if (name == "blake3") return FileHashAlgorithm::BLAKE3;
+    if (name == "xxh3")   return FileHashAlgorithm::XXH3;
+    return FileHashAlgorithm::UNKNOWN;
+}
+
 enum class FingerprintOptions
 {
     // Default: just combine hashes of file content from sorted absolute paths
@@ -34,7 +59,13 @@ enum class FingerprintOptions
     // HashRelativePaths: include relative paths in hashes in addition to content hashes
     // The base directories are the ones specified for search or resolved from symlinks
     // Any explicit file paths outside of these directories are absolute
-    HashRelativePaths
+    HashRelativePaths,
+
+    // HashTree: Merkle tree of the matched files. A directory's hash covers the sorted names
+    // and hashes of its entries, so it depends only on what is under it, not on where it is.
+    // The fingerprint is the hash of the deepest directory containing all files.
+    // Snapshots record every directory hash and comparisons skip subtrees whose hashes match
+    HashTree
 };
 
 enum class XattrMode {
@@ -56,44 +87,94 @@ struct SnapshotMetadata
     std::string snapshot_timestamp;
 };
 
-class fingerprint
+struct FingerprintSessionState;
+
+// One fingerprinting run with its own configuration, pending tasks, matched files and result.
+// Sessions share nothing but the worker pool (the queues, concurrency limits and read buffers
+// of dispatch_queues_helper.h), so several may run at once in one process - gate fingerprints
+// a task's inputs and outputs side by side - and none has to be reset for the next run.
+//
+// A session is used once: one or more find_and_process_* calls schedule the work and return
+// immediately, wait_for_all_tasks() waits for it, then the fingerprint and the outputs are
+// computed from the collected files. Destroying a session waits for its remaining tasks.
+class FingerprintSession
 {
 public:
+    // collection of hashed files into per-thread shards, for verbose reporting
+    struct MatchedFilesStats
+    {
+        size_t file_count = 0;   // files after the merge, before duplicate removal
+        size_t shard_count = 0;  // shards that contributed at least one file
+        double append_time = 0.0; // seconds spent appending, summed over all worker threads
+        double merge_time = 0.0;  // seconds spent merging the shards
+        double serial_queue_time = 0.0; // the same appends replayed through the serial mutation queue
+        size_t dedup_file_count = 0; // paths that reused the hash of a file already hashed in the session
+        uint64_t dedup_bytes = 0;    // content those paths did not read
+    };
+
+    // nullptr when the session state cannot be allocated
+    static std::unique_ptr<FingerprintSession> create(FileHashAlgorithm hash_algorithm, XattrMode xattr_mode) noexcept;
+
+    ~FingerprintSession();
+
+    FingerprintSession(const FingerprintSession&) = delete;
+    FingerprintSession& operator=(const FingerprintSession&) = delete;
+
+    FileHashAlgorithm get_hash_algorithm() const noexcept;
+
     // main entry point. schedules async tasks and returns immediately
     // separates directories from files and dispatches appropriately
     // may be started from any thread, typically main
     // exclude_patterns: optional set of absolute paths or glob patterns;
     //                   files matching any are skipped (and matching
     //                   literal directories are pruned from traversal)
-    static int find_and_process_paths(const std::unordered_set<std::string>& paths,
-                                      const std::unordered_set<std::string>& glob_patterns,
-                                      const std::unordered_set<std::string>& regex_patterns,
-                                      const std::unordered_set<std::string>& exclude_patterns = {}) noexcept;
+    int find_and_process_paths(const std::unordered_set<std::string>& paths,
+                               const std::unordered_set<std::string>& glob_patterns,
+                               const std::unordered_set<std::string>& regex_patterns,
+                               const std::unordered_set<std::string>& exclude_patterns = {}) noexcept;
 
     // alternative main entry point - same general principles but
     // - the input paths may point to actual files or directories
     // - input paths may be direcoreis with GLOB patterns, e.g. /path/to/dir/**/.cpp
-    static int find_and_process_globbed_paths(const std::unordered_set<std::string>& input_paths,
-                                              const std::unordered_set<std::string>& exclude_patterns = {}) noexcept;
+    int find_and_process_globbed_paths(const std::unordered_set<std::string>& input_paths,
+                                       const std::unordered_set<std::string>& exclude_patterns = {}) noexcept;
 
-    // the client should wait for all background tasks to finish
-    static void wait_for_all_tasks() noexcept;
+    // the client should wait for all background tasks of the session to finish
+    void wait_for_all_tasks() noexcept;
+
+    // stops scheduling new work and marks the run as failed. safe to call on any thread
+    void cancel() noexcept;
 
     // this can be called only after all dispatched tasks finished
-    static uint64_t sort_and_compute_fingerprint(FingerprintOptions fingerprintOptions) noexcept;
+    uint64_t sort_and_compute_fingerprint(FingerprintOptions fingerprintOptions) noexcept;
 
-    static int get_result() noexcept;
+    int get_result() const noexcept;
 
-    // reset all state so the class can be reused for another fingerprinting run
-    static void reset() noexcept;
+    // valid after sort_and_compute_fingerprint
+    MatchedFilesStats get_matched_files_stats() const noexcept;
 
-    static void list_matched_files() noexcept;
-    
-    static int save_snapshot_tsv(const std::string& path, const SnapshotMetadata& metadata) noexcept;
-    static int save_snapshot_json(const std::string& path, const SnapshotMetadata& metadata) noexcept;
-    static int save_snapshot_plist(const std::string& path, const SnapshotMetadata& metadata) noexcept;
-    
-    static int save_snapshot(const std::string& path, const SnapshotMetadata& metadata) noexcept;
+    // wall time of the directory traversal that finished last
+    double get_traversal_time() const noexcept;
+
+    void list_matched_files() noexcept;
+
+    int save_snapshot_tsv(const std::string& path, const SnapshotMetadata& metadata) noexcept;
+    int save_snapshot_json(const std::string& path, const SnapshotMetadata& metadata) noexcept;
+    int save_snapshot_plist(const std::string& path, const SnapshotMetadata& metadata) noexcept;
+    int save_snapshot_binary(const std::string& path, const SnapshotMetadata& metadata) noexcept;
+
+    int save_snapshot(const std::string& path, const SnapshotMetadata& metadata) noexcept;
+
+private:
+    explicit FingerprintSession(std::unique_ptr<FingerprintSessionState> state) noexcept;
+
+    std::unique_ptr<FingerprintSessionState> _state;
+};
+
+// Snapshot utilities that need no fingerprinting run
+class fingerprint
+{
+public:
     static CFMutableDictionaryRef load_snapshot(const std::string& path) noexcept;
     static int compare_snapshots(const std::string& path1, const std::string& path2) noexcept;
     
@@ -106,19 +187,4 @@ public:
         FingerprintOptions fingerprint_mode,
         uint64_t fingerprint,
         const struct timeval& timestamp) noexcept;
-
-private:
-
-    // flag to stop all tasks. safe to call on any thread
-    static void set_exiting() noexcept;
-
-    // expected to be called on directory_traversal_queue
-    static int find_files_internal(std::string search_dir,
-                                   const std::unordered_set<std::string>& glob_patterns,
-                                   const std::unordered_set<std::string>& regex_patterns,
-                                   const std::unordered_set<std::string>& exclude_patterns = {}) noexcept;
-    
-    // process individual files directly (globs ignored)
-    // expected to be called on directory_traversal_queue
-    static void process_files_internal(const std::vector<std::pair<std::string, FileInfo>>& files) noexcept;
 };
@@ -15,17 +15,41 @@
 #include <assert.h>
 #include <sys/time.h>
 #include <getopt.h>
+#include <cerrno>
+#include <climits>
+#include <cstdint>
 
 #include "fingerprint.h"
+#include "GlobSearch.h"
 #include "dispatch_queues_helper.h"
+#include "ReadBufferPool.h"
 #include "env_var_expand.h"
 #include "replay_version.h"
 
+// Long-only options use values >= 256 so they don't collide with short opts.
+enum
+{
+    kOptHashJobs = 256,
+    kOptIoDepth,
+    kOptReadMemory,
+    kOptWalker,
+    kOptVerifySnapshot,
+};
+
 FileHashAlgorithm g_hash = FileHashAlgorithm::CRC32C;
-XattrMode g_xattr_mode = XattrMode::On;
 
 bool g_verbose = false;
-double g_traversal_time = 0.0;
+
+// positive integer option value, or -1 when it is not one
+static long parse_positive_option(const char* value) noexcept
+{
+    char* end = nullptr;
+    errno = 0;
+    long number = strtol(value, &end, 10);
+    if ((errno != 0) || (end == value) || (*end != '\0') || (number <= 0))
+        return -1;
+    return number;
+}
 
 static void print_usage(std::ostream& stream)
 {
@@ -44,11 +68,13 @@ static void print_usage(std::ostream& stream)
     stream << "          - literal file or directory  : excludes the file, or prunes the whole subtree\n";
     stream << "          - glob with '/'              : matched against absolute file paths (e.g. 'src/**/*.gen.h')\n";
     stream << "          - glob without '/'           : gitignore-style, matches basename at any depth (e.g. '*.gen.h')\n";
-    stream << "  -H, --hash=ALGO     File content hash algorithm: crc32c (default) or blake3\n";
+    stream << "  -H, --hash=ALGO     File content hash algorithm: crc32c (default), blake3 or xxh3\n";
     stream << "  -F, --fingerprint-mode=MODE  Options to include paths in final fingerprint:\n";
     stream << "        default  : only file content hashes (rename-insensitive) - default if not specified\n";
     stream << "        absolute : include full absolute paths (detects moves/renames)\n";
     stream << "        relative : use relative paths when under searched dirs (recommended)\n";
+    stream << "        tree     : hash each directory from its sorted entries (names and content hashes);\n";
+    stream << "                   snapshots record directory hashes and --compare skips unchanged subtrees\n";
     stream << "  -X, --xattr=MODE    Control extended attribute (xattr) hash caching:\n";
     stream << "        on      : use cache if valid, update if changed - default\n";
     stream << "        off     : disable xattr caching\n";
@@ -56,13 +82,20 @@ static void print_usage(std::ostream& stream)
     stream << "        clear   : disable caching and delete existing xattrs\n";
     stream << "  -I, --inputs=FILE   Read input paths from FILE (one path per line, repeatable)\n";
     stream << "                      Supports Xcode .xcfilelist with ${VAR}/$(VAR) and plain lists.\n";
+    stream << "      --hash-jobs=N   Number of files hashed concurrently (default: number of cores)\n";
+    stream << "      --io-depth=N    Number of files read concurrently (default: 2 x number of cores, max 48)\n";
+    stream << "                      Raise for cold-cache trees on spinning disks or network volumes\n";
+    stream << "      --read-memory=MB  Cap on file content buffered between reading and hashing (default: 64)\n";
+    stream << "      --walker=KIND   Directory traversal: fts (default) or bulk (getattrlistbulk)\n";
     stream << "  -l, --list          List matched files with their hashes\n";
-    stream << "  -s, --snapshot=PATH Save snapshot of matched files with hashes to PATH (.tsv, .plist, or .json)\n";
+    stream << "  -s, --snapshot=PATH Save snapshot of matched files with hashes to PATH (.tsv, .plist, .json, or .fpsnap)\n";
     stream << "  -c, --compare=PATH  Compare snapshot PATH with current fingerprint run or with another snapshot\n";
     stream << "                      Passing two snapshot paths to compare executes fingerprint in comparison mode:\n";
     stream << "                      fingerprint --compare=/path/to/snapshot1.json --compare=/path/to/snapshot2.json\n";
     stream << "                      Using --compare once allows comparing previous fingerprint run to the current:\n";
     stream << "                      fingerprint --compare=mydir-snapshot-previous.plist path/to/mydir\n";
+    stream << "      --verify-snapshot  Check the crc32c of every .fpsnap snapshot loaded (reads the whole file)\n";
+    stream << "                      Without it only the header, section sizes and trailer are checked\n";
     stream << "  -h, --help          Print this help message\n";
     stream << "  -V, --version       Display version.\n";
     stream << "  -v, --verbose       Print all status information\n";
@@ -77,14 +110,14 @@ static void print_usage(std::ostream& stream)
     stream << "Glob patterns apply only to files discovered during directory traversal, not to directly specified files.\n";
     stream << "When no glob pattern is specified, all files under provided directories are fingerprinted.\n";
     stream << "\n";
-    stream << "With --xattr=ON the tool caches computed file hashes and saves FileInfo in \"public.fingerprint.crc32c\"\n";
-    stream << "or \"public.fingerprint.blake3\" xattr for files, depending on hash choice and then reads it back on next\n";
+    stream << "With --xattr=ON the tool caches computed file hashes and saves FileInfo in \"public.fingerprint.crc32c\",\n";
+    stream << "\"public.fingerprint.blake3\" or \"public.fingerprint.xxh3\" xattr for files, depending on hash choice and then reads it back on next\n";
     stream << "fingerprinting if file inode, size and modification dates are unchanged.\n";
     stream << "FileInfo is a 32 byte structure:\n";
     stream << "\t\"inode\" : 8 bytes,\n";
     stream << "\t\"size\" : 8 bytes,\n";
     stream << "\t\"mtime_ns\" : 8 bytes,\n";
-    stream << "\t{ crc32c : 4 bytes, reserved: 4 bytes } or blake3 : 8 bytes\n";
+    stream << "\t{ crc32c : 4 bytes, reserved: 4 bytes } or blake3 : 8 bytes or xxh3 : 8 bytes\n";
     stream << "xattr caching option significantly speeds up subsequent fingerprinting after initial hash calculation.\n";
     stream << "Turning it off makes the tool always perform file hashing, which might be justified in a zero trust\n";
     stream << "hostile environment at the file I/O and CPU expense. In a trusted or non-critical environment without malicious suspects,\n";
@@ -102,6 +135,11 @@ int main(int argc, char * argv[])
         { "fingerprint-mode",required_argument, nullptr, 'F' },
         { "xattr", required_argument, nullptr, 'X' },
         { "inputs", required_argument, nullptr, 'I' },
+        { "hash-jobs", required_argument, nullptr, kOptHashJobs },
+        { "io-depth", required_argument, nullptr, kOptIoDepth },
+        { "read-memory", required_argument, nullptr, kOptReadMemory },
+        { "walker", required_argument, nullptr, kOptWalker },
+        { "verify-snapshot", no_argument, nullptr, kOptVerifySnapshot },
         { "list",  no_argument,       nullptr, 'l' },
         { "snapshot", required_argument, nullptr, 's' },
         { "compare", required_argument, nullptr, 'c' },
@@ -121,6 +159,9 @@ int main(int argc, char * argv[])
     std::string snapshot_path;
     std::vector<std::string> compare_paths;
     FingerprintOptions fingerprint_mode = FingerprintOptions::Default;
+    long hash_jobs = 0;
+    long io_depth = 0;
+    long read_memory_mb = 0;
 
     int opt;
     while ((opt = getopt_long(argc, argv, "g:r:e:H:F:X:I:ls:c:hVv", long_options, nullptr)) != -1)
@@ -165,10 +206,12 @@ int main(int argc, char * argv[])
                     fingerprint_mode = FingerprintOptions::HashAbsolutePaths;
                 else if (mode == "relative")
                     fingerprint_mode = FingerprintOptions::HashRelativePaths;
+                else if (mode == "tree")
+                    fingerprint_mode = FingerprintOptions::HashTree;
                 else
                 {
                     std::cerr << "Error: invalid --fingerprint-mode: " << optarg << "\n";
-                    std::cerr << "       Valid values: default, absolute, relative\n";
+                    std::cerr << "       Valid values: default, absolute, relative, tree\n";
                     return EXIT_FAILURE;
                 }
             }
@@ -196,6 +239,49 @@ int main(int argc, char * argv[])
             }
             break;
                 
+            case kOptHashJobs:
+            case kOptIoDepth:
+            case kOptReadMemory:
+            {
+                long value = parse_positive_option(optarg);
+                if (value < 0)
+                {
+                    std::cerr << "Error: expected a positive number, got: " << optarg << "\n";
+                    return EXIT_FAILURE;
+                }
+
+                if (opt == kOptHashJobs)
+                    hash_jobs = value;
+                else if (opt == kOptIoDepth)
+                    io_depth = value;
+                else
+                    read_memory_mb = value;
+            }
+            break;
+
+            case kOptWalker:
+            {
+                std::string walker = optarg;
+                std::transform(walker.begin(), walker.end(), walker.begin(), ::tolower);
+                if (walker == "bulk")
+                    set_directory_walker(DirectoryWalker::Bulk);
+                else if (walker == "fts")
+                    set_directory_walker(DirectoryWalker::FTS);
+                else
+                {
+                    std::cerr << "Error: invalid --walker: " << optarg << "\n";
+                    std::cerr << "       Valid values: bulk, fts\n";
+                    return EXIT_FAILURE;
+                }
+            }
+            break;
+
+            case kOptVerifySnapshot:
+            {
+                set_verify_snapshot_checksum(true);
+            }
+            break;
+
             case 'l':
             {
                 list_files = true;
@@ -245,15 +331,8 @@ int main(int argc, char * argv[])
 
     // resolve hash_type option
     std::transform(hash_type.begin(), hash_type.end(), hash_type.begin(), ::tolower);
-    if(hash_type == "crc32c")
-    {
-        g_hash = FileHashAlgorithm::CRC32C;
-    }
-    else if(hash_type == "blake3")
-    {
-        g_hash = FileHashAlgorithm::BLAKE3;
-    }
-    else
+    g_hash = hash_algorithm_from_name(hash_type);
+    if(g_hash == FileHashAlgorithm::UNKNOWN)
     {
         std::cerr << "Invalid --hash value: " << hash_type << std::endl;
         print_usage(std::cerr);
@@ -262,14 +341,15 @@ int main(int argc, char * argv[])
 
     // resolve xattr option
     std::transform(xattr.begin(), xattr.end(), xattr.begin(), ::tolower);
+    XattrMode xattr_mode = XattrMode::On;
     if (xattr == "on")
-        g_xattr_mode = XattrMode::On;
+        xattr_mode = XattrMode::On;
     else if (xattr == "off")
-        g_xattr_mode = XattrMode::Off;
+        xattr_mode = XattrMode::Off;
     else if (xattr == "refresh")
-        g_xattr_mode = XattrMode::Refresh;
+        xattr_mode = XattrMode::Refresh;
     else if (xattr == "clear")
-        g_xattr_mode = XattrMode::Clear;
+        xattr_mode = XattrMode::Clear;
     else
     {
         std::cerr << "Error: invalid --xattr value: " << optarg << "\n";
@@ -277,6 +357,9 @@ int main(int argc, char * argv[])
         return EXIT_FAILURE;
     }
 
+    set_pipeline_limits((int)std::min(hash_jobs, (long)INT_MAX), (int)std::min(io_depth, (long)INT_MAX),
+                        (size_t)std::min(read_memory_mb, (long)(SIZE_MAX >> 20)) << 20);
+
     // Collect positional dir paths
     while (optind < argc)
     {
@@ -352,6 +435,11 @@ int main(int argc, char * argv[])
 
         std::cout << "hash algorithm: " << hash_type << std::endl;
         std::cout << "xattr cache: " << xattr << std::endl;
+        std::cout << "hash jobs: " << get_hash_jobs() << ", io depth: " << get_io_depth()
+                  << ", read buffers: " << get_read_buffer_pool().buffer_count() << " x "
+                  << (ReadBufferPool::kReadBufferSize >> 20) << " MB" << std::endl;
+        std::cout << "directory walker: "
+                  << ((get_directory_walker() == DirectoryWalker::Bulk) ? "bulk" : "fts") << std::endl;
     }
     
     struct timeval time_start;
@@ -360,22 +448,29 @@ int main(int argc, char * argv[])
 
     double time_delta = 0.0;
     
+    std::unique_ptr<FingerprintSession> session = FingerprintSession::create(g_hash, xattr_mode);
+    if (session == nullptr)
+    {
+        std::cerr << "Error: cannot create fingerprint session\n";
+        return EXIT_FAILURE;
+    }
+
     ::gettimeofday(&time_start, nullptr);
     
-    result = fingerprint::find_and_process_paths(paths, glob_patterns, regex_patterns, exclude_patterns);
-    fingerprint::wait_for_all_tasks();
+    result = session->find_and_process_paths(paths, glob_patterns, regex_patterns, exclude_patterns);
+    session->wait_for_all_tasks();
 
     ::gettimeofday(&time_tasks_end, nullptr);
 
-    uint64_t fingerprint = fingerprint::sort_and_compute_fingerprint(fingerprint_mode);
-    result = fingerprint::get_result();
+    uint64_t fingerprint = session->sort_and_compute_fingerprint(fingerprint_mode);
+    result = session->get_result();
 
     ::gettimeofday(&time_end, nullptr);
 
     if (list_files)
     {
         std::cout << std::endl << "Matched files (" << hash_type << " hash & path):" << std::endl;
-        fingerprint::list_matched_files();
+        session->list_matched_files();
         std::cout << std::endl;
     }
     
@@ -384,7 +479,7 @@ int main(int argc, char * argv[])
         SnapshotMetadata metadata = fingerprint::create_snapshot_metadata(
             paths, glob_patterns, regex_patterns, exclude_patterns, g_hash, fingerprint_mode, fingerprint, time_end);
         
-        int snap_result = fingerprint::save_snapshot(snapshot_path, metadata);
+        int snap_result = session->save_snapshot(snapshot_path, metadata);
         if (snap_result != EXIT_SUCCESS)
             result = snap_result;
     }
@@ -409,7 +504,7 @@ int main(int argc, char * argv[])
             SnapshotMetadata metadata = fingerprint::create_snapshot_metadata(
                 paths, glob_patterns, regex_patterns, exclude_patterns, g_hash, fingerprint_mode, fingerprint, time_end);
 
-            int snap_result = fingerprint::save_snapshot(current_snapshot, metadata);
+            int snap_result = session->save_snapshot(current_snapshot, metadata);
             if (snap_result != EXIT_SUCCESS)
             {
                 std::cerr << "Error: failed to create temporary snapshot for comparison\n";
@@ -434,7 +529,7 @@ int main(int argc, char * argv[])
 
     if (g_verbose)
     {
-        std::cout << "\nDirectory traversal time: " << (g_traversal_time*1000.0) << " ms\n";
+        std::cout << "\nDirectory traversal time: " << (session->get_traversal_time()*1000.0) << " ms\n";
 
         time_delta = (double)time_tasks_end.tv_sec + (double)time_tasks_end.tv_usec/(1000.0 * 1000.0) -
                      ((double)time_start.tv_sec + (double)time_start.tv_usec/(1000.0 * 1000.0));
@@ -446,6 +541,20 @@ int main(int argc, char * argv[])
 
         std::cout << "\nsort_and_compute_fingerprint time: " << (time_delta*1000.0) << " ms\n";
 
+        // what replaced posting one block per file to the serial mutation queue, and what
+        // that queue takes for the same files when they are replayed through it once
+        FingerprintSession::MatchedFilesStats collection = session->get_matched_files_stats();
+        double shards_time = collection.append_time + collection.merge_time;
+        std::cout << "\nMatched files collection: " << collection.file_count << " files in "
+                  << collection.shard_count << " per-thread shards, append time (all threads): "
+                  << (collection.append_time*1000.0) << " ms, merge time: " << (collection.merge_time*1000.0)
+                  << " ms, serial queue replay: " << (collection.serial_queue_time*1000.0)
+                  << " ms, time saved: " << ((collection.serial_queue_time - shards_time)*1000.0) << " ms\n";
+
+        // hard links and paths matched more than once, hashed by the first path only
+        std::cout << "\nHash dedupe by (device, inode): " << collection.dedup_file_count << " files, "
+                  << ((double)collection.dedup_bytes / (1024.0 * 1024.0)) << " MB not read again\n";
+
         time_delta = (double)time_end.tv_sec + (double)time_end.tv_usec/(1000.0 * 1000.0) -
                      ((double)time_start.tv_sec + (double)time_start.tv_usec/(1000.0 * 1000.0));
 
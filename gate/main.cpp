@@ -10,6 +10,7 @@
 #include <fstream>
 #include <string>
 #include <vector>
+#include <memory>
 #include <unordered_set>
 #include <algorithm>
 #include <ctime>
@@ -33,11 +34,9 @@
 #include "ChildProcess.h"
 
 
-// Globals required by fingerprint.cpp (declared extern there)
+// Globals required by FileHashing.h (declared extern there)
 FileHashAlgorithm g_hash = FileHashAlgorithm::CRC32C;
-XattrMode g_xattr_mode = XattrMode::On;
 bool g_verbose = false;
-double g_traversal_time = 0.0;
 
 extern char **environ;
 
@@ -69,7 +68,7 @@ static void print_usage(std::ostream& stream)
     stream << "                         -S \"${CONFIGURATION}\" -S \"${ARCHS}\"\n";
     stream << "  -c, --cache-dir=DIR    Cache directory (default: .gate-cache)\n";
     stream << "  -C, --cache-format=FMT Cache format: plist (default) or json\n";
-    stream << "  -H, --hash=ALGO       Hash algorithm: crc32c (default) or blake3\n";
+    stream << "  -H, --hash=ALGO       Hash algorithm: crc32c (default), blake3 or xxh3\n";
     stream << "  -f, --force            Force execution, ignore cache (still update cache after)\n";
     stream << "  --dry-run              Report hit/miss without executing\n";
     stream << "  --sandbox             Enable hard sandbox. Use --allow-read, --allow-write, --sandbox-profile\n";
@@ -156,36 +155,44 @@ static std::string current_timestamp()
     return std::string(buf);
 }
 
-// Fingerprint a list of files using the fingerprint class infrastructure.
-// Handles find_and_process_globbed_paths -> wait -> sort_and_compute -> reset cycle.
-// Optional excludes filter out files/dirs matching literal absolute paths or globs.
-static uint64_t fingerprint_files(const std::vector<std::string>& paths,
-                                  const std::vector<std::string>& excludes = {})
+// Start fingerprinting a list of files in a session of its own; the work runs in the background
+// until finish_fingerprint. Optional excludes filter out files/dirs matching literal absolute
+// paths or globs. Returns nullptr when the paths cannot be fingerprinted.
+static std::unique_ptr<FingerprintSession> start_fingerprint(const std::vector<std::string>& paths,
+                                                             const std::vector<std::string>& excludes = {})
 {
-    if (paths.empty()) return 0;
+    std::unique_ptr<FingerprintSession> session = FingerprintSession::create(g_hash, XattrMode::On);
+    if (session == nullptr) return nullptr;
 
     std::unordered_set<std::string> path_set(paths.begin(), paths.end());
     std::unordered_set<std::string> exclude_set(excludes.begin(), excludes.end());
 
-    int result = fingerprint::find_and_process_globbed_paths(path_set, exclude_set);
+    int result = session->find_and_process_globbed_paths(path_set, exclude_set);
     if (result != EXIT_SUCCESS)
-    {
-        fingerprint::reset();
-        return 0;
-    }
+        return nullptr; // the session cancels and waits for what it already started
 
-    fingerprint::wait_for_all_tasks();
+    return session;
+}
 
-    result = fingerprint::get_result();
-    if (result != EXIT_SUCCESS)
-    {
-        fingerprint::reset();
+// Wait for a session from start_fingerprint. Returns its fingerprint, or 0 on failure.
+static uint64_t finish_fingerprint(FingerprintSession* session)
+{
+    if (session == nullptr) return 0;
+
+    session->wait_for_all_tasks();
+    if (session->get_result() != EXIT_SUCCESS)
         return 0;
-    }
 
-    uint64_t fp = fingerprint::sort_and_compute_fingerprint(FingerprintOptions::HashRelativePaths);
-    fingerprint::reset();
-    return fp;
+    return session->sort_and_compute_fingerprint(FingerprintOptions::HashRelativePaths);
+}
+
+static uint64_t fingerprint_files(const std::vector<std::string>& paths,
+                                  const std::vector<std::string>& excludes = {})
+{
+    if (paths.empty()) return 0;
+
+    std::unique_ptr<FingerprintSession> session = start_fingerprint(paths, excludes);
+    return finish_fingerprint(session.get());
 }
 
 // Combine a file fingerprint with env text hash into a single fingerprint.
@@ -404,11 +411,8 @@ int main(int argc, char* argv[])
 
     // Configure hash algorithm
     std::transform(hash_type.begin(), hash_type.end(), hash_type.begin(), ::tolower);
-    if (hash_type == "crc32c")
-        g_hash = FileHashAlgorithm::CRC32C;
-    else if (hash_type == "blake3")
-        g_hash = FileHashAlgorithm::BLAKE3;
-    else
+    g_hash = hash_algorithm_from_name(hash_type);
+    if (g_hash == FileHashAlgorithm::UNKNOWN)
     {
         std::cerr << "error: invalid --hash value: " << hash_type << '\n';
         return 2;
@@ -541,8 +545,17 @@ int main(int argc, char* argv[])
 
     std::string task_signature = compute_task_signature(inputs, outputs, exclude_inputs, command_str, hash_type, signature_keys);
 
-    // Fingerprint inputs before execution (combined with env text)
-    uint64_t input_fingerprint = fingerprint_files(inputs, exclude_inputs);
+    // Fingerprint inputs before execution (combined with env text). When there is a cache
+    // entry to verify, the current outputs are fingerprinted at the same time: a hit needs
+    // both, and the two sessions share the worker pool instead of running one after the other.
+    std::unique_ptr<FingerprintSession> input_session = inputs.empty() ? nullptr
+                                                                       : start_fingerprint(inputs, exclude_inputs);
+    CacheEntry cached;
+    bool have_cache_entry = !force && cache_lookup(cache_dir, cache_format, task_signature, cached);
+    std::unique_ptr<FingerprintSession> output_session = (have_cache_entry && !outputs.empty())
+                                                         ? start_fingerprint(outputs) : nullptr;
+
+    uint64_t input_fingerprint = inputs.empty() ? 0 : finish_fingerprint(input_session.get());
     input_fingerprint = combine_with_env(input_fingerprint, env_text);
     if (!inputs.empty() && input_fingerprint == 0)
     {
@@ -553,8 +566,7 @@ int main(int argc, char* argv[])
     // Check cache (unless forced)
     if (!force)
     {
-        CacheEntry cached;
-        if (cache_lookup(cache_dir, cache_format, task_signature, cached))
+        if (have_cache_entry)
         {
             if (g_verbose)
                 std::cerr << "gate: cache entry found, verifying...\n";
@@ -564,7 +576,7 @@ int main(int argc, char* argv[])
             {
                 // Fingerprint current outputs
                 uint64_t current_output_fingerprint = outputs.empty() ? cached.output_fingerprint
-                                                             : fingerprint_files(outputs);
+                                                             : finish_fingerprint(output_session.get());
 
                 if ((outputs.empty() || current_output_fingerprint != 0) &&
                     current_output_fingerprint == cached.output_fingerprint)
@@ -590,7 +602,10 @@ int main(int argc, char* argv[])
         }
     }
 
-    // Cache miss (or forced)
+    // Cache miss (or forced). Stop the output fingerprinting that was started for the
+    // verification before the command rewrites the outputs.
+    output_session.reset();
+
     if (dry_run)
     {
         std::cerr << "gate: cache miss, would execute: " << command_str << '\n';
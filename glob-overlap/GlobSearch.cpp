@@ -1,11 +1,15 @@
 #include "GlobSearch.h"
+#include "BulkDirectoryReader.h"
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstring>
+#include <fcntl.h>
 #include <filesystem>
 #include <fts.h>
 #include <iostream>
 #include <memory>
+#include <unistd.h>
 
 using FTSPtr = std::unique_ptr<FTS, decltype(&fts_close)>;
 
@@ -210,18 +214,74 @@ bool matches_any_regex(const std::string& path, const std::vector<Regex>& regexe
 // Directory walk
 // ============================================================================
 
-int walk_directory(const std::string& search_dir,
-                   const std::vector<Glob>& compiled_globs,
-                   const std::vector<Regex>& compiled_regexes,
-                   const CompiledExcludes& compiled_excl,
-                   FileMatchedBlock on_match,
-                   std::vector<std::string>* symlinks_out,
-                   int fts_flags) noexcept
+static std::atomic<DirectoryWalker> s_directory_walker { DirectoryWalker::FTS };
+
+void set_directory_walker(DirectoryWalker walker) noexcept
 {
-    if (is_path_excluded(search_dir.c_str(), compiled_excl, search_dir.c_str()))
-        return 0;
+    s_directory_walker.store(walker, std::memory_order_relaxed);
+}
+
+DirectoryWalker get_directory_walker() noexcept
+{
+    return s_directory_walker.load(std::memory_order_relaxed);
+}
+
+static inline bool has_literal_excludes(const CompiledExcludes& compiled_excl) noexcept
+{
+    return !compiled_excl.literal_abs.empty() || !compiled_excl.literal_rel.empty();
+}
+
+// Whether a regular file or symlink is selected by the globs or regexes, which are matched
+// against its path relative to search_dir. Used by both walkers; the bulk walker calls it
+// before the entry's attributes are decoded.
+static bool matches_search_patterns(const char* path,
+                                    const std::string& search_dir,
+                                    const std::vector<Glob>& compiled_globs,
+                                    const std::vector<Regex>& compiled_regexes) noexcept
+{
+    const char* rel = path + search_dir.size();
+    if (*rel == '/')
+        ++rel;
+
+    return matches_any_glob(rel, compiled_globs)
+        || matches_any_regex(std::string(rel), compiled_regexes);
+}
+
+// Delivers one regular file or symlink the same way for both walkers; matched is
+// match_all or the result of matches_search_patterns.
+static void deliver_entry(const char* path,
+                          struct stat* statp,
+                          bool is_symlink,
+                          bool matched,
+                          const std::string& search_dir,
+                          const CompiledExcludes& compiled_excl,
+                          bool match_all,
+                          FileMatchedBlock on_match,
+                          std::vector<std::string>* symlinks_out) noexcept
+{
+    if (is_path_excluded(path, compiled_excl, search_dir.c_str()))
+        return;
+
+    if (matched)
+        on_match(path, statp);
+
+    // Collect symlinks so the caller can follow chains outside search_dir.
+    // No symlink chain collection in match-all: all entries already delivered.
+    if (!match_all && (symlinks_out != nullptr) && is_symlink)
+        symlinks_out->push_back(path);
+}
 
-    char* paths[2] = { const_cast<char*>(search_dir.c_str()), nullptr };
+static int walk_directory_fts(const std::string& search_dir,
+                              const std::string& start_dir,
+                              const std::vector<Glob>& compiled_globs,
+                              const std::vector<Regex>& compiled_regexes,
+                              const CompiledExcludes& compiled_excl,
+                              FileMatchedBlock on_match,
+                              std::vector<std::string>* symlinks_out,
+                              int fts_flags,
+                              DirectoryFoundBlock on_directory) noexcept
+{
+    char* paths[2] = { const_cast<char*>(start_dir.c_str()), nullptr };
     FTSPtr fts(fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR | fts_flags, nullptr), fts_close);
     if (fts == nullptr)
         return errno != 0 ? errno : EXIT_FAILURE;
@@ -235,47 +295,28 @@ int walk_directory(const std::string& search_dir,
         switch (ent->fts_info)
         {
             case FTS_D:
-                if ((!compiled_excl.literal_abs.empty() || !compiled_excl.literal_rel.empty())
+                if (has_literal_excludes(compiled_excl)
                     && is_path_under_literal_exclude(ent->fts_path, ent->fts_pathlen,
                                                      compiled_excl,
                                                      search_dir.c_str(), search_dir.size()))
                 {
                     fts_set(fts.get(), ent, FTS_SKIP);
                 }
+                else if ((on_directory != nullptr) && (ent->fts_level > FTS_ROOTLEVEL)
+                         && on_directory(ent->fts_path, ent->fts_statp))
+                {
+                    fts_set(fts.get(), ent, FTS_SKIP); // the caller walks this subtree
+                }
                 break;
 
             case FTS_F:
             case FTS_SL:
             case FTS_SLNONE:
-            {
-                if (is_path_excluded(ent->fts_path, compiled_excl, search_dir.c_str()))
-                    break;
-
-                if (match_all)
-                {
-                    on_match(ent->fts_path, ent->fts_statp);
-                    // No symlink chain collection in match-all: all entries already delivered.
-                    break;
-                }
-
-                const char* rel = ent->fts_path + search_dir.size();
-                if (*rel == '/')
-                    ++rel;
-
-                if (matches_any_glob(rel, compiled_globs)
-                    || matches_any_regex(std::string(rel), compiled_regexes))
-                {
-                    on_match(ent->fts_path, ent->fts_statp);
-                }
-
-                // Collect symlinks so the caller can follow chains outside search_dir.
-                if (symlinks_out != nullptr
-                    && (ent->fts_info == FTS_SL || ent->fts_info == FTS_SLNONE))
-                {
-                    symlinks_out->push_back(ent->fts_path);
-                }
+                deliver_entry(ent->fts_path, ent->fts_statp, ent->fts_info != FTS_F,
+                              match_all || matches_search_patterns(ent->fts_path, search_dir,
+                                                                   compiled_globs, compiled_regexes),
+                              search_dir, compiled_excl, match_all, on_match, symlinks_out);
                 break;
-            }
 
             case FTS_ERR:
             case FTS_DNR:
@@ -291,3 +332,138 @@ int walk_directory(const std::string& search_dir,
 
     return result;
 }
+
+// Same traversal as walk_directory_fts over getattrlistbulk batches: depth-first with an
+// explicit stack of directories, one open + a few getattrlistbulk calls per directory,
+// and the stat fields of every entry taken from the batch. Entries the filesystem could
+// not stat are skipped like FTS_NS; other types (fifos, devices, sockets) like FTS_DEFAULT.
+static int walk_directory_bulk(const std::string& search_dir,
+                               const std::string& start_dir,
+                               const struct stat& start_st,
+                               const std::vector<Glob>& compiled_globs,
+                               const std::vector<Regex>& compiled_regexes,
+                               const CompiledExcludes& compiled_excl,
+                               FileMatchedBlock on_match,
+                               std::vector<std::string>* symlinks_out,
+                               int fts_flags,
+                               DirectoryFoundBlock on_directory) noexcept
+{
+    // fts checks the root against the literal excludes too (relevant for walk_root)
+    if (has_literal_excludes(compiled_excl)
+        && is_path_under_literal_exclude(start_dir.c_str(), start_dir.size(), compiled_excl,
+                                         search_dir.c_str(), search_dir.size()))
+    {
+        return 0;
+    }
+
+    bool match_all = compiled_globs.empty() && compiled_regexes.empty();
+    bool stay_on_device = (fts_flags & FTS_XDEV) != 0;
+    int result = 0;
+
+    std::vector<std::string> pending;
+    pending.push_back(start_dir);
+    std::string path;
+
+    while (!pending.empty())
+    {
+        std::string dir = std::move(pending.back());
+        pending.pop_back();
+
+        int dirfd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (dirfd < 0)
+        {
+            int err = errno;
+            std::cerr << "directory read error on: " << dir << " errno=" << err << '\n';
+            result = err != 0 ? err : EXIT_FAILURE;
+            continue;
+        }
+
+        // Directories are always decoded, for the excludes, on_directory and the device
+        // check. Files the patterns reject are dropped from the batch by name, before their
+        // attributes are decoded - unless they are symlinks whose chains are collected.
+        bool matched = false;
+        auto wants_entry = [&](const char* name, mode_t type) -> bool
+        {
+            if (!S_ISDIR(type) && !S_ISREG(type) && !S_ISLNK(type))
+                return false;
+
+            path.assign(dir).append(1, '/').append(name);
+            if (S_ISDIR(type))
+                return true;
+
+            matched = match_all || matches_search_patterns(path.c_str(), search_dir,
+                                                           compiled_globs, compiled_regexes);
+            return matched || (S_ISLNK(type) && (symlinks_out != nullptr));
+        };
+
+        int err = read_directory_bulk(dirfd, wants_entry, [&](const BulkDirEntry& entry)
+        {
+            if (!entry.has_stat)
+                return;
+
+            // path was set by wants_entry, which runs right before for the same entry
+            struct stat st = entry.st;
+
+            if (S_ISDIR(st.st_mode))
+            {
+                if (has_literal_excludes(compiled_excl)
+                    && is_path_under_literal_exclude(path.c_str(), path.size(), compiled_excl,
+                                                     search_dir.c_str(), search_dir.size()))
+                    return;
+
+                if ((on_directory != nullptr) && on_directory(path.c_str(), &st))
+                    return; // the caller walks this subtree
+
+                // a mount point's st is the mounted root's (see BulkDirEntry), for this
+                // check and for on_directory above
+                if (stay_on_device && (st.st_dev != start_st.st_dev))
+                    return; // mount point: fts reports it but does not descend
+
+                pending.push_back(path);
+            }
+            else if (S_ISREG(st.st_mode) || S_ISLNK(st.st_mode))
+            {
+                deliver_entry(path.c_str(), &st, S_ISLNK(st.st_mode), matched,
+                              search_dir, compiled_excl, match_all, on_match, symlinks_out);
+            }
+        });
+        close(dirfd);
+
+        if (err != 0)
+        {
+            std::cerr << "directory read error on: " << dir << " errno=" << err << '\n';
+            result = err;
+        }
+    }
+
+    return result;
+}
+
+int walk_directory(const std::string& search_dir,
+                   const std::vector<Glob>& compiled_globs,
+                   const std::vector<Regex>& compiled_regexes,
+                   const CompiledExcludes& compiled_excl,
+                   FileMatchedBlock on_match,
+                   std::vector<std::string>* symlinks_out,
+                   int fts_flags,
+                   DirectoryFoundBlock on_directory,
+                   const std::string* walk_root) noexcept
+{
+    if (is_path_excluded(search_dir.c_str(), compiled_excl, search_dir.c_str()))
+        return 0;
+
+    const std::string& start_dir = (walk_root != nullptr) ? *walk_root : search_dir;
+
+    // A start that is not a directory (or is missing) is left to fts, which reports
+    // it the way the callers expect.
+    struct stat start_st;
+    if ((get_directory_walker() == DirectoryWalker::Bulk)
+        && (lstat(start_dir.c_str(), &start_st) == 0) && S_ISDIR(start_st.st_mode))
+    {
+        return walk_directory_bulk(search_dir, start_dir, start_st, compiled_globs, compiled_regexes,
+                                   compiled_excl, on_match, symlinks_out, fts_flags, on_directory);
+    }
+
+    return walk_directory_fts(search_dir, start_dir, compiled_globs, compiled_regexes,
+                              compiled_excl, on_match, symlinks_out, fts_flags, on_directory);
+}
@@ -0,0 +1,199 @@
+#pragma once
+
+// Directory reading with getattrlistbulk(2): one syscall returns a batch of entries
+// together with the metadata a walker needs (type, device, inode, size, times, mode),
+// where readdir + lstat costs one extra syscall per entry and fts(3) additionally
+// allocates an FTSENT and a full path for every one of them.
+
+#include <fcntl.h>
+#include <sys/attr.h>
+#include <sys/stat.h>
+#include <sys/vnode.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <unistd.h>
+
+// One entry of a directory batch. name points into the batch buffer and is valid only
+// during the callback. When the filesystem reports an error for the entry, has_stat is
+// false and st is zeroed: the fts walkers see such an entry as FTS_NS.
+//
+// For a directory that something is mounted on, the batch describes the directory it
+// covers: its ATTR_CMN_DEVID is the parent filesystem's, so a device comparison would
+// never see the mount. Those entries are flagged from ATTR_DIR_MOUNTSTATUS and their st
+// is taken from an lstat of the entry instead, which is what fts reports for them (the
+// root of the mounted filesystem, with its st_dev). Mount points are rare enough that
+// the extra syscall does not show.
+struct BulkDirEntry
+{
+    const char* name;
+    struct stat st; // st_dev, st_ino, st_mode, st_size, st_mtimespec and st_ctimespec; the rest is 0
+    bool        has_stat;
+    bool        is_mount_point;
+};
+
+inline mode_t bulk_type_mode_bits(fsobj_type_t type) noexcept
+{
+    switch (type)
+    {
+        case VREG:  return S_IFREG;
+        case VDIR:  return S_IFDIR;
+        case VLNK:  return S_IFLNK;
+        case VFIFO: return S_IFIFO;
+        case VSOCK: return S_IFSOCK;
+        case VCHR:  return S_IFCHR;
+        case VBLK:  return S_IFBLK;
+        default:    return 0;
+    }
+}
+
+// Calls on_entry(const BulkDirEntry&) for every entry of the directory open at dirfd
+// ("." and ".." are never returned) that wants_entry(const char* name, mode_t type) accepts.
+// type holds the S_IFMT bits only. wants_entry sees each entry once its name and type are
+// decoded; the rest of a rejected entry is not decoded and a mount point is not lstat'ed,
+// and on_entry follows it directly for an accepted one. Entries come in directory order,
+// unsorted. Returns 0 at the end of the directory, or the errno of a failed read.
+template <typename WantsEntry, typename OnEntry>
+int read_directory_bulk(int dirfd, WantsEntry&& wants_entry, OnEntry&& on_entry) noexcept
+{
+    struct attrlist request = {};
+    request.bitmapcount = ATTR_BIT_MAP_COUNT;
+    request.commonattr = ATTR_CMN_RETURNED_ATTRS | ATTR_CMN_NAME | ATTR_CMN_ERROR | ATTR_CMN_DEVID
+                       | ATTR_CMN_OBJTYPE | ATTR_CMN_MODTIME | ATTR_CMN_CHGTIME | ATTR_CMN_ACCESSMASK
+                       | ATTR_CMN_FILEID;
+    request.dirattr = ATTR_DIR_MOUNTSTATUS;
+    request.fileattr = ATTR_FILE_DATALENGTH;
+
+    // 32 KB holds a few hundred entries per call and is safe on a GCD worker stack
+    alignas(8) char buffer[32 * 1024];
+
+    for (;;)
+    {
+        int count = getattrlistbulk(dirfd, &request, buffer, sizeof(buffer), 0);
+        if (count < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return errno;
+        }
+        if (count == 0)
+            return 0;
+
+        const char* entry_start = buffer;
+        for (int i = 0; i < count; ++i)
+        {
+            // Layout per getattrlistbulk(2): length, returned attribute set, then each
+            // returned attribute in bit order - except ATTR_CMN_ERROR, which comes first.
+            // Attributes that were not returned take no space, hence the bit checks.
+            const char* field = entry_start;
+            uint32_t length = 0;
+            std::memcpy(&length, field, sizeof(length));
+            field += sizeof(length);
+            entry_start += length;
+
+            attribute_set_t returned;
+            std::memcpy(&returned, field, sizeof(returned));
+            field += sizeof(returned);
+
+            BulkDirEntry entry = {};
+            entry.has_stat = true;
+
+            if (returned.commonattr & ATTR_CMN_ERROR)
+            {
+                uint32_t error = 0;
+                std::memcpy(&error, field, sizeof(error));
+                field += sizeof(error);
+                entry.has_stat = (error == 0);
+            }
+
+            if (returned.commonattr & ATTR_CMN_NAME)
+            {
+                attrreference_t name_ref;
+                std::memcpy(&name_ref, field, sizeof(name_ref));
+                entry.name = field + name_ref.attr_dataoffset;
+                field += sizeof(name_ref);
+            }
+
+            if (returned.commonattr & ATTR_CMN_DEVID)
+            {
+                std::memcpy(&entry.st.st_dev, field, sizeof(dev_t));
+                field += sizeof(dev_t);
+            }
+
+            fsobj_type_t type = VNON;
+            if (returned.commonattr & ATTR_CMN_OBJTYPE)
+            {
+                std::memcpy(&type, field, sizeof(type));
+                field += sizeof(type);
+            }
+
+            if (entry.name == nullptr)
+                continue; // cannot be addressed without a name
+
+            if (!wants_entry(entry.name, bulk_type_mode_bits(type)))
+                continue;
+
+            if (returned.commonattr & ATTR_CMN_MODTIME)
+            {
+                std::memcpy(&entry.st.st_mtimespec, field, sizeof(struct timespec));
+                field += sizeof(struct timespec);
+            }
+
+            if (returned.commonattr & ATTR_CMN_CHGTIME)
+            {
+                std::memcpy(&entry.st.st_ctimespec, field, sizeof(struct timespec));
+                field += sizeof(struct timespec);
+            }
+
+            uint32_t access_mask = 0;
+            if (returned.commonattr & ATTR_CMN_ACCESSMASK)
+            {
+                std::memcpy(&access_mask, field, sizeof(access_mask));
+                field += sizeof(access_mask);
+            }
+
+            if (returned.commonattr & ATTR_CMN_FILEID)
+            {
+                uint64_t file_id = 0;
+                std::memcpy(&file_id, field, sizeof(file_id));
+                field += sizeof(file_id);
+                entry.st.st_ino = (ino_t)file_id;
+            }
+
+            // directory attributes are returned for directories only, before file attributes
+            if (returned.dirattr & ATTR_DIR_MOUNTSTATUS)
+            {
+                uint32_t mount_status = 0;
+                std::memcpy(&mount_status, field, sizeof(mount_status));
+                field += sizeof(mount_status);
+                entry.is_mount_point = (mount_status & DIR_MNTSTATUS_MNTPOINT) != 0;
+            }
+
+            // file attributes are returned for non-directories only
+            if (returned.fileattr & ATTR_FILE_DATALENGTH)
+            {
+                off_t data_length = 0;
+                std::memcpy(&data_length, field, sizeof(data_length));
+                field += sizeof(data_length);
+                entry.st.st_size = data_length;
+            }
+
+            entry.st.st_mode = bulk_type_mode_bits(type) | (mode_t)(access_mask & ~S_IFMT);
+
+            if (entry.has_stat && entry.is_mount_point)
+                entry.has_stat = (fstatat(dirfd, entry.name, &entry.st, AT_SYMLINK_NOFOLLOW) == 0);
+
+            if (!entry.has_stat)
+                entry.st = {};
+
+            on_entry(entry);
+        }
+    }
+}
+
+// read_directory_bulk for every entry.
+template <typename OnEntry>
+int read_directory_bulk(int dirfd, OnEntry&& on_entry) noexcept
+{
+    return read_directory_bulk(dirfd, [](const char*, mode_t) { return true; }, on_entry);
+}
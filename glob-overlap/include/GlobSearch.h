@@ -91,7 +91,30 @@ bool is_path_excluded(const char* abs_path, const CompiledExcludes& excludes,
 // GCD block called for each file that passes include/exclude filters.
 typedef void (^FileMatchedBlock)(const char* abs_path, struct stat* statp);
 
-// Walk search_dir with FTS, calling on_match for each non-excluded entry that
+// GCD block called for each directory below the walk start that survived literal-exclude
+// pruning, before the walk descends into it. Returning true hands the whole subtree over to
+// the caller (typically to walk it concurrently with walk_root set to abs_path) and the
+// current walk skips it; returning false keeps it in the current walk.
+typedef bool (^DirectoryFoundBlock)(const char* abs_path, struct stat* statp);
+
+// Directory reading backend of walk_directory.
+//   Bulk: getattrlistbulk batches (see BulkDirectoryReader.h) - names, types and the stat
+//         fields FileInfo needs come back with the directory listing, with no per-entry
+//         lstat and no FTSENT allocation. Opt-in until it has been checked against fts
+//         on the filesystems the tools run on.
+//   FTS:  fts(3), the original walker. The default.
+// Both deliver the same entries with the same stat fields to the callbacks.
+enum class DirectoryWalker
+{
+    Bulk,
+    FTS
+};
+
+// Process-wide; set before the first walk starts.
+void set_directory_walker(DirectoryWalker walker) noexcept;
+DirectoryWalker get_directory_walker() noexcept;
+
+// Walk search_dir with the selected DirectoryWalker, calling on_match for each non-excluded entry that
 // matches compiled_globs or compiled_regexes. When both vectors are empty every
 // non-excluded entry matches. Runs synchronously on the calling thread.
 //
@@ -102,13 +125,26 @@ typedef void (^FileMatchedBlock)(const char* abs_path, struct stat* statp);
 //   on_match.
 //
 // fts_flags: extra flags ORed into FTS_PHYSICAL | FTS_NOCHDIR. Callers that
-//   need to stay on one filesystem pass FTS_XDEV here.
+//   need to stay on one filesystem pass FTS_XDEV here. The Bulk walker honors
+//   FTS_XDEV the same way and ignores the other flags.
+//
+// on_directory: optional, see DirectoryFoundBlock. Lets a caller split one walk into
+//   subtree walks; the matched set is the same however the tree is split, because
+//   matching and exclusion are always relative to search_dir.
+//
+// walk_root: optional directory under search_dir to start the walk from, for the
+//   subtree walks handed out through on_directory. Globs, regexes and relative
+//   excludes still match against paths relative to search_dir. With FTS_XDEV the
+//   walk stays on walk_root's filesystem, so only subtrees on search_dir's device
+//   should be handed out to keep the single-walk semantics.
 //
-// Returns 0 on success, errno on FTS open failure or traversal error.
+// Returns 0 on success, errno on open failure or traversal error.
 int walk_directory(const std::string& search_dir,
                    const std::vector<Glob>& compiled_globs,
                    const std::vector<Regex>& compiled_regexes,
                    const CompiledExcludes& compiled_excl,
                    FileMatchedBlock on_match,
                    std::vector<std::string>* symlinks_out = nullptr,
-                   int fts_flags = 0) noexcept;
+                   int fts_flags = 0,
+                   DirectoryFoundBlock on_directory = nullptr,
+                   const std::string* walk_root = nullptr) noexcept;
@@ -0,0 +1,645 @@
+#include "ArtifactStore.h"
+
+#include "LogStream.h"
+#include "PosixFileOps.h"
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <optional>
+#include <string_view>
+
+#include "blake3.h"
+#include "yyjson.hpp"
+
+namespace artstore
+{
+
+constexpr uint64_t kRecordVersion = 1;
+constexpr size_t kObjectHexDigits = 32; // 128-bit blake3
+constexpr size_t kReadBufferBytes = 256 * 1024;
+
+// A temp left in tmp/ by a crashed run. Anything this old is no capture in progress.
+constexpr time_t kStaleTempSeconds = 60 * 60;
+
+struct FdGuard
+{
+	int fd;
+	~FdGuard()
+	{
+		if(fd >= 0)
+			close(fd);
+	}
+};
+
+bool write_all(int fd, const char *data, size_t size)
+{
+	while(size > 0)
+	{
+		ssize_t written = write(fd, data, size);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		data += written;
+		size -= (size_t)written;
+	}
+	return true;
+}
+
+// blake3-128 of everything readable from fd, as lowercase hex, and the byte count.
+bool hash_fd(int fd, std::string &outHex, uint64_t &outSize)
+{
+	blake3_hasher hasher;
+	blake3_hasher_init(&hasher);
+
+	std::vector<uint8_t> buffer(kReadBufferBytes);
+	uint64_t total = 0;
+	while(true)
+	{
+		ssize_t got = read(fd, buffer.data(), buffer.size());
+		if(got < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		if(got == 0)
+			break;
+		blake3_hasher_update(&hasher, buffer.data(), (size_t)got);
+		total += (uint64_t)got;
+	}
+
+	uint8_t digest[kObjectHexDigits / 2];
+	blake3_hasher_finalize(&hasher, digest, sizeof(digest));
+
+	static const char kHexDigits[] = "0123456789abcdef";
+	outHex.clear();
+	outHex.reserve(kObjectHexDigits);
+	for(uint8_t byte : digest)
+	{
+		outHex.push_back(kHexDigits[byte >> 4]);
+		outHex.push_back(kHexDigits[byte & 0x0F]);
+	}
+	outSize = total;
+	return true;
+}
+
+bool hash_file(const std::string &path, std::string &outHex, uint64_t &outSize)
+{
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC | O_NOFOLLOW);
+	if(fd < 0)
+		return false;
+	FdGuard guard{fd};
+	return hash_fd(fd, outHex, outSize);
+}
+
+// Object names are only ever what hash_fd produces: anything else in a record would be
+// a path component taken from a file on disk.
+bool is_object_name(std::string_view text)
+{
+	if(text.size() != kObjectHexDigits)
+		return false;
+	for(char oneChar : text)
+	{
+		if(!(((oneChar >= '0') && (oneChar <= '9')) || ((oneChar >= 'a') && (oneChar <= 'f'))))
+			return false;
+	}
+	return true;
+}
+
+// Sets mtime and atime to now: the "recently used" mark trim() evicts by.
+void touch(const std::string &path)
+{
+	(void)utimes(path.c_str(), nullptr);
+}
+
+// One file under objects/ or records/, as trim() sees it.
+struct StoredFile
+{
+	std::string path;
+	struct timespec mtime;
+	uint64_t size;
+};
+
+bool older(const struct timespec &a, const struct timespec &b)
+{
+	return (a.tv_sec < b.tv_sec) || ((a.tv_sec == b.tv_sec) && (a.tv_nsec < b.tv_nsec));
+}
+
+// Every regular file below dir.
+std::vector<StoredFile> list_files(const std::string &dir)
+{
+	std::vector<StoredFile> files;
+	char *paths[2] = {const_cast<char *>(dir.c_str()), nullptr};
+	FTSPtr fts(fts_open(paths, FTS_PHYSICAL | FTS_XDEV, nullptr), fts_close);
+	if(fts == nullptr)
+		return files;
+
+	FTSENT *ent;
+	while((ent = fts_read(fts.get())) != nullptr)
+	{
+		if(ent->fts_info != FTS_F)
+			continue;
+		files.push_back({ent->fts_path, ent->fts_statp->st_mtimespec, (uint64_t)ent->fts_statp->st_size});
+	}
+	return files;
+}
+
+} // namespace artstore
+
+using namespace artstore;
+
+ArtifactStore::ArtifactStore(const std::string &cacheDir, uint64_t limitBytes, bool verbose)
+	: mRoot(cacheDir + "/artifacts")
+	, mLimitBytes(limitBytes)
+	, mVerbose(verbose)
+{
+}
+
+std::string
+ArtifactStore::record_path(const std::string &signature, uint64_t worldIn) const
+{
+	char worldInHex[17];
+	snprintf(worldInHex, sizeof(worldInHex), "%016llx", (unsigned long long)worldIn);
+	return mRoot + "/records/" + signature + "-" + worldInHex + ".json";
+}
+
+std::string
+ArtifactStore::object_path(const std::string &object) const
+{
+	return mRoot + "/objects/" + object.substr(0, 2) + "/" + object.substr(2);
+}
+
+// Unique per process and call, so concurrent tasks and processes never share a temp.
+std::string
+ArtifactStore::temp_path(const std::string &base)
+{
+	uint64_t counter = mTempCounter.fetch_add(1, std::memory_order_relaxed);
+	return base + ".replay-artifact." + std::to_string((long)getpid()) + "." + std::to_string((unsigned long long)counter);
+}
+
+bool
+ArtifactStore::read_record(const std::string &path, const std::vector<std::string> &outputs,
+                           std::vector<Item> &outItems) const
+{
+	Json::Document doc = Json::parse_file(path.c_str());
+	Json::Val root = doc.root();
+	if(!root.is_obj())
+		return false;
+
+	// uint, not sint: yyjson reads a non-negative integer as unsigned.
+	std::optional<uint64_t> version = root.obj_get("version").get_uint();
+	if(!version.has_value() || (*version != kRecordVersion))
+		return false;
+
+	// The signature already covers the declared outputs, so a record that lists others
+	// is not one this task wrote: refuse it rather than restore to paths it does not own.
+	Json::Val items = root.obj_get("outputs");
+	if(!items.is_arr() || (items.arr_size() != outputs.size()))
+		return false;
+
+	outItems.clear();
+	outItems.reserve(outputs.size());
+	for(size_t i = 0; i < outputs.size(); ++i)
+	{
+		Json::Val oneItem = items.arr_get(i);
+		std::optional<std::string_view> itemPath = oneItem.obj_get("path").get_str();
+		std::optional<std::string_view> type = oneItem.obj_get("type").get_str();
+		if(!itemPath.has_value() || (*itemPath != outputs[i]) || !type.has_value())
+			return false;
+
+		Item item;
+		item.path = outputs[i];
+		if(*type == "absent")
+		{
+			item.type = ItemType::Absent;
+		}
+		else if(*type == "symlink")
+		{
+			std::optional<std::string_view> target = oneItem.obj_get("target").get_str();
+			if(!target.has_value() || target->empty())
+				return false;
+			item.type = ItemType::Symlink;
+			item.target = std::string(*target);
+		}
+		else if(*type == "file")
+		{
+			std::optional<std::string_view> object = oneItem.obj_get("object").get_str();
+			std::optional<uint64_t> mode = oneItem.obj_get("mode").get_uint();
+			std::optional<uint64_t> size = oneItem.obj_get("size").get_uint();
+			if(!object.has_value() || !is_object_name(*object) || !mode.has_value() || !size.has_value())
+				return false;
+			item.type = ItemType::File;
+			item.object = std::string(*object);
+			item.mode = (uint32_t)(*mode & 07777);
+			item.size = *size;
+		}
+		else
+		{
+			return false;
+		}
+		outItems.push_back(std::move(item));
+	}
+	return true;
+}
+
+bool
+ArtifactStore::write_record(const std::string &path, const std::vector<Item> &items)
+{
+	Json::MutableDoc doc;
+	Json::MutableVal root = doc.new_obj();
+	doc.obj_add(root, "version", doc.new_uint(kRecordVersion));
+
+	Json::MutableVal outputs = doc.new_arr();
+	for(const auto &item : items)
+	{
+		Json::MutableVal oneItem = doc.new_obj();
+		doc.obj_add(oneItem, "path", doc.new_str(item.path));
+		switch(item.type)
+		{
+			case ItemType::Absent:
+				doc.obj_add(oneItem, "type", doc.new_str("absent"));
+			break;
+
+			case ItemType::Symlink:
+				doc.obj_add(oneItem, "type", doc.new_str("symlink"));
+				doc.obj_add(oneItem, "target", doc.new_str(item.target));
+			break;
+
+			case ItemType::File:
+				doc.obj_add(oneItem, "type", doc.new_str("file"));
+				doc.obj_add(oneItem, "object", doc.new_str(item.object));
+				doc.obj_add(oneItem, "mode", doc.new_uint(item.mode));
+				doc.obj_add(oneItem, "size", doc.new_uint(item.size));
+			break;
+		}
+		doc.arr_append(outputs, oneItem);
+	}
+	doc.obj_add(root, "outputs", outputs);
+	doc.set_root(root);
+
+	std::string text = doc.to_string();
+	if(text.empty())
+		return false;
+
+	// The same temp+rename publication as the manifest, with O_EXCL|O_NOFOLLOW for the same
+	// shared-directory reason. Readers take no lock and see the old record or the new one.
+	std::string tempPath = temp_path(mRoot + "/tmp/record");
+	int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if(fd < 0)
+		return false;
+	bool written = write_all(fd, text.data(), text.size());
+	if((close(fd) != 0) || !written || (rename(tempPath.c_str(), path.c_str()) != 0))
+	{
+		unlink(tempPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool
+ArtifactStore::store_object(Item &item)
+{
+	// The clone is hashed, not the output: the clone is private to us, so what is hashed is
+	// exactly what gets stored, whatever happens to the output meanwhile. On APFS it shares
+	// the output's blocks, so the store costs little space until one of them is rewritten.
+	std::string tempPath = temp_path(mRoot + "/tmp/object");
+	if(posix_clone_item(item.path, tempPath) != 0)
+	{
+		unlink(tempPath.c_str());
+		return false;
+	}
+
+	if(!hash_file(tempPath, item.object, item.size))
+	{
+		unlink(tempPath.c_str());
+		return false;
+	}
+
+	// A name already present holds the same bytes, so replacing it is harmless, and a
+	// restore cloning from the old inode keeps reading it through its own descriptor.
+	std::string objectPath = object_path(item.object);
+	if(!posix_mkdir_p(posix_parent_dir(objectPath)) || (rename(tempPath.c_str(), objectPath.c_str()) != 0))
+	{
+		unlink(tempPath.c_str());
+		return false;
+	}
+
+	// copyfile carried the output's timestamps over; the store wants "used now".
+	touch(objectPath);
+	return true;
+}
+
+bool
+ArtifactStore::capture(const std::string &signature, uint64_t worldIn, const std::vector<std::string> &outputs)
+{
+	// Called from scheduler tasks, where an escaping exception is std::terminate. Anything
+	// thrown (bad_alloc) only costs the execution the store would have saved.
+	try
+	{
+		return capture_internal(signature, worldIn, outputs);
+	}
+	catch(...)
+	{
+		return false;
+	}
+}
+
+bool
+ArtifactStore::capture_internal(const std::string &signature, uint64_t worldIn, const std::vector<std::string> &outputs)
+{
+	if(outputs.empty())
+		return false;
+
+	if(!posix_mkdir_p(mRoot + "/tmp") || !posix_mkdir_p(mRoot + "/records"))
+	{
+		if(mVerbose)
+			LogError("artifacts: cannot create the store directory: %s\n", mRoot.c_str());
+		return false;
+	}
+
+	std::vector<Item> items;
+	items.reserve(outputs.size());
+	for(const auto &path : outputs)
+	{
+		Item item;
+		item.path = path;
+
+		struct stat st;
+		if(lstat(path.c_str(), &st) != 0)
+		{
+			// Absence is a product like any other (a task may legitimately not create a
+			// declared output), but only when it is genuinely absent.
+			if((errno != ENOENT) && (errno != ENOTDIR))
+				return false;
+			item.type = ItemType::Absent;
+		}
+		else if(S_ISLNK(st.st_mode))
+		{
+			char target[PATH_MAX];
+			ssize_t length = readlink(path.c_str(), target, sizeof(target));
+			if((length <= 0) || ((size_t)length >= sizeof(target)))
+				return false;
+			item.type = ItemType::Symlink;
+			item.target.assign(target, (size_t)length);
+		}
+		else if(S_ISREG(st.st_mode))
+		{
+			item.type = ItemType::File;
+			item.mode = (uint32_t)(st.st_mode & 07777);
+			if(!store_object(item))
+			{
+				if(mVerbose)
+					LogError("artifacts: cannot store %s\n", path.c_str());
+				return false;
+			}
+		}
+		else
+		{
+			return false; // a directory or a special file: not restorable, not recorded
+		}
+		items.push_back(std::move(item));
+	}
+
+	if(!write_record(record_path(signature, worldIn), items))
+	{
+		if(mVerbose)
+			LogError("artifacts: cannot write the record for %s\n", outputs.front().c_str());
+		return false;
+	}
+
+	mCapturedCount.fetch_add(1, std::memory_order_relaxed);
+	return true;
+}
+
+bool
+ArtifactStore::can_restore(const std::string &signature, uint64_t worldIn, const std::vector<std::string> &outputs) const
+{
+	try
+	{
+		std::vector<Item> items;
+		if(!read_record(record_path(signature, worldIn), outputs, items))
+			return false;
+
+		for(const auto &item : items)
+		{
+			if((item.type == ItemType::File) && !posix_path_exists(object_path(item.object)))
+				return false;
+		}
+		return true;
+	}
+	catch(...)
+	{
+		return false;
+	}
+}
+
+bool
+ArtifactStore::restore(const std::string &signature, uint64_t worldIn, const std::vector<std::string> &outputs)
+{
+	// As capture(): nothing may escape into the scheduler.
+	try
+	{
+		return restore_internal(signature, worldIn, outputs);
+	}
+	catch(...)
+	{
+		return false;
+	}
+}
+
+bool
+ArtifactStore::restore_internal(const std::string &signature, uint64_t worldIn, const std::vector<std::string> &outputs)
+{
+	std::string recordPath = record_path(signature, worldIn);
+	std::vector<Item> items;
+	if(!read_record(recordPath, outputs, items))
+		return false;
+
+	// Staged temps, one per item (empty for an absent one). Any left when this returns were
+	// not renamed into place and are removed.
+	std::vector<std::string> temps(items.size());
+	struct TempGuard
+	{
+		std::vector<std::string> &temps;
+		~TempGuard()
+		{
+			for(const auto &oneTemp : temps)
+			{
+				if(!oneTemp.empty())
+					unlink(oneTemp.c_str());
+			}
+		}
+	} tempGuard{temps};
+
+	// Stage everything that can fail before anything is replaced.
+	for(size_t i = 0; i < items.size(); ++i)
+	{
+		const Item &item = items[i];
+		if(item.type == ItemType::Absent)
+		{
+			// Removing a file or a link to reproduce the absence is fine; removing a
+			// directory is not something the task itself would have done.
+			struct stat st;
+			if((lstat(item.path.c_str(), &st) == 0) && S_ISDIR(st.st_mode))
+				return false;
+			continue;
+		}
+
+		// The task would have run with its output directory missing too, and most would
+		// have failed; a restore has what they would have written, so it creates it.
+		if(!posix_mkdir_p(posix_parent_dir(item.path)))
+			return false;
+
+		// A sibling of the destination, so the rename below stays on one volume.
+		std::string tempPath = temp_path(item.path);
+		if(item.type == ItemType::Symlink)
+		{
+			if(symlink(item.target.c_str(), tempPath.c_str()) != 0)
+				return false;
+			temps[i] = tempPath;
+			continue;
+		}
+
+		std::string objectPath = object_path(item.object);
+		if(posix_clone_item(objectPath, tempPath) != 0)
+		{
+			int cloneErrno = errno;
+			unlink(tempPath.c_str());
+			if(cloneErrno == ENOENT)
+				unlink(recordPath.c_str()); // evicted: the record can never restore again
+			return false;
+		}
+		temps[i] = tempPath;
+
+		// The object is trusted no further than its name: re-hash what was staged. One read
+		// of the file, against a re-execution it saves.
+		std::string hashed;
+		uint64_t size = 0;
+		if(!hash_file(tempPath, hashed, size))
+			return false;
+		if((hashed != item.object) || (size != item.size))
+		{
+			if(mVerbose)
+				LogError("artifacts: dropping a corrupt object: %s\n", objectPath.c_str());
+			unlink(objectPath.c_str());
+			unlink(recordPath.c_str());
+			return false;
+		}
+
+		// Fresh mtime, as an execution would have left; the recorded mode, not the object's.
+		if((chmod(tempPath.c_str(), (mode_t)item.mode) != 0) || (utimes(tempPath.c_str(), nullptr) != 0))
+			return false;
+	}
+
+	for(size_t i = 0; i < items.size(); ++i)
+	{
+		const Item &item = items[i];
+		if(item.type == ItemType::Absent)
+		{
+			if((unlink(item.path.c_str()) != 0) && (errno != ENOENT))
+				return false;
+			continue;
+		}
+
+		if(rename(temps[i].c_str(), item.path.c_str()) != 0)
+			return false;
+		temps[i].clear();
+		if(item.type == ItemType::File)
+			touch(object_path(item.object));
+	}
+
+	touch(recordPath);
+	return true;
+}
+
+void
+ArtifactStore::trim()
+{
+	size_t capturedCount = mCapturedCount.load(std::memory_order_relaxed);
+	if(capturedCount == 0)
+		return;
+
+	// Exclusive against another process's trim, so two of them do not both evict down to
+	// the limit from the same listing. Captures and restores take no lock: one racing an
+	// eviction loses its object, fails to restore, and executes.
+	std::string lockPath = mRoot + "/.lock";
+	int fd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if(fd < 0)
+		return;
+	struct LockGuard
+	{
+		int fd;
+		~LockGuard() { flock(fd, LOCK_UN); close(fd); }
+	} lockGuard{fd};
+
+	int lockResult;
+	while(((lockResult = flock(fd, LOCK_EX)) != 0) && (errno == EINTR))
+		{ /* keep waiting */ }
+	if(lockResult != 0)
+	{
+		if(mVerbose)
+			LogError("artifacts: cannot lock the store (%s), not trimming: %s\n", strerror(errno), lockPath.c_str());
+		return;
+	}
+
+	time_t now = time(nullptr);
+	for(const auto &oneTemp : list_files(mRoot + "/tmp"))
+	{
+		if((now - oneTemp.mtime.tv_sec) > kStaleTempSeconds)
+			unlink(oneTemp.path.c_str());
+	}
+
+	std::vector<StoredFile> objects = list_files(mRoot + "/objects");
+	uint64_t totalBytes = 0;
+	for(const auto &object : objects)
+	{
+		totalBytes += object.size;
+	}
+
+	size_t evictedCount = 0;
+	if(totalBytes > mLimitBytes)
+	{
+		std::sort(objects.begin(), objects.end(),
+			[](const StoredFile &a, const StoredFile &b) { return older(a.mtime, b.mtime); });
+
+		struct timespec cutoff = {0, 0};
+		for(const auto &object : objects)
+		{
+			if(totalBytes <= mLimitBytes)
+				break;
+			if(unlink(object.path.c_str()) != 0)
+				continue;
+			totalBytes -= object.size;
+			cutoff = object.mtime;
+			++evictedCount;
+		}
+
+		// A record is touched together with every object it names, so one last used no
+		// later than the newest evicted object may name an evicted object. Dropping it
+		// here saves a failed restore later; missing it would only cost that.
+		for(const auto &record : list_files(mRoot + "/records"))
+		{
+			if(!older(cutoff, record.mtime))
+				unlink(record.path.c_str());
+		}
+	}
+
+	if(mVerbose)
+	{
+		LogError("artifacts: %zu captured, %zu evicted, %llu bytes stored, store %s\n",
+			capturedCount, evictedCount, (unsigned long long)totalBytes, mRoot.c_str());
+	}
+}
@@ -0,0 +1,117 @@
+#pragma once
+// Content-addressed store of task outputs, for the incremental execution cache
+// (--cache-artifacts).
+//
+// The manifest can only say whether a task's products are still the ones it left. When
+// they are not - a deleted build directory, a fresh checkout, a branch switched back - the
+// task executes again, even though the same world_in produced exactly these bytes before.
+// This store keeps those bytes. After a task executes successfully, each output file is
+// cloned into objects/ under its content hash, and a record keyed by the task signature
+// and world_in lists what the task left. A later miss whose world_in has a record puts
+// the outputs back instead of running the action.
+//
+// Layout under <cache-dir>/artifacts:
+//   objects/<2 hex>/<30 hex>              file content, named by its 128-bit blake3 hash
+//   records/<signature>-<world_in>.json   the outputs one successful execution left
+//   tmp/                                  clones on their way into objects/ and records/
+//   .lock                                 held exclusively while trim() evicts
+//
+// Only outputs that are regular files, symlinks or absent are recorded: a task that left
+// a directory at an output gets no record and always executes. Restores are by clone
+// (copyfile falls back to a copy across volumes), never by hard link. A restored output
+// is the build's to modify, and a link would let an in-place edit of it rewrite the
+// stored object under every other record that names it.
+//
+// Capture and restore both set an object's and a record's mtime to now, and that is what
+// trim() evicts by: the least recently used objects go first until objects/ fits the size
+// limit, and every record last used no later than the newest evicted object goes with them.
+//
+// Everything here is disposable state. A record or object that is missing, unreadable or
+// does not hash to its name costs an execution, never a wrong product: a restored file is
+// re-hashed before it is renamed into place.
+//
+// capture(), restore() and can_restore() are thread-safe, and may run concurrently with
+// each other and with other processes sharing the cache directory. trim() is called once,
+// after the scheduler has drained.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+class ArtifactStore
+{
+public:
+	// cacheDir is the resolved --cache-dir; limitBytes bounds objects/ after trim().
+	// Creates nothing until something is captured.
+	ArtifactStore(const std::string &cacheDir, uint64_t limitBytes, bool verbose);
+
+	ArtifactStore(const ArtifactStore &) = delete;
+	ArtifactStore &operator=(const ArtifactStore &) = delete;
+
+	// Records what a task that has just executed successfully left at outputs, which must
+	// be its concrete declared outputs in declaration order. Returns false when nothing
+	// was recorded: an output of another type, or an I/O failure (reported under -v).
+	bool capture(const std::string &signature, uint64_t worldIn, const std::vector<std::string> &outputs);
+
+	// Puts back what capture() recorded for (signature, worldIn). Returns true only when
+	// every output was restored. Every output is staged beside its destination before the
+	// first one is replaced, so a false return has normally changed nothing; if a rename
+	// fails part way, the outputs restored so far are correct ones, and the caller
+	// executes the task, which writes them all anyway.
+	bool restore(const std::string &signature, uint64_t worldIn, const std::vector<std::string> &outputs);
+
+	// Whether restore() would find a record and every object it names. Writes nothing,
+	// for --dry-run.
+	bool can_restore(const std::string &signature, uint64_t worldIn, const std::vector<std::string> &outputs) const;
+
+	// Evicts the least recently used objects, and the records that named them, until
+	// objects/ fits the size limit. Does nothing unless this run captured something,
+	// since only a capture can grow the store.
+	void trim();
+
+	const std::string &root() const { return mRoot; }
+
+private:
+	enum class ItemType
+	{
+		Absent,
+		File,
+		Symlink
+	};
+
+	struct Item
+	{
+		std::string path;
+		ItemType type = ItemType::Absent;
+		uint32_t mode = 0;  // File: permission bits to restore
+		uint64_t size = 0;  // File
+		std::string object; // File: 32 lowercase hex digits
+		std::string target; // Symlink
+	};
+
+	std::string record_path(const std::string &signature, uint64_t worldIn) const;
+	std::string object_path(const std::string &object) const;
+	std::string temp_path(const std::string &base);
+
+	// Reads the record at path into outItems. False unless it is well formed and lists
+	// exactly outputs, in order.
+	bool read_record(const std::string &path, const std::vector<std::string> &outputs,
+	                 std::vector<Item> &outItems) const;
+	bool write_record(const std::string &path, const std::vector<Item> &items);
+
+	// Clones the regular file at item.path into objects/ and fills in its object name.
+	bool store_object(Item &item);
+
+	// The bodies of capture() and restore(), which only add the exception guard.
+	bool capture_internal(const std::string &signature, uint64_t worldIn, const std::vector<std::string> &outputs);
+	bool restore_internal(const std::string &signature, uint64_t worldIn, const std::vector<std::string> &outputs);
+
+	std::string mRoot;
+	uint64_t mLimitBytes = 0;
+	bool mVerbose = false;
+
+	std::atomic<uint64_t> mTempCounter{0};
+	std::atomic<size_t> mCapturedCount{0};
+};
@@ -0,0 +1,856 @@
+#include "BinaryManifest.h"
+
+#include "FileHashing.h" // crc32_impl
+#include "LogStream.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib> // arc4random_buf
+#include <cstring>
+
+namespace mfbin
+{
+
+// ---------------------------------------------------------------------------
+// On-disk format
+//
+//   <playlist-id>.replay-cache.bin
+//   MfHeader | count * MfEntry (sorted by signature) | string pool | MfTrailer
+//
+//   <playlist-id>.replay-cache.jrnl
+//   MfJournalHeader | batch*        where batch = MfBatchHeader | n * MfEntry | pool | MfBatchTrailer
+//
+// Native-endian magics, as in FingerprintStore: a file written on a machine of the other
+// byte order fails the magic check and is rebuilt rather than read transposed. Unlike the
+// sidecar the manifest is shareable between machines, but only between machines of one
+// byte order in this format; json and plist remain the portable choice.
+//
+// Strings are (offset, length) references into a pool, so an entry is fixed-width and the
+// table can be binary-searched in place. The table's pool is shared by all its entries and
+// deduplicated - most entries of a playlist share an action name, a key and a timestamp.
+// A batch carries its own pool, and its references are relative to it.
+// ---------------------------------------------------------------------------
+
+constexpr uint64_t kTableMagic = 0x0153464D594C5052ULL;    // "RPLYMFS\1" little-endian
+constexpr uint64_t kTrailerMagic = 0x0154464D594C5052ULL;  // "RPLYMFT\1" little-endian
+constexpr uint64_t kJournalMagic = 0x014A464D594C5052ULL;  // "RPLYMFJ\1" little-endian
+constexpr uint64_t kBatchMagic = 0x0142464D594C5052ULL;    // "RPLYMFB\1" little-endian
+constexpr uint64_t kBatchEndMagic = 0x0145464D594C5052ULL; // "RPLYMFE\1" little-endian
+constexpr uint32_t kFormatVersion = 1;
+
+constexpr uint32_t kEntryRemoved = 1; // MfEntry::flags, journal only: the signature was removed
+
+struct MfString
+{
+	uint32_t offset;
+	uint32_t length;
+};
+
+struct MfHeader
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t count;     // entries; cross-checked against the file size
+	uint64_t poolBytes; // including the padding to 8
+	// Identifies this table image to its journal, which is only read when its header
+	// names the same nonce. A table rewritten by a run that crashed before removing the
+	// old journal must not have the old journal's records laid over it.
+	uint64_t nonce;
+	MfString playlist;      // the resolved playlist path, against a playlist-id collision
+	MfString hashAlgorithm; // CacheHashAlgorithmName spelling
+	uint64_t reserved2;
+};
+
+struct MfEntry
+{
+	uint64_t signature; // the task signature as a number; the table is sorted by it
+	uint64_t worldIn;
+	uint64_t worldOut;
+	MfString action;
+	MfString key;
+	MfString timestamp;
+	uint32_t flags;
+	uint32_t reserved;
+};
+
+// crc32c for the reasons FpTrailer gives: it runs on every open, before any lookup.
+struct MfTrailer
+{
+	uint64_t magic;
+	uint32_t crc32c; // over bytes [0, fileSize - sizeof(MfTrailer))
+	uint32_t reserved;
+};
+
+struct MfJournalHeader
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t reserved;
+	uint64_t tableNonce; // the MfHeader::nonce of the table this journal extends
+	uint64_t reserved2;
+};
+
+struct MfBatchHeader
+{
+	uint64_t magic;
+	uint32_t count;     // entries that follow
+	uint32_t poolBytes; // pool bytes after them, including the padding to 8
+};
+
+struct MfBatchTrailer
+{
+	uint64_t magic;
+	uint32_t crc32c; // over [batch header, end of this batch's pool)
+	uint32_t reserved;
+};
+
+// The format is on disk the moment this ships, so pin it at compile time.
+static_assert(sizeof(MfString) == 8, "MfString must stay 8 bytes");
+static_assert(sizeof(MfHeader) == 64, "MfHeader must stay 64 bytes");
+static_assert(sizeof(MfEntry) == 56, "MfEntry must stay 56 bytes");
+static_assert(alignof(MfEntry) == 8, "MfEntry fields must stay naturally aligned");
+static_assert((sizeof(MfHeader) % alignof(MfEntry)) == 0, "entries must start aligned");
+static_assert(sizeof(MfTrailer) == 16, "MfTrailer must stay 16 bytes");
+static_assert(sizeof(MfJournalHeader) == 32, "MfJournalHeader must stay 32 bytes");
+static_assert(sizeof(MfBatchHeader) == 16, "MfBatchHeader must stay 16 bytes");
+static_assert(sizeof(MfBatchTrailer) == 16, "MfBatchTrailer must stay 16 bytes");
+
+// ---------------------------------------------------------------------------
+// Tuning
+// ---------------------------------------------------------------------------
+
+// The journal takes records until it holds this many, or a quarter of the table's entry
+// count if that is more; the run after that rewrites the table. Every lookup of a journaled
+// signature is a hash-map probe instead of a binary search, and every open re-reads the
+// journal, so it stays small next to the table it defers rewriting.
+constexpr uint64_t kMinJournalRecords = 64;
+constexpr uint64_t kJournalTableShare = 4;
+
+// Bounds for trusting counts read from a file before its checksum has been verified.
+constexpr uint64_t kMaxBatchEntries = 1ULL << 24;
+constexpr uint64_t kMaxJournalBytes = 64ULL << 20;
+constexpr uint64_t kMaxPoolBytes = 0xFFFFFFFFULL; // MfString offsets are 32-bit
+
+// ---------------------------------------------------------------------------
+// Helpers
+// ---------------------------------------------------------------------------
+
+// Closes a descriptor on every exit path, including a throw out of an allocating read.
+struct FdGuard
+{
+	int fd;
+	~FdGuard()
+	{
+		if(fd >= 0)
+			close(fd);
+	}
+};
+
+inline uint64_t padded_to_8(uint64_t bytes)
+{
+	return (bytes + 7) & ~(uint64_t)7;
+}
+
+// Task signatures are hex64 strings. Only the exact lowercase spelling hex64 produces is
+// accepted, so that the number converts back to the same string for collect_key.
+bool signature_from_hex(const std::string &text, uint64_t &outValue)
+{
+	if(text.size() != 16)
+		return false;
+
+	uint64_t result = 0;
+	for(char oneChar : text)
+	{
+		unsigned digit;
+		if((oneChar >= '0') && (oneChar <= '9'))
+			digit = (unsigned)(oneChar - '0');
+		else if((oneChar >= 'a') && (oneChar <= 'f'))
+			digit = (unsigned)(oneChar - 'a') + 10;
+		else
+			return false;
+		result = (result << 4) | digit;
+	}
+	outValue = result;
+	return true;
+}
+
+std::string signature_to_hex(uint64_t value)
+{
+	char buffer[17];
+	snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long)value);
+	return std::string(buffer);
+}
+
+// A string out of a pool of poolBytes, or false when the reference does not lie inside it.
+bool pool_string(const char *pool, uint64_t poolBytes, MfString ref, std::string &outValue)
+{
+	if(((uint64_t)ref.offset + (uint64_t)ref.length) > poolBytes)
+		return false;
+	outValue.assign(pool + ref.offset, ref.length);
+	return true;
+}
+
+// Whether the pool string ref equals value, without copying it out.
+bool pool_string_equals(const char *pool, uint64_t poolBytes, MfString ref, const std::string &value)
+{
+	if(((uint64_t)ref.offset + (uint64_t)ref.length) > poolBytes)
+		return false;
+	return (ref.length == value.size()) && (memcmp(pool + ref.offset, value.data(), ref.length) == 0);
+}
+
+bool entry_from_pool(const MfEntry &record, const char *pool, uint64_t poolBytes, StoredCacheEntry &outEntry)
+{
+	outEntry.worldIn = record.worldIn;
+	outEntry.worldOut = record.worldOut;
+	return pool_string(pool, poolBytes, record.action, outEntry.actionName) &&
+	       pool_string(pool, poolBytes, record.key, outEntry.playlistKey) &&
+	       pool_string(pool, poolBytes, record.timestamp, outEntry.timestamp);
+}
+
+bool same_entry(const StoredCacheEntry &a, const StoredCacheEntry &b)
+{
+	return (a.worldIn == b.worldIn) && (a.worldOut == b.worldOut) &&
+	       (a.actionName == b.actionName) && (a.playlistKey == b.playlistKey) &&
+	       (a.timestamp == b.timestamp);
+}
+
+// Builds a string pool. Deduplicates, because a table holds the same action names, keys
+// and timestamps over and over.
+struct PoolBuilder
+{
+	std::string bytes;
+	std::unordered_map<std::string, MfString> known;
+
+	// False when the pool would outgrow what an MfString can address.
+	bool add(const std::string &value, MfString &outRef)
+	{
+		auto found = known.find(value);
+		if(found != known.end())
+		{
+			outRef = found->second;
+			return true;
+		}
+		if(((uint64_t)bytes.size() + (uint64_t)value.size() + 7) > kMaxPoolBytes)
+			return false;
+		outRef.offset = (uint32_t)bytes.size();
+		outRef.length = (uint32_t)value.size();
+		bytes.append(value);
+		known.emplace(value, outRef);
+		return true;
+	}
+
+	bool add_entry(uint64_t signature, const StoredCacheEntry &entry, uint32_t flags, MfEntry &outRecord)
+	{
+		memset(&outRecord, 0, sizeof(outRecord));
+		outRecord.signature = signature;
+		outRecord.worldIn = entry.worldIn;
+		outRecord.worldOut = entry.worldOut;
+		outRecord.flags = flags;
+		return add(entry.actionName, outRecord.action) &&
+		       add(entry.playlistKey, outRecord.key) &&
+		       add(entry.timestamp, outRecord.timestamp);
+	}
+};
+
+// The whole buffer, continuing after a short write. Only for descriptors nobody else
+// writes to: the temp files here, never the journal.
+bool write_all(int fd, const uint8_t *data, size_t size)
+{
+	while(size > 0)
+	{
+		ssize_t written = write(fd, data, size);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			return false;
+		}
+		data += written;
+		size -= (size_t)written;
+	}
+	return true;
+}
+
+// Writes image to a fresh temp file beside path and renames it over path.
+bool publish_file(const std::string &path, const std::vector<uint8_t> &image)
+{
+	// O_EXCL|O_NOFOLLOW so a name planted by another user in a shared cache directory
+	// cannot redirect the write; the unlink first clears a stale temp left by a crashed
+	// run that happened to have this pid.
+	std::string tempPath = path + "." + std::to_string((long)getpid()) + ".tmp";
+	unlink(tempPath.c_str());
+	int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if(fd < 0)
+	{
+		LogError("error: cannot create temporary cache manifest: %s\n", tempPath.c_str());
+		return false;
+	}
+
+	bool written = write_all(fd, image.data(), image.size());
+	// close() is where some network filesystems first report a failed write.
+	if((close(fd) != 0) || !written)
+	{
+		LogError("error: cannot write cache manifest: %s\n", tempPath.c_str());
+		unlink(tempPath.c_str());
+		return false;
+	}
+
+	if(rename(tempPath.c_str(), path.c_str()) != 0)
+	{
+		LogError("error: cannot replace cache manifest: %s\n", path.c_str());
+		unlink(tempPath.c_str());
+		return false;
+	}
+	return true;
+}
+
+} // namespace mfbin
+
+using namespace mfbin;
+
+// ============================================================================
+// Reading
+// ============================================================================
+
+BinaryManifest::BinaryManifest(std::string manifestPath, std::string playlistPath, std::string hashAlgorithm)
+	: mManifestPath(std::move(manifestPath))
+	, mPlaylistPath(std::move(playlistPath))
+	, mHashAlgorithm(std::move(hashAlgorithm))
+{
+	// <id>.replay-cache.bin -> <id>.replay-cache.jrnl
+	size_t dot = mManifestPath.find_last_of('.');
+	size_t slash = mManifestPath.find_last_of('/');
+	bool hasExtension = (dot != std::string::npos) && ((slash == std::string::npos) || (dot > slash));
+	mJournalPath = (hasExtension ? mManifestPath.substr(0, dot) : mManifestPath) + ".jrnl";
+}
+
+BinaryManifest::~BinaryManifest()
+{
+	if(mBase != nullptr)
+		munmap(mBase, mMapSize);
+}
+
+std::unique_ptr<BinaryManifest>
+BinaryManifest::Open(const std::string &manifestPath, const std::string &playlistPath,
+                     const std::string &hashAlgorithm)
+{
+	std::unique_ptr<BinaryManifest> manifest(new BinaryManifest(manifestPath, playlistPath, hashAlgorithm));
+	manifest->map_table();
+	manifest->read_journal();
+
+	size_t live = manifest->mTableCount;
+	for(const auto &pair : manifest->mOverlay)
+	{
+		bool inTable = (manifest->find_in_table(pair.first) != nullptr);
+		if(pair.second.removed && inTable)
+			--live;
+		else if(!pair.second.removed && !inTable)
+			++live;
+	}
+	manifest->mLiveCount = live;
+	return manifest;
+}
+
+// Any failure leaves the table unmapped, which reads as an empty manifest. Nothing is
+// reported: the manifest is disposable, and the json and plist readers are silent too.
+//
+// Everything is derived from the one descriptor, and the entry count used for bounds is
+// cross-checked against the file size before anything is read through it. The mapping
+// is private and read-only, and the table is only ever replaced by rename, so a
+// concurrent publisher never changes what is mapped here. Truncating the file in place
+// would (SIGBUS); only someone with write access to the cache directory can, which is
+// the same exposure the sidecar index documents.
+void
+BinaryManifest::map_table()
+{
+	// O_NONBLOCK: a FIFO planted at this name would otherwise block the open forever.
+	int fd = open(mManifestPath.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK);
+	if(fd < 0)
+		return;
+	FdGuard guard{fd}; // the mapping outlives the descriptor
+
+	struct stat st;
+	if((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size < 0))
+		return;
+
+	const uint64_t fileSize = (uint64_t)st.st_size;
+	const uint64_t fixedBytes = sizeof(MfHeader) + sizeof(MfTrailer);
+	if(fileSize < fixedBytes)
+		return;
+
+	void *base = mmap(nullptr, (size_t)fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	if(base == MAP_FAILED)
+		return;
+
+	struct MapGuard
+	{
+		void *base;
+		size_t size;
+		~MapGuard()
+		{
+			if(base != nullptr)
+				munmap(base, size);
+		}
+	} mapGuard{base, (size_t)fileSize};
+
+	MfHeader header;
+	memcpy(&header, base, sizeof(header));
+	if((header.magic != kTableMagic) || (header.version != kFormatVersion))
+		return;
+
+	// Both sizes are bounded by the file before they are added, so the sum cannot wrap.
+	uint64_t bodyBytes = fileSize - fixedBytes;
+	if((header.count > (bodyBytes / sizeof(MfEntry))) || (header.poolBytes > bodyBytes))
+		return;
+	if(((header.count * sizeof(MfEntry)) + header.poolBytes) != bodyBytes)
+		return;
+
+	uint64_t checkedBytes = fileSize - sizeof(MfTrailer);
+	MfTrailer trailer;
+	memcpy(&trailer, (const uint8_t *)base + checkedBytes, sizeof(trailer));
+	if(trailer.magic != kTrailerMagic)
+		return;
+	if(trailer.crc32c != crc32_impl(0, (const char *)base, (size_t)checkedBytes))
+		return;
+
+	const MfEntry *entries = (const MfEntry *)((const uint8_t *)base + sizeof(MfHeader));
+	const char *pool = (const char *)(entries + header.count);
+
+	// A playlist-id collision, or a change of --cache-hash: both mean start over.
+	std::string text;
+	if(!pool_string(pool, header.poolBytes, header.playlist, text) || (text != mPlaylistPath))
+		return;
+	if(!pool_string(pool, header.poolBytes, header.hashAlgorithm, text) || (text != mHashAlgorithm))
+		return;
+
+	mapGuard.base = nullptr; // kept
+	mBase = base;
+	mMapSize = (size_t)fileSize;
+	mEntries = entries;
+	mTableCount = (size_t)header.count;
+	mPool = pool;
+	mPoolBytes = header.poolBytes;
+	mNonce = header.nonce;
+}
+
+void
+BinaryManifest::read_journal()
+{
+	mOverlay.clear();
+	mJournalRecords = 0;
+	mJournalBytes = 0;
+	mJournalClean = true;
+
+	int fd = open(mJournalPath.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK);
+	if(fd < 0)
+	{
+		// ENOENT is the normal case: nothing was appended since the last table rewrite.
+		// Anything else at that name has to be replaced before it can be appended to.
+		if(errno != ENOENT)
+			mJournalClean = false;
+		return;
+	}
+	FdGuard guard{fd};
+
+	struct stat st;
+	if((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || (st.st_size < 0) ||
+	   ((uint64_t)st.st_size > kMaxJournalBytes))
+	{
+		mJournalClean = false;
+		return;
+	}
+
+	// read() rather than mmap, as for the sidecar journal: this is the one file written
+	// in place, and a heap copy cannot change under us while it is being validated.
+	std::vector<uint8_t> raw((size_t)st.st_size);
+	size_t filled = 0;
+	while(filled < raw.size())
+	{
+		ssize_t count = read(fd, raw.data() + filled, raw.size() - filled);
+		if(count < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			mJournalClean = false;
+			return;
+		}
+		if(count == 0)
+			break;
+		filled += (size_t)count;
+	}
+	raw.resize(filled);
+
+	// The journal is created with its header in place (see append_batch), so one without
+	// a complete header was not written by us. A journal naming another table image was
+	// left by a rewrite that crashed before removing it: true records, but against a
+	// table that no longer exists, so none of them is read.
+	MfJournalHeader header;
+	if(raw.size() < sizeof(header))
+	{
+		mJournalClean = false;
+		return;
+	}
+	memcpy(&header, raw.data(), sizeof(header));
+	if((header.magic != kJournalMagic) || (header.version != kFormatVersion) ||
+	   (mBase == nullptr) || (header.tableNonce != mNonce))
+	{
+		mJournalClean = false;
+		return;
+	}
+
+	size_t offset = sizeof(MfJournalHeader);
+	while(offset < raw.size())
+	{
+		// There is one appender at a time, so the first batch that does not verify is the
+		// end of the journal: torn by a crash, or still being written by a publisher that
+		// holds the lock while this reader does not.
+		size_t remaining = raw.size() - offset;
+		if(remaining < (sizeof(MfBatchHeader) + sizeof(MfBatchTrailer)))
+			break;
+
+		MfBatchHeader batch;
+		memcpy(&batch, raw.data() + offset, sizeof(batch));
+		if((batch.magic != kBatchMagic) || (batch.count == 0) || (batch.count > kMaxBatchEntries))
+			break;
+
+		uint64_t bodyBytes = sizeof(MfBatchHeader) + ((uint64_t)batch.count * sizeof(MfEntry)) + batch.poolBytes;
+		if((bodyBytes + sizeof(MfBatchTrailer)) > remaining)
+			break;
+
+		MfBatchTrailer trailer;
+		memcpy(&trailer, raw.data() + offset + bodyBytes, sizeof(trailer));
+		if((trailer.magic != kBatchEndMagic) ||
+		   (trailer.crc32c != crc32_impl(0, (const char *)(raw.data() + offset), (size_t)bodyBytes)))
+			break;
+
+		// Copied out rather than cast in place: the vector's storage is not promised to be
+		// aligned for MfEntry.
+		const uint8_t *records = raw.data() + offset + sizeof(MfBatchHeader);
+		const char *pool = (const char *)(records + ((size_t)batch.count * sizeof(MfEntry)));
+		std::vector<std::pair<uint64_t, JournalRecord>> parsed(batch.count);
+		bool wellFormed = true;
+		for(uint32_t i = 0; (i < batch.count) && wellFormed; ++i)
+		{
+			MfEntry record;
+			memcpy(&record, records + ((size_t)i * sizeof(MfEntry)), sizeof(record));
+			parsed[i].first = record.signature;
+			parsed[i].second.removed = ((record.flags & kEntryRemoved) != 0);
+			if(!parsed[i].second.removed)
+				wellFormed = entry_from_pool(record, pool, batch.poolBytes, parsed[i].second.entry);
+		}
+		if(!wellFormed)
+			break;
+
+		// In order, so a later record for a signature replaces an earlier one.
+		for(auto &pair : parsed)
+		{
+			mOverlay[pair.first] = std::move(pair.second);
+		}
+		mJournalRecords += batch.count;
+		offset += (size_t)(bodyBytes + sizeof(MfBatchTrailer));
+	}
+
+	mJournalBytes = offset;
+	if(offset != raw.size())
+		mJournalClean = false;
+}
+
+const MfEntry *
+BinaryManifest::find_in_table(uint64_t signature) const
+{
+	const MfEntry *end = mEntries + mTableCount;
+	const MfEntry *found = std::lower_bound(mEntries, end, signature,
+		[](const MfEntry &record, uint64_t value) { return record.signature < value; });
+	if((found == end) || (found->signature != signature))
+		return nullptr;
+	return found;
+}
+
+std::optional<StoredCacheEntry>
+BinaryManifest::table_entry(size_t index) const
+{
+	StoredCacheEntry entry;
+	if(!entry_from_pool(mEntries[index], mPool, mPoolBytes, entry))
+		return std::nullopt;
+	return entry;
+}
+
+std::optional<StoredCacheEntry>
+BinaryManifest::find(const std::string &signature) const
+{
+	uint64_t key = 0;
+	if(!signature_from_hex(signature, key))
+		return std::nullopt;
+
+	auto overlaid = mOverlay.find(key);
+	if(overlaid != mOverlay.end())
+	{
+		if(overlaid->second.removed)
+			return std::nullopt;
+		return overlaid->second.entry;
+	}
+
+	const MfEntry *record = find_in_table(key);
+	if(record == nullptr)
+		return std::nullopt;
+	return table_entry((size_t)(record - mEntries));
+}
+
+template <typename Visitor>
+void
+BinaryManifest::for_each_live(Visitor &&visit) const
+{
+	for(size_t i = 0; i < mTableCount; ++i)
+	{
+		uint64_t signature = mEntries[i].signature;
+		if(mOverlay.count(signature) != 0)
+			continue;
+		std::optional<StoredCacheEntry> entry = table_entry(i);
+		if(entry.has_value())
+			visit(signature, *entry);
+	}
+	for(const auto &pair : mOverlay)
+	{
+		if(!pair.second.removed)
+			visit(pair.first, pair.second.entry);
+	}
+}
+
+void
+BinaryManifest::collect_key(const std::string &playlistKey, std::vector<std::string> &outSignatures) const
+{
+	// The live entries of for_each_live, with the table's keys compared in the pool: no
+	// entry is copied out, so this stays a scan of the mapping even for a large table.
+	for(size_t i = 0; i < mTableCount; ++i)
+	{
+		uint64_t signature = mEntries[i].signature;
+		if((mOverlay.count(signature) == 0) && pool_string_equals(mPool, mPoolBytes, mEntries[i].key, playlistKey))
+			outSignatures.push_back(signature_to_hex(signature));
+	}
+	for(const auto &pair : mOverlay)
+	{
+		if(!pair.second.removed && (pair.second.entry.playlistKey == playlistKey))
+			outSignatures.push_back(signature_to_hex(pair.first));
+	}
+}
+
+// ============================================================================
+// Publishing
+// ============================================================================
+
+bool
+BinaryManifest::publish(const std::unordered_map<std::string, StoredCacheEntry> &updatedEntries,
+                        const std::unordered_set<std::string> &removedSignatures)
+{
+	// Only what differs from what is on disk. Hits never reach updatedEntries, and an
+	// executed task always carries a new timestamp, so this is one record per task that
+	// ran plus one per entry removed.
+	std::vector<std::pair<uint64_t, JournalRecord>> delta;
+	for(const auto &signature : removedSignatures)
+	{
+		uint64_t key = 0;
+		if(signature_from_hex(signature, key) && find(signature).has_value())
+		{
+			JournalRecord record;
+			record.removed = true;
+			delta.emplace_back(key, std::move(record));
+		}
+	}
+	for(const auto &pair : updatedEntries)
+	{
+		uint64_t key = 0;
+		if(!signature_from_hex(pair.first, key))
+			continue;
+		std::optional<StoredCacheEntry> current = find(pair.first);
+		if(current.has_value() && same_entry(*current, pair.second))
+			continue;
+		JournalRecord record;
+		record.entry = pair.second;
+		delta.emplace_back(key, std::move(record));
+	}
+
+	if(delta.empty())
+		return true;
+
+	// Sorted so the batch is the same bytes for the same changes; stable so a signature
+	// both removed and updated keeps its update last, as the json and plist merge does.
+	std::stable_sort(delta.begin(), delta.end(),
+		[](const auto &a, const auto &b) { return a.first < b.first; });
+
+	uint64_t budget = std::max(kMinJournalRecords, (uint64_t)mTableCount / kJournalTableShare);
+	bool fits = (mBase != nullptr) && mJournalClean &&
+	            ((mJournalRecords + (uint64_t)delta.size()) <= budget);
+	if(fits && append_batch(delta))
+		return true;
+	return rewrite_table(delta);
+}
+
+// Returns false when nothing was appended; the caller then rewrites the table, which
+// holds everything the journal would have.
+bool
+BinaryManifest::append_batch(const std::vector<std::pair<uint64_t, JournalRecord>> &delta)
+{
+	if(delta.size() > kMaxBatchEntries)
+		return false;
+
+	PoolBuilder pool;
+	std::vector<MfEntry> records(delta.size());
+	for(size_t i = 0; i < delta.size(); ++i)
+	{
+		const JournalRecord &record = delta[i].second;
+		if(!pool.add_entry(delta[i].first, record.entry, record.removed ? kEntryRemoved : 0, records[i]))
+			return false;
+	}
+	uint64_t poolBytes = padded_to_8(pool.bytes.size());
+
+	size_t bodyBytes = sizeof(MfBatchHeader) + (records.size() * sizeof(MfEntry)) + (size_t)poolBytes;
+	std::vector<uint8_t> image(bodyBytes + sizeof(MfBatchTrailer), 0);
+
+	MfBatchHeader batch;
+	memset(&batch, 0, sizeof(batch));
+	batch.magic = kBatchMagic;
+	batch.count = (uint32_t)records.size();
+	batch.poolBytes = (uint32_t)poolBytes;
+	memcpy(image.data(), &batch, sizeof(batch));
+	memcpy(image.data() + sizeof(batch), records.data(), records.size() * sizeof(MfEntry));
+	memcpy(image.data() + sizeof(batch) + (records.size() * sizeof(MfEntry)), pool.bytes.data(), pool.bytes.size());
+
+	MfBatchTrailer trailer;
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.magic = kBatchEndMagic;
+	trailer.crc32c = crc32_impl(0, (const char *)image.data(), bodyBytes);
+	memcpy(image.data() + bodyBytes, &trailer, sizeof(trailer));
+
+	// A journal is created complete with its header, under a temp name, so a reader
+	// never sees one without it. O_NOFOLLOW and O_NONBLOCK against a planted symlink or
+	// FIFO in a shared cache directory.
+	const int appendFlags = O_WRONLY | O_APPEND | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK;
+	int fd = open(mJournalPath.c_str(), appendFlags);
+	if((fd < 0) && (errno == ENOENT))
+	{
+		MfJournalHeader header;
+		memset(&header, 0, sizeof(header));
+		header.magic = kJournalMagic;
+		header.version = kFormatVersion;
+		header.tableNonce = mNonce;
+		std::vector<uint8_t> headerImage(sizeof(header));
+		memcpy(headerImage.data(), &header, sizeof(header));
+		if(!publish_file(mJournalPath, headerImage))
+			return false;
+		mJournalBytes = sizeof(header);
+		fd = open(mJournalPath.c_str(), appendFlags);
+	}
+	if(fd < 0)
+		return false;
+	FdGuard guard{fd};
+
+	// Under the exclusive lock nothing else appends, so the file must end exactly where
+	// Open() found its last valid batch. Anything else is not ours to append behind.
+	struct stat st;
+	if((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode) || ((uint64_t)st.st_size != mJournalBytes))
+		return false;
+
+	ssize_t written;
+	do
+	{
+		written = write(fd, image.data(), image.size());
+	}
+	while((written < 0) && (errno == EINTR));
+
+	if(written != (ssize_t)image.size())
+	{
+		// Roll back to where we found it; if even that fails, remove the journal and let
+		// the rewrite that follows publish everything in the table.
+		if((written > 0) && (ftruncate(fd, (off_t)mJournalBytes) != 0))
+			unlink(mJournalPath.c_str());
+		return false;
+	}
+	mJournalBytes += image.size();
+	return true;
+}
+
+bool
+BinaryManifest::rewrite_table(const std::vector<std::pair<uint64_t, JournalRecord>> &delta)
+{
+	std::unordered_map<uint64_t, const JournalRecord *> changes;
+	changes.reserve(delta.size());
+	for(const auto &pair : delta)
+	{
+		changes[pair.first] = &pair.second; // later wins, as in the journal
+	}
+
+	// By value: for_each_live hands table entries out as temporaries.
+	std::vector<std::pair<uint64_t, StoredCacheEntry>> entries;
+	entries.reserve(mLiveCount + delta.size());
+	for_each_live([&](uint64_t signature, const StoredCacheEntry &entry) {
+		if(changes.count(signature) == 0)
+			entries.emplace_back(signature, entry);
+	});
+	for(const auto &pair : changes)
+	{
+		if(!pair.second->removed)
+			entries.emplace_back(pair.first, pair.second->entry);
+	}
+	std::sort(entries.begin(), entries.end(),
+		[](const auto &a, const auto &b) { return a.first < b.first; });
+
+	PoolBuilder pool;
+	MfHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = kTableMagic;
+	header.version = kFormatVersion;
+	header.count = entries.size();
+	if(!pool.add(mPlaylistPath, header.playlist) || !pool.add(mHashAlgorithm, header.hashAlgorithm))
+		return false;
+
+	std::vector<MfEntry> records(entries.size());
+	for(size_t i = 0; i < entries.size(); ++i)
+	{
+		if(!pool.add_entry(entries[i].first, entries[i].second, 0, records[i]))
+		{
+			LogError("error: cache manifest is too large for the binary format: %s\n", mManifestPath.c_str());
+			return false;
+		}
+	}
+	header.poolBytes = padded_to_8(pool.bytes.size());
+
+	// A fresh nonce per image, never zero, so no journal written against an earlier image
+	// can be read against this one. arc4random needs no seeding and cannot fail.
+	do
+	{
+		arc4random_buf(&header.nonce, sizeof(header.nonce));
+	}
+	while(header.nonce == 0);
+
+	size_t entryBytes = records.size() * sizeof(MfEntry);
+	size_t checkedBytes = sizeof(MfHeader) + entryBytes + (size_t)header.poolBytes;
+	std::vector<uint8_t> image(checkedBytes + sizeof(MfTrailer), 0);
+	memcpy(image.data(), &header, sizeof(header));
+	if(entryBytes > 0)
+		memcpy(image.data() + sizeof(MfHeader), records.data(), entryBytes);
+	memcpy(image.data() + sizeof(MfHeader) + entryBytes, pool.bytes.data(), pool.bytes.size());
+
+	MfTrailer trailer;
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.magic = kTrailerMagic;
+	trailer.crc32c = crc32_impl(0, (const char *)image.data(), checkedBytes);
+	memcpy(image.data() + checkedBytes, &trailer, sizeof(trailer));
+
+	if(!publish_file(mManifestPath, image))
+		return false;
+
+	// The table now holds everything the journal did. A crash before this unlink leaves
+	// a journal naming the previous nonce, which no reader will apply.
+	unlink(mJournalPath.c_str());
+	mJournalBytes = 0;
+	mJournalRecords = 0;
+	mJournalClean = true;
+	return true;
+}
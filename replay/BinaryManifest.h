@@ -0,0 +1,122 @@
+#pragma once
+// The binary form of the cache manifest (--cache-format binary).
+//
+// The JSON and plist manifests are parsed whole before the first task can start, and
+// rewritten whole by every run that changes anything: at a hundred thousand tasks that is
+// tens of milliseconds of parsing and allocation per run, plus a full rewrite to record
+// that five of them executed. This format removes both.
+//
+// The table is a sorted array of fixed-width entries keyed by the 64-bit task signature,
+// followed by one pool holding every string, and is mapped read-only: opening it is a
+// checksum pass, and a lookup is a binary search with no parsing and no allocation beyond
+// copying out the entry it finds. Changes go to an append-only journal beside it, in the
+// way FingerprintStore keeps its own: a run that changed five tasks appends one batch of
+// five records. The first run whose changes no longer fit the journal rewrites the table
+// with the journal folded in, and removes the journal.
+//
+// Both files are disposable state under the manifest's policy. A table that is absent,
+// short, foreign, of another version, hash algorithm or playlist, or fails its checksum
+// reads as empty, and its journal with it. A journal batch that is torn or fails its
+// checksum ends the journal there.
+//
+// Writers hold the manifest lock (CacheSession::write_manifest) exclusively, so there is
+// only ever one appender. Readers take no lock: the table is replaced by rename, and a
+// batch still being appended fails its checksum and is simply not read yet.
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "TaskCacheTypes.h" // StoredCacheEntry
+
+namespace mfbin
+{
+	struct MfEntry; // on-disk entry; the layout lives in BinaryManifest.cpp
+}
+
+class BinaryManifest
+{
+public:
+	// Maps and validates the table at manifestPath and reads its journal. Never fails
+	// because of the files: anything unusable reads as an empty manifest, and the next
+	// publish() rewrites it. Throws only bad_alloc.
+	static std::unique_ptr<BinaryManifest> Open(const std::string &manifestPath,
+	                                            const std::string &playlistPath,
+	                                            const std::string &hashAlgorithm);
+
+	~BinaryManifest();
+
+	BinaryManifest(const BinaryManifest &) = delete;
+	BinaryManifest &operator=(const BinaryManifest &) = delete;
+
+	// The entry stored for signature, journal first because it is newer. Thread-safe:
+	// neither the mapping nor the journal overlay changes after Open().
+	std::optional<StoredCacheEntry> find(const std::string &signature) const;
+
+	// Live entries: the table's, less those the journal removed, plus those it added.
+	size_t entry_count() const { return mLiveCount; }
+
+	// Appends the signature of every live entry recorded for playlistKey to outSignatures.
+	void collect_key(const std::string &playlistKey, std::vector<std::string> &outSignatures) const;
+
+	// Publishes removedSignatures, then updatedEntries, against what was read by Open().
+	// Only entries that actually differ are written, so a run that changed nothing writes
+	// nothing. The caller must hold the manifest lock exclusively, and must have opened
+	// this object while holding it. Returns false when something needed publishing and
+	// was not published; the reason has been reported.
+	bool publish(const std::unordered_map<std::string, StoredCacheEntry> &updatedEntries,
+	             const std::unordered_set<std::string> &removedSignatures);
+
+private:
+	struct JournalRecord
+	{
+		bool removed = false;
+		StoredCacheEntry entry;
+	};
+
+	BinaryManifest(std::string manifestPath, std::string playlistPath, std::string hashAlgorithm);
+
+	void map_table();
+	void read_journal();
+
+	// The entry at index in the mapped table, or nullopt when its strings lie outside
+	// the pool.
+	std::optional<StoredCacheEntry> table_entry(size_t index) const;
+	const mfbin::MfEntry *find_in_table(uint64_t signature) const;
+
+	// Calls visit(signature, entry) for every live entry, in no particular order.
+	template <typename Visitor>
+	void for_each_live(Visitor &&visit) const;
+
+	bool append_batch(const std::vector<std::pair<uint64_t, JournalRecord>> &delta);
+	bool rewrite_table(const std::vector<std::pair<uint64_t, JournalRecord>> &delta);
+
+	std::string mManifestPath;
+	std::string mJournalPath;
+	std::string mPlaylistPath;
+	std::string mHashAlgorithm;
+
+	// The mapped table; mBase is null when there is no usable table.
+	void *mBase = nullptr;
+	size_t mMapSize = 0;
+	const mfbin::MfEntry *mEntries = nullptr;
+	size_t mTableCount = 0;
+	const char *mPool = nullptr;
+	uint64_t mPoolBytes = 0;
+	uint64_t mNonce = 0;
+
+	// The journal, as read: the latest record per signature, and what it takes to
+	// append to it. mJournalClean is false when the file holds anything past its last
+	// valid batch, or belongs to another table image, and cannot just be appended to.
+	std::unordered_map<uint64_t, JournalRecord> mOverlay;
+	uint64_t mJournalRecords = 0;
+	uint64_t mJournalBytes = 0;
+	bool mJournalClean = true;
+
+	size_t mLiveCount = 0;
+};
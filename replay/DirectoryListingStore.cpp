@@ -0,0 +1,807 @@
+#include "DirectoryListingStore.h"
+
+#include "BulkDirectoryReader.h"
+#include "FileHashing.h" // crc32_impl
+#include "LogStream.h"
+#include "PosixFileOps.h" // posix_mkdir_p
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <uuid/uuid.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace dlstore
+{
+
+// ---------------------------------------------------------------------------
+// On-disk format
+//
+//   listings-<hostuuid32hex>.bin
+//   DlHeader | count * DlRecord | pool | DlTrailer
+//
+// Records are sorted by path, so a lookup is a binary search over the loaded file and
+// nothing is indexed at open. Each record names a stretch of the pool holding its path,
+// then its entries, each one as a type byte, the name and a NUL. Native-endian magics,
+// as in the FingerprintStore: a file from a machine of the other byte order is rebuilt.
+// ---------------------------------------------------------------------------
+
+constexpr uint64_t kHeaderMagic = 0x01534C44594C5052ULL;  // "RPLYDLS\1" little-endian
+constexpr uint64_t kTrailerMagic = 0x01544C44594C5052ULL; // "RPLYDLT\1" little-endian
+constexpr uint32_t kFormatVersion = 1;
+
+struct DlHeader
+{
+	uint64_t magic;
+	uint32_t version;
+	uint32_t count;
+	uint64_t poolBytes;
+	uint64_t runCounter; // bumped on each save that writes; drives eviction
+	uint8_t hostUuid[16];
+};
+
+struct DlRecord
+{
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtimeNs;
+	int64_t ctimeNs;
+	uint64_t poolOffset;    // of the path; the entries follow it
+	uint32_t pathLength;
+	uint32_t entriesLength; // bytes
+	uint32_t entryCount;
+	uint32_t epoch;         // runCounter of the last save that saw this directory used
+};
+
+struct DlTrailer
+{
+	uint64_t magic;
+	uint32_t crc32c; // over bytes [0, fileSize - sizeof(DlTrailer))
+	uint32_t reserved;
+};
+
+static_assert(sizeof(DlHeader) == 48, "DlHeader must stay 48 bytes");
+static_assert(sizeof(DlRecord) == 56, "DlRecord must stay 56 bytes");
+static_assert(sizeof(DlTrailer) == 16, "DlTrailer must stay 16 bytes");
+static_assert((sizeof(DlHeader) % alignof(DlRecord)) == 0, "records must start aligned");
+
+// ---------------------------------------------------------------------------
+// Tuning
+// ---------------------------------------------------------------------------
+
+// Power of two: the shard is picked with a mask.
+constexpr size_t kShardCount = 64;
+
+// A listing is stored only when its directory last changed at least this long before it
+// was read. HFS+ and FAT keep whole seconds, so an entry created later in the same second
+// as the read leaves mtime where it was; two seconds clears that and the odd clock step.
+constexpr int64_t kRacyNs = 2000000000LL;
+
+// Same policy as the FingerprintStore: the run counter only moves when the store is
+// written, so a steady state that reuses every listing ages nothing.
+constexpr uint32_t kMaxIdleRuns = 32;
+constexpr uint64_t kMaxRunCounter = 0xFFFFFFFFULL;
+
+// Bounds on what a corrupt file can ask us to read or allocate before its checksum is
+// checked, and on what a save will write. The record count is 32 bits on disk.
+constexpr uint64_t kMaxFileBytes = 1ULL << 30;
+constexpr uint64_t kMaxRecords = 1ULL << 22;
+
+struct Image
+{
+	std::vector<uint8_t> bytes;
+	const DlRecord *records = nullptr;
+	uint32_t count = 0;
+	const uint8_t *pool = nullptr;
+	uint64_t poolBytes = 0;
+	uint64_t runCounter = 0;
+
+	std::string_view path_of(const DlRecord &record) const
+	{
+		return std::string_view((const char *)(pool + record.poolOffset), record.pathLength);
+	}
+
+	std::string_view entries_of(const DlRecord &record) const
+	{
+		return std::string_view((const char *)(pool + record.poolOffset + record.pathLength),
+			record.entriesLength);
+	}
+};
+
+void report(bool verbose, const char *what, const std::string &path)
+{
+	if(verbose)
+		LogError("listings: %s: %s\n", what, path.c_str());
+}
+
+int64_t timespec_ns(const struct timespec &ts)
+{
+	return ((int64_t)ts.tv_sec * 1000000000LL) + (int64_t)ts.tv_nsec;
+}
+
+// Reads and fully validates the store at path into outImage. Any failure leaves it empty,
+// which every caller treats as "no store"; the file itself is left alone.
+void load_image(const std::string &path, const uint8_t *wantHost, bool verbose, Image &outImage)
+{
+	outImage = Image();
+
+	// O_NONBLOCK so that a FIFO planted under this name in a shared cache directory
+	// fails the S_ISREG check below instead of hanging the open.
+	int fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC | O_NONBLOCK);
+	if(fd < 0)
+	{
+		if(errno != ENOENT) // the normal cold start
+			report(verbose, "cannot open store", path);
+		return;
+	}
+
+	struct stat st;
+	bool usable = (fstat(fd, &st) == 0) && S_ISREG(st.st_mode);
+	const uint64_t fixedBytes = sizeof(DlHeader) + sizeof(DlTrailer);
+	if(usable && ((st.st_size < (off_t)fixedBytes) || ((uint64_t)st.st_size > kMaxFileBytes)))
+		usable = false;
+	if(!usable)
+	{
+		report(verbose, "store is not a regular file of a usable size", path);
+		close(fd);
+		return;
+	}
+
+	std::vector<uint8_t> bytes((size_t)st.st_size);
+	size_t done = 0;
+	while(done < bytes.size())
+	{
+		ssize_t count = pread(fd, bytes.data() + done, bytes.size() - done, (off_t)done);
+		if(count < 0)
+		{
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		if(count == 0)
+			break;
+		done += (size_t)count;
+	}
+	close(fd);
+	if(done != bytes.size())
+	{
+		report(verbose, "cannot read store", path);
+		return;
+	}
+
+	size_t bodyBytes = bytes.size() - sizeof(DlTrailer);
+	DlTrailer trailer;
+	memcpy(&trailer, bytes.data() + bodyBytes, sizeof(trailer));
+	if((trailer.magic != kTrailerMagic) ||
+	   (trailer.crc32c != crc32_impl(0, (const char *)bytes.data(), bodyBytes)))
+	{
+		report(verbose, "store checksum mismatch", path);
+		return;
+	}
+
+	DlHeader header;
+	memcpy(&header, bytes.data(), sizeof(header));
+	if((header.magic != kHeaderMagic) || (header.version != kFormatVersion) ||
+	   (memcmp(header.hostUuid, wantHost, sizeof(header.hostUuid)) != 0))
+	{
+		report(verbose, "store has another format or host", path);
+		return;
+	}
+
+	// The sizes in the header have to account for the file exactly, and every record has
+	// to stay inside the pool. Both are checked before anything is indexed by them.
+	uint64_t recordBytes = (uint64_t)header.count * sizeof(DlRecord);
+	if((recordBytes > bodyBytes - sizeof(DlHeader)) ||
+	   (header.poolBytes != bodyBytes - sizeof(DlHeader) - recordBytes))
+	{
+		report(verbose, "store size does not match its header", path);
+		return;
+	}
+	const DlRecord *records = (const DlRecord *)(bytes.data() + sizeof(DlHeader));
+	for(uint32_t i = 0; i < header.count; ++i)
+	{
+		const DlRecord &record = records[i];
+		uint64_t length = (uint64_t)record.pathLength + record.entriesLength;
+		if((record.poolOffset > header.poolBytes) || (length > header.poolBytes - record.poolOffset))
+		{
+			report(verbose, "store record out of bounds", path);
+			return;
+		}
+	}
+
+	outImage.bytes = std::move(bytes);
+	outImage.records = (const DlRecord *)(outImage.bytes.data() + sizeof(DlHeader));
+	outImage.count = header.count;
+	outImage.pool = outImage.bytes.data() + sizeof(DlHeader) + recordBytes;
+	outImage.poolBytes = header.poolBytes;
+	outImage.runCounter = header.runCounter;
+}
+
+// The index of path's record, or -1.
+int64_t find_record(const Image &image, std::string_view path)
+{
+	size_t low = 0;
+	size_t high = image.count;
+	while(low < high)
+	{
+		size_t middle = low + ((high - low) / 2);
+		int order = image.path_of(image.records[middle]).compare(path);
+		if(order == 0)
+			return (int64_t)middle;
+		if(order < 0)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	return -1;
+}
+
+// Decodes a record's entries, stored as a type byte, the name and a NUL each. The checksum only says the file is the one that was
+// written, so the names are checked again here: one that could climb out of its
+// directory, or a listing that does not add up, is a miss.
+bool decode_entries(std::string_view encoded, uint32_t expectedCount,
+                    std::vector<std::pair<uint8_t, std::string>> &outEntries)
+{
+	outEntries.clear();
+	outEntries.reserve(expectedCount);
+	size_t offset = 0;
+	while(offset < encoded.size())
+	{
+		uint8_t type = (uint8_t)encoded[offset++];
+		if((type < 1) || (type > 3))
+			return false;
+		size_t end = encoded.find('\0', offset);
+		if(end == std::string_view::npos)
+			return false;
+		std::string_view name = encoded.substr(offset, end - offset);
+		if(name.empty() || (name == ".") || (name == "..") || (name.find('/') != std::string_view::npos))
+			return false;
+		outEntries.emplace_back(type, std::string(name));
+		offset = end + 1;
+	}
+	return (outEntries.size() == expectedCount);
+}
+
+// A dedicated lock file that is never renamed or removed, for the same reason as the
+// FingerprintStore's: the store inode is replaced on every save.
+int open_lock(const std::string &cacheDir, const std::string &lockPath, bool verbose)
+{
+	if(!posix_mkdir_p(cacheDir))
+	{
+		report(verbose, "cannot create cache directory for store", cacheDir);
+		return -1;
+	}
+	int fd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if(fd < 0)
+	{
+		report(verbose, "cannot open store lock file", lockPath);
+		return -1;
+	}
+	int lockResult;
+	while(((lockResult = flock(fd, LOCK_EX)) != 0) && (errno == EINTR))
+		{ /* a signal interrupted the wait: keep waiting rather than writing unlocked */ }
+	if(lockResult != 0)
+	{
+		report(verbose, "cannot lock store", lockPath);
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+struct LockGuard
+{
+	int fd;
+	~LockGuard()
+	{
+		flock(fd, LOCK_UN);
+		close(fd);
+	}
+};
+
+} // namespace dlstore
+
+using namespace dlstore;
+
+// This run's listings, by path. Sharded like the FingerprintStore's records, because
+// every scheduler thread expanding a glob comes through here once per directory.
+struct alignas(64) DirectoryListingStore::Shard
+{
+	struct RunListing
+	{
+		std::shared_ptr<const Listing> listing;
+		bool save = false; // read in this run, as opposed to reused from the file
+	};
+
+	std::mutex lock;
+	std::unordered_map<std::string, RunListing> listings;
+};
+
+struct DirectoryListingStore::Ancestor
+{
+	uint64_t dev;
+	uint64_t ino;
+};
+
+namespace
+{
+
+bool same_directory(uint64_t dev, uint64_t ino, int64_t mtimeNs, int64_t ctimeNs, const struct stat &st)
+{
+	return (dev == (uint64_t)st.st_dev) && (ino == (uint64_t)st.st_ino) &&
+	       (mtimeNs == timespec_ns(st.st_mtimespec)) && (ctimeNs == timespec_ns(st.st_ctimespec));
+}
+
+} // namespace
+
+DirectoryListingStore::DirectoryListingStore(std::string cacheDir, std::string path, const uint8_t *hostUuid,
+                                             bool refresh, bool verbose)
+	: mCacheDir(std::move(cacheDir))
+	, mPath(std::move(path))
+	, mRefresh(refresh)
+	, mVerbose(verbose)
+	, mLoaded(new Image())
+	, mShards(new Shard[kShardCount])
+{
+	memcpy(mHostUuid, hostUuid, sizeof(mHostUuid));
+}
+
+DirectoryListingStore::~DirectoryListingStore() = default;
+
+std::unique_ptr<DirectoryListingStore>
+DirectoryListingStore::Open(const std::string &cacheDir, bool refresh, bool verbose)
+{
+	// An all-zero host when gethostuuid is denied, as for the FingerprintStore.
+	uint8_t hostUuid[16] = {0};
+	struct timespec wait = {0, 0};
+	if(gethostuuid(hostUuid, &wait) != 0)
+		memset(hostUuid, 0, sizeof(hostUuid));
+
+	char hostHex[33];
+	for(size_t i = 0; i < sizeof(hostUuid); ++i)
+		snprintf(hostHex + (i * 2), 3, "%02x", hostUuid[i]);
+
+	std::unique_ptr<DirectoryListingStore> store;
+	try
+	{
+		std::string path = cacheDir;
+		if(!path.empty() && (path.back() != '/'))
+			path += '/';
+		path += "listings-";
+		path += hostHex;
+		path += ".bin";
+
+		store.reset(new DirectoryListingStore(cacheDir, path, hostUuid, refresh, verbose));
+		load_image(store->mPath, hostUuid, verbose, *store->mLoaded);
+		store->mUsed.reset(new std::atomic<uint8_t>[store->mLoaded->count]());
+	}
+	catch(...)
+	{
+		return nullptr;
+	}
+	return store;
+}
+
+size_t
+DirectoryListingStore::loaded_count() const
+{
+	return mLoaded->count;
+}
+
+bool
+DirectoryListingStore::walk(const std::string &root, const struct stat &rootStat,
+                            const std::function<void(const std::string &path)> &visit)
+{
+	std::vector<Ancestor> ancestors;
+	return walk_directory(root, rootStat, ancestors, visit);
+}
+
+bool
+DirectoryListingStore::walk_directory(const std::string &path, const struct stat &st, std::vector<Ancestor> &ancestors,
+                                      const std::function<void(const std::string &path)> &visit)
+{
+	bool failed = false;
+	std::shared_ptr<const Listing> listing = find_listing(path, st, failed);
+	if(listing == nullptr)
+		return false;
+
+	ancestors.push_back({(uint64_t)st.st_dev, (uint64_t)st.st_ino});
+
+	// fts does not double a trailing slash on the root, so neither do we.
+	std::string childPath = path;
+	if(childPath.empty() || (childPath.back() != '/'))
+		childPath += '/';
+	size_t prefixLength = childPath.size();
+
+	for(const auto &entry : listing->entries)
+	{
+		childPath.resize(prefixLength);
+		childPath += entry.second;
+
+		// A file's entry can be taken at its word: it cannot become anything else without
+		// moving this directory's mtime. A subdirectory has its own listing to validate,
+		// so it is stat'ed - which is the one stat per directory this walk costs.
+		if(entry.first != EntryType::Directory)
+		{
+			visit(childPath);
+			continue;
+		}
+
+		struct stat childStat;
+		if(lstat(childPath.c_str(), &childStat) != 0)
+		{
+			failed = true; // FTS_NS
+			continue;
+		}
+		if(S_ISDIR(childStat.st_mode))
+		{
+			bool cycle = std::any_of(ancestors.begin(), ancestors.end(), [&](const Ancestor &ancestor)
+			{
+				return (ancestor.dev == (uint64_t)childStat.st_dev) && (ancestor.ino == (uint64_t)childStat.st_ino);
+			});
+			if(cycle || !walk_directory(childPath, childStat, ancestors, visit))
+				failed = true; // FTS_DC, or somewhere below
+		}
+		else if(S_ISREG(childStat.st_mode) || S_ISLNK(childStat.st_mode))
+		{
+			visit(childPath); // replaced since this run read the listing
+		}
+	}
+
+	ancestors.pop_back();
+	return !failed;
+}
+
+std::shared_ptr<const DirectoryListingStore::Listing>
+DirectoryListingStore::find_listing(const std::string &path, const struct stat &st, bool &outFailed)
+{
+	Shard &shard = mShards[std::hash<std::string>()(path) & (kShardCount - 1)];
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		auto found = shard.listings.find(path);
+		if(found != shard.listings.end())
+		{
+			const Listing &listing = *found->second.listing;
+			if(same_directory(listing.dev, listing.ino, listing.mtimeNs, listing.ctimeNs, st))
+				return found->second.listing;
+		}
+	}
+
+	int64_t index = mRefresh ? -1 : find_record(*mLoaded, path);
+	if(index >= 0)
+	{
+		const DlRecord &record = mLoaded->records[index];
+		if(same_directory(record.dev, record.ino, record.mtimeNs, record.ctimeNs, st))
+		{
+			std::shared_ptr<Listing> listing = std::make_shared<Listing>();
+			listing->dev = record.dev;
+			listing->ino = record.ino;
+			listing->mtimeNs = record.mtimeNs;
+			listing->ctimeNs = record.ctimeNs;
+			std::vector<std::pair<uint8_t, std::string>> entries;
+			if(decode_entries(mLoaded->entries_of(record), record.entryCount, entries))
+			{
+				listing->entries.reserve(entries.size());
+				for(auto &entry : entries)
+					listing->entries.emplace_back((EntryType)entry.first, std::move(entry.second));
+
+				mUsed[index].store(1, std::memory_order_relaxed);
+				mReused.fetch_add(1, std::memory_order_relaxed);
+
+				// Kept for the rest of the run, so the next glob through this directory
+				// does not decode it again. Not marked for saving: it is already stored.
+				std::lock_guard<std::mutex> guard(shard.lock);
+				Shard::RunListing &slot = shard.listings[path];
+				if(slot.listing == nullptr)
+					slot.listing = listing;
+				return listing;
+			}
+		}
+	}
+
+	return read_listing(path, outFailed);
+}
+
+std::shared_ptr<const DirectoryListingStore::Listing>
+DirectoryListingStore::read_listing(const std::string &path, bool &outFailed)
+{
+	// Taken before the read, so the quiet period below is measured against the earliest
+	// moment the listing can describe.
+	int64_t readStartNs = (int64_t)clock_gettime_nsec_np(CLOCK_REALTIME);
+
+	int fd = open(path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	if(fd < 0)
+	{
+		outFailed = true; // FTS_DNR
+		return nullptr;
+	}
+
+	// The tuple the listing is stored under comes from the descriptor that was read, not
+	// from the caller's lstat: if the directory was replaced in between, this is the one
+	// the entries belong to, and the next lookup simply misses.
+	struct stat opened;
+	if(fstat(fd, &opened) != 0)
+	{
+		close(fd);
+		outFailed = true;
+		return nullptr;
+	}
+
+	std::shared_ptr<Listing> listing = std::make_shared<Listing>();
+	listing->dev = (uint64_t)opened.st_dev;
+	listing->ino = (uint64_t)opened.st_ino;
+	listing->mtimeNs = timespec_ns(opened.st_mtimespec);
+	listing->ctimeNs = timespec_ns(opened.st_ctimespec);
+
+	bool complete = true;
+	int readError = read_directory_bulk(fd, [&](const BulkDirEntry &entry)
+	{
+		if(!entry.has_stat)
+		{
+			complete = false; // FTS_NS
+			return;
+		}
+		if(S_ISDIR(entry.st.st_mode))
+			listing->entries.emplace_back(EntryType::Directory, entry.name);
+		else if(S_ISREG(entry.st.st_mode))
+			listing->entries.emplace_back(EntryType::File, entry.name);
+		else if(S_ISLNK(entry.st.st_mode))
+			listing->entries.emplace_back(EntryType::Symlink, entry.name);
+		// fifos, sockets and devices are never matched, so they are not kept
+	});
+	close(fd);
+	if(readError != 0)
+		complete = false; // FTS_DNR, or FTS_ERR part way through
+
+	std::sort(listing->entries.begin(), listing->entries.end(),
+		[](const std::pair<EntryType, std::string> &a, const std::pair<EntryType, std::string> &b)
+		{ return strcmp(a.second.c_str(), b.second.c_str()) < 0; });
+
+	mRead.fetch_add(1, std::memory_order_relaxed);
+
+	if(!complete)
+	{
+		// What could be read is still walked, as fts would, but nothing is kept.
+		outFailed = true;
+		return listing;
+	}
+
+	int64_t lastChangeNs = std::max(listing->mtimeNs, listing->ctimeNs);
+	if((lastChangeNs > readStartNs) || ((readStartNs - lastChangeNs) < kRacyNs))
+		return listing; // too recent to trust its timestamps, this run included
+
+	Shard &shard = mShards[std::hash<std::string>()(path) & (kShardCount - 1)];
+	{
+		std::lock_guard<std::mutex> guard(shard.lock);
+		Shard::RunListing &slot = shard.listings[path];
+		slot.listing = listing;
+		slot.save = true;
+	}
+	mDirty.store(true, std::memory_order_relaxed);
+	return listing;
+}
+
+void
+DirectoryListingStore::save()
+{
+	if(!mDirty.load(std::memory_order_relaxed))
+		return; // every directory walked was already stored: nothing to write
+
+	try
+	{
+		save_internal();
+	}
+	catch(...)
+	{
+		report(mVerbose, "cannot save store", mPath);
+	}
+}
+
+void
+DirectoryListingStore::save_internal()
+{
+	int lockFd = open_lock(mCacheDir, mPath + ".lock", mVerbose);
+	if(lockFd < 0)
+		return;
+	LockGuard lockGuard{lockFd};
+
+	// Re-read under the lock: another process may have saved since this one opened, and
+	// its listings are as good as ours.
+	Image current;
+	load_image(mPath, mHostUuid, false, current);
+
+	uint64_t oldRun = current.runCounter;
+	bool keepSurvivors = true;
+	if(oldRun >= kMaxRunCounter)
+	{
+		oldRun = 0;
+		keepSurvivors = false;
+	}
+	uint64_t newRun = oldRun + 1;
+
+	// Paths of the listings this run reused, which stay current whatever their epoch.
+	std::unordered_set<std::string_view> used;
+	for(uint32_t i = 0; i < mLoaded->count; ++i)
+	{
+		if(mUsed[i].load(std::memory_order_relaxed) != 0)
+			used.insert(mLoaded->path_of(mLoaded->records[i]));
+	}
+
+	struct OutRecord
+	{
+		std::string_view path;
+		DlRecord record;          // poolOffset and pathLength are filled in when written
+		std::string_view entries; // encoded
+	};
+	std::vector<OutRecord> out;
+	std::unordered_map<std::string_view, size_t> byPath;
+
+	if(keepSurvivors)
+	{
+		for(uint32_t i = 0; i < current.count; ++i)
+		{
+			const DlRecord &record = current.records[i];
+			std::string_view path = current.path_of(record);
+			bool inUse = (used.count(path) != 0);
+			if(!inUse && (((uint64_t)record.epoch + kMaxIdleRuns) < newRun))
+				continue;
+			OutRecord kept = {path, record, current.entries_of(record)};
+			if(inUse)
+				kept.record.epoch = (uint32_t)newRun;
+			if(byPath.emplace(path, out.size()).second)
+				out.push_back(kept);
+		}
+	}
+
+	// This run's reads supersede whatever the file had for the same directory. The
+	// encodings live in their own list, sized up front so the views into it stay put.
+	size_t pending = 0;
+	for(size_t i = 0; i < kShardCount; ++i)
+	{
+		for(const auto &item : mShards[i].listings)
+			pending += item.second.save ? 1 : 0;
+	}
+	std::vector<std::string> encodings;
+	encodings.reserve(pending);
+	for(size_t i = 0; i < kShardCount; ++i)
+	{
+		for(const auto &item : mShards[i].listings)
+		{
+			if(!item.second.save)
+				continue;
+			const Listing &listing = *item.second.listing;
+			std::string &encoded = encodings.emplace_back();
+			for(const auto &entry : listing.entries)
+			{
+				encoded += (char)entry.first;
+				encoded += entry.second;
+				encoded += '\0';
+			}
+
+			OutRecord fresh;
+			fresh.path = item.first;
+			memset(&fresh.record, 0, sizeof(fresh.record));
+			fresh.record.dev = listing.dev;
+			fresh.record.ino = listing.ino;
+			fresh.record.mtimeNs = listing.mtimeNs;
+			fresh.record.ctimeNs = listing.ctimeNs;
+			fresh.record.entryCount = (uint32_t)listing.entries.size();
+			fresh.record.epoch = (uint32_t)newRun;
+			fresh.entries = encoded;
+
+			auto found = byPath.find(fresh.path);
+			if(found != byPath.end())
+			{
+				out[found->second] = fresh;
+			}
+			else
+			{
+				byPath.emplace(fresh.path, out.size());
+				out.push_back(fresh);
+			}
+		}
+	}
+
+	if(out.size() > kMaxRecords)
+	{
+		report(mVerbose, "too many directories to store", mPath);
+		return;
+	}
+
+	std::sort(out.begin(), out.end(),
+		[](const OutRecord &a, const OutRecord &b) { return a.path < b.path; });
+
+	uint64_t poolBytes = 0;
+	for(const OutRecord &record : out)
+		poolBytes += record.path.size() + record.entries.size();
+	size_t bodySize = sizeof(DlHeader) + (out.size() * sizeof(DlRecord)) + (size_t)poolBytes;
+	if((bodySize + sizeof(DlTrailer)) > kMaxFileBytes)
+	{
+		report(mVerbose, "too many directories to store", mPath);
+		return;
+	}
+
+	std::vector<uint8_t> image(bodySize + sizeof(DlTrailer), 0);
+
+	DlHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = kHeaderMagic;
+	header.version = kFormatVersion;
+	header.count = (uint32_t)out.size();
+	header.poolBytes = poolBytes;
+	header.runCounter = newRun;
+	memcpy(header.hostUuid, mHostUuid, sizeof(header.hostUuid));
+	memcpy(image.data(), &header, sizeof(header));
+
+	uint8_t *recordCursor = image.data() + sizeof(DlHeader);
+	uint8_t *pool = recordCursor + (out.size() * sizeof(DlRecord));
+	uint64_t poolOffset = 0;
+	for(OutRecord &record : out)
+	{
+		record.record.poolOffset = poolOffset;
+		record.record.pathLength = (uint32_t)record.path.size();
+		record.record.entriesLength = (uint32_t)record.entries.size();
+		memcpy(recordCursor, &record.record, sizeof(DlRecord));
+		recordCursor += sizeof(DlRecord);
+		memcpy(pool + poolOffset, record.path.data(), record.path.size());
+		poolOffset += record.path.size();
+		memcpy(pool + poolOffset, record.entries.data(), record.entries.size());
+		poolOffset += record.entries.size();
+	}
+
+	DlTrailer trailer;
+	memset(&trailer, 0, sizeof(trailer));
+	trailer.magic = kTrailerMagic;
+	trailer.crc32c = crc32_impl(0, (const char *)image.data(), bodySize);
+	memcpy(image.data() + bodySize, &trailer, sizeof(trailer));
+
+	// Temp name, O_EXCL|O_NOFOLLOW and rename, for the FingerprintStore's reasons.
+	std::string tempPath = mPath + "." + std::to_string((long)getpid()) + ".tmp";
+	unlink(tempPath.c_str());
+	int tempFd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if(tempFd < 0)
+	{
+		report(mVerbose, "cannot create temporary store", tempPath);
+		return;
+	}
+
+	const uint8_t *cursor = image.data();
+	size_t remaining = image.size();
+	bool written = true;
+	while(remaining > 0)
+	{
+		ssize_t count = write(tempFd, cursor, remaining);
+		if(count <= 0)
+		{
+			if((count < 0) && (errno == EINTR))
+				continue;
+			written = false;
+			break;
+		}
+		cursor += count;
+		remaining -= (size_t)count;
+	}
+	close(tempFd);
+
+	if(!written || (rename(tempPath.c_str(), mPath.c_str()) != 0))
+	{
+		report(mVerbose, written ? "cannot replace store" : "cannot write temporary store", mPath);
+		unlink(tempPath.c_str());
+		return;
+	}
+
+	if(mVerbose)
+	{
+		LogError("listings: saved %zu directories (%zu bytes) to %s\n",
+			out.size(), image.size(), mPath.c_str());
+	}
+}
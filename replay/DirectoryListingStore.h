@@ -0,0 +1,137 @@
+#pragma once
+// Persistent directory listings for glob expansion, for the incremental execution cache.
+//
+// A glob input is expanded by walking the tree under its concrete prefix, and a fully
+// cached run walks every one of them again just to learn that nothing was added or
+// removed. fts(3) lstats every entry it passes on the way, so on a playlist declaring
+// hundreds of src/**/*.cpp-style inputs that walk is most of what the run costs.
+//
+// This store keeps each visited directory's sorted entry names and types, together with
+// the directory's own (st_dev, st_ino, mtime, ctime). Adding, removing or renaming an
+// entry moves its directory's mtime and ctime, so while that tuple still matches, the
+// stored listing is the directory's listing. A later walk then costs one lstat per
+// directory: it reuses the listings whose directory is unchanged, re-reads only the ones
+// that changed, and never stats a file at all. Edits to a file's content do not touch
+// its directory and are not this store's business - the fingerprint hashes them.
+//
+// A listing is only stored once its directory has been quiet for a couple of seconds
+// before the read (kRacyNs in the .cpp). On a filesystem with coarse timestamps an entry
+// created in the same tick as the read would otherwise leave the tuple unchanged, and
+// the stored listing would miss it for good.
+//
+// Like the FingerprintStore it sits beside, the store is machine-local (inode numbers
+// are): the host UUID is in the file name and the header. It is disposable state, too:
+// a file that is missing, truncated or fails its checksum reads as empty, which costs
+// reading every directory once, never a wrong listing.
+//
+// walk() is thread-safe and is called from every scheduler thread. save() is called
+// once, after the scheduler has drained.
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+struct stat;
+
+namespace dlstore
+{
+	struct Image; // a loaded store file; the layout lives in DirectoryListingStore.cpp
+}
+
+class DirectoryListingStore
+{
+public:
+	// Opens the store for one cache directory. Never fails because of the file: anything
+	// wrong with it yields an empty store, reported under verbose. Under refresh, nothing
+	// stored is reused, but what this run reads is still saved.
+	// Returns nullptr only when the object could not be allocated.
+	static std::unique_ptr<DirectoryListingStore> Open(const std::string &cacheDir, bool refresh, bool verbose);
+
+	~DirectoryListingStore();
+
+	DirectoryListingStore(const DirectoryListingStore &) = delete;
+	DirectoryListingStore &operator=(const DirectoryListingStore &) = delete;
+
+	// Walks the tree under root the way fts(3) does with FTS_PHYSICAL and calls visit with
+	// the path of every regular file and symlink in it, in no particular order. Paths are
+	// built from root the way fts builds fts_path. Symlinks are reported, never followed.
+	// rootStat is root's own lstat, which must be a directory.
+	// Returns false when part of the tree could not be read - an unreadable directory, an
+	// entry that could not be stat'ed, a directory cycle - in the cases where fts would have
+	// reported FTS_DNR, FTS_NS or FTS_DC. What was readable has still been visited.
+	bool walk(const std::string &root, const struct stat &rootStat,
+	          const std::function<void(const std::string &path)> &visit);
+
+	// Publishes what this run read, if anything: temp file and rename, under a lock file,
+	// merged with whatever another process published in the meantime. A run that reused
+	// every listing writes nothing. Listings no run has used for kMaxIdleRuns rewrites are
+	// dropped. Never throws and never fails the run.
+	void save();
+
+	// Directories whose stored listing was reused, and directories read, in this run.
+	size_t reused_count() const { return mReused.load(std::memory_order_relaxed); }
+	size_t read_count() const { return mRead.load(std::memory_order_relaxed); }
+
+	// Listings in the store as loaded.
+	size_t loaded_count() const;
+
+	const std::string &path() const { return mPath; }
+
+private:
+	DirectoryListingStore(std::string cacheDir, std::string path, const uint8_t *hostUuid,
+	                      bool refresh, bool verbose);
+
+	enum class EntryType : uint8_t
+	{
+		File = 1,
+		Directory = 2,
+		Symlink = 3
+	};
+
+	// What a directory held when it was read. Names are sorted as strcmp orders them.
+	struct Listing
+	{
+		uint64_t dev = 0;
+		uint64_t ino = 0;
+		int64_t mtimeNs = 0;
+		int64_t ctimeNs = 0;
+		std::vector<std::pair<EntryType, std::string>> entries;
+	};
+
+	struct Shard;
+	struct Ancestor;
+
+	bool walk_directory(const std::string &path, const struct stat &st, std::vector<Ancestor> &ancestors,
+	                    const std::function<void(const std::string &path)> &visit);
+
+	// The directory's listing: stored in this run, stored on disk, or read now, in that
+	// order of preference. Null when the directory could not be read.
+	std::shared_ptr<const Listing> find_listing(const std::string &path, const struct stat &st, bool &outFailed);
+
+	// Reads the directory at path. Recorded for save() when its listing is complete and
+	// the directory has been quiet for long enough to trust its timestamps.
+	std::shared_ptr<const Listing> read_listing(const std::string &path, bool &outFailed);
+
+	void save_internal();
+
+	std::string mCacheDir;
+	std::string mPath;
+	uint8_t mHostUuid[16] = {0};
+	bool mRefresh = false;
+	bool mVerbose = false;
+
+	// Immutable after Open, so walk() reads it without a lock.
+	std::unique_ptr<dlstore::Image> mLoaded;
+	// One flag per loaded listing, set when this run reused it, so that save() keeps
+	// what is in use and lets the rest age out.
+	std::unique_ptr<std::atomic<uint8_t>[]> mUsed;
+
+	std::unique_ptr<Shard[]> mShards;
+	std::atomic<bool> mDirty{false};
+	std::atomic<size_t> mReused{0};
+	std::atomic<size_t> mRead{0};
+};
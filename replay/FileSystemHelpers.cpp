@@ -1,8 +1,12 @@
 #include "FileSystemHelpers.h"
+#include "DirectoryListingStore.h"
 #include "PosixFileOps.h"
 #include "GlobOverlap.h"
 #include "GlobSearch.h"
+#include "BulkDirectoryReader.h"
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/stat.h>
 #include <algorithm>
 #include <cerrno>
@@ -52,26 +56,10 @@ static int fts_name_compar(const FTSENT **a, const FTSENT **b)
 	return strcmp((*a)->fts_name, (*b)->fts_name);
 }
 
-bool build_directory_tree(const char *path, TreeNode &out_root, int maxDepth)
+// The children of the directory at path, down to maxDepth (unlimited when negative), in
+// fts order.
+static bool build_directory_tree_fts(const char *path, TreeNode &out_root, int maxDepth)
 {
-	// Derive root display name from last path component
-	std::string pathStr(path);
-	size_t lastSlash = pathStr.rfind('/');
-	out_root.name = (lastSlash != std::string::npos && lastSlash + 1 < pathStr.size())
-	                ? pathStr.substr(lastSlash + 1)
-	                : pathStr;
-	out_root.isDirectory = true;
-
-	// fts_open succeeds even for nonexistent paths; verify the root exists first.
-	struct stat st;
-	if (stat(path, &st) != 0)
-		return false;
-	if (S_ISDIR(st.st_mode) == 0)
-	{
-		errno = ENOTDIR;
-		return false;
-	}
-
 	char *paths[2] = { const_cast<char *>(path), nullptr };
 	FTSPtr fts(fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, fts_name_compar), fts_close);
 	if (fts == nullptr)
@@ -96,12 +84,7 @@ bool build_directory_tree(const char *path, TreeNode &out_root, int maxDepth)
 			{
 				if (lvl == 0)
 				{
-					// Root dir itself. maxDepth == 0: root only; maxDepth < 0: unlimited.
-					if (maxDepth == 0)
-					{
-						fts_set(fts.get(), ent, FTS_SKIP);
-						break;
-					}
+					// Root dir itself
 					if ((int)levelToNode.size() < 1)
 						levelToNode.resize(1);
 					levelToNode[0] = &out_root;
@@ -158,11 +141,105 @@ bool build_directory_tree(const char *path, TreeNode &out_root, int maxDepth)
 	return true;
 }
 
+// Same tree as build_directory_tree_fts, listing each directory with getattrlistbulk.
+static bool build_directory_tree_bulk(const char *path, TreeNode &out_root, int maxDepth)
+{
+	std::string pathStr(path);
+
+	// Like fts with FTS_PHYSICAL, a symlinked root is listed but not descended into.
+	struct stat lst;
+	if ((lstat(path, &lst) == 0) && S_ISLNK(lst.st_mode))
+		return true;
+
+	// Depth-first over an explicit stack. Each directory is listed with getattrlistbulk,
+	// which returns entry types with the names, so no entry needs its own stat.
+	// A node's children vector is complete and sorted before any of its subdirectories
+	// is pushed, so the TreeNode pointers on the stack stay valid.
+	struct PendingDir
+	{
+		TreeNode *node;
+		std::string path;
+		int level;
+	};
+	std::vector<PendingDir> pending;
+	pending.push_back({&out_root, pathStr, 0});
+
+	while (!pending.empty())
+	{
+		PendingDir dir = std::move(pending.back());
+		pending.pop_back();
+
+		int dirfd = open(dir.path.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+		if (dirfd < 0)
+			continue; // unreadable: listed with no children, as fts reports FTS_DNR
+
+		std::vector<TreeNode> &children = dir.node->children;
+		read_directory_bulk(dirfd, [&](const BulkDirEntry &entry)
+		{
+			if (!entry.has_stat)
+				return;
+			if (S_ISDIR(entry.st.st_mode))
+				children.push_back({entry.name, true, {}});
+			else if (S_ISREG(entry.st.st_mode) || S_ISLNK(entry.st.st_mode))
+				children.push_back({entry.name, false, {}});
+		});
+		close(dirfd);
+
+		// same order as fts_name_compar
+		std::sort(children.begin(), children.end(),
+			[](const TreeNode &a, const TreeNode &b) { return a.name < b.name; });
+
+		int childLevel = dir.level + 1;
+		if ((maxDepth >= 0) && (childLevel >= maxDepth))
+			continue;
+
+		// reverse push so subdirectories are listed in name order
+		for (auto it = children.rbegin(); it != children.rend(); ++it)
+		{
+			if (it->isDirectory)
+				pending.push_back({&*it, dir.path + "/" + it->name, childLevel});
+		}
+	}
+
+	return true;
+}
+
+bool build_directory_tree(const char *path, TreeNode &out_root, int maxDepth)
+{
+	// Derive root display name from last path component
+	std::string pathStr(path);
+	size_t lastSlash = pathStr.rfind('/');
+	out_root.name = (lastSlash != std::string::npos && lastSlash + 1 < pathStr.size())
+	                ? pathStr.substr(lastSlash + 1)
+	                : pathStr;
+	out_root.isDirectory = true;
+
+	// fts_open succeeds even for nonexistent paths; verify the root exists first.
+	struct stat st;
+	if (stat(path, &st) != 0)
+		return false;
+	if (S_ISDIR(st.st_mode) == 0)
+	{
+		errno = ENOTDIR;
+		return false;
+	}
+
+	// maxDepth == 0: root only; maxDepth < 0: unlimited.
+	if (maxDepth == 0)
+		return true;
+
+	// the same walker as walk_directory: fts unless getattrlistbulk was opted into
+	if (get_directory_walker() == DirectoryWalker::Bulk)
+		return build_directory_tree_bulk(path, out_root, maxDepth);
+	return build_directory_tree_fts(path, out_root, maxDepth);
+}
+
 // ============================================================================
 // Glob expansion
 // ============================================================================
 
-std::vector<std::string> expand_glob(const std::string &pattern, bool *outFailed)
+std::vector<std::string> expand_glob(const std::string &pattern, bool *outFailed,
+                                     DirectoryListingStore *listings)
 {
 	std::vector<std::string> results;
 
@@ -194,6 +271,31 @@ std::vector<std::string> expand_glob(const std::string &pattern, bool *outFailed
 				   lowercase_suffix.begin(), ::tolower);
 	glob::glob compiled_glob(lowercase_suffix);
 
+	auto match_path = [&](const char *path) {
+		const char *rel = path + base_dir.size();
+		if (*rel == '/')
+			++rel;
+
+		std::string lowercase_rel(rel);
+		std::transform(lowercase_rel.begin(), lowercase_rel.end(),
+					   lowercase_rel.begin(), ::tolower);
+
+		if (glob_match(lowercase_rel, compiled_glob))
+			results.emplace_back(path);
+	};
+
+	// Only a base that is a real directory goes through the listings: a missing base, or
+	// one that is itself a symlink, is left to fts, which reports it as it always has.
+	struct stat base_st;
+	if ((listings != nullptr) && (lstat(base_dir.c_str(), &base_st) == 0) && S_ISDIR(base_st.st_mode)) {
+		bool complete = listings->walk(base_dir, base_st, [&](const std::string &path) {
+			match_path(path.c_str());
+		});
+		if (!complete && (outFailed != nullptr))
+			*outFailed = true;
+		return results;
+	}
+
 	char *paths[2] = { const_cast<char *>(base_dir.c_str()), nullptr };
 	FTSPtr fts(fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, nullptr), fts_close);
 	if (fts == nullptr) {
@@ -217,19 +319,9 @@ std::vector<std::string> expand_glob(const std::string &pattern, bool *outFailed
 		switch (ent->fts_info) {
 			case FTS_F:
 			case FTS_SL:
-			case FTS_SLNONE: {
-				const char *rel = ent->fts_path + base_dir.size();
-				if (*rel == '/')
-					++rel;
-
-				std::string lowercase_rel(rel);
-				std::transform(lowercase_rel.begin(), lowercase_rel.end(),
-							   lowercase_rel.begin(), ::tolower);
-
-				if (glob_match(lowercase_rel, compiled_glob))
-					results.emplace_back(ent->fts_path);
+			case FTS_SLNONE:
+				match_path(ent->fts_path);
 				break;
-			}
 			case FTS_ERR: // read error
 			case FTS_DNR: // directory unreadable
 			case FTS_NS:  // stat failed
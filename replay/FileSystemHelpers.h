@@ -2,6 +2,8 @@
 #include <string>
 #include <vector>
 
+class DirectoryListingStore;
+
 struct DirEntry {
 	std::string name;
 	bool isDirectory;
@@ -18,10 +20,12 @@ struct TreeNode {
 	std::vector<TreeNode> children; // populated only when isDirectory
 };
 
-// Build a tree rooted at path using fts_read (iterative, no recursion).
-// Root node name is derived from the last path component.
+// Build a tree rooted at path from getattrlistbulk listings (iterative, no recursion).
+// Root node name is derived from the last path component. Children are sorted by name.
+// Symlinks are leaves, as with fts FTS_PHYSICAL; fifos, devices and sockets are omitted.
 // maxDepth controls depth: 0 = root node only (no children), 1 = immediate children, etc.
-// Returns false if fts_open fails. Unreadable subdirectories are silently skipped.
+// Returns false if path is missing or not a directory. Unreadable subdirectories are
+// listed without children.
 bool build_directory_tree(const char *path, TreeNode &out_root, int maxDepth);
 
 // Expand a single absolute glob pattern (e.g. /src/**/*.swift) to matching absolute paths.
@@ -31,7 +35,10 @@ bool build_directory_tree(const char *path, TreeNode &out_root, int maxDepth);
 // a SHORTER match list that is otherwise indistinguishable from "those files are gone",
 // which is a wrong answer for callers that compare match lists across runs - the cache
 // fingerprint above all. Callers that only consume the matches can keep ignoring it.
-std::vector<std::string> expand_glob(const std::string &pattern, bool *outFailed = nullptr);
+// listings, when not null, replaces the fts walk with one over the persisted directory
+// listings (DirectoryListingStore.h); the matches and outFailed are the same either way.
+std::vector<std::string> expand_glob(const std::string &pattern, bool *outFailed = nullptr,
+                                     DirectoryListingStore *listings = nullptr);
 
 // Search files matching any positive pattern, excluding paths that match any exclude pattern.
 // Exclude patterns use the same glob engine as positive patterns (glob::glob / glob_match,
@@ -4,6 +4,8 @@
 #include "FileInfo.h"
 #include "LogStream.h"
 #include "PosixFileOps.h" // posix_mkdir_p
+#include "json_serialization.h"
+#include "yyjson.hpp"
 
 #include <fcntl.h>
 #include <sys/file.h>
@@ -41,6 +43,7 @@ constexpr uint32_t kFormatVersion = 1;
 
 constexpr uint32_t kAlgoCrc32c = 0;
 constexpr uint32_t kAlgoBlake3 = 1;
+constexpr uint32_t kAlgoXxh3 = 2;
 
 // Where the published image records its own checksum. replay's own name, not one of the
 // public.fingerprint.* names the gate and fingerprint tools memoize from - see
@@ -158,9 +161,9 @@ static_assert((sizeof(FpHeader) % alignof(FpSlot)) == 0, "slots must start align
 static_assert(sizeof(FpJournalHeader) == 32, "FpJournalHeader must stay 32 bytes");
 static_assert(sizeof(FpBatchHeader) == 32, "FpBatchHeader must stay 32 bytes");
 static_assert(sizeof(FpBatchTrailer) == 16, "FpBatchTrailer must stay 16 bytes");
-// Together these are what lets the journal reader walk from one batch to the next and
-// still hand out an aligned FpSlot pointer: the first batch starts at a multiple of
-// alignof(FpSlot), and every batch is a whole number of them long.
+// Together these keep every intact batch on an FpSlot boundary: the first batch starts at
+// a multiple of alignof(FpSlot), and every batch is a whole number of them long. The
+// reader copies slots out all the same, because a torn batch can shift the ones after it.
 static_assert(((sizeof(FpJournalHeader) + sizeof(FpBatchHeader)) % alignof(FpSlot)) == 0,
               "a batch's slots must start aligned");
 static_assert(((sizeof(FpBatchHeader) + sizeof(FpBatchTrailer)) % alignof(FpSlot)) == 0,
@@ -338,7 +341,7 @@ void report(bool verbose, const char *what, const std::string &path)
 // own value only cross-checked - sizing a mapping from a header field is the standard
 // way to turn a corrupt file into an out-of-bounds read.
 void map_and_validate(const std::string &path, uint32_t wantAlgo, const uint8_t *wantHost,
-                      bool verbose, MappedStore &outMap)
+                      bool populate, bool verbose, MappedStore &outMap)
 {
 	outMap.reset();
 
@@ -395,8 +398,18 @@ void map_and_validate(const std::string &path, uint32_t wantAlgo, const uint8_t
 		return;
 	}
 
+	// The checksum below reads every page of the mapping before the first lookup, so
+	// lookups always land on resident pages. With populate the whole mapping is faulted
+	// in up front where the system can (MAP_POPULATE), and otherwise asked for ahead of
+	// the checksum pass. Off by default: with the file in the page cache the checksum
+	// pass faults it in as fast, and the option is for stores read from a slow disk.
 	size_t mapSize = (size_t)st.st_size;
-	void *base = mmap(nullptr, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+	int mapFlags = MAP_PRIVATE;
+#if defined(MAP_POPULATE)
+	if(populate)
+		mapFlags |= MAP_POPULATE;
+#endif
+	void *base = mmap(nullptr, mapSize, PROT_READ, mapFlags, fd, 0);
 	if(base == MAP_FAILED)
 	{
 		report(verbose, "cannot map store", path);
@@ -406,6 +419,12 @@ void map_and_validate(const std::string &path, uint32_t wantAlgo, const uint8_t
 	outMap.base = base;
 	outMap.size = mapSize;
 
+	// A hint, so the result does not matter.
+#if !defined(MAP_POPULATE)
+	if(populate)
+		(void)madvise(base, mapSize, MADV_WILLNEED);
+#endif
+
 	FpHeader header;
 	memcpy(&header, base, sizeof(header));
 	if(header.magic != kHeaderMagic)
@@ -550,9 +569,39 @@ const FpSlot *find_slot(const FpSlot *slots, uint64_t capacity, uint64_t fileKey
 	return nullptr;
 }
 
+// Fills in out's shape and probe histogram from the table itself. A slot's probe length
+// is its distance from its home slot plus one, which is exactly how far find_slot walks
+// to reach it.
+void measure_table(const FpSlot *slots, uint64_t capacity, FingerprintStore::TableStats &out)
+{
+	out = FingerprintStore::TableStats();
+	if((slots == nullptr) || (capacity == 0))
+		return;
+
+	out.capacity = capacity;
+	uint64_t mask = capacity - 1;
+	for(uint64_t i = 0; i < capacity; ++i)
+	{
+		if(slots[i].fileKey == 0)
+			continue;
+		uint64_t probe = ((i - (slots[i].fileKey & mask)) & mask) + 1;
+		size_t bucket = (probe <= 1) ? 0 : (size_t)(64 - __builtin_clzll(probe - 1));
+		if(bucket >= FingerprintStore::kProbeBuckets)
+			bucket = FingerprintStore::kProbeBuckets - 1;
+		++out.probes[bucket];
+		++out.entries;
+		if(probe > out.maxProbe)
+			out.maxProbe = probe;
+	}
+}
+
 const char *algorithm_name(uint32_t algorithmTag)
 {
-	return (algorithmTag == kAlgoBlake3) ? "blake3" : "crc32c";
+	if(algorithmTag == kAlgoBlake3)
+		return "blake3";
+	if(algorithmTag == kAlgoXxh3)
+		return "xxh3";
+	return "crc32c";
 }
 
 // An in-memory probe table over a flat list of slots. Used for the journal, which is a
@@ -611,8 +660,66 @@ struct JournalContents
 	// file we could not make sense of at all. Never fatal - the slots recovered before
 	// the problem are still good and are carried into the replacement.
 	bool needsReset = false;
+	// The file ends in a batch cut short with nothing behind it. Read without the lock
+	// that is most likely an append in flight; read under the exclusive lock it can only
+	// be one that was torn.
+	bool incompleteTail = false;
+	uint64_t bytes = 0; // what was read, valid batches or not
 };
 
+enum class BatchCheck
+{
+	Valid,
+	Incomplete, // runs past the end of what was read
+	Invalid     // not a batch, or one that fails its checksum
+};
+
+// Validates the batch that starts at data. On Valid, outBatch is its header and
+// outBatchBytes its length including the trailer.
+BatchCheck check_batch(const uint8_t *data, size_t remaining, bool verbose, const std::string &path,
+                       FpBatchHeader &outBatch, uint64_t &outBatchBytes)
+{
+	if(remaining < (sizeof(FpBatchHeader) + sizeof(FpBatchTrailer)))
+		return BatchCheck::Incomplete;
+
+	memcpy(&outBatch, data, sizeof(outBatch));
+	if((outBatch.magic != kBatchMagic) || (outBatch.count == 0) || (outBatch.count > kMaxBatchEntries))
+		return BatchCheck::Invalid;
+
+	// Bounded by kMaxBatchEntries above, so neither product can overflow, and the
+	// comparison against what is actually left is what makes the count safe to trust.
+	uint64_t bodyBytes = sizeof(FpBatchHeader) + (outBatch.count * sizeof(FpSlot));
+	outBatchBytes = bodyBytes + sizeof(FpBatchTrailer);
+	if(outBatchBytes > remaining)
+		return BatchCheck::Incomplete;
+
+	FpBatchTrailer trailer;
+	memcpy(&trailer, data + bodyBytes, sizeof(trailer));
+	if(trailer.magic != kBatchEndMagic)
+		return BatchCheck::Invalid;
+	if(trailer.crc32c != crc32_impl(0, (const char *)data, (size_t)bodyBytes))
+	{
+		report(verbose, "journal batch failed its integrity check", path);
+		return BatchCheck::Invalid;
+	}
+	return BatchCheck::Valid;
+}
+
+// The offset of the next batch magic at or after from, or raw.size() when there is none.
+// Slot bytes can contain the magic by chance; check_batch rejects such a match by its
+// checksum and the scan goes on from the byte after it.
+size_t find_next_batch(const std::vector<uint8_t> &raw, size_t from)
+{
+	for(size_t offset = from; (offset + sizeof(kBatchMagic)) <= raw.size(); ++offset)
+	{
+		uint64_t magic;
+		memcpy(&magic, raw.data() + offset, sizeof(magic));
+		if(magic == kBatchMagic)
+			return offset;
+	}
+	return raw.size();
+}
+
 // Reads and fully validates the journal for the table image identified by storeRun.
 // Like the table, any failure means "nothing usable here", never an error the run sees.
 void read_journal(const std::string &path, uint32_t wantAlgo, const uint8_t *wantHost,
@@ -620,6 +727,8 @@ void read_journal(const std::string &path, uint32_t wantAlgo, const uint8_t *wan
 {
 	out.slots.clear();
 	out.needsReset = false;
+	out.incompleteTail = false;
+	out.bytes = 0;
 
 	// O_NONBLOCK for the reason map_and_validate uses it: a FIFO planted at this name
 	// would otherwise block the open forever, before the S_ISREG check below can reject it.
@@ -676,6 +785,7 @@ void read_journal(const std::string &path, uint32_t wantAlgo, const uint8_t *wan
 		filled += (size_t)count;
 	}
 	raw.resize(filled);
+	out.bytes = raw.size();
 
 	if(raw.size() < sizeof(FpJournalHeader))
 	{
@@ -695,43 +805,24 @@ void read_journal(const std::string &path, uint32_t wantAlgo, const uint8_t *wan
 	size_t offset = sizeof(FpJournalHeader);
 	while(offset < raw.size())
 	{
-		uint64_t remaining = (uint64_t)(raw.size() - offset);
-		if(remaining < (sizeof(FpBatchHeader) + sizeof(FpBatchTrailer)))
-		{
-			out.needsReset = true; // a tail too short to be a batch at all
-			break;
-		}
-
 		FpBatchHeader batch;
-		memcpy(&batch, raw.data() + offset, sizeof(batch));
-		if((batch.magic != kBatchMagic) || (batch.count == 0) || (batch.count > kMaxBatchEntries))
-		{
-			out.needsReset = true;
-			break;
-		}
-
-		// Bounded by kMaxBatchEntries above, so neither product can overflow, and the
-		// comparison against what is actually left is what makes the count safe to trust.
-		uint64_t bodyBytes = sizeof(FpBatchHeader) + (batch.count * sizeof(FpSlot));
-		uint64_t batchBytes = bodyBytes + sizeof(FpBatchTrailer);
-		if(batchBytes > remaining)
-		{
-			out.needsReset = true;
-			break;
-		}
-
-		FpBatchTrailer trailer;
-		memcpy(&trailer, raw.data() + offset + bodyBytes, sizeof(trailer));
-		if(trailer.magic != kBatchEndMagic)
-		{
-			out.needsReset = true;
-			break;
-		}
-		if(trailer.crc32c != crc32_impl(0, (const char *)(raw.data() + offset), (size_t)bodyBytes))
+		uint64_t batchBytes = 0;
+		BatchCheck check = check_batch(raw.data() + offset, raw.size() - offset, verbose, path,
+			batch, batchBytes);
+		if(check != BatchCheck::Valid)
 		{
-			report(verbose, "journal batch failed its integrity check", path);
-			out.needsReset = true;
-			break;
+			// Several processes append at once, so a bad batch no longer means everything
+			// after it is unreachable: the next batch can start anywhere after it, aligned
+			// or not. A short tail with nothing behind it is most likely a batch another
+			// process is writing right now, and is left alone; anything else is a torn or
+			// corrupt batch with good ones behind it, which the next rewrite clears out.
+			size_t next = find_next_batch(raw, offset + 1);
+			if((next < raw.size()) || (check == BatchCheck::Invalid))
+				out.needsReset = true;
+			else
+				out.incompleteTail = true;
+			offset = next;
+			continue;
 		}
 
 		// Both halves of the identity, because runCounter restarts at 1 every time the
@@ -740,11 +831,12 @@ void read_journal(const std::string &path, uint32_t wantAlgo, const uint8_t *wan
 		// carries 0, which no batch this code writes can name.
 		if((batch.storeRun == storeRun) && (batch.storeNonce == storeNonce) && (storeNonce != 0))
 		{
-			// Aligned by construction: the static_asserts above make every batch start and
-			// every batch length a multiple of alignof(FpSlot), and raw.data() is at least
-			// that aligned because it came from the allocator.
-			const FpSlot *slots = (const FpSlot *)(raw.data() + offset + sizeof(FpBatchHeader));
-			out.slots.insert(out.slots.end(), slots, slots + batch.count);
+			// Copied rather than cast in place: after a skipped batch the next one need not
+			// start on an FpSlot boundary.
+			size_t first = out.slots.size();
+			out.slots.resize(first + (size_t)batch.count);
+			memcpy(out.slots.data() + first, raw.data() + offset + sizeof(FpBatchHeader),
+				(size_t)batch.count * sizeof(FpSlot));
 		}
 		else
 		{
@@ -808,23 +900,69 @@ void mirror_checksum_xattr(int fd, uint32_t wholeFileCrc32c, const std::string &
 	}
 }
 
+FpJournalHeader make_journal_header(uint32_t algorithmTag, const uint8_t *hostUuid)
+{
+	FpJournalHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = kJournalMagic;
+	header.version = kFormatVersion;
+	header.hashAlgo = algorithmTag;
+	memcpy(header.hostUuid, hostUuid, sizeof(header.hostUuid));
+	return header;
+}
+
+// Puts an empty journal - its header and nothing else - at path, unless one is already
+// there. Written under a temp name and linked into place, so that processes appending
+// concurrently never see a journal without its header, nor write a second header into
+// it: link() fails with EEXIST for every one of them but the first.
+bool create_journal(const std::string &path, uint32_t algorithmTag, const uint8_t *hostUuid, bool verbose)
+{
+	std::string tempPath = path + "." + std::to_string((long)getpid()) + ".tmp";
+	unlink(tempPath.c_str());
+	int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if(fd < 0)
+	{
+		report(verbose, "cannot create journal", tempPath);
+		return false;
+	}
+
+	FpJournalHeader header = make_journal_header(algorithmTag, hostUuid);
+	bool written = (write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header));
+	close(fd);
+
+	bool linked = written && ((link(tempPath.c_str(), path.c_str()) == 0) || (errno == EEXIST));
+	unlink(tempPath.c_str());
+	if(!linked)
+		report(verbose, "cannot create journal", path);
+	return linked;
+}
+
 // Appends one batch, or writes the journal from scratch when rewrite is set - the repair
 // path, which carries the records that did verify into the replacement so that a torn
 // tail costs only the batch it truncated.
 //
-// Returns false when it published nothing. The journal is then either untouched (every
-// failure on the append path rolls back) or removed (the repair path, which has to clear
-// the unusable file before it can replace it). Either way the caller's fallback - rewrite
-// the whole table, folding in the records it still holds in memory - is correct.
+// exclusive says whether the caller holds the store lock exclusively. Without it, other
+// processes may be appending to the same journal at this very moment, which shapes the
+// whole write: the batch goes out in a single O_APPEND write(), so it lands in one piece
+// after whatever the others wrote; and a failed write cannot be rolled back, because the
+// length we found may no longer be the end of the file. Its torn bytes stay behind for the
+// reader to skip, and the caller's fallback - a rewrite under the exclusive lock - clears
+// them. rewrite requires exclusive.
+//
+// Returns false when it published nothing. The caller's fallback - rewrite the whole
+// table, folding in the records it still holds in memory - is then correct. On success
+// outJournalBytes is where this batch ended, which is the journal's size unless another
+// process has appended since, and outBatchBytes is the size of the batch itself.
 bool write_journal_batch(const std::string &path, uint32_t algorithmTag, const uint8_t *hostUuid,
                          uint64_t storeRun, uint64_t storeNonce, const std::vector<FpSlot> &carried,
-                         const std::vector<FpSlot> &fresh, bool rewrite, bool verbose)
+                         const std::vector<FpSlot> &fresh, bool rewrite, bool exclusive, bool verbose,
+                         uint64_t &outJournalBytes, uint64_t &outBatchBytes)
 {
 	// Before anything is opened or removed: a batch with no records is not a thing to
 	// write. The caller relies on this to tell "nothing to publish" apart from a failure.
 	size_t carriedCount = rewrite ? carried.size() : 0;
 	uint64_t count = (uint64_t)carriedCount + (uint64_t)fresh.size();
-	if((count == 0) || (count > kMaxBatchEntries))
+	if((count == 0) || (count > kMaxBatchEntries) || (rewrite && !exclusive))
 		return false;
 
 	if(rewrite)
@@ -834,8 +972,10 @@ bool write_journal_batch(const std::string &path, uint32_t algorithmTag, const u
 	// advertised use case, and without it another user can plant this name as a symlink
 	// and have us append to a file of their choosing. O_NONBLOCK so that a planted FIFO
 	// fails the open (ENXIO) instead of blocking it until a reader turns up.
-	int fd = open(path.c_str(),
-		O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK, 0644);
+	const int appendFlags = O_WRONLY | O_APPEND | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK;
+	int fd = open(path.c_str(), appendFlags);
+	if((fd < 0) && (errno == ENOENT) && create_journal(path, algorithmTag, hostUuid, verbose))
+		fd = open(path.c_str(), appendFlags);
 	if(fd < 0)
 	{
 		report(verbose, "cannot open journal for append", path);
@@ -850,24 +990,24 @@ bool write_journal_batch(const std::string &path, uint32_t algorithmTag, const u
 		return false;
 	}
 	off_t originalSize = st.st_size;
-	bool needHeader = (originalSize == 0);
-	if(!needHeader && ((uint64_t)originalSize < sizeof(FpJournalHeader)))
-		return false; // a stub too short to hold a header: let the caller rewrite the table
+	if((uint64_t)originalSize < sizeof(FpJournalHeader))
+	{
+		// A stub left by a crash, or by a filesystem that cannot link(). Only a writer
+		// that excludes every other can tell it will be the one to give it a header.
+		if(!exclusive || (originalSize != 0))
+			return false; // let the caller rewrite the table
+		FpJournalHeader header = make_journal_header(algorithmTag, hostUuid);
+		if(write(fd, &header, sizeof(header)) != (ssize_t)sizeof(header))
+		{
+			if(ftruncate(fd, 0) != 0)
+				unlink(path.c_str());
+			return false;
+		}
+		originalSize = sizeof(header);
+	}
 
-	size_t headerBytes = needHeader ? sizeof(FpJournalHeader) : 0;
 	size_t bodyBytes = sizeof(FpBatchHeader) + (size_t)(count * sizeof(FpSlot));
-	std::vector<uint8_t> image(headerBytes + bodyBytes + sizeof(FpBatchTrailer), 0);
-
-	if(needHeader)
-	{
-		FpJournalHeader header;
-		memset(&header, 0, sizeof(header));
-		header.magic = kJournalMagic;
-		header.version = kFormatVersion;
-		header.hashAlgo = algorithmTag;
-		memcpy(header.hostUuid, hostUuid, sizeof(header.hostUuid));
-		memcpy(image.data(), &header, sizeof(header));
-	}
+	std::vector<uint8_t> image(bodyBytes + sizeof(FpBatchTrailer), 0);
 
 	FpBatchHeader batch;
 	memset(&batch, 0, sizeof(batch));
@@ -875,9 +1015,9 @@ bool write_journal_batch(const std::string &path, uint32_t algorithmTag, const u
 	batch.count = count;
 	batch.storeRun = storeRun;
 	batch.storeNonce = storeNonce;
-	memcpy(image.data() + headerBytes, &batch, sizeof(batch));
+	memcpy(image.data(), &batch, sizeof(batch));
 
-	size_t slotOffset = headerBytes + sizeof(FpBatchHeader);
+	size_t slotOffset = sizeof(FpBatchHeader);
 	if(carriedCount > 0)
 		memcpy(image.data() + slotOffset, carried.data(), carriedCount * sizeof(FpSlot));
 	if(!fresh.empty())
@@ -889,40 +1029,101 @@ bool write_journal_batch(const std::string &path, uint32_t algorithmTag, const u
 	FpBatchTrailer trailer;
 	memset(&trailer, 0, sizeof(trailer));
 	trailer.magic = kBatchEndMagic;
-	trailer.crc32c = crc32_impl(0, (const char *)(image.data() + headerBytes), bodyBytes);
-	memcpy(image.data() + headerBytes + bodyBytes, &trailer, sizeof(trailer));
+	trailer.crc32c = crc32_impl(0, (const char *)image.data(), bodyBytes);
+	memcpy(image.data() + bodyBytes, &trailer, sizeof(trailer));
 
-	const uint8_t *cursor = image.data();
-	size_t remaining = image.size();
-	bool written = true;
-	while(remaining > 0)
+	// One write() and no continuation of a short one: the remainder of a second call
+	// could land after another process's batch, tearing both.
+	ssize_t written;
+	do
 	{
-		ssize_t count2 = write(fd, cursor, remaining);
-		if(count2 <= 0)
-		{
-			if((count2 < 0) && (errno == EINTR))
-				continue;
-			written = false;
-			break;
-		}
-		cursor += count2;
-		remaining -= (size_t)count2;
+		written = write(fd, image.data(), image.size());
 	}
+	while((written < 0) && (errno == EINTR));
 
-	if(!written)
+	if(written != (ssize_t)image.size())
 	{
-		// A half-written batch is worse than a lost one: the reader stops at the first
-		// batch that fails, so everything appended after it would be unreachable until the
-		// next table rewrite. Roll back to the length we found, and if even that fails,
-		// remove the journal - the table on its own is always a complete answer.
 		report(verbose, "cannot append to journal", path);
-		if(ftruncate(fd, originalSize) != 0)
+		// A half-written batch costs the batches behind it a scan and the journal a
+		// rewrite. When nobody else can have appended since, roll back to the length we
+		// found, and if even that fails, remove the journal - the table on its own is
+		// always a complete answer.
+		if(exclusive && (written > 0) && (ftruncate(fd, originalSize) != 0))
 			unlink(path.c_str());
 		return false;
 	}
+	outJournalBytes = (uint64_t)originalSize + image.size();
+	outBatchBytes = image.size();
+	return true;
+}
+
+// Opens the store's lock file, creating the cache directory if need be. -1 on failure,
+// already reported.
+//
+// A dedicated lock file, and one that is never renamed or removed: the store inode is
+// replaced by a rewrite's rename, so a lock held on the store itself would stop excluding
+// anyone the moment the first writer finished. Independent of the manifest's lock, so two
+// playlists sharing a cache directory do not serialize on both. O_CLOEXEC keeps the
+// descriptor out of [execute] children, which would hold the lock past our own close.
+// O_NOFOLLOW because a shared cache directory is an advertised use case, and without it
+// another user can plant this name as a symlink and have us open a file of their
+// choosing for writing.
+int open_store_lock(const std::string &cacheDir, const std::string &lockPath, bool verbose)
+{
+	if(!posix_mkdir_p(cacheDir))
+	{
+		report(verbose, "cannot create cache directory for store", cacheDir);
+		return -1;
+	}
+	int fd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
+	if(fd < 0)
+		report(verbose, "cannot open store lock file", lockPath);
+	return fd;
+}
+
+// Everything done under the store lock allocates. Releasing by scope exit rather than by
+// code path means an escaping exception cannot leave the lock held until process exit
+// and wedge every concurrent replay on this store.
+struct LockGuard
+{
+	int fd;
+	~LockGuard()
+	{
+		flock(fd, LOCK_UN);
+		close(fd);
+	}
+};
+
+// Takes the store lock as operation (LOCK_SH or LOCK_EX). Converting a lock already held
+// is not atomic: flock() releases it before waiting for the new mode, so whatever was
+// read under the old one has to be read again.
+bool lock_store(int fd, int operation, const std::string &lockPath, bool verbose)
+{
+	int lockResult;
+	while(((lockResult = flock(fd, operation)) != 0) && (errno == EINTR))
+		{ /* a signal interrupted the wait: keep waiting rather than writing unlocked */ }
+	if(lockResult != 0)
+	{
+		// ENOLCK, or a filesystem that does not implement flock - realistic on the
+		// network and FUSE mounts where a shared cache directory is the whole point.
+		// Writing anyway would reintroduce the lost update the lock exists to prevent.
+		report(verbose, "cannot lock store", lockPath);
+		return false;
+	}
 	return true;
 }
 
+// What save() found on disk under the lock, and what this run has to add to it.
+struct SavePlan
+{
+	MappedStore fresh;
+	JournalContents journal;
+	// Everything this run saw that the table plus its journal does not already agree with.
+	std::vector<FpSlot> newSlots;
+	// The journal can take newSlots without the table needing a rewrite.
+	bool appendable = false;
+};
+
 } // namespace fpstore
 
 using namespace fpstore;
@@ -958,13 +1159,17 @@ FingerprintStore::~FingerprintStore()
 }
 
 std::unique_ptr<FingerprintStore>
-FingerprintStore::Open(const std::string &cacheDir, FileHashAlgorithm algorithm, bool verbose)
+FingerprintStore::Open(const std::string &cacheDir, FileHashAlgorithm algorithm, bool populate, bool verbose)
 {
+	uint64_t openStartNs = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
 	uint32_t algorithmTag;
 	if(algorithm == FileHashAlgorithm::CRC32C)
 		algorithmTag = kAlgoCrc32c;
 	else if(algorithm == FileHashAlgorithm::BLAKE3)
 		algorithmTag = kAlgoBlake3;
+	else if(algorithm == FileHashAlgorithm::XXH3)
+		algorithmTag = kAlgoXxh3;
 	else
 		return nullptr; // caller error: there is no store format for UNKNOWN or MISMATCH
 
@@ -1002,6 +1207,7 @@ FingerprintStore::Open(const std::string &cacheDir, FileHashAlgorithm algorithm,
 
 		store.reset(new FingerprintStore(cacheDir, stem + ".bin", stem + ".jrnl",
 			algorithmTag, hostUuid, verbose));
+		store->mPopulate = populate;
 	}
 	catch(...)
 	{
@@ -1009,7 +1215,9 @@ FingerprintStore::Open(const std::string &cacheDir, FileHashAlgorithm algorithm,
 	}
 
 	MappedStore mapped;
-	map_and_validate(store->mPath, algorithmTag, hostUuid, verbose, mapped);
+	uint64_t mapStartNs = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	map_and_validate(store->mPath, algorithmTag, hostUuid, populate, verbose, mapped);
+	store->mStats.mapNs = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - mapStartNs;
 	if(mapped.valid())
 	{
 		uint64_t runCounter = mapped.runCounter;
@@ -1023,6 +1231,7 @@ FingerprintStore::Open(const std::string &cacheDir, FileHashAlgorithm algorithm,
 		// actually mapped: without that pairing its records would be overlaid on a table
 		// they were never written against. Allocating, so guarded - an unreadable journal
 		// costs re-hashing, which is what every other failure in this module costs.
+		uint64_t journalStartNs = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
 		try
 		{
 			JournalContents journal;
@@ -1034,12 +1243,14 @@ FingerprintStore::Open(const std::string &cacheDir, FileHashAlgorithm algorithm,
 			store->mOverlaySlots = store->mOverlay->slots.data();
 			store->mOverlayCapacity = store->mOverlay->capacity;
 			store->mJournalCount = (size_t)store->mOverlay->distinct;
+			store->mJournalBytes = journal.bytes;
 
 			// A journal that cannot be appended to as it stands has to be rewritten, and
 			// only save() can do that. Marking the store dirty is what gets us there even
 			// on a run that changes nothing - otherwise a tail torn by a crash would sit
-			// there permanently, hiding every batch appended after it.
-			if(journal.needsReset)
+			// there permanently, costing every later reader a scan. A short tail may just
+			// be another process's append in flight; save() looks again under the lock.
+			if(journal.needsReset || journal.incompleteTail)
 				store->mDirty.store(true, std::memory_order_relaxed);
 		}
 		catch(...)
@@ -1048,8 +1259,11 @@ FingerprintStore::Open(const std::string &cacheDir, FileHashAlgorithm algorithm,
 			store->mOverlaySlots = nullptr;
 			store->mOverlayCapacity = 0;
 			store->mJournalCount = 0;
+			store->mJournalBytes = 0;
 		}
+		store->mStats.journalReadNs = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - journalStartNs;
 	}
+	store->mStats.openNs = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - openStartNs;
 	return store;
 }
 
@@ -1087,6 +1301,21 @@ FingerprintStore::lookup(const FileInfo &info, uint64_t &outContentHash) const
 	return true;
 }
 
+void
+FingerprintStore::prefetch(const FileInfo &info) const
+{
+	uint64_t key = file_key(info);
+	if(key == 0)
+		return;
+
+	// Both home slots, because find_known() reads the journal first and falls through to
+	// the table. Either is empty when it is absent, as in find_slot().
+	if((mOverlaySlots != nullptr) && (mOverlayCapacity != 0))
+		__builtin_prefetch(&mOverlaySlots[key & (mOverlayCapacity - 1)]);
+	if((mSlots != nullptr) && (mCapacity != 0))
+		__builtin_prefetch(&mSlots[key & (mCapacity - 1)]);
+}
+
 bool
 FingerprintStore::matches_known(uint64_t fileKey, uint64_t statTag, uint64_t contentHash) const
 {
@@ -1146,110 +1375,31 @@ FingerprintStore::computed_count() const
 }
 
 void
-FingerprintStore::save()
+FingerprintStore::plan_save(SavePlan &plan, bool exclusive) const
 {
-	// Called after the whole build has already succeeded. Sorting, merging and building
-	// the image all allocate, and an escaping bad_alloc here would terminate the process
-	// after the work it was protecting is done. Losing the memo costs a re-hash.
-	try
-	{
-		save_internal();
-	}
-	catch(...)
-	{
-		report(mVerbose, "could not save store", mPath);
-	}
-}
-
-void
-FingerprintStore::save_internal()
-{
-	if(!mDirty.load(std::memory_order_relaxed))
-		return; // steady state: everything this run saw is already stored
-
-	if(!posix_mkdir_p(mCacheDir))
-	{
-		report(mVerbose, "cannot create cache directory for store", mCacheDir);
-		return;
-	}
-
-	// A dedicated lock file, and one that is never renamed or removed: the store inode
-	// is replaced by the rename below, so a lock held on the store itself would stop
-	// excluding anyone the moment the first writer finished. Independent of the
-	// manifest's lock, so two playlists sharing a cache directory do not serialize on
-	// both. O_CLOEXEC keeps the descriptor out of [execute] children, which would hold
-	// the lock past our own close. O_NOFOLLOW because a shared cache directory is an
-	// advertised use case, and without it another user can plant this name as a symlink
-	// and have us open a file of their choosing for writing.
-	std::string lockPath = mPath + ".lock";
-	int lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC | O_NOFOLLOW, 0644);
-	if(lockFd < 0)
-	{
-		report(mVerbose, "cannot open store lock file", lockPath);
-		return;
-	}
-	// Everything from here to the unlock allocates. Releasing by scope exit rather than
-	// by code path means an escaping exception cannot leave the exclusive lock held
-	// until process exit and wedge every concurrent replay on this store.
-	struct LockGuard
-	{
-		int fd;
-		~LockGuard()
-		{
-			flock(fd, LOCK_UN);
-			close(fd);
-		}
-	} lockGuard{lockFd};
-
-	int lockResult;
-	while(((lockResult = flock(lockFd, LOCK_EX)) != 0) && (errno == EINTR))
-		{ /* a signal interrupted the wait: keep waiting rather than writing unlocked */ }
-	if(lockResult != 0)
-	{
-		// ENOLCK, or a filesystem that does not implement flock - realistic on the
-		// network and FUSE mounts where a shared cache directory is the whole point.
-		// Writing anyway would reintroduce the lost update the lock exists to prevent.
-		report(mVerbose, "cannot lock store", lockPath);
-		return;
-	}
-
 	// Re-read under the lock. Another process may have published since we mapped ours,
 	// and merging into that is what keeps two concurrent playlists from each dropping
 	// the other's entries.
-	MappedStore fresh;
-	map_and_validate(mPath, mAlgorithmTag, mHostUuid, mVerbose, fresh);
-
-	// Collapse duplicates so the table is sized from the number of files, not from the
-	// number of (task, file) pairs - a header included by a thousand tasks would
-	// otherwise inflate the store a thousandfold. Independent per shard, so it fans out.
-	// A file always lands in the same shard (the shard is chosen from its key), so a
-	// per-shard dedupe is a global one.
-	//
-	// From here to the end, the shard vectors are read and rewritten WITHOUT their
-	// mutexes. That is not an oversight and the mutexes would not fix it: the dedupe
-	// reorders and shrinks each vector while the merge loops below hold references into
-	// it, so a record() landing anywhere in this window is a bug no lock can absorb.
-	// The precondition is the one save() documents - called once, after the scheduler
-	// has drained - and taking the locks here would only make concurrent recording look
-	// supported.
-	Shard *shards = mShards.get();
-	dispatch_apply(kShardCount, DISPATCH_APPLY_AUTO, ^(size_t i) {
-		dedupe_shard(shards[i].records);
-	});
-
-	uint64_t uniqueRecords = 0;
-	for(size_t i = 0; i < kShardCount; ++i)
-		uniqueRecords += shards[i].records.size();
+	MappedStore &fresh = plan.fresh;
+	map_and_validate(mPath, mAlgorithmTag, mHostUuid, mPopulate, mVerbose, fresh);
+	plan.newSlots.clear();
+	plan.appendable = false;
 
 	// The journal as it stands right now, which is not necessarily the one this process
 	// loaded: another run may have appended to it, or replaced the table under it, since.
 	// Paired with the image we just mapped, for the same reason Open pairs them.
-	JournalContents journal;
+	JournalContents &journal = plan.journal;
+	journal.slots.clear();
+	journal.needsReset = false;
+	journal.incompleteTail = false;
 	if(fresh.valid())
 	{
 		read_journal(mJournalPath, mAlgorithmTag, mHostUuid, fresh.runCounter, fresh.nonce,
 			mVerbose, journal);
 	}
+	// Nobody appends while the lock is held exclusively, so a batch cut short is torn.
+	if(exclusive && journal.incompleteTail)
+		journal.needsReset = true;
 
 	SlotIndex published;
 	build_index(journal.slots, published);
@@ -1257,7 +1407,8 @@ FingerprintStore::save_internal()
 	// Everything this run saw that the table plus its journal does not already agree with.
 	// On an incremental run this is a handful of files out of thousands, and it is exactly
 	// what the journal exists to write instead of the whole table.
-	std::vector<FpSlot> newSlots;
+	std::vector<FpSlot> &newSlots = plan.newSlots;
+	const Shard *shards = mShards.get();
 	for(size_t i = 0; i < kShardCount; ++i)
 	{
 		for(const PendingRecord &pending : shards[i].records)
@@ -1285,18 +1436,6 @@ FingerprintStore::save_internal()
 		}
 	}
 
-	// Another process may have published everything we saw between our load and this lock,
-	// which turns a dirty run back into a no-op.
-	if(newSlots.empty() && !journal.needsReset)
-	{
-		mDirty.store(false, std::memory_order_relaxed);
-		return;
-	}
-
-	// Append when the journal can absorb this run's changes; rewrite the table when it
-	// cannot. The rewrite is what compacts - it folds the journal back in, applies
-	// eviction and resizes - so the journal never has to hold more than a bounded delta.
-	//
 	// Both bounds are heuristics for WHEN to compact, never for correctness: the append
 	// does not touch the table, and the rewrite sizes itself from what it actually merges.
 	// fresh.count being the header's advisory value is therefore harmless here.
@@ -1309,72 +1448,359 @@ FingerprintStore::save_internal()
 	// journal could never grow enough to trigger the compaction that would fix it.
 	// Falling through to a rewrite instead costs one full write and mints a nonce, after
 	// which the journal works normally.
-	if(fresh.valid() && (fresh.nonce != 0))
+	if(!fresh.valid() || (fresh.nonce == 0))
+		return;
+
+	uint64_t journalTotal = (uint64_t)journal.slots.size() + (uint64_t)newSlots.size();
+
+	// How many of those would be NEW slots in the table rather than overwrites of one
+	// it already has. The distinction is the whole point: a run that rewrote a
+	// thousand existing files adds nothing to the table's occupancy, and counting
+	// those as new made it compact - and then GROW - for a load it was never going to
+	// carry. Measured on 20000 files, the naive count compacted at 4090 journal
+	// entries against a budget of 8192 and doubled the table to 2 MB for 20001 entries.
+	SlotIndex pending;
 	{
-		uint64_t journalTotal = (uint64_t)journal.slots.size() + (uint64_t)newSlots.size();
+		std::vector<FpSlot> combined = journal.slots;
+		combined.insert(combined.end(), newSlots.begin(), newSlots.end());
+		build_index(combined, pending);
+	}
+	uint64_t trulyNew = 0;
+	for(const FpSlot &slot : pending.slots)
+	{
+		if(slot.fileKey == 0)
+			continue;
+		if(find_slot(fresh.slots(), fresh.capacity, slot.fileKey) == nullptr)
+			++trulyNew;
+	}
+
+	// Entries, and separately bytes: the entry budget is a fraction of the table, and
+	// for an enormous table that fraction can exceed what the reader is willing to
+	// read back (kMaxJournalBytes). Appending past that would produce a journal the
+	// next run resets wholesale, losing the records and re-hashing every time.
+	uint64_t journalBytes = sizeof(FpJournalHeader) +
+		(journalTotal * sizeof(FpSlot)) + sizeof(FpBatchHeader) + sizeof(FpBatchTrailer);
+	bool fitsJournal = (journalTotal <= journal_budget(fresh.capacity)) &&
+		(journalBytes <= kMaxJournalBytes);
+	bool fitsTable = ((double)(fresh.count + trulyNew) <=
+		((double)fresh.capacity * kMaxLoadFactor));
+	if(mDeferCompaction)
+	{
+		// Deferred compaction drops both heuristics and keeps only the reader's hard
+		// limit: the run appends whatever it has, and the folding is left to compact().
+		plan.appendable = (journalBytes <= kMaxJournalBytes);
+	}
+	else
+	{
+		plan.appendable = fitsJournal && fitsTable;
+	}
+}
+
+FingerprintStore::Stats
+FingerprintStore::stats() const
+{
+	Stats result = mStats;
+	result.hits = hit_count();
+	result.computed = computed_count();
+	result.journalBytes = mJournalBytes;
+	measure_table(mSlots, mCapacity, result.table);
+	measure_table(mOverlaySlots, mOverlayCapacity, result.overlay);
+	return result;
+}
 
-		// How many of those would be NEW slots in the table rather than overwrites of one
-		// it already has. The distinction is the whole point: a run that rewrote a
-		// thousand existing files adds nothing to the table's occupancy, and counting
-		// those as new made it compact - and then GROW - for a load it was never going to
-		// carry. Measured on 20000 files, the naive count compacted at 4090 journal
-		// entries against a budget of 8192 and doubled the table to 2 MB for 20001 entries.
-		SlotIndex pending;
+const char *
+FingerprintStore::save_route_name(SaveRoute route)
+{
+	switch(route)
+	{
+		case SaveRoute::NotSaved:        return "not-saved";
+		case SaveRoute::Unchanged:       return "unchanged";
+		case SaveRoute::Appended:        return "appended";
+		case SaveRoute::JournalRepaired: return "journal-repaired";
+		case SaveRoute::TableRewritten:  return "table-rewritten";
+		case SaveRoute::Failed:          return "failed";
+	}
+	return "unknown";
+}
+
+static const char *const kProbeBucketNames[FingerprintStore::kProbeBuckets] =
+{
+	"1", "2", "3-4", "5-8", "9-16", "17-32", "33+"
+};
+
+static double
+ns_to_ms(uint64_t ns)
+{
+	return (double)ns / 1e6;
+}
+
+void
+FingerprintStore::log_stats() const
+{
+	Stats st = stats();
+
+	LogError("memo: open %.2f ms (table %.2f ms, journal %.2f ms), save %.2f ms (%s, %llu bytes written)",
+		ns_to_ms(st.openNs), ns_to_ms(st.mapNs), ns_to_ms(st.journalReadNs), ns_to_ms(st.saveNs),
+		save_route_name(st.saveRoute), (unsigned long long)st.bytesWritten);
+	if(st.compactNs != 0)
+		LogError(", compact %.2f ms", ns_to_ms(st.compactNs));
+	LogError("\n");
+
+	LogError("memo: table %llu of %llu slots (load %.2f), journal %llu of %llu slots (load %.2f) in %llu bytes\n",
+		(unsigned long long)st.table.entries, (unsigned long long)st.table.capacity, st.table.load_factor(),
+		(unsigned long long)st.overlay.entries, (unsigned long long)st.overlay.capacity,
+		st.overlay.load_factor(), (unsigned long long)st.journalBytes);
+
+	const struct { const char *name; const TableStats *table; } tables[] =
+	{
+		{"table", &st.table},
+		{"journal", &st.overlay},
+	};
+	for(const auto &one : tables)
+	{
+		if(one.table->entries == 0)
+			continue;
+		LogError("memo: %s probe lengths", one.name);
+		for(size_t i = 0; i < kProbeBuckets; ++i)
+			LogError(" %s:%llu", kProbeBucketNames[i], (unsigned long long)one.table->probes[i]);
+		LogError(", longest %llu\n", (unsigned long long)one.table->maxProbe);
+	}
+}
+
+static Json::MutableVal
+table_stats_json(Json::MutableDoc &doc, const FingerprintStore::TableStats &table)
+{
+	Json::MutableVal obj = doc.new_obj();
+	doc.obj_add(obj, "capacity", doc.new_uint(table.capacity));
+	doc.obj_add(obj, "entries", doc.new_uint(table.entries));
+	doc.obj_add(obj, "load_factor", doc.new_real(table.load_factor()));
+	Json::MutableVal probes = doc.new_obj();
+	for(size_t i = 0; i < FingerprintStore::kProbeBuckets; ++i)
+		doc.obj_add(probes, kProbeBucketNames[i], doc.new_uint(table.probes[i]));
+	doc.obj_add(obj, "probe_lengths", probes);
+	doc.obj_add(obj, "longest_probe", doc.new_uint(table.maxProbe));
+	return obj;
+}
+
+bool
+FingerprintStore::write_stats_json(const std::string &path) const
+{
+	Stats st = stats();
+
+	Json::MutableDoc doc;
+	Json::MutableVal root = doc.new_obj();
+	doc.obj_add(root, "store", doc.new_str(mPath));
+	doc.obj_add(root, "hash_algorithm", doc.new_str(algorithm_name(mAlgorithmTag)));
+	doc.obj_add(root, "hits", doc.new_uint(st.hits));
+	doc.obj_add(root, "computed", doc.new_uint(st.computed));
+	doc.obj_add(root, "table", table_stats_json(doc, st.table));
+
+	Json::MutableVal journal = table_stats_json(doc, st.overlay);
+	doc.obj_add(journal, "bytes", doc.new_uint(st.journalBytes));
+	doc.obj_add(root, "journal", journal);
+
+	Json::MutableVal timing = doc.new_obj();
+	doc.obj_add(timing, "open", doc.new_real(ns_to_ms(st.openNs)));
+	doc.obj_add(timing, "map", doc.new_real(ns_to_ms(st.mapNs)));
+	doc.obj_add(timing, "journal_read", doc.new_real(ns_to_ms(st.journalReadNs)));
+	doc.obj_add(timing, "save", doc.new_real(ns_to_ms(st.saveNs)));
+	doc.obj_add(timing, "compact", doc.new_real(ns_to_ms(st.compactNs)));
+	doc.obj_add(root, "timing_ms", timing);
+
+	Json::MutableVal save = doc.new_obj();
+	doc.obj_add(save, "route", doc.new_str(save_route_name(st.saveRoute)));
+	doc.obj_add(save, "bytes_written", doc.new_uint(st.bytesWritten));
+	doc.obj_add(root, "save", save);
+	doc.set_root(root);
+
+	// Only a report: written straight to its path, with no temp file and no lock.
+	return write_json_doc_to_file(doc, path.c_str()) == EXIT_SUCCESS;
+}
+
+void
+FingerprintStore::save()
+{
+	// Called after the whole build has already succeeded. Sorting, merging and building
+	// the image all allocate, and an escaping bad_alloc here would terminate the process
+	// after the work it was protecting is done. Losing the memo costs a re-hash.
+	uint64_t startNs = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	try
+	{
+		save_internal();
+	}
+	catch(...)
+	{
+		mStats.saveRoute = SaveRoute::Failed;
+		report(mVerbose, "could not save store", mPath);
+	}
+	mStats.saveNs = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - startNs;
+}
+
+uint64_t
+FingerprintStore::collapse_records()
+{
+	// Collapse duplicates so the table is sized from the number of files, not from the
+	// number of (task, file) pairs - a header included by a thousand tasks would
+	// otherwise inflate the store a thousandfold. Independent per shard, so it fans out.
+	// A file always lands in the same shard (the shard is chosen from its key), so a
+	// per-shard dedupe is a global one.
+	//
+	// From here until save() or compact() returns, the shard vectors are read and
+	// rewritten WITHOUT their mutexes. That is not an oversight and the mutexes would not
+	// fix it: the dedupe reorders and shrinks each vector while the merge loops hold
+	// references into it, so a record() landing anywhere in this window is a bug no lock
+	// can absorb.
+	// The precondition is the one save() documents - called once, after the scheduler
+	// has drained - and taking the locks here would only make concurrent recording look
+	// supported.
+	Shard *shards = mShards.get();
+	dispatch_apply(kShardCount, DISPATCH_APPLY_AUTO, ^(size_t i) {
+		dedupe_shard(shards[i].records);
+	});
+
+	uint64_t uniqueRecords = 0;
+	for(size_t i = 0; i < kShardCount; ++i)
+		uniqueRecords += shards[i].records.size();
+	return uniqueRecords;
+}
+
+void
+FingerprintStore::save_internal()
+{
+	mStats.saveRoute = SaveRoute::Unchanged;
+	if(!mDirty.load(std::memory_order_relaxed))
+		return; // steady state: everything this run saw is already stored
+
+	// Until something is published, every way out of here is a failure.
+	mStats.saveRoute = SaveRoute::Failed;
+	uint64_t uniqueRecords = collapse_records();
+
+	std::string lockPath = mPath + ".lock";
+	int lockFd = open_store_lock(mCacheDir, lockPath, mVerbose);
+	if(lockFd < 0)
+		return;
+	LockGuard lockGuard{lockFd};
+
+	// Two passes. The common incremental run only appends one batch to the journal, and
+	// appends are safe alongside each other, so that pass holds the lock SHARED: it keeps a
+	// rewrite from replacing the table or the journal underneath, while parallel runs on
+	// one cache directory all append at once instead of queueing behind each other. A run
+	// that has to rewrite - the journal is full or damaged, or the append failed - comes
+	// back for the lock exclusively and plans again from what is on disk then.
+	SavePlan plan;
+	if(!lock_store(lockFd, LOCK_SH, lockPath, mVerbose))
+		return;
+	plan_save(plan, false);
+
+	// Another process may have published everything we saw between our load and this lock,
+	// which turns a dirty run back into a no-op. A short tail is only settled by looking
+	// again with the lock exclusive: either its append finished by then, or it was torn.
+	if(plan.newSlots.empty() && !plan.journal.needsReset && !plan.journal.incompleteTail)
+	{
+		mStats.saveRoute = SaveRoute::Unchanged;
+		mDirty.store(false, std::memory_order_relaxed);
+		return;
+	}
+
+	uint64_t journalBytes = 0;
+	uint64_t batchBytes = 0;
+	if(plan.appendable && !plan.newSlots.empty() && !plan.journal.needsReset &&
+	   write_journal_batch(mJournalPath, mAlgorithmTag, mHostUuid, plan.fresh.runCounter,
+			plan.fresh.nonce, plan.journal.slots, plan.newSlots, false, false, mVerbose, journalBytes,
+			batchBytes))
+	{
+		if(mVerbose)
 		{
-			std::vector<FpSlot> combined = journal.slots;
-			combined.insert(combined.end(), newSlots.begin(), newSlots.end());
-			build_index(combined, pending);
+			LogError("memo: appended %zu records to the journal, now %llu bytes\n",
+				(size_t)plan.newSlots.size(), (unsigned long long)journalBytes);
 		}
-		uint64_t trulyNew = 0;
-		for(const FpSlot &slot : pending.slots)
+		// The overlay this object still holds is now a run out of date. Nothing reads it
+		// again - save() is called once, at the end - and rebuilding it would only serve a
+		// second save that has nothing left to publish.
+		mStats.saveRoute = SaveRoute::Appended;
+		mStats.bytesWritten += batchBytes;
+		mDirty.store(false, std::memory_order_relaxed);
+		return;
+	}
+
+	if(!lock_store(lockFd, LOCK_EX, lockPath, mVerbose))
+		return;
+	plan_save(plan, true);
+
+	MappedStore &fresh = plan.fresh;
+	JournalContents &journal = plan.journal;
+	const std::vector<FpSlot> &newSlots = plan.newSlots;
+	if(newSlots.empty() && !journal.needsReset)
+	{
+		mStats.saveRoute = SaveRoute::Unchanged;
+		mDirty.store(false, std::memory_order_relaxed);
+		return;
+	}
+
+	// Append when the journal can absorb this run's changes; rewrite the table when it
+	// cannot. The rewrite is what compacts - it folds the journal back in, applies
+	// eviction and resizes - so the journal never has to hold more than a bounded delta,
+	// unless compaction is deferred to compact(). Under the exclusive lock the append
+	// may also repair: it rewrites the journal from the batches that verified when the
+	// one on disk cannot be appended to as it stands.
+	if(plan.appendable)
+	{
+		// Nothing to write and nothing worth carrying: the journal is simply unusable,
+		// and removing it is the entire repair. Falling through to a table rewrite
+		// here would publish a fresh copy of bytes that are already correct.
+		if(newSlots.empty() && journal.slots.empty())
 		{
-			if(slot.fileKey == 0)
-				continue;
-			if(find_slot(fresh.slots(), fresh.capacity, slot.fileKey) == nullptr)
-				++trulyNew;
+			unlink(mJournalPath.c_str());
+			mStats.saveRoute = SaveRoute::JournalRepaired;
+			mDirty.store(false, std::memory_order_relaxed);
+			return;
 		}
-
-		// Entries, and separately bytes: the entry budget is a fraction of the table, and
-		// for an enormous table that fraction can exceed what the reader is willing to
-		// read back (kMaxJournalBytes). Appending past that would produce a journal the
-		// next run resets wholesale, losing the records and re-hashing every time.
-		uint64_t journalBytes = sizeof(FpJournalHeader) +
-			(journalTotal * sizeof(FpSlot)) + sizeof(FpBatchHeader) + sizeof(FpBatchTrailer);
-		bool fitsJournal = (journalTotal <= journal_budget(fresh.capacity)) &&
-			(journalBytes <= kMaxJournalBytes);
-		bool fitsTable = ((double)(fresh.count + trulyNew) <=
-			((double)fresh.capacity * kMaxLoadFactor));
-		if(fitsJournal && fitsTable)
+		if(write_journal_batch(mJournalPath, mAlgorithmTag, mHostUuid, fresh.runCounter,
+				fresh.nonce, journal.slots, newSlots, journal.needsReset, true, mVerbose, journalBytes,
+				batchBytes))
 		{
-			// Nothing to write and nothing worth carrying: the journal is simply unusable,
-			// and removing it is the entire repair. Falling through to a table rewrite
-			// here would publish a fresh copy of bytes that are already correct.
-			if(newSlots.empty() && journal.slots.empty())
+			if(mVerbose && journal.needsReset)
 			{
-				unlink(mJournalPath.c_str());
-				mDirty.store(false, std::memory_order_relaxed);
-				return;
+				LogError("memo: rewrote the journal with %zu records, now %llu bytes\n",
+					journal.slots.size() + newSlots.size(), (unsigned long long)journalBytes);
 			}
-			if(write_journal_batch(mJournalPath, mAlgorithmTag, mHostUuid, fresh.runCounter,
-					fresh.nonce, journal.slots, newSlots, journal.needsReset, mVerbose))
+			else if(mVerbose)
 			{
-				if(mVerbose)
-				{
-					LogError("memo: appended %zu records to the journal\n",
-						(size_t)newSlots.size());
-				}
-				// The overlay this object still holds is now a run out of date. Nothing
-				// reads it again - save() is called once, at the end - and rebuilding it
-				// would only serve a second save that has nothing left to publish.
-				mDirty.store(false, std::memory_order_relaxed);
-				return;
+				LogError("memo: appended %zu records to the journal, now %llu bytes\n",
+					(size_t)newSlots.size(), (unsigned long long)journalBytes);
 			}
-			// The append failed and rolled itself back. Fall through and rewrite instead:
-			// the table is the durable half, and it can always absorb what the journal
-			// could not take.
+			mStats.saveRoute = journal.needsReset ? SaveRoute::JournalRepaired : SaveRoute::Appended;
+			mStats.bytesWritten += batchBytes;
+			mDirty.store(false, std::memory_order_relaxed);
+			return;
 		}
+		// The append failed and rolled itself back. Fall through and rewrite instead:
+		// the table is the durable half, and it can always absorb what the journal
+		// could not take.
+	}
+
+	if(rewrite_store(plan, uniqueRecords))
+	{
+		// Published. A second save() would only rewrite the same bytes.
+		mStats.saveRoute = SaveRoute::TableRewritten;
+		mDirty.store(false, std::memory_order_relaxed);
 	}
 
+	// lockGuard releases the flock and closes the descriptor here.
+}
+
+bool
+FingerprintStore::rewrite_store(SavePlan &plan, uint64_t uniqueRecords)
+{
+	// Timed from here rather than from save(): waiting for the lock is contention, and
+	// what -v is meant to show is what the rewrite itself costs.
+	uint64_t startNs = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+
+	MappedStore &fresh = plan.fresh;
+	JournalContents &journal = plan.journal;
+	uint64_t foldedJournalBytes = journal.bytes;
+	const Shard *shards = mShards.get();
+
 	uint64_t oldRun = fresh.valid() ? fresh.runCounter : 0;
 	bool keepSurvivors = fresh.valid();
 	if(oldRun >= kMaxRunCounter)
@@ -1426,7 +1852,7 @@ FingerprintStore::save_internal()
 		if(capacity >= kMaxCapacity)
 		{
 			report(mVerbose, "too many entries to store", mPath);
-			return;
+			return false;
 		}
 		capacity <<= 1;
 	}
@@ -1520,7 +1946,7 @@ FingerprintStore::save_internal()
 	if(tempFd < 0)
 	{
 		report(mVerbose, "cannot create temporary store", tempPath);
-		return;
+		return false;
 	}
 
 	const uint8_t *cursor = image.data();
@@ -1554,7 +1980,7 @@ FingerprintStore::save_internal()
 	{
 		report(mVerbose, "cannot write temporary store", tempPath);
 		unlink(tempPath.c_str());
-		return;
+		return false;
 	}
 
 	// Atomic against concurrent readers: they see either the old inode or the new one,
@@ -1569,9 +1995,11 @@ FingerprintStore::save_internal()
 		// The rename can fail in ways that leave the temp intact (ENOSPC, EROFS, the
 		// store path replaced by a directory); clean up or it stays there forever.
 		unlink(tempPath.c_str());
-		return;
+		return false;
 	}
 
+	mStats.bytesWritten += image.size();
+
 	// The journal described the image that was just replaced, and everything in it has
 	// been folded into the new one. Clearing it AFTER the rename is deliberate: a crash in
 	// between leaves records that are still true but belong to a superseded generation,
@@ -1580,10 +2008,58 @@ FingerprintStore::save_internal()
 	unlink(mJournalPath.c_str());
 
 	if(mVerbose)
-		LogError("memo: rewrote the store with %zu entries\n", (size_t)inserted);
+	{
+		LogError("memo: rewrote the store with %zu entries in %.1f ms, folding in a %llu-byte journal\n",
+			(size_t)inserted, (double)(clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - startNs) / 1e6,
+			(unsigned long long)foldedJournalBytes);
+	}
+	return true;
+}
+
+void
+FingerprintStore::compact()
+{
+	// Same guard as save(), for the same reason: the rewrite allocates, and failing to
+	// compact costs nothing but a larger journal for the next run to read.
+	uint64_t startNs = clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+	try
+	{
+		compact_internal();
+	}
+	catch(...)
+	{
+		report(mVerbose, "could not compact store", mPath);
+	}
+	mStats.compactNs = clock_gettime_nsec_np(CLOCK_UPTIME_RAW) - startNs;
+}
 
-	// Published. A second save() would only rewrite the same bytes.
-	mDirty.store(false, std::memory_order_relaxed);
+void
+FingerprintStore::compact_internal()
+{
+	uint64_t uniqueRecords = collapse_records();
 
-	// lockGuard releases the flock and closes the descriptor here.
+	std::string lockPath = mPath + ".lock";
+	int lockFd = open_store_lock(mCacheDir, lockPath, mVerbose);
+	if(lockFd < 0)
+		return;
+	LockGuard lockGuard{lockFd};
+	if(!lock_store(lockFd, LOCK_EX, lockPath, mVerbose))
+		return;
+
+	SavePlan plan;
+	plan_save(plan, true);
+
+	// A table with no journal is already compact, and rewriting it anyway would age every
+	// entry in it by one run for nothing.
+	struct stat st;
+	bool haveJournal = (lstat(mJournalPath.c_str(), &st) == 0);
+	if(!haveJournal && plan.newSlots.empty())
+	{
+		if(mVerbose)
+			LogError("memo: nothing to compact: %s has no journal\n", mPath.c_str());
+		return;
+	}
+
+	if(rewrite_store(plan, uniqueRecords))
+		mDirty.store(false, std::memory_order_relaxed);
 }
@@ -33,6 +33,12 @@
 // the next run that does not fit folds the journal back in, which is also where eviction
 // and resizing happen. Lookups read the journal first, because it is newer.
 //
+// Several processes can publish into one store at once. Appends hold the store lock
+// shared, and each batch goes out in a single O_APPEND write with its own checksum, so
+// concurrent runs land their batches side by side instead of queueing. Only a rewrite
+// holds the lock exclusively. Readers take no lock at all: they validate batch by batch
+// and step over one that is torn or still being written.
+//
 // Every entry point is thread-safe. lookup() is lock-free (it only reads the mapping and
 // the journal overlay, both immutable for the life of the object); record() shards its
 // writes; save() is called once, after the scheduler has drained.
@@ -49,11 +55,55 @@ namespace fpstore
 {
 	struct FpSlot;    // on-disk slot; the layout lives in FingerprintStore.cpp
 	struct SlotIndex; // an in-memory probe table, used to overlay the journal on the table
+	struct SavePlan;  // what save() found on disk under the lock, and what it will add
 }
 
 class FingerprintStore
 {
 public:
+	// Which route save() took. Only the last save counts.
+	enum class SaveRoute
+	{
+		NotSaved,        // save() was not called, as under --dry-run
+		Unchanged,       // everything was already on disk: nothing written
+		Appended,        // one batch appended to the journal
+		JournalRepaired, // the journal rewritten from the batches that verified, or removed
+		TableRewritten,  // the table rewritten, with the journal folded in
+		Failed           // something needed publishing and was not published
+	};
+
+	// Probe lengths are bucketed by powers of two: 1, 2, 3-4, 5-8, 9-16, 17-32, 33 and up.
+	static constexpr size_t kProbeBuckets = 7;
+
+	// The shape of one open-addressed table. probes[] counts entries by how many slots a
+	// successful lookup of each one inspects, 1 being its home slot: that is what a hit
+	// costs, and long runs there are what a full or badly clustered table looks like.
+	struct TableStats
+	{
+		uint64_t capacity = 0;
+		uint64_t entries = 0;
+		uint64_t probes[kProbeBuckets] = {};
+		uint64_t maxProbe = 0;
+
+		double load_factor() const { return (capacity != 0) ? ((double)entries / (double)capacity) : 0.0; }
+	};
+
+	struct Stats
+	{
+		size_t hits = 0;
+		size_t computed = 0;
+		TableStats table;
+		TableStats overlay;         // the journal, as indexed for lookups
+		uint64_t journalBytes = 0;  // as loaded
+		uint64_t openNs = 0;        // all of Open()
+		uint64_t mapNs = 0;         // of which: mapping and validating the table
+		uint64_t journalReadNs = 0; // of which: reading and indexing the journal
+		uint64_t saveNs = 0;
+		uint64_t compactNs = 0;
+		uint64_t bytesWritten = 0;  // by save() and compact() together
+		SaveRoute saveRoute = SaveRoute::NotSaved;
+	};
+
 	// Opens the store for one cache directory and one hash algorithm.
 	//
 	// Never fails because of the file: absent, unreadable, truncated, wrong magic,
@@ -62,11 +112,15 @@ public:
 	// not be read is rebuilt wholesale by the next save(); it is never unlinked, so a
 	// transient read error on a network mount does not destroy good data.
 	//
+	// populate faults the whole table in when it is mapped (--cache-memo-populate),
+	// instead of page by page as its checksum is verified.
+	//
 	// Returns nullptr only when the caller passed an algorithm that is neither CRC32C
 	// nor BLAKE3, or when the object itself could not be allocated. Reasons are reported
 	// once, and only under verbose.
 	static std::unique_ptr<FingerprintStore> Open(const std::string &cacheDir,
 	                                              FileHashAlgorithm algorithm,
+	                                              bool populate,
 	                                              bool verbose);
 
 	~FingerprintStore();
@@ -81,6 +135,12 @@ public:
 	// condition under which the file's bytes cannot have changed.
 	bool lookup(const FileInfo &info, uint64_t &outContentHash) const;
 
+	// Starts loading the slots a later lookup(info) will probe first, and returns at once.
+	// A caller walking a list of files issues it one file ahead, so the cache and TLB miss
+	// on a large table overlaps the work on the current file instead of stalling the next.
+	// A hint only: it reads nothing and never faults.
+	void prefetch(const FileInfo &info) const;
+
 	// Records what this run knows about one file. Call for EVERY file looked up, hit or
 	// miss: a run that only recorded its misses would let every unchanged file's entry
 	// age out and be evicted in one go, and re-hashing a whole tree at once is precisely
@@ -111,6 +171,17 @@ public:
 	// has finished. Never throws and never fails the run: losing the memo costs a re-hash.
 	void save();
 
+	// Keeps save() off the rewrite route whenever the journal can still be read back:
+	// the run appends its changes however many there are, and folding the journal into
+	// the table is left to compact(). For stores large enough that the rewrite would
+	// dominate the tail of an otherwise cached run. Call before save().
+	void set_defer_compaction(bool defer) { mDeferCompaction = defer; }
+
+	// Folds the journal into the table now, under the exclusive lock: the rewrite save()
+	// would otherwise do when the journal outgrows its budget, evicting and resizing
+	// included. A store with no journal is left alone. Like save(), never throws.
+	void compact();
+
 	// Entries in the table as loaded. Advisory - it is the header's own count, which is
 	// never used for bounds. Excludes the journal; see journal_entry_count().
 	size_t loaded_entry_count() const { return mLoadedCount; }
@@ -118,6 +189,9 @@ public:
 	// Distinct entries the journal overlays on the table, as loaded.
 	size_t journal_entry_count() const { return mJournalCount; }
 
+	// The journal's size in bytes, as loaded.
+	uint64_t journal_bytes() const { return mJournalBytes; }
+
 	const std::string &journal_path() const { return mJournalPath; }
 
 	// Counted per lookup, not per file: a header fingerprinted by twenty tasks counts
@@ -130,12 +204,41 @@ public:
 
 	const std::string &path() const { return mPath; }
 
+	// The tables are described as this run opened them, which is what its lookups probed.
+	// Their probe histograms are computed here by walking them rather than counted on the
+	// lookup path, which keeps lookup() free of shared writes but touches every
+	// page of the mapping. Meant for the end of a run, under -v or --cache-memo-stats.
+	Stats stats() const;
+
+	// The -v report of stats(), a few lines on the error stream.
+	void log_stats() const;
+
+	// stats() as a JSON document at path, for dashboards. Reports and returns false when
+	// the file cannot be written; the run does not fail for it.
+	bool write_stats_json(const std::string &path) const;
+
+	static const char *save_route_name(SaveRoute route);
+
 private:
 	FingerprintStore(std::string cacheDir, std::string path, std::string journalPath,
 	                 uint32_t algorithmTag, const uint8_t *hostUuid, bool verbose);
 
-	// The body of save(), which only adds the exception guard around it.
+	// The bodies of save() and compact(), which only add the exception guard around them.
 	void save_internal();
+	void compact_internal();
+
+	// Dedupes this run's records in place and returns how many are left.
+	uint64_t collapse_records();
+
+	// Maps the store and reads its journal as they are on disk now, and works out which of
+	// this run's records they lack and whether the journal can take them. Called with the
+	// store lock held; exclusive says in which mode.
+	void plan_save(fpstore::SavePlan &plan, bool exclusive) const;
+
+	// Writes a new table from the plan's image, its journal and this run's records, then
+	// clears the journal. Called with the store lock held exclusively. False when nothing
+	// was published.
+	bool rewrite_store(fpstore::SavePlan &plan, uint64_t uniqueRecords);
 
 	// The entry for this file in the journal overlay if it has one, otherwise the entry in
 	// the table, otherwise null. The journal is newer than the table by construction, so
@@ -154,6 +257,7 @@ private:
 	uint32_t mAlgorithmTag = 0;
 	uint8_t mHostUuid[16] = {0};
 	bool mVerbose = false;
+	bool mPopulate = false;
 
 	// The loaded mapping. mSlots is null when there is no valid store on disk, which is
 	// the normal cold case and not an error.
@@ -175,9 +279,14 @@ private:
 	const fpstore::FpSlot *mOverlaySlots = nullptr;
 	uint64_t mOverlayCapacity = 0;
 	size_t mJournalCount = 0;
+	uint64_t mJournalBytes = 0;
+	bool mDeferCompaction = false;
 
 	std::unique_ptr<Shard[]> mShards;
 
+	// Timings, the save route and bytes written. The rest of stats() is derived on demand.
+	Stats mStats;
+
 	mutable std::atomic<size_t> mHits{0};
 	std::atomic<size_t> mStores{0};
 	std::atomic<bool> mDirty{false};
@@ -215,6 +215,9 @@ HandleActionStep(ActionStep step, ReplayContext *context, action_handler_t actio
 		oneInfo.cacheable = cacheable && cacheAllowed;
 		oneInfo.extras = std::move(extras);
 		oneInfo.outputsExistenceOnly = outputsExistenceOnly;
+		// A hardlink's product is the link to its source; a restored copy would have the
+		// same bytes and none of the sharing.
+		oneInfo.outputsRestorable = (replayAction != kFileActionHardlink);
 		actionHandler(std::move(actionFn), std::move(actionInputs), std::move(actionMutatingInputs), std::move(actionExclusiveInputs), std::move(actionOutputs), std::move(oneInfo));
 	};
 
@@ -129,6 +129,12 @@ typedef struct
 	FileHashAlgorithm cacheHash;
 	CacheMemo cacheMemo;            // --cache-memo: where per-file content hashes are memoized
 	bool cacheMemoRefresh;          // --cache-memo-refresh: recompute every hash and rewrite the memo
+	bool cacheDeferCompaction;      // --cache-defer-compaction: append to the memo journal, never fold it
+	bool cacheCompact;              // --cache-compact: fold the memo journal into its index
+	std::string cacheMemoStatsPath; // --cache-memo-stats: where to write the memo's JSON statistics
+	bool cacheMemoPopulate;         // --cache-memo-populate: fault the memo index in when it is mapped
+	bool cacheArtifacts;            // --cache-artifacts: restore outputs from the artifact store on a miss
+	uint64_t cacheArtifactsLimit;   // --cache-artifacts-limit, in bytes
 	std::vector<std::string> cacheGlobalEnvNames; // --cache-env, folded into every task
 	CacheSession *cacheSession;     // owned by the dispatch function, null when not caching
 	std::string playlistPath;       // resolved absolute playlist path; keys the manifest
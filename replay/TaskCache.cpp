@@ -33,7 +33,7 @@ static const int64_t kManifestVersion = 1;
 const char *
 CacheHashAlgorithmName(FileHashAlgorithm algorithm)
 {
-	return (algorithm == FileHashAlgorithm::BLAKE3) ? "blake3" : "crc32c";
+	return hash_algorithm_name(algorithm);
 }
 
 // ============================================================================
@@ -135,7 +135,8 @@ compute_task_signature(const std::string &actionName,
 // ============================================================================
 
 static std::optional<uint64_t>
-compute_world_out_internal(const std::vector<std::string> &ownedPaths, bool outputsExistenceOnly)
+compute_world_out_internal(const std::vector<std::string> &ownedPaths, bool outputsExistenceOnly,
+                           PathFingerprintMemo *memo)
 {
 	if(!outputsExistenceOnly)
 	{
@@ -144,7 +145,7 @@ compute_world_out_internal(const std::vector<std::string> &ownedPaths, bool outp
 		// the fixed-point check reproduces. A failed rollup (glob compile, allocation)
 		// propagates as nullopt: collapsing it to a sentinel would make the same
 		// deterministic failure at store and check time look like a match - a wrong hit.
-		return TaskFingerprint::fingerprint_paths(ownedPaths, false);
+		return TaskFingerprint::fingerprint_paths(ownedPaths, false, memo);
 	}
 
 	// create directory: the output must be checked as existence + type only, never as
@@ -202,7 +203,7 @@ compute_world_out_internal(const std::vector<std::string> &ownedPaths, bool outp
 }
 
 std::optional<uint64_t>
-compute_world_out(const std::vector<std::string> &ownedPaths, bool outputsExistenceOnly)
+compute_world_out(const std::vector<std::string> &ownedPaths, bool outputsExistenceOnly, PathFingerprintMemo *memo)
 {
 	// Same guarantee as TaskFingerprint::fingerprint_paths, which the non-existence-only
 	// branch already has: this runs inside a taskBlock on a GCD queue (run_task) and on
@@ -211,7 +212,7 @@ compute_world_out(const std::vector<std::string> &ownedPaths, bool outputsExiste
 	// own. Report it as "unavailable", which can only cost an extra execution.
 	try
 	{
-		return compute_world_out_internal(ownedPaths, outputsExistenceOnly);
+		return compute_world_out_internal(ownedPaths, outputsExistenceOnly, memo);
 	}
 	catch(...)
 	{
@@ -258,13 +259,29 @@ WrapActionWithCache(std::function<bool()> action,
                     ReplayContext *context)
 {
 	CacheSession *session = context->cacheSession;
-	if((session == nullptr) || !cacheInfo.cacheable)
+	if(session == nullptr)
 	{
 		return [inner = std::move(action)]() {
 			(void)inner();
 		};
 	}
 
+	// Owned paths (world_out material): outputs + exclusive + mutating, glob or
+	// concrete. Concrete outputs separately for the miss-reason refinement.
+	std::vector<std::string> ownedPaths = outputs;
+	ownedPaths.insert(ownedPaths.end(), exclusiveInputs.begin(), exclusiveInputs.end());
+	ownedPaths.insert(ownedPaths.end(), mutatingInputs.begin(), mutatingInputs.end());
+
+	if(!cacheInfo.cacheable)
+	{
+		// Not cached, but it still writes what it owns, and a cacheable task that depends
+		// on it must not be served what the path memo saw before it ran.
+		return [session, ownedPaths = std::move(ownedPaths), inner = std::move(action)]() {
+			(void)inner();
+			session->invalidate_owned_paths(ownedPaths);
+		};
+	}
+
 	// Signature and env text come from the expanded, original-case declaration
 	// vectors, so the cache key is identical across execution engines and stays
 	// independent of dependency-analysis internals.
@@ -274,12 +291,6 @@ WrapActionWithCache(std::function<bool()> action,
 		cacheInfo.extras, signatureEnvNames, context->playlistKey);
 	std::string envText = build_cache_env_text(context->cacheGlobalEnvNames, cacheInfo.envNames, context->environment);
 
-	// Owned paths (world_out material): outputs + exclusive + mutating, glob or
-	// concrete. Concrete outputs separately for the miss-reason refinement.
-	std::vector<std::string> ownedPaths = outputs;
-	ownedPaths.insert(ownedPaths.end(), exclusiveInputs.begin(), exclusiveInputs.end());
-	ownedPaths.insert(ownedPaths.end(), mutatingInputs.begin(), mutatingInputs.end());
-
 	std::vector<std::string> concreteOutputs;
 	for(const auto &oneOutput : outputs)
 	{
@@ -287,8 +298,17 @@ WrapActionWithCache(std::function<bool()> action,
 			concreteOutputs.push_back(oneOutput);
 	}
 
+	// The artifact store replays a task by putting files back at its outputs, so it can only
+	// stand in for one that writes nothing else: no moved, deleted or edited inputs, and no
+	// glob output, which names no path to put anything at. Create-directory is left out as
+	// well; its product is a directory, which the store does not hold.
+	bool restorable = cacheInfo.outputsRestorable && !cacheInfo.outputsExistenceOnly &&
+		exclusiveInputs.empty() && mutatingInputs.empty() &&
+		!outputs.empty() && (concreteOutputs.size() == outputs.size());
+
 	TaskCacheRecord *record = session->make_record(std::move(signature), actionName, inputs,
-		std::move(ownedPaths), std::move(concreteOutputs), std::move(envText), cacheInfo.outputsExistenceOnly);
+		std::move(ownedPaths), std::move(concreteOutputs), std::move(envText), cacheInfo.outputsExistenceOnly,
+		restorable);
 	return [session, record, inner = std::move(action)]() {
 		session->run_task(record, inner);
 	};
@@ -438,8 +458,17 @@ CacheSession::CacheSession(std::string playlistPath, std::string playlistKey, Re
 		playlistId |= ((uint64_t)output[i]) << (8 * i);
 	}
 
-	const char *extension = (mContext->cacheFormat == CacheFormat::Json) ? "json" : "plist";
+	const char *extension = "json";
+	if(mContext->cacheFormat == CacheFormat::Plist)
+		extension = "plist";
+	else if(mContext->cacheFormat == CacheFormat::Binary)
+		extension = "bin";
 	mManifestPath = mContext->cacheDir + "/" + hex64(playlistId) + ".replay-cache." + extension;
+
+	// Shared by every playlist using this cache directory: a record is keyed by the task
+	// signature and world_in, which describe one execution whichever playlist it is in.
+	if(mContext->cacheArtifacts)
+		mArtifacts = std::make_unique<ArtifactStore>(mContext->cacheDir, mContext->cacheArtifactsLimit, mContext->verbose);
 }
 
 void
@@ -533,21 +562,30 @@ CacheSession::load()
 	// disposable state.
 	try
 	{
-		read_manifest_entries(mLoadedEntries);
+		// The binary table is mapped rather than loaded: nothing is parsed up front, and
+		// lookup() searches it in place. A failure to open it leaves an empty manifest.
+		if(mContext->cacheFormat == CacheFormat::Binary)
+			mBinaryManifest = BinaryManifest::Open(mManifestPath, mPlaylistPath, CacheHashAlgorithmName(mContext->cacheHash));
+		else
+			read_manifest_entries(mLoadedEntries);
 	}
 	catch(...)
 	{
 		mLoadedEntries.clear();
+		mBinaryManifest.reset();
 	}
 }
 
-const StoredCacheEntry *
+std::optional<StoredCacheEntry>
 CacheSession::lookup(const std::string &signature) const
 {
+	if(mBinaryManifest != nullptr)
+		return mBinaryManifest->find(signature);
+
 	auto found = mLoadedEntries.find(signature);
 	if(found == mLoadedEntries.end())
-		return nullptr;
-	return &found->second;
+		return std::nullopt;
+	return found->second;
 }
 
 TaskCacheRecord *
@@ -557,7 +595,8 @@ CacheSession::make_record(std::string signature,
                           std::vector<std::string> ownedPaths,
                           std::vector<std::string> concreteOutputs,
                           std::string envText,
-                          bool outputsExistenceOnly)
+                          bool outputsExistenceOnly,
+                          bool restorable)
 {
 	std::lock_guard<std::mutex> lock(mRecordsMutex);
 	// TaskCacheRecord holds an atomic and is therefore neither copyable nor movable:
@@ -571,6 +610,7 @@ CacheSession::make_record(std::string signature,
 	record.concreteOutputs = std::move(concreteOutputs);
 	record.envText = std::move(envText);
 	record.outputsExistenceOnly = outputsExistenceOnly;
+	record.restorable = restorable;
 	return &record;
 }
 
@@ -594,18 +634,18 @@ CacheSession::run_task(TaskCacheRecord *record, const std::function<bool()> &inn
 	// --cache-refresh too - because it is what finalize stores if the task executes
 	// successfully. It must describe the state the task actually consumes, so it is
 	// captured here, immediately before the task runs, never at end of run (4.1).
-	std::optional<uint64_t> rollup = TaskFingerprint::fingerprint_paths(record->plainInputs, true);
+	std::optional<uint64_t> rollup = TaskFingerprint::fingerprint_paths(record->plainInputs, true, &mPathMemo);
 	if(rollup.has_value())
 		record->checkedWorldIn = TaskFingerprint::combine_with_env(*rollup, record->envText);
 
-	const StoredCacheEntry *entry = lookup(record->signature);
+	std::optional<StoredCacheEntry> entry = lookup(record->signature);
 
 	const char *missReason = nullptr;
 	if(!record->checkedWorldIn.has_value())
 		missReason = "missing input";
 	else if(mContext->cacheRefresh)
 		missReason = "refresh";
-	else if(entry == nullptr)
+	else if(!entry.has_value())
 		missReason = "new task";
 	else if(*record->checkedWorldIn != entry->worldIn)
 		missReason = "inputs changed";
@@ -617,7 +657,7 @@ CacheSession::run_task(TaskCacheRecord *record, const std::function<bool()> &inn
 		// point) still matches its recorded state and hits. An existence check must
 		// never veto that: it would re-run create+delete chains on every run forever.
 		// A rollup that cannot be computed can never hit.
-		std::optional<uint64_t> currentOut = compute_world_out(record->ownedPaths, record->outputsExistenceOnly);
+		std::optional<uint64_t> currentOut = compute_world_out(record->ownedPaths, record->outputsExistenceOnly, &mPathMemo);
 		if(!currentOut.has_value() || (*currentOut != entry->worldOut))
 		{
 			missReason = "products changed";
@@ -657,12 +697,37 @@ CacheSession::run_task(TaskCacheRecord *record, const std::function<bool()> &inn
 		return;
 	}
 
+	// The artifact store can stand in for the execution when it holds what a successful
+	// execution with this very world_in left. Never under --cache-refresh, whose point is
+	// to execute, and never without a world_in, which is half of the key.
+	bool storable = (mArtifacts != nullptr) && record->restorable && record->checkedWorldIn.has_value();
+	bool tryRestore = storable && !mContext->cacheRefresh;
+
 	if(mContext->dryRun)
 	{
-		std::string line = std::string("[cache] MISS (") + missReason + ") " + record->actionName + " " + report_path(record) + "\n";
+		// Handlers no-op under dryRun but still print their action descriptions; a task the
+		// store would restore does not run, so it prints nothing but its report line.
+		// The outcome is left at NotSeen: nothing executed, and finalize never runs under
+		// dryRun anyway, so no entry can be stored for this pretend run.
+		bool wouldRestore = tryRestore && mArtifacts->can_restore(record->signature, *record->checkedWorldIn, record->concreteOutputs);
+		std::string line = std::string(wouldRestore ? "[cache] RESTORE (" : "[cache] MISS (") + missReason + ") " +
+			record->actionName + " " + report_path(record) + "\n";
 		mContext->outputSerializer->scheduleString(std::move(line), -1);
+		if(!wouldRestore)
+			(void)inner();
+		return;
 	}
-	else if(mContext->verbose)
+
+	if(tryRestore && mArtifacts->restore(record->signature, *record->checkedWorldIn, record->concreteOutputs))
+	{
+		record->outcome.store(CacheOutcome::Restored, std::memory_order_release);
+		invalidate_owned_paths(record->ownedPaths);
+		if(mContext->verbose)
+			LogError("cache: RESTORED (%s) %s %s\n", missReason, record->actionName.c_str(), report_path(record).c_str());
+		return;
+	}
+
+	if(mContext->verbose)
 	{
 		// Under --verbose the reason goes to STDERR as a "cache:" diagnostic, next to the
 		// end-of-run summary - not to stdout as the "[cache]" dry-run report format. A miss
@@ -674,17 +739,18 @@ CacheSession::run_task(TaskCacheRecord *record, const std::function<bool()> &inn
 		LogError("cache: MISS (%s) %s %s\n", missReason, record->actionName.c_str(), report_path(record).c_str());
 	}
 
-	if(mContext->dryRun)
-	{
-		// Handlers no-op under dryRun but still print their action descriptions.
-		// The outcome is left at NotSeen: nothing executed, and finalize never runs
-		// under dryRun anyway, so no entry can be stored for this pretend run.
-		(void)inner();
-		return;
-	}
-
 	bool isOK = inner();
 	record->outcome.store(isOK ? CacheOutcome::ExecutedOK : CacheOutcome::Failed, std::memory_order_release);
+
+	// Captured here, before any dependent can start, so the store holds what this task
+	// left and not what a later task made of it. A capture that fails only means the next
+	// miss executes.
+	if(isOK && storable)
+		(void)mArtifacts->capture(record->signature, *record->checkedWorldIn, record->concreteOutputs);
+
+	// A failed action may have written part of what it owns, so this does not wait for
+	// success.
+	invalidate_owned_paths(record->ownedPaths);
 }
 
 void
@@ -720,6 +786,7 @@ CacheSession::finalize_and_save_internal()
 	size_t hitCount = 0;
 	size_t executedCount = 0;
 	size_t failedCount = 0;
+	size_t restoredCount = 0;
 
 	std::string timestamp = current_timestamp();
 
@@ -757,6 +824,13 @@ CacheSession::finalize_and_save_internal()
 					toStore.push_back(&record);
 			break;
 
+			case CacheOutcome::Restored:
+				++restoredCount;
+				// Its outputs are what an execution with this world_in left, so it is stored
+				// exactly like one; world_in is always known, since it keyed the restore.
+				toStore.push_back(&record);
+			break;
+
 			case CacheOutcome::Failed:
 				++failedCount;
 				// Carry the old entry if there is one. It can only produce a hit later if
@@ -783,8 +857,9 @@ CacheSession::finalize_and_save_internal()
 	{
 		TaskCacheRecord **records = toStore.data();
 		std::optional<uint64_t> *results = worldOuts.data();
+		PathFingerprintMemo *memo = &mPathMemo;
 		dispatch_apply(toStore.size(), DISPATCH_APPLY_AUTO, ^(size_t i) {
-			results[i] = compute_world_out(records[i]->ownedPaths, records[i]->outputsExistenceOnly);
+			results[i] = compute_world_out(records[i]->ownedPaths, records[i]->outputsExistenceOnly, memo);
 		});
 	}
 
@@ -810,11 +885,16 @@ CacheSession::finalize_and_save_internal()
 		updatedEntries[record->signature] = std::move(entry);
 	}
 
+	// Independent of the manifest: the store is bounded whether or not the write below
+	// succeeds.
+	if(mArtifacts != nullptr)
+		mArtifacts->trim();
+
 	if(!write_manifest(updatedEntries, removedSignatures, seenSignatures))
 		return;
 
-	LogError("cache: %zu hits, %zu executed, %zu failed, manifest %s\n",
-		hitCount, executedCount, failedCount, mManifestPath.c_str());
+	LogError("cache: %zu hits, %zu executed, %zu failed, %zu restored, %zu paths from the run memo, manifest %s\n",
+		hitCount, executedCount, failedCount, restoredCount, mPathMemo.hit_count(), mManifestPath.c_str());
 }
 
 bool
@@ -865,6 +945,9 @@ CacheSession::write_manifest(const std::unordered_map<std::string, StoredCacheEn
 		return false;
 	}
 
+	if(mContext->cacheFormat == CacheFormat::Binary)
+		return write_binary_manifest(updatedEntries, removedSignatures, seenSignatures);
+
 	// Re-read the manifest now that the lock is held, and apply this run's delta to
 	// THAT, not to the snapshot load() took before the scheduler started. Two replay
 	// invocations on different playlist keys of one playlist file share this manifest;
@@ -1022,3 +1105,51 @@ CacheSession::write_manifest(const std::unordered_map<std::string, StoredCacheEn
 	// lockGuard releases the flock and closes the descriptor here.
 	return (result == EXIT_SUCCESS);
 }
+
+bool
+CacheSession::write_binary_manifest(const std::unordered_map<std::string, StoredCacheEntry> &updatedEntries,
+                                    const std::unordered_set<std::string> &removedSignatures,
+                                    const std::unordered_set<std::string> &seenSignatures) const
+{
+	// A run that only hit has nothing to publish unless the prune below would remove
+	// something. That is decided on the table load() mapped, so such a run - the common
+	// one - skips the reopen and its checksum pass over the whole table, and leaves both
+	// files untouched. Entries another process added for this key since load() are left
+	// for the next run to prune; carrying them costs nothing.
+	if(updatedEntries.empty() && removedSignatures.empty())
+	{
+		bool pruneNeeded = mPruneAllowed;
+		if(pruneNeeded && (mBinaryManifest != nullptr))
+		{
+			std::vector<std::string> keyed;
+			mBinaryManifest->collect_key(mPlaylistKey, keyed);
+			pruneNeeded = std::any_of(keyed.begin(), keyed.end(),
+				[&](const std::string &signature) { return seenSignatures.count(signature) == 0; });
+		}
+		if(!pruneNeeded)
+			return true;
+	}
+
+	// Opened afresh under the lock for the reason write_manifest re-reads: the delta goes
+	// on top of what is on disk now, not of what load() mapped before the scheduler
+	// started, and the journal must be appended to where it ends now. An exception here
+	// escapes to finalize_and_save, after the lock guard in write_manifest has released.
+	std::unique_ptr<BinaryManifest> manifest =
+		BinaryManifest::Open(mManifestPath, mPlaylistPath, CacheHashAlgorithmName(mContext->cacheHash));
+
+	// The prune rule of write_manifest, expressed as removals so it reaches the journal as
+	// records like any other change.
+	std::unordered_set<std::string> removed = removedSignatures;
+	if(mPruneAllowed)
+	{
+		std::vector<std::string> keyed;
+		manifest->collect_key(mPlaylistKey, keyed);
+		for(auto &signature : keyed)
+		{
+			if(seenSignatures.count(signature) == 0)
+				removed.insert(std::move(signature));
+		}
+	}
+
+	return manifest->publish(updatedEntries, removed);
+}
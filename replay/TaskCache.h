@@ -2,10 +2,14 @@
 // Per-playlist incremental execution cache: task signatures and the run manifest.
 // See private/replay_caching_design.md sections 4.4 and 4.5.
 
+#include "ArtifactStore.h"
+#include "BinaryManifest.h"
 #include "TaskCacheTypes.h"
+#include "TaskFingerprint.h" // PathFingerprintMemo
 #include "ReplayAction.h"
 
 #include <deque>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <string>
@@ -17,8 +21,10 @@
 // world_out value. Shared by the check side and the store side so the two can never
 // disagree. outputsExistenceOnly (create-directory) compares a constant marker plus
 // existence and S_ISDIR instead of directory content, because other tasks legitimately
-// write into that directory afterwards (design 4.6).
-std::optional<uint64_t> compute_world_out(const std::vector<std::string> &ownedPaths, bool outputsExistenceOnly);
+// write into that directory afterwards (design 4.6). memo is passed on to
+// TaskFingerprint::fingerprint_paths.
+std::optional<uint64_t> compute_world_out(const std::vector<std::string> &ownedPaths, bool outputsExistenceOnly,
+                                          PathFingerprintMemo *memo = nullptr);
 
 // Content-based cache key for one task, stable across runs and execution modes.
 // blake3 over domain-tagged, length-prefixed fields; 16 lowercase hex chars.
@@ -44,7 +50,8 @@ std::string build_cache_env_text(const std::vector<std::string> &globalNames,
 // Turns a bool action into the void block the execution engines run. When
 // context->cacheSession is set and the action is cacheable, this computes the
 // signature, creates the session record and returns the up-to-date-check wrapper;
-// otherwise it returns a trivial adapter that just drops the bool. Shared by the
+// otherwise it returns an adapter that drops the bool and, under a cache session,
+// invalidates what the action owns in the session's path memo. Shared by the
 // dependency-analysis task builder and serial dispatch so both engines cache
 // through identical logic. Must be called on the graph-building thread.
 std::function<void()> WrapActionWithCache(std::function<bool()> action,
@@ -56,16 +63,6 @@ std::function<void()> WrapActionWithCache(std::function<bool()> action,
                                           const ActionCacheInfo &cacheInfo,
                                           ReplayContext *context);
 
-// One manifest entry as loaded from disk.
-struct StoredCacheEntry
-{
-	std::string actionName;
-	std::string playlistKey;
-	uint64_t worldIn = 0;
-	uint64_t worldOut = 0;
-	std::string timestamp;
-};
-
 // Run-scoped owner of the manifest and of every TaskCacheRecord.
 // Lives for the duration of one playlist (one --playlist-key) execution.
 class CacheSession
@@ -89,9 +86,10 @@ public:
 	// an unseen step is not the same as a removed one.
 	void set_prune_allowed(bool allowed) { mPruneAllowed = allowed; }
 
-	// Borrowed pointer into the loaded entries, or nullptr when the task is new.
-	// Valid until finalize_and_save(); the loaded map is immutable after load().
-	const StoredCacheEntry *lookup(const std::string &signature) const;
+	// The loaded entry for signature, or nullopt when the task is new. A copy, because the
+	// binary manifest has no StoredCacheEntry to point into. Thread-safe: what load() read
+	// is immutable afterwards.
+	std::optional<StoredCacheEntry> lookup(const std::string &signature) const;
 
 	// Creates a record owned by this session. Returns a stable pointer (deque-backed).
 	// Thread-safe: taskBlock construction happens on the graph-building thread today,
@@ -102,25 +100,36 @@ public:
 	                             std::vector<std::string> ownedPaths,
 	                             std::vector<std::string> concreteOutputs,
 	                             std::string envText,
-	                             bool outputsExistenceOnly);
+	                             bool outputsExistenceOnly,
+	                             bool restorable);
 
 	// Executes one cacheable task through the up-to-date check (design 4.6): when
 	// the stored entry still matches both the consumed inputs and the owned paths,
-	// the task is skipped as a hit; otherwise inner runs and its result is recorded
-	// for finalize_and_save. world_in is captured here, at check time, even for new
+	// the task is skipped as a hit; otherwise its outputs are restored from the
+	// artifact store when it holds them for this world_in, or inner runs, and the
+	// result is recorded for finalize_and_save. world_in is captured here, at check time, even for new
 	// tasks and under --cache-refresh, because it becomes the stored value.
 	// Thread-safe: called concurrently from scheduler tasks; record must have been
 	// returned by make_record on this session.
 	void run_task(TaskCacheRecord *record, const std::function<bool()> &inner);
 
+	// Tells the run's path memo that a task owning ownedPaths has finished, whatever its
+	// outcome. Called for every task of the run, cacheable or not, before its dependents
+	// can start. Thread-safe.
+	void invalidate_owned_paths(const std::vector<std::string> &ownedPaths) { mPathMemo.invalidate(ownedPaths); }
+
 	// Call once after the scheduler has drained. Captures end-of-run world_out for
-	// every task that executed successfully, carries entries forward per the outcome
-	// matrix (design 4.5 step 3), prunes stale entries for this playlist key, and
-	// writes the manifest atomically. Also prints the end-of-run summary line.
+	// every task that executed successfully or was restored, carries entries forward per
+	// the outcome matrix (design 4.5 step 3), prunes stale entries for this playlist key,
+	// trims the artifact store and writes the manifest atomically. Also prints the
+	// end-of-run summary line.
 	void finalize_and_save();
 
 	const std::string &manifest_path() const { return mManifestPath; }
-	size_t loaded_entry_count() const { return mLoadedEntries.size(); }
+	size_t loaded_entry_count() const
+	{
+		return (mBinaryManifest != nullptr) ? mBinaryManifest->entry_count() : mLoadedEntries.size();
+	}
 
 private:
 	// The body of finalize_and_save, which only adds the exception guard around it.
@@ -137,14 +146,25 @@ private:
 	                    const std::unordered_set<std::string> &removedSignatures,
 	                    const std::unordered_set<std::string> &seenSignatures) const;
 
+	// write_manifest for CacheFormat::Binary, called with the lock already held: the same
+	// delta and prune, published as journal records rather than a rewritten file.
+	bool write_binary_manifest(const std::unordered_map<std::string, StoredCacheEntry> &updatedEntries,
+	                           const std::unordered_set<std::string> &removedSignatures,
+	                           const std::unordered_set<std::string> &seenSignatures) const;
+
 	std::string mPlaylistPath;
 	std::string mPlaylistKey;
 	ReplayContext *mContext = nullptr;
 	std::string mManifestPath;
 	bool mPruneAllowed = true;
 
-	std::unordered_map<std::string, StoredCacheEntry> mLoadedEntries;
+	std::unordered_map<std::string, StoredCacheEntry> mLoadedEntries; // json and plist
+	std::unique_ptr<BinaryManifest> mBinaryManifest;                    // binary: mapped, not loaded
+	std::unique_ptr<ArtifactStore> mArtifacts;                          // --cache-artifacts only
 
 	std::mutex mRecordsMutex;
 	std::deque<TaskCacheRecord> mRecords; // deque: push_back keeps existing pointers stable
+
+	// What this run's world_in and world_out rollups already collected, per declared path.
+	PathFingerprintMemo mPathMemo;
 };
@@ -14,7 +14,8 @@
 enum class CacheFormat
 {
 	Json,
-	Plist
+	Plist,
+	Binary // mapped table plus append-only journal; see BinaryManifest.h
 };
 
 // Where per-file content hashes are memoized between runs (--cache-memo).
@@ -33,6 +34,7 @@ enum class CacheOutcome
 	NotSeen,    // never dispatched (cycle, or short-circuited before the wrapper ran)
 	Hit,        // up to date, skipped
 	ExecutedOK, // ran and reported success
+	Restored,   // missed, and its outputs were put back from the artifact store instead
 	Failed      // ran and reported failure
 };
 
@@ -43,6 +45,7 @@ struct ActionCacheInfo
 	std::string extras;                 // action-specific identity beyond the path vectors
 	bool cacheable = false;
 	bool outputsExistenceOnly = false;  // create-directory: check existence + S_ISDIR, not content
+	bool outputsRestorable = true;      // false when a copy of the output is not the product (hardlink)
 	std::vector<std::string> envNames;  // per-step "env" names folded into the input fingerprint
 };
 
@@ -59,6 +62,9 @@ struct TaskCacheRecord
 	std::vector<std::string> concreteOutputs; // non-glob outputs, for the fast existence pass
 	std::string envText;                     // NAME=value lines folded into world_in
 	bool outputsExistenceOnly = false;
+	// The artifact store may capture and restore this task's outputs (--cache-artifacts):
+	// every owned path is a concrete output, and a copy of the output is the product.
+	bool restorable = false;
 
 	// The FINAL world_in value, captured at CHECK time: the plain-input rollup with
 	// envText ALREADY folded in via TaskFingerprint::combine_with_env. finalize stores
@@ -71,5 +77,15 @@ struct TaskCacheRecord
 	std::atomic<CacheOutcome> outcome{CacheOutcome::NotSeen};
 };
 
-// "crc32c" / "blake3" - the spelling persisted in the manifest and accepted by --cache-hash.
+// One manifest entry as loaded from disk, whatever the manifest format.
+struct StoredCacheEntry
+{
+	std::string actionName;
+	std::string playlistKey;
+	uint64_t worldIn = 0;
+	uint64_t worldOut = 0;
+	std::string timestamp;
+};
+
+// "crc32c" / "blake3" / "xxh3" - the spelling persisted in the manifest and accepted by --cache-hash.
 const char *CacheHashAlgorithmName(FileHashAlgorithm algorithm);
@@ -5,10 +5,13 @@
 #include "PosixFileOps.h"
 #include "GlobOverlap.h"
 
+#include "FileHashDedup.h"
 #include "FileHashing.h"
 #include "FileInfo.h"
 #include "blake3.h"
 
+#include <dispatch/dispatch.h>
+
 #include <algorithm>
 #include <cerrno>
 #include <climits>
@@ -17,22 +20,25 @@
 #include <unordered_set>
 #include <utility>
 
-// Globals required by FileHashing.h and by fingerprint.cpp (both declare them extern).
-// Mirrors gate/main.cpp:37-40. Set from the command line before execution starts.
+// Globals required by FileHashing.h (declared extern there). Mirrors gate/main.cpp.
+// Set from the command line before execution starts.
 FileHashAlgorithm g_hash = FileHashAlgorithm::CRC32C;
-// Only the CacheMemo::Xattr branch below reads this, but fingerprint.cpp declares it
-// extern and is linked into replay through FingerprintLib, so the definition stays.
+// Read only by the CacheMemo::Xattr branch below.
 // Defaults to Off, matching the default backend: main sets it for real whenever the
-// cache is enabled, and any path that ever fingerprints without going through that
+// cache is enabled, and any path that ever hashes without going through that
 // setup should write nothing to the user's files rather than everything.
 XattrMode g_xattr_mode = XattrMode::Off;
 bool g_verbose = false;
-double g_traversal_time = 0.0;
 
 // Memoization backend selection - see TaskFingerprint.h.
 CacheMemo g_memo_backend = CacheMemo::Off;
 bool g_memo_refresh = false;
 FingerprintStore *g_fingerprint_store = nullptr;
+DirectoryListingStore *g_listing_store = nullptr;
+
+// Process-wide like the store: a file's identity says nothing about which playlist
+// reached it, and the key moves whenever its content can have.
+FileHashDedup g_hash_dedup;
 
 namespace
 {
@@ -45,6 +51,16 @@ constexpr int kMaxSymlinkHops = 32;
 // directories from running the thread's stack out.
 constexpr int kMaxCollectDepth = 32;
 
+// Below this many collected entries the rollup's files are hashed on the calling thread.
+// Most tasks declare a handful of files, and fanning those out would cost more than it
+// saves; a declared directory of thousands is what the parallel pass is for.
+constexpr size_t kParallelHashMinEntries = 256;
+
+// Entries handed to one dispatch_apply iteration. Large enough that the per-iteration
+// overhead disappears behind the memo lookups, small enough that one chunk of slow
+// files does not leave the other workers idle at the end.
+constexpr size_t kParallelHashChunkSize = 64;
+
 struct HashedFile
 {
 	std::string path;
@@ -63,6 +79,10 @@ struct CollectState
 
 	int depth = 0;
 
+	// Set once a symlink's target has been looked at. What the target contributes lies
+	// outside the declared path, so PathFingerprintMemo cannot tell which writes reach it.
+	bool followedSymlink = false;
+
 	// Set when any part of the tree could not be read: fts_open failed, or fts reported
 	// an unreadable directory or a stat failure. Such a subtree contributes NOTHING to
 	// the rollup, which is byte-for-byte what an ABSENT subtree contributes - so without
@@ -195,6 +215,7 @@ void collect_directory(const std::string &dirPath, CollectState &state)
 // to the target invisible. Mirrors the engine's resolve_symlink_chain (fingerprint.cpp).
 void collect_symlink_target(const std::string &linkPath, CollectState &state, bool followDirectoryTargets)
 {
+	state.followedSymlink = true;
 	std::string current = linkPath;
 	std::unordered_set<std::string> visited;
 	visited.insert(current);
@@ -295,6 +316,42 @@ bool collect_concrete_path(const std::string &path, CollectState &state)
 	return true;
 }
 
+// Collects one non-empty declared path: a concrete path, or a glob pattern's matches.
+// Returns false only for a non-glob path that does not exist.
+bool collect_declared_path(const std::string &path, CollectState &state)
+{
+	// A literal path that exists always wins over glob interpretation. Filenames may
+	// legitimately contain glob metacharacters (data[1].json), and treating such a
+	// file as a pattern would silently match nothing AND bypass the missing-input
+	// check, turning every later edit of that file into a wrong skip.
+	if(collect_concrete_path(path, state))
+		return true;
+
+	if(!globoverlap::is_glob_pattern(path))
+		return false;
+
+	// A glob matching nothing is not an error: it contributes nothing,
+	// which is the same as all its matches being absent. A glob whose walk
+	// FAILED is a different thing entirely and must degrade the rollup: an
+	// unreadable directory shortens the match list, and a shortened list is
+	// byte-for-byte what deleting those files produces. The fixed point of a
+	// glob delete or move is precisely "matches nothing", so a transient
+	// fts_open failure (EMFILE under a wide first wave) would otherwise
+	// reproduce the stored value exactly and skip a task that must run.
+	bool globFailed = false;
+	std::vector<std::string> matches = expand_glob(path, &globFailed, g_listing_store);
+	if(globFailed)
+	{
+		state.failed = true;
+		return true;
+	}
+	for(const auto &match : matches)
+	{
+		collect_concrete_path(match, state);
+	}
+	return true;
+}
+
 // The content hash currently held by info, as one 64-bit value, per the selected
 // algorithm. Explicit rather than always reading hash.blake3: a zero-extended crc32c
 // happens to read back correctly through the union's 64-bit member on a little-endian
@@ -304,6 +361,8 @@ uint64_t current_hash_value(const FileInfo &info)
 {
 	if(g_hash == FileHashAlgorithm::CRC32C)
 		return (uint64_t)info.hash.crc32c;
+	if(g_hash == FileHashAlgorithm::XXH3)
+		return info.hash.xxh3;
 	return info.hash.blake3;
 }
 
@@ -311,6 +370,8 @@ void store_hash_value(FileInfo &info, uint64_t value)
 {
 	if(g_hash == FileHashAlgorithm::CRC32C)
 		info.hash.crc32c = (uint32_t)value;
+	else if(g_hash == FileHashAlgorithm::XXH3)
+		info.hash.xxh3 = value;
 	else
 		info.hash.blake3 = value;
 }
@@ -318,22 +379,9 @@ void store_hash_value(FileInfo &info, uint64_t value)
 // Fills in info.hash for one file, honoring the selected memoization backend.
 // The xattr branch keeps the exact policy of the engine's process_matched_file_async
 // (fingerprint.cpp), so the "public.fingerprint.*" format stays shared with gate.
-// Returns false when the file's content could not be read, so the caller can degrade the
-// whole rollup rather than let an unreadable file contribute a 0 hash: the same file
-// edited to the same size behind a persistent read failure would otherwise be invisible.
-bool hash_one_file(HashedFile &entry)
+// Returns false when the file's content could not be read.
+bool hash_file_content(HashedFile &entry)
 {
-	// A directory contributes its existence and nothing else: its content is the files
-	// already collected under it, and its st_size is allocation noise, not content.
-	// Returning here also keeps directories out of the store, where they would occupy
-	// slots that say nothing.
-	if(entry.info.is_directory())
-	{
-		entry.info.size = 0;
-		entry.info.hash.blake3 = 0;
-		return true;
-	}
-
 	if((g_memo_backend == CacheMemo::Sidecar) && (g_fingerprint_store != nullptr))
 	{
 		uint64_t memoized = 0;
@@ -389,6 +437,103 @@ bool hash_one_file(HashedFile &entry)
 	return hashed;
 }
 
+// Fills in info.hash for one collected entry.
+// Returns false when the file's content could not be read, so the caller can degrade the
+// whole rollup rather than let an unreadable file contribute a 0 hash: the same file
+// edited to the same size behind a persistent read failure would otherwise be invisible.
+bool hash_one_file(HashedFile &entry)
+{
+	// A directory contributes its existence and nothing else: its content is the files
+	// already collected under it, and its st_size is allocation noise, not content.
+	// Returning here also keeps directories out of the store, where they would occupy
+	// slots that say nothing.
+	if(entry.info.is_directory())
+	{
+		entry.info.size = 0;
+		entry.info.hash.blake3 = 0;
+		return true;
+	}
+
+	// Checked before either memo backend. The sidecar store only sees the hashes of
+	// earlier runs, so within one run every task declaring a shared header re-read it;
+	// now the first one hashes it and concurrent ones wait for that hash. Hard links
+	// under a declared tree are caught the same way.
+	FileHashDedup::Claim claim = g_hash_dedup.claim(entry.info);
+	if(claim == FileHashDedup::Claim::Done)
+		return true;
+	if(claim == FileHashDedup::Claim::Failed)
+		return false;
+
+	// Whatever happens, the claim is published: paths waiting on it block until it is.
+	// Should anything under hash_file_content throw, the waiters fail with this path and
+	// the exception goes on to hash_collected_files, which counts the chunk as unread.
+	bool hashed = false;
+	try
+	{
+		hashed = hash_file_content(entry);
+	}
+	catch(...)
+	{
+		g_hash_dedup.publish(entry.info, false);
+		throw;
+	}
+	g_hash_dedup.publish(entry.info, hashed);
+	return hashed;
+}
+
+// Hashes entries [begin, end) in order. Returns false when any of them could not be read.
+// The store's slots for the next file are requested while this one is hashed, so on a
+// table far larger than the cache its lookup finds them loaded rather than stalling.
+bool hash_file_range(HashedFile *entries, size_t begin, size_t end)
+{
+	FingerprintStore *store = (g_memo_backend == CacheMemo::Sidecar) ? g_fingerprint_store : nullptr;
+	bool allHashed = true;
+	for(size_t i = begin; i < end; ++i)
+	{
+		if((store != nullptr) && ((i + 1) < end))
+			store->prefetch(entries[i + 1].info);
+		if(!hash_one_file(entries[i]))
+			allHashed = false;
+	}
+	return allHashed;
+}
+
+// Fills in info.hash for every collected entry. Returns false when any could not be read.
+// A task declaring a directory of tens of thousands of files would otherwise hash them all
+// on its own thread, typically near the end of a run when the rest of the scheduler's
+// pool is idle. dispatch_apply runs on that same pool and the calling thread works
+// through chunks itself, so unlike a dispatch_group_wait it cannot starve when every
+// worker is busy: at worst it degrades to the serial loop.
+// The rollup stays deterministic because each entry is written by exactly one chunk and
+// is read only after dispatch_apply returns, in the sorted order.
+bool hash_collected_files(std::vector<HashedFile> &entries)
+{
+	size_t count = entries.size();
+	if(count < kParallelHashMinEntries)
+		return hash_file_range(entries.data(), 0, count);
+
+	size_t chunkCount = (count + kParallelHashChunkSize - 1) / kParallelHashChunkSize;
+	std::vector<uint8_t> chunkHashed(chunkCount, 0);
+	HashedFile *files = entries.data();
+	uint8_t *hashed = chunkHashed.data();
+	dispatch_apply(chunkCount, DISPATCH_APPLY_AUTO, ^(size_t chunk) {
+		size_t begin = chunk * kParallelHashChunkSize;
+		size_t end = std::min(begin + kParallelHashChunkSize, count);
+		// An exception escaping a dispatch block is std::terminate, not the catch in
+		// fingerprint_paths; a chunk that throws counts as unread instead.
+		try
+		{
+			hashed[chunk] = hash_file_range(files, begin, end) ? 1 : 0;
+		}
+		catch(...)
+		{
+			hashed[chunk] = 0;
+		}
+	});
+
+	return std::all_of(chunkHashed.begin(), chunkHashed.end(), [](uint8_t ok) { return ok != 0; });
+}
+
 void hash_update_u64_le(blake3_hasher &hasher, uint64_t value)
 {
 	uint8_t bytes[8];
@@ -399,56 +544,278 @@ void hash_update_u64_le(blake3_hasher &hasher, uint64_t value)
 	blake3_hasher_update(&hasher, bytes, sizeof(bytes));
 }
 
+// Where path lives, for comparing the locations PathFingerprintMemo keeps and drops:
+// absolute, with symlinked directories resolved, and lowercased like the dependency
+// analysis's FileTree copies, because the volumes replay runs on are case-insensitive by
+// default and two spellings of one file must compare equal. A path that does not exist
+// yet (an output about to be created) is resolved through its deepest existing ancestor.
+std::string memo_location(const std::string &path)
+{
+	std::string current = path;
+	std::vector<std::string> missing;
+	char resolved[PATH_MAX];
+	while(realpath(current.c_str(), resolved) == nullptr)
+	{
+		while((current.size() > 1) && (current.back() == '/'))
+			current.pop_back();
+		if((current == ".") || (current == "/"))
+		{
+			// Not even the root resolves; compare the path as spelled.
+			std::string location = path;
+			std::transform(location.begin(), location.end(), location.begin(), ::tolower);
+			return location;
+		}
+		size_t slash = current.rfind('/');
+		missing.push_back(current.substr((slash == std::string::npos) ? 0 : slash + 1));
+		if(slash == std::string::npos)
+			current = ".";
+		else
+			current = (slash == 0) ? std::string("/") : current.substr(0, slash);
+	}
+
+	std::string location(resolved);
+	for(auto it = missing.rbegin(); it != missing.rend(); ++it)
+	{
+		if(location.back() != '/')
+			location.push_back('/');
+		location += *it;
+	}
+	std::transform(location.begin(), location.end(), location.begin(), ::tolower);
+	return location;
+}
+
+// True when one location is the other or lies inside it.
+bool locations_overlap(const std::string &a, const std::string &b)
+{
+	const std::string &shorter = (a.size() <= b.size()) ? a : b;
+	const std::string &longer = (a.size() <= b.size()) ? b : a;
+	if(longer.compare(0, shorter.size(), shorter) != 0)
+		return false;
+	return (longer.size() == shorter.size()) || (shorter.back() == '/') || (longer[shorter.size()] == '/');
+}
+
+// The location a declared path's entries are found under: a glob's concrete prefix,
+// since files created anywhere below it can start matching.
+std::string declared_location(const std::string &path)
+{
+	if(!globoverlap::is_glob_pattern(path))
+		return memo_location(path);
+	std::string prefix = globoverlap::glob_concrete_prefix(path);
+	return memo_location(prefix.empty() ? std::string(".") : prefix);
+}
+
 } // anonymous namespace
 
-static std::optional<uint64_t>
-fingerprint_paths_internal(const std::vector<std::string> &paths, bool requireConcreteFiles)
+struct PathFingerprintMemo::Segment
 {
-	CollectState state;
-	state.entries.reserve(paths.size());
+	std::vector<HashedFile> entries; // hashed, in collection order
+	std::vector<std::pair<dev_t, ino_t>> visitedDirs;
+	std::string location;
+	bool followedSymlink = false;
+};
+
+std::shared_ptr<const PathFingerprintMemo::Segment>
+PathFingerprintMemo::find(const std::string &path)
+{
+	std::lock_guard<std::mutex> guard(mMutex);
+	auto found = mSegments.find(path);
+	if(found == mSegments.end())
+		return nullptr;
+	return found->second;
+}
+
+void
+PathFingerprintMemo::count_hit()
+{
+	mHits.fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t
+PathFingerprintMemo::epoch()
+{
+	std::lock_guard<std::mutex> guard(mMutex);
+	return (uint64_t)mInvalidated.size();
+}
+
+void
+PathFingerprintMemo::insert(const std::string &path, std::shared_ptr<const Segment> segment, uint64_t sinceEpoch)
+{
+	std::lock_guard<std::mutex> guard(mMutex);
+	if(mDisabled)
+		return;
+	// A task that completed while this segment was being collected may have written under
+	// it halfway through the walk; keeping it would serve that torn state to every later
+	// declaration.
+	for(size_t i = (size_t)sinceEpoch; i < mInvalidated.size(); ++i)
+	{
+		if(segment->followedSymlink || locations_overlap(segment->location, mInvalidated[i]))
+			return;
+	}
+	mSegments[path] = std::move(segment);
+}
+
+void
+PathFingerprintMemo::invalidate(const std::vector<std::string> &ownedPaths) noexcept
+{
+	if(ownedPaths.empty())
+		return;
+
+	try
+	{
+		std::vector<std::string> locations;
+		locations.reserve(ownedPaths.size());
+		for(const auto &path : ownedPaths)
+			locations.push_back(declared_location(path));
+
+		std::lock_guard<std::mutex> guard(mMutex);
+		if(mDisabled)
+			return;
+		for(auto it = mSegments.begin(); it != mSegments.end();)
+		{
+			const Segment &segment = *it->second;
+			bool stale = segment.followedSymlink ||
+				std::any_of(locations.begin(), locations.end(),
+					[&](const std::string &location) { return locations_overlap(segment.location, location); });
+			it = stale ? mSegments.erase(it) : std::next(it);
+		}
+		mInvalidated.insert(mInvalidated.end(), locations.begin(), locations.end());
+	}
+	catch(...)
+	{
+		// Without a record of this invalidation, nothing memoized can be trusted again.
+		std::lock_guard<std::mutex> guard(mMutex);
+		mDisabled = true;
+		mSegments.clear();
+	}
+}
+
+// The memoized counterpart of the collection loop in fingerprint_paths_internal: collects
+// and hashes each declared path into state, taking it from memo when it is there and
+// adding it to memo when it was collected here. Returns false where that loop returns
+// nullopt for a missing path.
+// The entries are the ones the plain loop would collect. A segment is collected from a
+// clean slate so it can serve any later call, but the plain loop skips directories the
+// same call already walked under another spelling; a segment that shares a directory
+// with what state already holds is therefore collected again as the loop would, and is
+// not kept.
+static bool
+collect_with_memo(const std::vector<std::string> &paths, bool requireConcreteFiles, PathFingerprintMemo &memo,
+                  CollectState &state)
+{
+	struct Collected
+	{
+		const std::string *path;
+		std::shared_ptr<PathFingerprintMemo::Segment> segment;
+		uint64_t epoch;
+		bool keep;
+	};
+	std::vector<Collected> collected;
+
+	auto sharesDirectory = [&state](const auto &dirs) {
+		return std::any_of(dirs.begin(), dirs.end(),
+			[&state](const std::pair<dev_t, ino_t> &dir) { return state.visitedDirs.count(dir) != 0; });
+	};
 
 	for(const auto &path : paths)
 	{
 		if(path.empty())
 		{
-			// An input that expanded to nothing is a declaration error, not an absent file.
 			if(requireConcreteFiles)
-				return std::nullopt;
+				return false;
+			continue;
+		}
+
+		std::shared_ptr<const PathFingerprintMemo::Segment> memoized = memo.find(path);
+		if((memoized != nullptr) && !sharesDirectory(memoized->visitedDirs))
+		{
+			memo.count_hit();
+			state.visitedDirs.insert(memoized->visitedDirs.begin(), memoized->visitedDirs.end());
+			state.entries.insert(state.entries.end(), memoized->entries.begin(), memoized->entries.end());
 			continue;
 		}
 
-		// A literal path that exists always wins over glob interpretation. Filenames may
-		// legitimately contain glob metacharacters (data[1].json), and treating such a
-		// file as a pattern would silently match nothing AND bypass the missing-input
-		// check, turning every later edit of that file into a wrong skip.
-		if(collect_concrete_path(path, state))
+		uint64_t epoch = memo.epoch();
+		CollectState local;
+		bool present = collect_declared_path(path, local);
+		bool keep = present && (memoized == nullptr);
+		if(sharesDirectory(local.visitedDirs))
+		{
+			local = CollectState();
+			local.visitedDirs = state.visitedDirs;
+			present = collect_declared_path(path, local);
+			keep = false;
+		}
+		if(!present && requireConcreteFiles)
+			return false;
+		if(local.failed)
+		{
+			state.failed = true;
 			continue;
+		}
+
+		auto segment = std::make_shared<PathFingerprintMemo::Segment>();
+		segment->entries = std::move(local.entries);
+		segment->visitedDirs.assign(local.visitedDirs.begin(), local.visitedDirs.end());
+		segment->followedSymlink = local.followedSymlink;
+		if(keep)
+			segment->location = declared_location(path);
+		state.visitedDirs.insert(local.visitedDirs.begin(), local.visitedDirs.end());
+		collected.push_back({&path, std::move(segment), epoch, keep});
+	}
+
+	if(state.failed)
+		return true;
+
+	// Everything collected here is hashed in one pass, so a task declaring many small
+	// paths still reaches the parallel threshold.
+	std::vector<HashedFile> pending;
+	for(const auto &one : collected)
+		pending.insert(pending.end(), std::make_move_iterator(one.segment->entries.begin()),
+			std::make_move_iterator(one.segment->entries.end()));
+	if(!hash_collected_files(pending))
+	{
+		state.failed = true;
+		return true;
+	}
+
+	size_t offset = 0;
+	for(auto &one : collected)
+	{
+		size_t count = one.segment->entries.size();
+		std::move(pending.begin() + offset, pending.begin() + offset + count, one.segment->entries.begin());
+		offset += count;
+		state.entries.insert(state.entries.end(), one.segment->entries.begin(), one.segment->entries.end());
+		if(one.keep)
+			memo.insert(*one.path, std::move(one.segment), one.epoch);
+	}
+	return true;
+}
 
-		if(globoverlap::is_glob_pattern(path))
+static std::optional<uint64_t>
+fingerprint_paths_internal(const std::vector<std::string> &paths, bool requireConcreteFiles, PathFingerprintMemo *memo)
+{
+	CollectState state;
+	state.entries.reserve(paths.size());
+
+	if(memo != nullptr)
+	{
+		if(!collect_with_memo(paths, requireConcreteFiles, *memo, state))
+			return std::nullopt;
+	}
+	else
+	{
+		for(const auto &path : paths)
 		{
-			// A glob matching nothing is not an error: it contributes nothing,
-			// which is the same as all its matches being absent. A glob whose walk
-			// FAILED is a different thing entirely and must degrade the rollup: an
-			// unreadable directory shortens the match list, and a shortened list is
-			// byte-for-byte what deleting those files produces. The fixed point of a
-			// glob delete or move is precisely "matches nothing", so a transient
-			// fts_open failure (EMFILE under a wide first wave) would otherwise
-			// reproduce the stored value exactly and skip a task that must run.
-			bool globFailed = false;
-			std::vector<std::string> matches = expand_glob(path, &globFailed);
-			if(globFailed)
+			if(path.empty())
 			{
-				state.failed = true;
+				// An input that expanded to nothing is a declaration error, not an absent file.
+				if(requireConcreteFiles)
+					return std::nullopt;
 				continue;
 			}
-			for(const auto &match : matches)
-			{
-				collect_concrete_path(match, state);
-			}
-		}
-		else if(requireConcreteFiles)
-		{
-			return std::nullopt;
+
+			if(!collect_declared_path(path, state) && requireConcreteFiles)
+				return std::nullopt;
 		}
 	}
 
@@ -460,11 +827,9 @@ fingerprint_paths_internal(const std::vector<std::string> &paths, bool requireCo
 		[](const HashedFile &a, const HashedFile &b) { return a.path == b.path; });
 	state.entries.erase(last, state.entries.end());
 
-	for(auto &entry : state.entries)
-	{
-		if(!hash_one_file(entry))
-			state.failed = true;
-	}
+	// collect_with_memo has hashed its entries already.
+	if((memo == nullptr) && !hash_collected_files(state.entries))
+		state.failed = true;
 
 	// Anything the rollup could not read makes the result unusable rather than merely
 	// incomplete: an unread subtree and an absent one produce the same bytes, so a
@@ -510,14 +875,15 @@ fingerprint_paths_internal(const std::vector<std::string> &paths, bool requireCo
 }
 
 std::optional<uint64_t>
-TaskFingerprint::fingerprint_paths(const std::vector<std::string> &paths, bool requireConcreteFiles)
+TaskFingerprint::fingerprint_paths(const std::vector<std::string> &paths, bool requireConcreteFiles,
+                                   PathFingerprintMemo *memo)
 {
 	// This runs inside a taskBlock on a GCD queue, where an escaping exception would be
 	// std::terminate. Glob compilation and vector growth can both throw, and a failed
 	// fingerprint must never take the run down: report it as "unavailable" instead.
 	try
 	{
-		return fingerprint_paths_internal(paths, requireConcreteFiles);
+		return fingerprint_paths_internal(paths, requireConcreteFiles, memo);
 	}
 	catch(...)
 	{
@@ -1,38 +1,44 @@
 #pragma once
-// Synchronous, GCD-free fingerprinting of a task's declared paths.
+// Synchronous fingerprinting of a task's declared paths.
 //
-// The fingerprint tool's engine (fingerprint/fingerprint.cpp) keeps static
-// containers and drives its own GCD queues, so it cannot be called from replay's
-// concurrently executing tasks: the wrapper runs on the scheduler's concurrent
-// queue and the engine blocks in dispatch_group_wait waiting for workers from the
-// same pool, which starves and eventually deadlocks under a wide first wave.
+// The fingerprint tool's engine (fingerprint/fingerprint.cpp) is reentrant - each run
+// is a FingerprintSession - but it cannot be called from replay's concurrently
+// executing tasks: it drives its walks and hashing on GCD queues and then blocks in
+// dispatch_group_wait until they finish. The wrapper already runs on the scheduler's
+// concurrent queue, so each blocked wrapper holds a worker of the same pool its
+// session's blocks need, which starves and eventually deadlocks under a wide first wave.
 //
-// This module therefore does all the work in-thread: path expansion, directory
-// traversal, per-file hashing and the rollup. It shares only the stateless
-// per-file pieces with the engine (FileHashing.h), so the "public.fingerprint.*"
-// xattr stat-cache stays compatible with gate and fingerprint.
+// This module therefore does the work in the calling thread: path expansion, directory
+// traversal and the rollup. Per-file hashing is the one exception: a large entry list is
+// spread over dispatch_apply, which the calling thread takes part in, so it needs no
+// free worker to make progress. It shares only the stateless per-file pieces with the
+// engine (FileHashing.h), so the "public.fingerprint.*" xattr stat-cache stays
+// compatible with gate and fingerprint.
 // All entry points are thread-safe and reentrant.
 
+#include <atomic>
 #include <cstdint>
+#include <memory>
+#include <mutex>
 #include <optional>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "fingerprint.h"     // FileHashAlgorithm, XattrMode
+#include "FileHashDedup.h"
 #include "TaskCacheTypes.h"  // CacheMemo
 
+class DirectoryListingStore;
 class FingerprintStore;
 
-// Configuration globals required by FileHashing.h and fingerprint.cpp.
+// Configuration globals required by FileHashing.h.
 // Defined in TaskFingerprint.cpp; set once from the command line before the
 // scheduler starts, read-only afterwards.
 extern FileHashAlgorithm g_hash;
 extern bool g_verbose;
-extern double g_traversal_time;
 
-// The xattr memoization's own mode. Still declared extern by fingerprint.cpp, which is
-// linked into replay through FingerprintLib, so the definition has to stay here even
-// though replay now reaches it only through the CacheMemo::Xattr branch.
+// The xattr memoization's own mode, read only by the CacheMemo::Xattr branch.
 extern XattrMode g_xattr_mode;
 
 // Which memoization backend hash_one_file uses, and whether it must ignore what is
@@ -45,6 +51,62 @@ extern bool g_memo_refresh;
 // Borrowed here; every method it exposes is thread-safe.
 extern FingerprintStore *g_fingerprint_store;
 
+// Directory listings persisted between runs, owned by main and non-null whenever the
+// cache memoizes at all (not under --cache-memo off). Glob inputs are expanded through
+// it. Borrowed here; thread-safe.
+extern DirectoryListingStore *g_listing_store;
+
+// Files already hashed in this process by (device, inode, size, mtime, ctime), consulted
+// before either memo backend; main reports what it saved under --verbose.
+extern FileHashDedup g_hash_dedup;
+
+// Run-scoped memo of what fingerprint_paths collected and hashed for each declared path,
+// so a header or SDK directory declared by thousands of tasks is walked, stat'ed and
+// probed once per run, and every later declaration of it costs one lookup here.
+// Keyed by the path as declared; a glob pattern keeps its whole expansion.
+// Entries are only right for as long as nothing writes under them, and in a replay run
+// the only writers are its tasks, so every task that completes passes its owned paths
+// (outputs, exclusive and mutating inputs) to invalidate(), before any task that
+// depends on it can start. Locations are compared after resolving symlinked directories,
+// case-insensitively, and an entry that followed a symlink anywhere is dropped by any
+// invalidation at all, since what it read lies outside its own tree.
+// Owned by one CacheSession and never shared between runs: changes made between runs
+// are not invalidated by anything. Thread-safe.
+class PathFingerprintMemo
+{
+public:
+	// One declared path's collected and hashed entries; defined in TaskFingerprint.cpp.
+	struct Segment;
+
+	PathFingerprintMemo() = default;
+	PathFingerprintMemo(const PathFingerprintMemo &) = delete;
+	PathFingerprintMemo &operator=(const PathFingerprintMemo &) = delete;
+
+	// Forgets every memoized path whose location overlaps one of ownedPaths - equal to it,
+	// inside it or containing it. Glob patterns invalidate from their concrete prefix.
+	// Never throws: a memo that cannot record an invalidation is cleared and stops
+	// memoizing for the rest of the run.
+	void invalidate(const std::vector<std::string> &ownedPaths) noexcept;
+
+	// Declared paths served from the memo instead of being walked and hashed again.
+	size_t hit_count() const { return mHits.load(std::memory_order_relaxed); }
+
+	// Used by fingerprint_paths only.
+	std::shared_ptr<const Segment> find(const std::string &path);
+	void count_hit();
+	uint64_t epoch();
+	void insert(const std::string &path, std::shared_ptr<const Segment> segment, uint64_t sinceEpoch);
+
+private:
+	std::mutex mMutex;
+	std::unordered_map<std::string, std::shared_ptr<const Segment>> mSegments;
+	// Every location invalidated so far, in order; an epoch is an index into it. A segment
+	// collected while a task completed is only kept when that task did not touch it.
+	std::vector<std::string> mInvalidated;
+	bool mDisabled = false;
+	std::atomic<size_t> mHits{0};
+};
+
 class TaskFingerprint
 {
 public:
@@ -67,8 +129,11 @@ public:
 	// directory, stat or open failure, symlink nesting past the depth bound), regardless
 	// of requireConcreteFiles: an unread subtree contributes exactly what an absent one
 	// contributes, so a partial rollup could match a stored value it does not describe.
+	// memo, when given, serves declared paths already fingerprinted in this run and keeps
+	// the ones collected here; the result is the same value as without it.
 	// Never throws and never fails the run.
-	static std::optional<uint64_t> fingerprint_paths(const std::vector<std::string> &paths, bool requireConcreteFiles);
+	static std::optional<uint64_t> fingerprint_paths(const std::vector<std::string> &paths, bool requireConcreteFiles,
+	                                                 PathFingerprintMemo *memo = nullptr);
 
 	// Folds declared environment text into a file fingerprint.
 	// Returns fp unchanged when envText is empty. Mirrors gate's combine_with_env.
@@ -25,6 +25,7 @@
 #include "PlaylistDoc.h"
 #include "TaskFingerprint.h"
 #include "FingerprintStore.h"
+#include "DirectoryListingStore.h"
 #include "PosixFileOps.h"
 
 #include <limits.h>
@@ -51,6 +52,12 @@ enum
 	kOptCacheEnv,
 	kOptCacheMemo,
 	kOptCacheMemoRefresh,
+	kOptCacheDeferCompaction,
+	kOptCacheCompact,
+	kOptCacheMemoStats,
+	kOptCacheMemoPopulate,
+	kOptCacheArtifacts,
+	kOptCacheArtifactsLimit,
 };
 
 static struct option sLongOptions[] =
@@ -81,6 +88,12 @@ static struct option sLongOptions[] =
 	{"cache-env",			required_argument,	NULL, kOptCacheEnv},
 	{"cache-memo",			required_argument,	NULL, kOptCacheMemo},
 	{"cache-memo-refresh",	no_argument,			NULL, kOptCacheMemoRefresh},
+	{"cache-defer-compaction",	no_argument,		NULL, kOptCacheDeferCompaction},
+	{"cache-compact",		no_argument,			NULL, kOptCacheCompact},
+	{"cache-memo-stats",	required_argument,	NULL, kOptCacheMemoStats},
+	{"cache-memo-populate",	no_argument,			NULL, kOptCacheMemoPopulate},
+	{"cache-artifacts",		no_argument,			NULL, kOptCacheArtifacts},
+	{"cache-artifacts-limit",	required_argument,	NULL, kOptCacheArtifactsLimit},
 	{"version",				no_argument,		NULL, 'V'},
 	{"help",				no_argument,		NULL, 'h'},
 	{NULL, 					0,					NULL,  0 }
@@ -132,8 +145,10 @@ DisplayHelp(void)
 		"                     Off by default. Requires a playlist file; works in the default concurrent\n"
 		"                     mode and in --serial mode. See \"Incremental execution cache\" below.\n"
 		"  --cache-dir DIR    Directory holding the cache manifest. Default \".replay-cache\". Implies --cache.\n"
-		"  --cache-format json|plist   Manifest format. Default \"json\". Implies --cache.\n"
-		"  --cache-hash crc32c|blake3   Per-file content hash algorithm. Default \"crc32c\". Implies --cache.\n"
+		"  --cache-format json|plist|binary   Manifest format. Default \"json\". \"binary\" is a sorted table\n"
+		"                     mapped for lookup, with an append-only journal for changes; for playlists\n"
+		"                     with many thousands of cacheable actions. Implies --cache.\n"
+		"  --cache-hash crc32c|blake3|xxh3   Per-file content hash algorithm. Default \"crc32c\". Implies --cache.\n"
 		"  --cache-refresh    Execute everything, ignoring stored entries, but record fresh ones. Implies --cache.\n"
 		"  --cache-env NAME   Fold the value of this environment variable into every task's input fingerprint.\n"
 		"                     May be repeated. Implies --cache.\n"
@@ -146,6 +161,24 @@ DisplayHelp(void)
 		"                     Implies --cache.\n"
 		"  --cache-memo-refresh   Ignore what is memoized, recompute every file hash and rewrite the memo.\n"
 		"                     Implies --cache.\n"
+		"  --cache-defer-compaction   Never fold the sidecar journal into its index at the end of a run:\n"
+		"                     append to the journal instead, and leave the rewrite to --cache-compact.\n"
+		"                     For very large indexes, whose rewrite would dominate an otherwise cached run.\n"
+		"                     Implies --cache.\n"
+		"  --cache-compact    Fold the sidecar journal into its index, evicting stale entries. Without a\n"
+		"                     playlist it is the only thing replay does; with one it runs after the playlist.\n"
+		"                     Implies --cache.\n"
+		"  --cache-memo-stats PATH   Write the sidecar index's statistics to PATH as JSON at the end of the run:\n"
+		"                     load factors, probe lengths, open and save times, bytes written and the route\n"
+		"                     the save took. -v prints the same figures. Implies --cache.\n"
+		"  --cache-memo-populate   Read the whole sidecar index into memory when it is opened, rather than\n"
+		"                     page by page as it is verified. For large indexes on a slow disk; with the\n"
+		"                     index in the page cache it makes no difference. Implies --cache.\n"
+		"  --cache-artifacts  Keep the output files of executed actions in a content-addressed store in\n"
+		"                     --cache-dir, and restore them instead of executing when an action misses with\n"
+		"                     inputs it has already been run with. Implies --cache.\n"
+		"  --cache-artifacts-limit MB   Size limit of the artifact store. Default 1024. Least recently used\n"
+		"                     files are evicted at the end of a run. Implies --cache-artifacts.\n"
 		"  --sandbox          Enable hard sandbox. When used with a playlist file (not stdin), replay\n"
 		"                     auto-discovers declared paths from the playlist and adds them to the policy.\n"
 		"                     Combine with --allow-read, --allow-write, --sandbox-profile for additional paths.\n"
@@ -265,6 +298,28 @@ DisplayHelp(void)
 		"  After restructuring a playlist (especially removing a step that mutated earlier products),\n"
 		"  run once with --cache-refresh to re-execute everything and rebuild the manifest.\n"
 		"\n"
+		"  The json and plist manifests are read whole before the first action starts and rewritten whole\n"
+		"  by every run that changes anything. --cache-format binary keeps the entries in a table sorted by\n"
+		"  action signature instead, which is mapped and searched in place, so a run reads only the entries\n"
+		"  of the actions it has. A run's changes are appended to a journal beside it, one record per action\n"
+		"  that executed or was removed, and a run that changes nothing writes nothing. The first run whose\n"
+		"  changes no longer fit the journal rewrites the table with them folded in. Both files carry\n"
+		"  checksums, and one that fails is treated like a missing manifest. The byte order is the machine's,\n"
+		"  so json and plist remain the formats to share between machines of different architectures.\n"
+		"\n"
+		"  --cache-artifacts keeps what executed actions produced, so that a miss need not mean an execution.\n"
+		"  After an action executes successfully, each of its output files is cloned into a store in\n"
+		"  --cache-dir under the hash of its content, and recorded against the action's input fingerprint.\n"
+		"  When the action later misses - its outputs were deleted or changed, or its inputs went back to a\n"
+		"  state it has already run with - and the store holds a record for the current inputs, the outputs\n"
+		"  are cloned back and the action does not run. Each restored file is checked against its hash first,\n"
+		"  and a store that cannot serve the whole action leaves it to execute. Only actions whose declared\n"
+		"  outputs are all concrete paths holding files or symlinks, and that change nothing else, are stored:\n"
+		"  not move, delete, edit, hardlink or create directory. Like a hit, a restore reproduces nothing an\n"
+		"  action does outside its declared outputs. Restores are clones, never hard links, so editing a\n"
+		"  restored file cannot reach the store. A run that added to the store trims it to\n"
+		"  --cache-artifacts-limit at the end, evicting the least recently used files first.\n"
+		"\n"
 		"  The per-file hash memoization (--cache-memo) records a content hash per file so that unchanged\n"
 		"  files are not read again. The two backends answer the same question but trust different things,\n"
 		"  because one of them writes to the very file it is memoizing and the other does not:\n"
@@ -297,7 +352,10 @@ DisplayHelp(void)
 		"  that may be tens of megabytes. The first run whose changes no longer fit the journal folds it back\n"
 		"  into the index and clears it, which is also when entries no recent run has mentioned are evicted.\n"
 		"  Every journal batch carries its own checksum, so a batch left half-written by a crash costs that\n"
-		"  batch and nothing else.\n"
+		"  batch and nothing else. Several replay processes sharing one cache directory append their batches\n"
+		"  side by side without waiting for each other; only the run that folds the journal back in has the\n"
+		"  store to itself. Under --cache-defer-compaction no run folds it in, and the journal grows until a\n"
+		"  --cache-compact pass does; -v reports the journal's size and how long each rewrite of the index took.\n"
 		"\n"
 		"  When the index is written it usually also records its own crc32c, and the file's inode, size and\n"
 		"  mtime at that moment, in a \"public.replay.store-crc32c\" attribute, readable with \"xattr -px\". A\n"
@@ -320,6 +378,26 @@ DisplayHelp(void)
 		"  of that a run notices depends on how much of it is fingerprinting - a playlist dominated by process\n"
 		"  spawning sees no difference between the three.\n"
 		"\n"
+		"  Within one run, whatever the backend (and with --cache-memo off too), a file is hashed once however\n"
+		"  many tasks declare it: the first task to reach a file hashes it, tasks reaching the same device,\n"
+		"  inode, size, mtime and ctime meanwhile wait for that hash and later ones reuse it. Hard links under\n"
+		"  a declared tree are hashed once the same way. -v reports the files and bytes this saved.\n"
+		"\n"
+		"  Declared paths are memoized for the run as well: what a declared file, directory or glob collected\n"
+		"  and hashed is kept, and the next task declaring the same path reuses it without walking, stat-ing or\n"
+		"  probing anything again. When a task finishes, whatever it owns (its outputs, exclusive and mutating\n"
+		"  inputs) drops the memoized paths in, under or above it, before any task depending on it starts.\n"
+		"  Files changed during a run by anything other than its own tasks are not noticed until the next run.\n"
+		"\n"
+		"  Glob inputs are expanded from directory listings kept between runs, in a listings-<host>.bin file in\n"
+		"  the cache directory. Each directory a glob walked is stored with its sorted entries and its device,\n"
+		"  inode, modification and change times. A later run stats each directory once and reuses its listing\n"
+		"  while those still match, re-reading only the directories that changed, so an unchanged tree costs one\n"
+		"  stat per directory rather than one per file. A directory changed within two seconds of being read is\n"
+		"  not stored, since a coarse timestamp might not move for the next change. Like the sidecar, the file is\n"
+		"  machine-local and disposable. --cache-memo-refresh ignores it, --cache-memo off turns it off, and\n"
+		"  --dry-run reads it without writing it.\n"
+		"\n"
 		"  With --sandbox, the cache directory is granted read-write in the sandbox automatically. The default\n"
 		"  sidecar memoization lives there, so it keeps working when the input trees are read-only. Choosing\n"
 		"  --cache-memo xattr under a sandbox means every memoization write to an input is denied and logged\n"
@@ -327,13 +405,14 @@ DisplayHelp(void)
 		"\n"
 		"  --dry-run --cache reports [cache] HIT or [cache] MISS (<reason>) per cacheable action on stdout\n"
 		"  without executing or writing anything - a \"what would rebuild\" query (no summary line, since\n"
-		"  nothing runs). During a real run, --verbose reports the same hits and miss reasons on stderr as\n"
-		"  \"cache: HIT/MISS ...\" lines, so stdout stays exactly what the playlist would print without --cache.\n"
+		"  nothing runs). With --cache-artifacts a miss the store would serve is reported as [cache] RESTORE\n"
+		"  (<reason>). During a real run, --verbose reports the same on stderr as \"cache: HIT/MISS/RESTORED\"\n"
+		"  lines, so stdout stays exactly what the playlist would print without --cache.\n"
 		"  A task that misses with the reason \"missing input\" on every run has a declared path that cannot be\n"
 		"  read - a nonexistent input, or an unreadable file inside a declared directory. Such a task can never\n"
 		"  be cached, because an unread path and a deleted one are indistinguishable in the fingerprint.\n"
 		"  Every run that actually executes with --cache ends with a summary line on stderr:\n"
-		"  cache: N hits, M executed, K failed, manifest <path>.\n"
+		"  cache: N hits, M executed, K failed, R restored, P paths from the run memo, manifest <path>.\n"
 		"\n"
 		"  A failed action's previous entry is kept. It can only produce a hit later if the declared world\n"
 		"  returns to the exact state a SUCCESSFUL run recorded, so the skip is correct - but note that a run\n"
@@ -680,6 +759,12 @@ int main(int argc, const char * argv[])
 	context.cacheHash = FileHashAlgorithm::CRC32C;
 	context.cacheMemo = CacheMemo::Sidecar;
 	context.cacheMemoRefresh = false;
+	context.cacheDeferCompaction = false;
+	context.cacheCompact = false;
+	context.cacheMemoStatsPath = {};
+	context.cacheMemoPopulate = false;
+	context.cacheArtifacts = false;
+	context.cacheArtifactsLimit = 1024ULL * 1024 * 1024;
 	context.cacheSession = nullptr;
 
 	std::vector<std::string> playlistKeys;
@@ -817,9 +902,11 @@ int main(int argc, const char * argv[])
 					context.cacheFormat = CacheFormat::Json;
 				else if(format == "plist")
 					context.cacheFormat = CacheFormat::Plist;
+				else if(format == "binary")
+					context.cacheFormat = CacheFormat::Binary;
 				else
 				{
-					LogError("error: invalid --cache-format \"%s\". Expected \"json\" or \"plist\"\n", optarg);
+					LogError("error: invalid --cache-format \"%s\". Expected \"json\", \"plist\" or \"binary\"\n", optarg);
 					return EXIT_FAILURE;
 				}
 			}
@@ -828,14 +915,10 @@ int main(int argc, const char * argv[])
 			case kOptCacheHash:
 			{
 				context.cacheEnabled = true;
-				std::string algorithm(optarg);
-				if(algorithm == "crc32c")
-					context.cacheHash = FileHashAlgorithm::CRC32C;
-				else if(algorithm == "blake3")
-					context.cacheHash = FileHashAlgorithm::BLAKE3;
-				else
+				context.cacheHash = hash_algorithm_from_name(optarg);
+				if(context.cacheHash == FileHashAlgorithm::UNKNOWN)
 				{
-					LogError("error: invalid --cache-hash \"%s\". Expected \"crc32c\" or \"blake3\"\n", optarg);
+					LogError("error: invalid --cache-hash \"%s\". Expected \"crc32c\", \"blake3\" or \"xxh3\"\n", optarg);
 					return EXIT_FAILURE;
 				}
 			}
@@ -874,6 +957,49 @@ int main(int argc, const char * argv[])
 				context.cacheMemoRefresh = true;
 			break;
 
+			case kOptCacheDeferCompaction:
+				context.cacheEnabled = true;
+				context.cacheDeferCompaction = true;
+			break;
+
+			case kOptCacheCompact:
+				context.cacheEnabled = true;
+				context.cacheCompact = true;
+			break;
+
+			case kOptCacheMemoStats:
+				context.cacheEnabled = true;
+				context.cacheMemoStatsPath = optarg;
+			break;
+
+			case kOptCacheMemoPopulate:
+				context.cacheEnabled = true;
+				context.cacheMemoPopulate = true;
+			break;
+
+			case kOptCacheArtifacts:
+				context.cacheEnabled = true;
+				context.cacheArtifacts = true;
+			break;
+
+			case kOptCacheArtifactsLimit:
+			{
+				context.cacheEnabled = true;
+				context.cacheArtifacts = true;
+				// Digits only: strtoull alone would take "-1" as a huge limit and "" as zero.
+				char *end = nullptr;
+				errno = 0;
+				unsigned long long megabytes = strtoull(optarg, &end, 10);
+				if((optarg[0] < '0') || (optarg[0] > '9') || (*end != '\0') || (errno != 0) ||
+				   (megabytes > (UINT64_MAX >> 20)))
+				{
+					LogError("error: invalid --cache-artifacts-limit \"%s\". Expected a size in megabytes\n", optarg);
+					return EXIT_FAILURE;
+				}
+				context.cacheArtifactsLimit = (uint64_t)megabytes << 20;
+			}
+			break;
+
 			case 'V':
 				printf( "replay %s\n", STRINGIFY_VALUE(REPLAY_VERSION) );
 				return EXIT_SUCCESS;
@@ -901,7 +1027,7 @@ int main(int argc, const char * argv[])
 			unsupportedMode = "--mcp-server";
 		else if(!context.batchName.empty())
 			unsupportedMode = "--start-server";
-		else if(playlistPath == nullptr)
+		else if((playlistPath == nullptr) && !context.cacheCompact)
 			unsupportedMode = "stdin streaming";
 		else if(context.concurrent && !context.analyzeDependencies)
 			unsupportedMode = "--no-dependency"; // serial dispatch never consults it, so -s -p caches fine
@@ -937,7 +1063,31 @@ int main(int argc, const char * argv[])
 		// The cache directory is resolved now, while the CWD is still meaningful and
 		// before the sandbox is applied, so the manifest path cannot move under us.
 		context.cacheDir = file_helpers::resolve_literal_path(context.cacheDir);
-		context.playlistPath = file_helpers::resolve_literal_path(playlistPath);
+		if(playlistPath != nullptr)
+			context.playlistPath = file_helpers::resolve_literal_path(playlistPath);
+
+		if(context.cacheCompact && (context.cacheMemo != CacheMemo::Sidecar))
+		{
+			LogError("error: --cache-compact only applies to --cache-memo sidecar\n");
+			return EXIT_FAILURE;
+		}
+		if(context.cacheMemoPopulate && (context.cacheMemo != CacheMemo::Sidecar))
+		{
+			LogError("error: --cache-memo-populate only applies to --cache-memo sidecar\n");
+			return EXIT_FAILURE;
+		}
+		if(!context.cacheMemoStatsPath.empty())
+		{
+			if(context.cacheMemo != CacheMemo::Sidecar)
+			{
+				LogError("error: --cache-memo-stats only applies to --cache-memo sidecar\n");
+				return EXIT_FAILURE;
+			}
+			// Resolved with the cache directory, before anything can change the CWD.
+			context.cacheMemoStatsPath = file_helpers::resolve_literal_path(context.cacheMemoStatsPath);
+			if(sandboxRequested)
+				sandboxAllowWrite.push_back(context.cacheMemoStatsPath);
+		}
 
 		if(sandboxRequested)
 		{
@@ -986,8 +1136,39 @@ int main(int argc, const char * argv[])
 	std::unique_ptr<FingerprintStore> fingerprintStore;
 	if(context.cacheEnabled && (context.cacheMemo == CacheMemo::Sidecar))
 	{
-		fingerprintStore = FingerprintStore::Open(context.cacheDir, context.cacheHash, context.verbose);
+		fingerprintStore = FingerprintStore::Open(context.cacheDir, context.cacheHash, context.cacheMemoPopulate,
+		                                           context.verbose);
 		g_fingerprint_store = fingerprintStore.get();
+		if(fingerprintStore != nullptr)
+			fingerprintStore->set_defer_compaction(context.cacheDeferCompaction);
+	}
+
+	// --cache-compact without a playlist is a maintenance pass over the store alone, run
+	// between builds so that no build pays for the rewrite. Nothing else is set up for it.
+	if(context.cacheCompact && (playlistPath == nullptr))
+	{
+		if(context.dryRun)
+			LogError("warning: --cache-compact does nothing under --dry-run\n");
+		else if(fingerprintStore != nullptr)
+			fingerprintStore->compact();
+		if(fingerprintStore != nullptr)
+		{
+			if(context.verbose)
+				fingerprintStore->log_stats();
+			if(!context.cacheMemoStatsPath.empty())
+				fingerprintStore->write_stats_json(context.cacheMemoStatsPath);
+		}
+		safe_exit(EXIT_SUCCESS);
+	}
+
+	// Opened alongside the FingerprintStore, and owned the same way. Directory listings
+	// are not file hashes, so every memo backend gets them; only --cache-memo off, which
+	// promises to memoize nothing between runs, goes without.
+	std::unique_ptr<DirectoryListingStore> listingStore;
+	if(context.cacheEnabled && (context.cacheMemo != CacheMemo::Off))
+	{
+		listingStore = DirectoryListingStore::Open(context.cacheDir, context.cacheMemoRefresh, context.verbose);
+		g_listing_store = listingStore.get();
 	}
 
 	// Load the playlist once before the sandbox is applied so we can read the file freely.
@@ -1137,17 +1318,45 @@ int main(int argc, const char * argv[])
 	if(fingerprintStore != nullptr)
 	{
 		if(!context.dryRun)
+		{
 			fingerprintStore->save();
+			if(context.cacheCompact)
+				fingerprintStore->compact();
+		}
 		if(context.verbose)
 		{
 			// The journal count is how many of the entries available to this run came
 			// from the append log rather than the table, which is what makes "did the
-			// incremental path actually work" visible without parsing the files.
-			LogError("memo: %zu hits, %zu computed, store %s (%zu table, %zu journalled)\n",
+			// incremental path actually work" visible without parsing the files. Its size
+			// is what every run pays to read back until the journal is compacted.
+			LogError("memo: %zu hits, %zu computed, store %s (%zu table, %zu journalled in %llu bytes)\n",
 				fingerprintStore->hit_count(), fingerprintStore->computed_count(),
 				fingerprintStore->path().c_str(),
-				fingerprintStore->loaded_entry_count(), fingerprintStore->journal_entry_count());
+				fingerprintStore->loaded_entry_count(), fingerprintStore->journal_entry_count(),
+				(unsigned long long)fingerprintStore->journal_bytes());
+			fingerprintStore->log_stats();
 		}
+		if(!context.cacheMemoStatsPath.empty())
+			fingerprintStore->write_stats_json(context.cacheMemoStatsPath);
+	}
+
+	if(listingStore != nullptr)
+	{
+		if(!context.dryRun)
+			listingStore->save();
+		if(context.verbose)
+		{
+			LogError("listings: %zu directories reused, %zu read, store %s (%zu loaded)\n",
+				listingStore->reused_count(), listingStore->read_count(),
+				listingStore->path().c_str(), listingStore->loaded_count());
+		}
+	}
+
+	if(context.cacheEnabled && context.verbose)
+	{
+		FileHashDedup::Stats dedup = g_hash_dedup.stats();
+		LogError("fingerprint: %zu files (%llu bytes) took the hash of the same inode hashed earlier in this run\n",
+			dedup.files, (unsigned long long)dedup.bytes);
 	}
 
 	// It looks like a lot of unnecessary Obj-C memory cleanup is happening at exit
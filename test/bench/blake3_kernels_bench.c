@@ -0,0 +1,163 @@
+// Per-kernel BLAKE3 throughput and correctness check.
+//
+// Calls each blake3_hash_many_* kernel the CPU supports directly, on the same
+// buffer of whole 1 KiB chunks, and compares every chaining value with the
+// portable kernel's. A kernel that disagrees fails the run, so the benchmark
+// doubles as a test that each SIMD path computes the same hash. The last lines
+// report which degree blake3_dispatch.c picks on this machine and the
+// throughput of the public hasher API, which is what fingerprint, gate and
+// replay actually call.
+//
+// Built and run by test/bench_blake3_kernels.sh.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blake3_impl.h"
+
+typedef void (*hash_many_fn)(const uint8_t *const *inputs, size_t num_inputs,
+                             size_t blocks, const uint32_t key[8],
+                             uint64_t counter, bool increment_counter,
+                             uint8_t flags, uint8_t flags_start,
+                             uint8_t flags_end, uint8_t *out);
+
+typedef struct
+{
+    const char *name;
+    hash_many_fn fn;
+    bool supported;
+} Kernel;
+
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Hashes all chunks in groups of MAX_SIMD_DEGREE, the way blake3.c feeds
+// blake3_hash_many, writing one 32-byte chaining value per chunk.
+static void
+hash_all_chunks(hash_many_fn fn, const uint8_t *const *chunks, size_t chunk_count, uint8_t *cvs)
+{
+    for(size_t i = 0; i < chunk_count; i += MAX_SIMD_DEGREE)
+    {
+        size_t n = chunk_count - i;
+        if(n > MAX_SIMD_DEGREE)
+            n = MAX_SIMD_DEGREE;
+        fn(&chunks[i], n, BLAKE3_CHUNK_LEN / BLAKE3_BLOCK_LEN, IV, i, true,
+           0, CHUNK_START, CHUNK_END, &cvs[i * BLAKE3_OUT_LEN]);
+    }
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t size_mb = (argc > 1) ? (size_t)strtoul(argv[1], NULL, 10) : 64;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 5;
+    if(size_mb == 0 || iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s [size_mb] [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t size = size_mb * 1024 * 1024;
+    size_t chunk_count = size / BLAKE3_CHUNK_LEN;
+    uint8_t *buffer = (uint8_t *)malloc(size);
+    const uint8_t **chunks = (const uint8_t **)malloc(chunk_count * sizeof(uint8_t *));
+    uint8_t *expected = (uint8_t *)malloc(chunk_count * BLAKE3_OUT_LEN);
+    uint8_t *actual = (uint8_t *)malloc(chunk_count * BLAKE3_OUT_LEN);
+    if(buffer == NULL || chunks == NULL || expected == NULL || actual == NULL)
+    {
+        fprintf(stderr, "error: cannot allocate %zu MB\n", size_mb);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for(size_t i = 0; i < size; i++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        buffer[i] = (uint8_t)(state >> 56);
+    }
+    for(size_t i = 0; i < chunk_count; i++)
+        chunks[i] = &buffer[i * BLAKE3_CHUNK_LEN];
+
+    Kernel kernels[] = {
+        {"portable", blake3_hash_many_portable, true},
+#if defined(IS_X86)
+#if !defined(BLAKE3_NO_SSE2)
+        {"sse2", blake3_hash_many_sse2, __builtin_cpu_supports("sse2")},
+#endif
+#if !defined(BLAKE3_NO_SSE41)
+        {"sse41", blake3_hash_many_sse41, __builtin_cpu_supports("sse4.1")},
+#endif
+#if !defined(BLAKE3_NO_AVX2)
+        {"avx2", blake3_hash_many_avx2, __builtin_cpu_supports("avx2")},
+#endif
+#if !defined(BLAKE3_NO_AVX512)
+        {"avx512", blake3_hash_many_avx512,
+            __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")},
+#endif
+#endif
+#if BLAKE3_USE_NEON == 1
+        {"neon", blake3_hash_many_neon, true},
+#endif
+    };
+
+    hash_all_chunks(blake3_hash_many_portable, chunks, chunk_count, expected);
+
+    int failures = 0;
+    printf("%-10s %12s\n", "kernel", "GB/s");
+    for(size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++)
+    {
+        if(!kernels[k].supported)
+        {
+            printf("%-10s %12s\n", kernels[k].name, "unsupported");
+            continue;
+        }
+
+        memset(actual, 0, chunk_count * BLAKE3_OUT_LEN);
+        hash_all_chunks(kernels[k].fn, chunks, chunk_count, actual);
+        if(memcmp(actual, expected, chunk_count * BLAKE3_OUT_LEN) != 0)
+        {
+            printf("%-10s %12s\n", kernels[k].name, "MISMATCH");
+            failures++;
+            continue;
+        }
+
+        double best = 0.0;
+        for(int iter = 0; iter < iterations; iter++)
+        {
+            double start = now_seconds();
+            hash_all_chunks(kernels[k].fn, chunks, chunk_count, actual);
+            double elapsed = now_seconds() - start;
+            if(best == 0.0 || elapsed < best)
+                best = elapsed;
+        }
+        printf("%-10s %12.2f\n", kernels[k].name, (double)size / best / 1e9);
+    }
+
+    double best = 0.0;
+    uint8_t digest[BLAKE3_OUT_LEN];
+    for(int iter = 0; iter < iterations; iter++)
+    {
+        double start = now_seconds();
+        blake3_hasher hasher;
+        blake3_hasher_init(&hasher);
+        blake3_hasher_update(&hasher, buffer, size);
+        blake3_hasher_finalize(&hasher, digest, sizeof(digest));
+        double elapsed = now_seconds() - start;
+        if(best == 0.0 || elapsed < best)
+            best = elapsed;
+    }
+    printf("dispatch   degree %zu, hasher %.2f GB/s\n", blake3_simd_degree(), (double)size / best / 1e9);
+
+    free(actual);
+    free(expected);
+    free(chunks);
+    free(buffer);
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
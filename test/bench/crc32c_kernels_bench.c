@@ -0,0 +1,211 @@
+// Per-kernel CRC32C correctness check and throughput matrix.
+//
+// Every crc32c kernel the CPU supports is called directly, as is crc32_impl,
+// which dispatches to one of them at runtime (fast-crc32/crc32c_arch.c). Each is
+// compared with a byte-at-a-time table CRC for every length up to 2 KB and a set
+// of longer lengths around the kernels' block boundaries, at every start offset
+// within a cache line, and chained through a non-zero initial crc the way the
+// read pipeline feeds a file in pieces. A kernel that disagrees fails the run.
+//
+// Throughput is then reported per kernel for the buffer sizes a file reaches
+// compute_buffer_hash with, from a cache-line aligned and a misaligned start.
+//
+// Built and run by test/bench_crc32c_kernels.sh.
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+uint32_t crc32_impl(uint32_t crc0, const char *buf, size_t len);
+#if defined(__x86_64__)
+uint32_t crc32c_sse42_impl(uint32_t crc0, const char *buf, size_t len);
+uint32_t crc32c_avx512_impl(uint32_t crc0, const char *buf, size_t len);
+#endif
+
+typedef uint32_t (*crc_fn)(uint32_t crc0, const char *buf, size_t len);
+
+typedef struct
+{
+    const char *name;
+    crc_fn fn;
+    bool supported;
+} Kernel;
+
+static uint32_t g_table[256];
+static volatile uint32_t g_sink;
+
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static void
+init_table(void)
+{
+    for(uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for(int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ ((crc & 1) ? 0x82F63B78u : 0);
+        g_table[i] = crc;
+    }
+}
+
+static uint32_t
+crc32c_reference(uint32_t crc0, const char *buf, size_t len)
+{
+    uint32_t crc = ~crc0;
+    for(size_t i = 0; i < len; i++)
+        crc = (crc >> 8) ^ g_table[(crc ^ (uint8_t)buf[i]) & 0xff];
+    return ~crc;
+}
+
+// Returns the number of mismatches, printing the first one.
+static int
+verify_kernel(const Kernel *kernel, const char *buffer)
+{
+    // Lengths across the 8 byte alignment prologue, the 256/512 byte vector loop
+    // entry of the AVX-512 kernel and the 4080 byte blocks of the SSE4.2 kernel.
+    static const size_t long_lengths[] = {
+        4079, 4080, 4081, 4095, 4096, 4097, 8160, 8191, 12240 + 5, 65536 + 7, 1024 * 1024 + 13,
+    };
+    size_t lengths[2049 + sizeof(long_lengths) / sizeof(long_lengths[0])];
+    size_t length_count = 0;
+    for(size_t len = 0; len <= 2048; len++)
+        lengths[length_count++] = len;
+    for(size_t i = 0; i < sizeof(long_lengths) / sizeof(long_lengths[0]); i++)
+        lengths[length_count++] = long_lengths[i];
+
+    int failures = 0;
+    for(size_t l = 0; l < length_count; l++)
+    {
+        size_t len = lengths[l];
+        for(size_t offset = 0; offset < 64; offset++)
+        {
+            const char *start = buffer + offset;
+            uint32_t expected = crc32c_reference(0, start, len);
+            uint32_t actual = kernel->fn(0, start, len);
+
+            // the same bytes in two pieces, split off the kernel's alignment
+            size_t split = (len * 3 / 7) | 1;
+            if(split > len)
+                split = len;
+            uint32_t chained = kernel->fn(kernel->fn(0, start, split), start + split, len - split);
+
+            if(actual != expected || chained != expected)
+            {
+                if(failures == 0)
+                    printf("%-10s MISMATCH at length %zu offset %zu: %08x / chained %08x, expected %08x\n",
+                           kernel->name, len, offset, actual, chained, expected);
+                failures++;
+            }
+        }
+    }
+    return failures;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t large_mb = (argc > 1) ? (size_t)strtoul(argv[1], NULL, 10) : 64;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 5;
+    if(large_mb == 0 || iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s [large_size_mb] [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // one spare cache line for the misaligned starts
+    size_t large = large_mb * 1024 * 1024;
+    if(large < 2 * 1024 * 1024)
+        large = 2 * 1024 * 1024;
+    char *buffer = (char *)aligned_alloc(64, large + 64);
+    if(buffer == NULL)
+    {
+        fprintf(stderr, "error: cannot allocate %zu MB\n", large_mb);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for(size_t i = 0; i < large + 64; i++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        buffer[i] = (char)(state >> 56);
+    }
+    init_table();
+
+    Kernel kernels[] = {
+#if defined(__x86_64__)
+        {"sse42", crc32c_sse42_impl, __builtin_cpu_supports("sse4.2")},
+        {"avx512", crc32c_avx512_impl,
+            __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq")},
+#endif
+        {"dispatch", crc32_impl, true},
+    };
+    size_t kernel_count = sizeof(kernels) / sizeof(kernels[0]);
+
+    int failures = 0;
+    for(size_t k = 0; k < kernel_count; k++)
+    {
+        if(!kernels[k].supported)
+            continue;
+        int mismatches = verify_kernel(&kernels[k], buffer);
+        if(mismatches != 0)
+        {
+            printf("%-10s %d mismatches\n", kernels[k].name, mismatches);
+            kernels[k].supported = false;
+            failures += mismatches;
+        }
+    }
+
+    size_t sizes[] = {64, 256, 1024, 4096, 16384, 65536, 1024 * 1024, large};
+    size_t offsets[] = {0, 1};
+
+    printf("%-10s %12s %6s %12s %12s\n", "kernel", "size", "align", "GB/s", "ns/call");
+    for(size_t k = 0; k < kernel_count; k++)
+    {
+        if(!kernels[k].supported)
+        {
+            printf("%-10s %12s\n", kernels[k].name, "unsupported");
+            continue;
+        }
+        for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            for(size_t o = 0; o < sizeof(offsets) / sizeof(offsets[0]); o++)
+            {
+                size_t size = sizes[s];
+                // about the same number of bytes per timed pass whatever the size, spread
+                // over the buffer so small sizes are not always served from one cache line
+                size_t calls = (size < large) ? (64 * 1024 * 1024) / size : 1;
+                size_t stride = (size + 63) & ~(size_t)63;
+                size_t slots = large / stride;
+
+                double best = 0.0;
+                for(int iter = 0; iter < iterations; iter++)
+                {
+                    uint32_t sum = 0;
+                    double start = now_seconds();
+                    for(size_t c = 0; c < calls; c++)
+                        sum += kernels[k].fn(0, buffer + offsets[o] + (c % slots) * stride, size);
+                    double elapsed = now_seconds() - start;
+                    g_sink = sum;
+                    if(best == 0.0 || elapsed < best)
+                        best = elapsed;
+                }
+
+                double bytes = (double)size * (double)calls;
+                printf("%-10s %12zu %6zu %12.2f %12.1f\n", kernels[k].name, size, offsets[o],
+                       bytes / best / 1e9, best * 1e9 / (double)calls);
+            }
+        }
+    }
+
+    free(buffer);
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
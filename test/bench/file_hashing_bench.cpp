@@ -0,0 +1,545 @@
+// Microbenchmarks of the per-file hashing hot path in isolation, written as one JSON
+// document on stdout so runs can be kept and compared between releases. Progress goes
+// to stderr.
+//
+//   throughput      each algorithm and each kernel the CPU supports, on one core, for
+//                   buffers from 64 B up to max_size_mb (1 GB by default); and
+//                   compute_buffer_hash itself, which is what the tools call and which
+//                   spreads buffers of kParallelHashThreshold and more over all cores.
+//   per_file        the fixed cost of one tiny file: lstat, compute_file_hash (open,
+//                   read, close, hash), the xattr memo write and probe, and a probe of
+//                   replay's FingerprintStore, for the default crc32c.
+//   mmap_crossover  hash_file_by_read against hash_file_by_mmap over one file per size
+//                   around kHashMmapThreshold, page cache warm, for each algorithm.
+//
+// Before anything is timed, every kernel and the parallel path are checked against the
+// dispatched one-pass hash; a mismatch is reported and fails the run.
+//
+// Built and run by test/bench_file_hashing.sh.
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "FileHashing.h"
+#include "FingerprintStore.h"
+#include "replay_version.h"
+
+// The source revision the results belong to, passed in by the build script.
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+FileHashAlgorithm g_hash = FileHashAlgorithm::CRC32C;
+bool g_verbose = false;
+
+#if defined(__x86_64__)
+extern "C" uint32_t crc32c_sse42_impl(uint32_t crc0, const char* buf, size_t len);
+extern "C" uint32_t crc32c_avx512_impl(uint32_t crc0, const char* buf, size_t len);
+#endif
+
+// blake3_dispatch.c is built with BLAKE3_TESTING, which exports the cpu feature mask it
+// dispatches on: narrowing it forces the hasher onto a narrower kernel. Bits as in its
+// enum cpu_feature.
+extern "C" int g_cpu_features;
+static constexpr int kBlake3Sse41 = 1 | 2 | 4;
+static constexpr int kBlake3Avx2 = kBlake3Sse41 | 8 | 16;
+static constexpr int kBlake3Avx512 = kBlake3Avx2 | 32 | 64;
+static constexpr int kBlake3Detect = 1 << 30;
+
+static volatile uint64_t g_sink;
+
+struct Kernel
+{
+    const char* algorithm;
+    const char* kernel;
+    uint64_t (*fn)(const uint8_t* buffer, size_t size);
+    int blake3_features; // for blake3 kernels, the mask to dispatch on
+    bool supported;
+};
+
+struct ThroughputResult
+{
+    std::string function;
+    std::string algorithm;
+    std::string kernel;
+    size_t size;
+    double gb_per_s;
+    double ns_per_call;
+};
+
+struct PerFileResult
+{
+    std::string operation;
+    size_t file_size;
+    double us_per_file;
+};
+
+struct CrossoverPoint
+{
+    std::string algorithm;
+    size_t size;
+    double read_gb_per_s;
+    double mmap_gb_per_s;
+};
+
+static double now_seconds() noexcept
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Best of iterations, in seconds, of calling body() once.
+template <typename Body>
+static double best_of(int iterations, Body body)
+{
+    double best = 0.0;
+    for (int iter = 0; iter < iterations; iter++)
+    {
+        double start = now_seconds();
+        body();
+        double elapsed = now_seconds() - start;
+        if (best == 0.0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+static uint64_t hash_crc32c(const uint8_t* buffer, size_t size) noexcept
+{
+    return crc32_impl(0, (const char*)buffer, size);
+}
+
+#if defined(__x86_64__)
+static uint64_t hash_crc32c_sse42(const uint8_t* buffer, size_t size) noexcept
+{
+    return crc32c_sse42_impl(0, (const char*)buffer, size);
+}
+
+static uint64_t hash_crc32c_avx512(const uint8_t* buffer, size_t size) noexcept
+{
+    return crc32c_avx512_impl(0, (const char*)buffer, size);
+}
+#endif
+
+static uint64_t hash_blake3(const uint8_t* buffer, size_t size) noexcept
+{
+    uint64_t result = 0;
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, buffer, size);
+    blake3_hasher_finalize(&hasher, (uint8_t*)&result, sizeof(result));
+    return result;
+}
+
+static uint64_t hash_xxh3(const uint8_t* buffer, size_t size) noexcept
+{
+    return XXH3_64bits(buffer, size);
+}
+
+static uint64_t hash_one_pass(FileHashAlgorithm algorithm, const uint8_t* buffer, size_t size) noexcept
+{
+    if (algorithm == FileHashAlgorithm::CRC32C)
+        return hash_crc32c(buffer, size);
+    if (algorithm == FileHashAlgorithm::XXH3)
+        return hash_xxh3(buffer, size);
+    return hash_blake3(buffer, size);
+}
+
+static uint64_t hash_value(const FileInfo& info, FileHashAlgorithm algorithm) noexcept
+{
+    return (algorithm == FileHashAlgorithm::CRC32C) ? (uint64_t)info.hash.crc32c : info.hash.blake3;
+}
+
+static std::vector<Kernel> make_kernels()
+{
+    std::vector<Kernel> kernels;
+#if defined(__x86_64__)
+    kernels.push_back({"crc32c", "sse42", hash_crc32c_sse42, 0, __builtin_cpu_supports("sse4.2") != 0});
+    kernels.push_back({"crc32c", "avx512", hash_crc32c_avx512, 0,
+                       __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq")});
+    kernels.push_back({"blake3", "portable", hash_blake3, 0, true});
+    kernels.push_back({"blake3", "sse41", hash_blake3, kBlake3Sse41, __builtin_cpu_supports("sse4.1") != 0});
+    kernels.push_back({"blake3", "avx2", hash_blake3, kBlake3Avx2, __builtin_cpu_supports("avx2") != 0});
+    kernels.push_back({"blake3", "avx512", hash_blake3, kBlake3Avx512,
+                       __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")});
+#else
+    kernels.push_back({"crc32c", "neon", hash_crc32c, 0, true});
+    kernels.push_back({"blake3", "neon", hash_blake3, kBlake3Detect, true});
+#endif
+    kernels.push_back({"xxh3", "default", hash_xxh3, 0, true});
+    return kernels;
+}
+
+static void select_kernel(const Kernel& kernel) noexcept
+{
+    g_cpu_features = (strcmp(kernel.algorithm, "blake3") == 0) ? kernel.blake3_features : kBlake3Detect;
+}
+
+static int verify(const std::vector<Kernel>& kernels, const uint8_t* buffer, size_t large)
+{
+    int failures = 0;
+    size_t sizes[] = {0, 1, 63, 64, 1023, 4096 + 7, 1024 * 1024 + 13};
+    for (const Kernel& kernel : kernels)
+    {
+        if (!kernel.supported)
+            continue;
+        for (size_t size : sizes)
+        {
+            if (size > large)
+                continue;
+            g_cpu_features = kBlake3Detect;
+            uint64_t expected = hash_one_pass(hash_algorithm_from_name(kernel.algorithm), buffer + 1, size);
+            select_kernel(kernel);
+            uint64_t actual = kernel.fn(buffer + 1, size);
+            if (actual != expected)
+            {
+                fprintf(stderr, "%s %s at %zu bytes: MISMATCH\n", kernel.algorithm, kernel.kernel, size);
+                failures++;
+            }
+        }
+    }
+    g_cpu_features = kBlake3Detect;
+
+    // the parallel ranges of compute_buffer_hash must reproduce the one-pass value
+    size_t parallel_size = (large < kParallelHashThreshold + 4097) ? large : kParallelHashThreshold + 4097;
+    for (FileHashAlgorithm algorithm : {FileHashAlgorithm::CRC32C, FileHashAlgorithm::BLAKE3, FileHashAlgorithm::XXH3})
+    {
+        FileInfo info {};
+        compute_buffer_hash(buffer, parallel_size, info, algorithm);
+        if (hash_value(info, algorithm) != hash_one_pass(algorithm, buffer, parallel_size))
+        {
+            fprintf(stderr, "compute_buffer_hash %s at %zu bytes: MISMATCH\n", hash_algorithm_name(algorithm), parallel_size);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+// About the same number of bytes per timed pass whatever the size, spread over the
+// buffer so small sizes are not always served from one cache line.
+template <typename Hash>
+static ThroughputResult measure_throughput(const uint8_t* buffer, size_t large, size_t size, int iterations, Hash hash)
+{
+    size_t calls = (size < 64 * 1024 * 1024) ? (64 * 1024 * 1024) / size : 1;
+    size_t slots = large / size;
+    double best = best_of(iterations, [&] {
+        uint64_t sum = 0;
+        for (size_t c = 0; c < calls; c++)
+            sum += hash(buffer + (c % slots) * size, size);
+        g_sink = sum;
+    });
+
+    ThroughputResult result {};
+    result.size = size;
+    result.gb_per_s = (double)size * (double)calls / best / 1e9;
+    result.ns_per_call = best * 1e9 / (double)calls;
+    return result;
+}
+
+static bool write_file(const std::string& path, const uint8_t* data, size_t size) noexcept
+{
+    int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return false;
+    size_t written = 0;
+    while (written < size)
+    {
+        ssize_t result = write(fd, data + written, size - written);
+        if (result <= 0)
+            break;
+        written += (size_t)result;
+    }
+    close(fd);
+    return written == size;
+}
+
+static bool measure_per_file(const std::string& work_dir, const uint8_t* buffer, size_t file_size, size_t file_count,
+                             int iterations, std::vector<PerFileResult>& results)
+{
+    std::string dir = work_dir + "/files_" + std::to_string(file_size);
+    if (mkdir(dir.c_str(), 0755) != 0)
+    {
+        fprintf(stderr, "error: cannot create %s\n", dir.c_str());
+        return false;
+    }
+
+    std::vector<std::string> paths;
+    for (size_t i = 0; i < file_count; i++)
+    {
+        paths.push_back(dir + "/f" + std::to_string(i));
+        if (!write_file(paths.back(), buffer + (i % 4096) * 64, file_size))
+        {
+            fprintf(stderr, "error: cannot write %s\n", paths.back().c_str());
+            return false;
+        }
+    }
+
+    std::vector<FileInfo> infos(file_count);
+    auto stat_all = [&] {
+        for (size_t i = 0; i < file_count; i++)
+        {
+            struct stat st;
+            if (lstat(paths[i].c_str(), &st) == 0)
+                infos[i] = FileInfo(st);
+        }
+    };
+    auto record = [&](const char* operation, double seconds) {
+        results.push_back({operation, file_size, seconds * 1e6 / (double)file_count});
+    };
+
+    record("lstat", best_of(iterations, stat_all));
+
+    record("compute_file_hash", best_of(iterations, [&] {
+        for (size_t i = 0; i < file_count; i++)
+            compute_file_hash(paths[i], infos[i], FileHashAlgorithm::CRC32C);
+    }));
+
+    record("xattr_write", best_of(iterations, [&] {
+        for (size_t i = 0; i < file_count; i++)
+            write_xattr_fileinfo(paths[i], infos[i], FileHashAlgorithm::CRC32C);
+    }));
+
+    size_t xattr_hits = 0;
+    record("xattr_probe", best_of(iterations, [&] {
+        xattr_hits = 0;
+        for (size_t i = 0; i < file_count; i++)
+        {
+            FileInfo probe = infos[i];
+            xattr_hits += read_xattr_fileinfo(paths[i], probe, FileHashAlgorithm::CRC32C) ? 1 : 0;
+        }
+    }));
+    if (xattr_hits != file_count)
+        fprintf(stderr, "warning: %zu of %zu xattr probes missed\n", file_count - xattr_hits, file_count);
+
+    // setxattr moved every ctime, which the store validates: take fresh stats
+    stat_all();
+    std::string cache_dir = dir + "/cache";
+    {
+        std::unique_ptr<FingerprintStore> store = FingerprintStore::Open(cache_dir, FileHashAlgorithm::CRC32C, false, false);
+        if (store == nullptr)
+            return false;
+        for (size_t i = 0; i < file_count; i++)
+            store->record(infos[i], infos[i].hash.crc32c);
+        store->save();
+    }
+
+    std::unique_ptr<FingerprintStore> store;
+    double open_seconds = best_of(1, [&] {
+        store = FingerprintStore::Open(cache_dir, FileHashAlgorithm::CRC32C, false, false);
+    });
+    if (store == nullptr)
+        return false;
+    // amortized over the files it holds, which is what a run that probes all of them pays
+    record("store_open", open_seconds);
+
+    size_t store_hits = 0;
+    record("store_probe", best_of(iterations, [&] {
+        store_hits = 0;
+        for (size_t i = 0; i < file_count; i++)
+        {
+            uint64_t hash = 0;
+            store_hits += store->lookup(infos[i], hash) ? 1 : 0;
+        }
+    }));
+    if (store_hits != file_count)
+        fprintf(stderr, "warning: %zu of %zu FingerprintStore probes missed\n", file_count - store_hits, file_count);
+
+    return true;
+}
+
+static bool measure_crossover(const std::string& work_dir, const uint8_t* buffer, size_t large, int iterations,
+                              std::vector<CrossoverPoint>& points)
+{
+    for (size_t size = 256 * 1024; size <= large && size <= 256 * 1024 * 1024; size *= 2)
+    {
+        std::string path = work_dir + "/crossover_" + std::to_string(size);
+        if (!write_file(path, buffer, size))
+        {
+            fprintf(stderr, "error: cannot write %s\n", path.c_str());
+            return false;
+        }
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0)
+            return false;
+
+        for (FileHashAlgorithm algorithm : {FileHashAlgorithm::CRC32C, FileHashAlgorithm::BLAKE3, FileHashAlgorithm::XXH3})
+        {
+            auto time_path = [&](bool (*hash_file)(int, FileInfo&, FileHashAlgorithm) noexcept) {
+                FileInfo info(st);
+                return best_of(iterations, [&] {
+                    int fd = open(path.c_str(), O_RDONLY);
+                    if (fd >= 0)
+                    {
+                        hash_file(fd, info, algorithm);
+                        close(fd);
+                    }
+                });
+            };
+            double read_seconds = time_path(hash_file_by_read);
+            double mmap_seconds = time_path(hash_file_by_mmap);
+            points.push_back({hash_algorithm_name(algorithm), size, (double)size / read_seconds / 1e9,
+                              (double)size / mmap_seconds / 1e9});
+        }
+        unlink(path.c_str());
+    }
+    return true;
+}
+
+static std::string cpu_name()
+{
+    char name[256] = {0};
+    size_t length = sizeof(name) - 1;
+    if (sysctlbyname("machdep.cpu.brand_string", name, &length, nullptr, 0) != 0)
+        return "unknown";
+    return name;
+}
+
+static void print_json(size_t large, size_t file_count, int iterations, const std::vector<ThroughputResult>& throughput,
+                       const std::vector<PerFileResult>& per_file, const std::vector<CrossoverPoint>& crossover)
+{
+    struct utsname system_name {};
+    uname(&system_name);
+    char timestamp[32];
+    time_t now = time(nullptr);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    printf("{\n");
+    printf("  \"benchmark\": \"file_hashing\",\n");
+    printf("  \"version\": \"%s\",\n", STRINGIFY_VALUE(REPLAY_VERSION));
+    printf("  \"revision\": \"%s\",\n", BENCH_REVISION);
+    printf("  \"timestamp\": \"%s\",\n", timestamp);
+    printf("  \"machine\": {\"arch\": \"%s\", \"cpu\": \"%s\", \"logical_cpus\": %ld},\n", system_name.machine,
+           cpu_name().c_str(), sysconf(_SC_NPROCESSORS_ONLN));
+    printf("  \"parameters\": {\"max_size\": %zu, \"file_count\": %zu, \"iterations\": %d, \"mmap_threshold\": %zu, "
+           "\"parallel_hash_threshold\": %zu},\n", large, file_count, iterations, kHashMmapThreshold, kParallelHashThreshold);
+
+    printf("  \"throughput\": [\n");
+    for (size_t i = 0; i < throughput.size(); i++)
+    {
+        const ThroughputResult& r = throughput[i];
+        printf("    {\"function\": \"%s\", \"algorithm\": \"%s\", \"kernel\": \"%s\", \"size\": %zu, "
+               "\"gb_per_s\": %.3f, \"ns_per_call\": %.1f}%s\n", r.function.c_str(), r.algorithm.c_str(),
+               r.kernel.c_str(), r.size, r.gb_per_s, r.ns_per_call, (i + 1 < throughput.size()) ? "," : "");
+    }
+    printf("  ],\n");
+
+    printf("  \"per_file\": [\n");
+    for (size_t i = 0; i < per_file.size(); i++)
+    {
+        const PerFileResult& r = per_file[i];
+        printf("    {\"operation\": \"%s\", \"file_size\": %zu, \"us_per_file\": %.3f}%s\n", r.operation.c_str(),
+               r.file_size, r.us_per_file, (i + 1 < per_file.size()) ? "," : "");
+    }
+    printf("  ],\n");
+
+    printf("  \"mmap_crossover\": [\n");
+    for (size_t i = 0; i < crossover.size(); i++)
+    {
+        const CrossoverPoint& p = crossover[i];
+        printf("    {\"algorithm\": \"%s\", \"size\": %zu, \"read_gb_per_s\": %.3f, \"mmap_gb_per_s\": %.3f}%s\n",
+               p.algorithm.c_str(), p.size, p.read_gb_per_s, p.mmap_gb_per_s, (i + 1 < crossover.size()) ? "," : "");
+    }
+    printf("  ]\n");
+    printf("}\n");
+}
+
+int main(int argc, char** argv)
+{
+    // the work directory holds the per-file and crossover files; the caller removes it
+    const char* work_dir = (argc > 1) ? argv[1] : nullptr;
+    size_t large_mb = (argc > 2) ? (size_t)strtoul(argv[2], nullptr, 10) : 1024;
+    size_t file_count = (argc > 3) ? (size_t)strtoul(argv[3], nullptr, 10) : 10000;
+    int iterations = (argc > 4) ? atoi(argv[4]) : 3;
+    if (work_dir == nullptr || large_mb == 0 || file_count == 0 || iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s work_dir [max_size_mb] [file_count] [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    // one spare byte so the kernels are also checked from an odd address
+    size_t large = large_mb * 1024 * 1024;
+    uint8_t* buffer = (uint8_t*)malloc(large + 1);
+    if (buffer == nullptr)
+    {
+        fprintf(stderr, "error: cannot allocate %zu MB\n", large_mb);
+        return EXIT_FAILURE;
+    }
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for (size_t i = 0; i < large + 1; i++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        buffer[i] = (uint8_t)(state >> 56);
+    }
+
+    std::vector<Kernel> kernels = make_kernels();
+    int failures = verify(kernels, buffer, large);
+
+    std::vector<size_t> sizes;
+    for (size_t size = 64; size <= large; size *= 4)
+        sizes.push_back(size);
+    if (sizes.back() != large)
+        sizes.push_back(large);
+
+    std::vector<ThroughputResult> throughput;
+    for (const Kernel& kernel : kernels)
+    {
+        if (!kernel.supported)
+            continue;
+        fprintf(stderr, "throughput: %s %s\n", kernel.algorithm, kernel.kernel);
+        select_kernel(kernel);
+        for (size_t size : sizes)
+        {
+            ThroughputResult result = measure_throughput(buffer, large, size, iterations, kernel.fn);
+            result.function = "kernel";
+            result.algorithm = kernel.algorithm;
+            result.kernel = kernel.kernel;
+            throughput.push_back(result);
+        }
+    }
+    g_cpu_features = kBlake3Detect;
+
+    for (FileHashAlgorithm algorithm : {FileHashAlgorithm::CRC32C, FileHashAlgorithm::BLAKE3, FileHashAlgorithm::XXH3})
+    {
+        fprintf(stderr, "throughput: compute_buffer_hash %s\n", hash_algorithm_name(algorithm));
+        for (size_t size : sizes)
+        {
+            ThroughputResult result = measure_throughput(buffer, large, size, iterations,
+                [algorithm](const uint8_t* data, size_t length) {
+                    FileInfo info {};
+                    compute_buffer_hash(data, length, info, algorithm);
+                    return info.hash.blake3;
+                });
+            result.function = "compute_buffer_hash";
+            result.algorithm = hash_algorithm_name(algorithm);
+            result.kernel = "dispatch";
+            throughput.push_back(result);
+        }
+    }
+
+    std::vector<PerFileResult> per_file;
+    std::vector<CrossoverPoint> crossover;
+    bool ok = true;
+    for (size_t file_size : {64, 4096})
+    {
+        fprintf(stderr, "per_file: %zu files of %zu bytes\n", file_count, file_size);
+        ok = ok && measure_per_file(work_dir, buffer, file_size, file_count, iterations, per_file);
+    }
+    fprintf(stderr, "mmap_crossover\n");
+    ok = ok && measure_crossover(work_dir, buffer, large, iterations, crossover);
+
+    print_json(large, file_count, iterations, throughput, per_file, crossover);
+
+    free(buffer);
+    return (ok && failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
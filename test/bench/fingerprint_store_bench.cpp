@@ -0,0 +1,260 @@
+// Probe latency of replay's FingerprintStore at the table sizes a large monorepo
+// reaches, written as one JSON document on stdout so runs can be kept and compared
+// between releases. Progress goes to stderr.
+//
+// For each entry count a store is built from synthetic records, saved, and opened
+// again; then a fixed set of files, picked at random across the whole table, is looked
+// up in three passes:
+//
+//   cold        the first pass after Open(). The mapping has just been validated, so
+//               its pages are resident, but the caches and TLB hold whatever the
+//               checksum pass left - the state a run's first lookups see.
+//   warm        the best of the later passes, looking each file up in turn.
+//   prefetched  the same, with FingerprintStore::prefetch() issued one file ahead, the
+//               way the rollup in TaskFingerprint.cpp walks its files.
+//
+// The open and the cold pass are also timed once with the table populated up front
+// (--cache-memo-populate), before the default open the three passes above run on.
+//
+// A probe that misses fails the run: every file looked up was recorded.
+//
+// A store of 20M entries is a 1 GB file, and building it holds the records and the
+// image in memory at once; leave a few GB free.
+//
+// Built and run by test/bench_fingerprint_store.sh.
+
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <sys/utsname.h>
+#include <unistd.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#include "FileInfo.h"
+#include "FingerprintStore.h"
+#include "replay_version.h"
+
+// The source revision the results belong to, passed in by the build script.
+#ifndef BENCH_REVISION
+#define BENCH_REVISION "unknown"
+#endif
+
+static volatile uint64_t g_sink;
+
+struct StoreResult
+{
+    size_t entries;
+    uint64_t capacity;
+    uint64_t file_bytes;
+    double build_seconds;
+    double open_ms;
+    double open_populated_ms;
+    double cold_ns_per_probe;
+    double cold_populated_ns_per_probe;
+    double warm_ns_per_probe;
+    double prefetched_ns_per_probe;
+};
+
+static double now_seconds() noexcept
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+// Best of iterations, in seconds, of calling body() once.
+template <typename Body>
+static double best_of(int iterations, Body body)
+{
+    double best = 0.0;
+    for (int iter = 0; iter < iterations; iter++)
+    {
+        double start = now_seconds();
+        body();
+        double elapsed = now_seconds() - start;
+        if (best == 0.0 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+// The stat of synthetic file i. Sequential inode numbers are what a freshly checked
+// out tree looks like, and the store mixes them before use.
+static FileInfo make_info(size_t i) noexcept
+{
+    struct stat st {};
+    st.st_dev = 1;
+    st.st_ino = (ino_t)(i + 1);
+    st.st_mode = S_IFREG | 0644;
+    st.st_size = (off_t)(4096 + (i % 512));
+    st.st_mtimespec.tv_sec = 1700000000;
+    st.st_ctimespec.tv_sec = 1700000000;
+    return FileInfo(st);
+}
+
+static bool build_store(const std::string& cache_dir, size_t entries)
+{
+    std::unique_ptr<FingerprintStore> store = FingerprintStore::Open(cache_dir, FileHashAlgorithm::CRC32C, false, false);
+    if (store == nullptr)
+        return false;
+    for (size_t i = 0; i < entries; i++)
+        store->record(make_info(i), (uint64_t)i * 0x9E3779B97F4A7C15ULL);
+    store->save();
+    return store->stats().saveRoute == FingerprintStore::SaveRoute::TableRewritten;
+}
+
+static bool measure_store(const std::string& work_dir, size_t entries, size_t probes, int iterations,
+                          std::vector<StoreResult>& results)
+{
+    StoreResult result {};
+    result.entries = entries;
+
+    std::string cache_dir = work_dir + "/store_" + std::to_string(entries);
+    double start = now_seconds();
+    if (!build_store(cache_dir, entries))
+    {
+        fprintf(stderr, "error: cannot build a %zu-entry store in %s\n", entries, cache_dir.c_str());
+        return false;
+    }
+    result.build_seconds = now_seconds() - start;
+
+    // picked up front, so the timed passes do nothing but look up
+    std::vector<FileInfo> infos(probes);
+    uint64_t state = 0x9E3779B97F4A7C15ULL ^ entries;
+    for (size_t p = 0; p < probes; p++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        infos[p] = make_info((size_t)((state >> 16) % entries));
+    }
+
+    std::unique_ptr<FingerprintStore> store;
+    size_t misses = 0;
+    auto probe_all = [&](bool prefetch) {
+        uint64_t sum = 0;
+        for (size_t p = 0; p < probes; p++)
+        {
+            if (prefetch && (p + 1) < probes)
+                store->prefetch(infos[p + 1]);
+            uint64_t hash = 0;
+            if (store->lookup(infos[p], hash))
+                sum += hash;
+            else
+                misses++;
+        }
+        g_sink = sum;
+    };
+
+    result.open_populated_ms = best_of(1, [&] {
+        store = FingerprintStore::Open(cache_dir, FileHashAlgorithm::CRC32C, true, false);
+    }) * 1e3;
+    if (store == nullptr)
+        return false;
+    result.cold_populated_ns_per_probe = best_of(1, [&] { probe_all(false); }) * 1e9 / (double)probes;
+    store.reset();
+
+    result.open_ms = best_of(1, [&] {
+        store = FingerprintStore::Open(cache_dir, FileHashAlgorithm::CRC32C, false, false);
+    }) * 1e3;
+    if (store == nullptr)
+        return false;
+    result.cold_ns_per_probe = best_of(1, [&] { probe_all(false); }) * 1e9 / (double)probes;
+    result.warm_ns_per_probe = best_of(iterations, [&] { probe_all(false); }) * 1e9 / (double)probes;
+    result.prefetched_ns_per_probe = best_of(iterations, [&] { probe_all(true); }) * 1e9 / (double)probes;
+    if (misses != 0)
+    {
+        fprintf(stderr, "error: %zu of %zu probes into the %zu-entry store missed\n", misses,
+                probes * (size_t)(2 + 2 * iterations), entries);
+        return false;
+    }
+
+    FingerprintStore::Stats stats = store->stats();
+    result.capacity = stats.table.capacity;
+    std::string path = store->path();
+    struct stat st;
+    result.file_bytes = (stat(path.c_str(), &st) == 0) ? (uint64_t)st.st_size : 0;
+
+    // the next store is built from scratch, so this one's gigabyte need not stay around
+    store.reset();
+    unlink(path.c_str());
+
+    results.push_back(result);
+    return true;
+}
+
+static std::string cpu_name()
+{
+    char name[256] = {0};
+    size_t length = sizeof(name) - 1;
+    if (sysctlbyname("machdep.cpu.brand_string", name, &length, nullptr, 0) != 0)
+        return "unknown";
+    return name;
+}
+
+static void print_json(size_t probes, int iterations, const std::vector<StoreResult>& results)
+{
+    struct utsname system_name {};
+    uname(&system_name);
+    char timestamp[32];
+    time_t now = time(nullptr);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+    printf("{\n");
+    printf("  \"benchmark\": \"fingerprint_store\",\n");
+    printf("  \"version\": \"%s\",\n", STRINGIFY_VALUE(REPLAY_VERSION));
+    printf("  \"revision\": \"%s\",\n", BENCH_REVISION);
+    printf("  \"timestamp\": \"%s\",\n", timestamp);
+    printf("  \"machine\": {\"arch\": \"%s\", \"cpu\": \"%s\", \"logical_cpus\": %ld},\n", system_name.machine,
+           cpu_name().c_str(), sysconf(_SC_NPROCESSORS_ONLN));
+    printf("  \"parameters\": {\"probes\": %zu, \"iterations\": %d},\n", probes, iterations);
+
+    printf("  \"stores\": [\n");
+    for (size_t i = 0; i < results.size(); i++)
+    {
+        const StoreResult& r = results[i];
+        printf("    {\"entries\": %zu, \"capacity\": %llu, \"file_bytes\": %llu, \"build_s\": %.2f, \"open_ms\": %.2f, "
+               "\"open_populated_ms\": %.2f, \"cold_ns_per_probe\": %.1f, \"cold_populated_ns_per_probe\": %.1f, "
+               "\"warm_ns_per_probe\": %.1f, \"prefetched_ns_per_probe\": %.1f}%s\n",
+               r.entries, (unsigned long long)r.capacity, (unsigned long long)r.file_bytes, r.build_seconds,
+               r.open_ms, r.open_populated_ms, r.cold_ns_per_probe, r.cold_populated_ns_per_probe,
+               r.warm_ns_per_probe, r.prefetched_ns_per_probe, (i + 1 < results.size()) ? "," : "");
+    }
+    printf("  ]\n");
+    printf("}\n");
+}
+
+int main(int argc, char** argv)
+{
+    // the work directory holds the stores; the caller removes it
+    const char* work_dir = (argc > 1) ? argv[1] : nullptr;
+    size_t probes = (argc > 2) ? (size_t)strtoul(argv[2], nullptr, 10) : 1000000;
+    int iterations = (argc > 3) ? atoi(argv[3]) : 3;
+    std::vector<size_t> entry_counts;
+    for (int arg = 4; arg < argc; arg++)
+        entry_counts.push_back((size_t)strtoul(argv[arg], nullptr, 10));
+    if (entry_counts.empty())
+        entry_counts = {200000, 2000000, 20000000};
+    bool counts_ok = true;
+    for (size_t count : entry_counts)
+        counts_ok = counts_ok && (count != 0);
+    if (work_dir == nullptr || probes == 0 || iterations <= 0 || !counts_ok)
+    {
+        fprintf(stderr, "usage: %s work_dir [probes] [iterations] [entries ...]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<StoreResult> results;
+    bool ok = true;
+    for (size_t entries : entry_counts)
+    {
+        fprintf(stderr, "store: %zu entries, %zu probes\n", entries, probes);
+        ok = ok && measure_store(work_dir, entries, probes, iterations, results);
+    }
+
+    print_json(probes, iterations, results);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
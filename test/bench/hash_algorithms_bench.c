@@ -0,0 +1,170 @@
+// Single-core throughput of the three per-file content hashes: crc32c (crc32_impl),
+// blake3 (the public hasher API) and xxh3 (XXH3_64bits), over the buffer sizes a file
+// reaches compute_buffer_hash with.
+//
+// Small sizes stand for the many small files of a source tree, where the per-call
+// setup dominates; the large size is streaming throughput. The parallel range hashing
+// of crc32c and blake3 for mapped files (ParallelHashing.h) is not measured: it scales
+// with cores, and xxh3 has no equivalent.
+//
+// Before timing, xxh3 and blake3 are also fed the large buffer in 1 MB pieces, the way
+// the read pipeline streams a file through ReadBufferPool, and must reproduce the
+// one-shot value. A mismatch fails the run.
+//
+// Built and run by test/bench_hash_algorithms.sh.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "blake3.h"
+#define XXH_STATIC_LINKING_ONLY
+#include "xxhash.h"
+
+uint32_t crc32_impl(uint32_t crc0, const char *buf, size_t len);
+
+static volatile uint64_t g_sink;
+
+static double
+now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
+
+static uint64_t
+hash_crc32c(const uint8_t *buffer, size_t size)
+{
+    return crc32_impl(0, (const char *)buffer, size);
+}
+
+static uint64_t
+hash_blake3(const uint8_t *buffer, size_t size)
+{
+    uint64_t result = 0;
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    blake3_hasher_update(&hasher, buffer, size);
+    blake3_hasher_finalize(&hasher, (uint8_t *)&result, sizeof(result));
+    return result;
+}
+
+static uint64_t
+hash_xxh3(const uint8_t *buffer, size_t size)
+{
+    return XXH3_64bits(buffer, size);
+}
+
+typedef uint64_t (*hash_fn)(const uint8_t *buffer, size_t size);
+
+typedef struct
+{
+    const char *name;
+    hash_fn fn;
+} Algorithm;
+
+static int
+check_streamed(const uint8_t *buffer, size_t size, size_t piece)
+{
+    int failures = 0;
+
+    XXH3_state_t *state = XXH3_createState();
+    XXH3_64bits_reset(state);
+    blake3_hasher hasher;
+    blake3_hasher_init(&hasher);
+    for(size_t offset = 0; offset < size; offset += piece)
+    {
+        size_t len = (size - offset < piece) ? size - offset : piece;
+        XXH3_64bits_update(state, buffer + offset, len);
+        blake3_hasher_update(&hasher, buffer + offset, len);
+    }
+
+    if(XXH3_64bits_digest(state) != hash_xxh3(buffer, size))
+    {
+        printf("xxh3 streamed in %zu byte pieces: MISMATCH\n", piece);
+        failures++;
+    }
+
+    uint64_t streamed = 0;
+    blake3_hasher_finalize(&hasher, (uint8_t *)&streamed, sizeof(streamed));
+    if(streamed != hash_blake3(buffer, size))
+    {
+        printf("blake3 streamed in %zu byte pieces: MISMATCH\n", piece);
+        failures++;
+    }
+
+    XXH3_freeState(state);
+    return failures;
+}
+
+int
+main(int argc, char **argv)
+{
+    size_t large_mb = (argc > 1) ? (size_t)strtoul(argv[1], NULL, 10) : 64;
+    int iterations = (argc > 2) ? atoi(argv[2]) : 5;
+    if(large_mb == 0 || iterations <= 0)
+    {
+        fprintf(stderr, "usage: %s [large_size_mb] [iterations]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    size_t large = large_mb * 1024 * 1024;
+    uint8_t *buffer = (uint8_t *)malloc(large);
+    if(buffer == NULL)
+    {
+        fprintf(stderr, "error: cannot allocate %zu MB\n", large_mb);
+        return EXIT_FAILURE;
+    }
+
+    uint64_t state = 0x9E3779B97F4A7C15ULL;
+    for(size_t i = 0; i < large; i++)
+    {
+        state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+        buffer[i] = (uint8_t)(state >> 56);
+    }
+
+    int failures = check_streamed(buffer, large, 1024 * 1024);
+
+    Algorithm algorithms[] = {
+        {"crc32c", hash_crc32c},
+        {"blake3", hash_blake3},
+        {"xxh3", hash_xxh3},
+    };
+    size_t sizes[] = {64, 1024, 4096, 65536, large};
+
+    printf("%-8s %12s %12s %12s\n", "algo", "size", "GB/s", "ns/call");
+    for(size_t a = 0; a < sizeof(algorithms) / sizeof(algorithms[0]); a++)
+    {
+        for(size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+        {
+            size_t size = sizes[s];
+            // about the same number of bytes per timed pass whatever the size, spread
+            // over the buffer so small sizes are not always served from one cache line
+            size_t calls = (size < large) ? (64 * 1024 * 1024) / size : 1;
+            size_t slots = large / size;
+
+            double best = 0.0;
+            for(int iter = 0; iter < iterations; iter++)
+            {
+                uint64_t sum = 0;
+                double start = now_seconds();
+                for(size_t c = 0; c < calls; c++)
+                    sum += algorithms[a].fn(buffer + (c % slots) * size, size);
+                double elapsed = now_seconds() - start;
+                g_sink = sum;
+                if(best == 0.0 || elapsed < best)
+                    best = elapsed;
+            }
+
+            double bytes = (double)size * (double)calls;
+            printf("%-8s %12zu %12.2f %12.1f\n", algorithms[a].name, size,
+                   bytes / best / 1e9, best * 1e9 / (double)calls);
+        }
+    }
+
+    free(buffer);
+    return (failures == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,22 @@
+#!/bin/bash
+# Builds and runs the per-kernel BLAKE3 benchmark against the vendored sources.
+# Usage: bench_blake3_kernels.sh [size_mb] [iterations]
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+REPO_DIR="$SCRIPT_DIR/.."
+BLAKE3_DIR="$REPO_DIR/blake3"
+BENCH_BIN="$(mktemp -t blake3_kernels_bench.XXXXXX)"
+trap 'rm -f "$BENCH_BIN"' EXIT
+
+"${CC:-cc}" -O3 -I "$BLAKE3_DIR" -o "$BENCH_BIN" \
+    "$SCRIPT_DIR/bench/blake3_kernels_bench.c" \
+    "$BLAKE3_DIR/blake3.c" \
+    "$BLAKE3_DIR/blake3_dispatch.c" \
+    "$BLAKE3_DIR/blake3_portable.c" \
+    "$BLAKE3_DIR/blake3_arch.c" \
+    "$BLAKE3_DIR/blake3_arch_sse41.c" \
+    "$BLAKE3_DIR/blake3_arch_avx2.c" \
+    "$BLAKE3_DIR/blake3_arch_avx512.c"
+
+"$BENCH_BIN" "$@"
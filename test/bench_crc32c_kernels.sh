@@ -0,0 +1,22 @@
+#!/bin/bash
+# Builds and runs the per-kernel CRC32C check and benchmark against the vendored sources.
+# Usage: bench_crc32c_kernels.sh [large_size_mb] [iterations]
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+REPO_DIR="$SCRIPT_DIR/.."
+CRC32_DIR="$REPO_DIR/fast-crc32"
+BENCH_BIN="$(mktemp -t crc32c_kernels_bench.XXXXXX)"
+trap 'rm -f "$BENCH_BIN"' EXIT
+
+CRC_FLAGS=""
+if [ "$(uname -m)" = "x86_64" ]; then
+    CRC_FLAGS="-mcrc32 -mpclmul"
+fi
+
+"${CC:-cc}" -O3 $CRC_FLAGS -o "$BENCH_BIN" \
+    "$SCRIPT_DIR/bench/crc32c_kernels_bench.c" \
+    "$CRC32_DIR/crc32c_arch.c" \
+    "$CRC32_DIR/crc32c_avx512.c"
+
+"$BENCH_BIN" "$@"
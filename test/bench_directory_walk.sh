@@ -0,0 +1,70 @@
+#!/bin/bash
+# Times directory traversal alone - bulk (getattrlistbulk) against fts - over a tree of
+# ~500k entries, with a warm and a cold page cache. The glob matches nothing, so no file
+# is opened or hashed and the numbers are the walk itself ("Directory traversal time"
+# from --verbose) plus the wall time of the whole run.
+# Cold runs flush the unified buffer cache with purge, which needs sudo; without it
+# only warm numbers are printed.
+# Usage: bench_directory_walk.sh [/path/to/fingerprint] [entry_count] [hash_jobs]
+#   hash_jobs defaults to 1 to compare single walks; pass 0 for the default
+#   (subtree walks on all cores).
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+FINGERPRINT_BIN="${1:-${FINGERPRINT_BIN:-${SCRIPT_DIR}/../build/Release/fingerprint}}"
+ENTRY_COUNT="${2:-500000}"
+HASH_JOBS="${3:-1}"
+
+BENCH_DIR="$(mktemp -d -t fingerprint_directory_walk.XXXXXX)"
+trap 'rm -rf "$BENCH_DIR"' EXIT
+
+# 50 top-level directories x 10 subdirectories x N empty files
+echo "Creating $ENTRY_COUNT entries in $BENCH_DIR"
+/usr/bin/perl -e '
+    my ($dir, $count) = @ARGV;
+    my $per_dir = int($count / 500) || 1;
+    for my $i (0 .. $count - 1) {
+        my $leaf = int($i / $per_dir) % 500;
+        my $top = sprintf("%s/t%02d", $dir, int($leaf / 10));
+        my $sub = sprintf("%s/s%d", $top, $leaf % 10);
+        mkdir $top unless -d $top;
+        mkdir $sub unless -d $sub;
+        open(my $fh, ">", "$sub/f$i.txt") or die "$sub/f$i.txt: $!";
+        close($fh);
+    }' "$BENCH_DIR" "$ENTRY_COUNT"
+
+CAN_PURGE=0
+if sudo -n /usr/sbin/purge 2>/dev/null; then
+    CAN_PURGE=1
+fi
+
+JOBS_ARGS=()
+if [ "$HASH_JOBS" != "0" ]; then
+    JOBS_ARGS=(--hash-jobs="$HASH_JOBS")
+fi
+
+run() {
+    local label="$1"
+    local walker="$2"
+    local start end output walk_ms
+    start=$(/usr/bin/perl -MTime::HiRes=time -e 'printf "%.6f", time')
+    output=$("$FINGERPRINT_BIN" --xattr=off --walker="$walker" ${JOBS_ARGS[@]+"${JOBS_ARGS[@]}"} \
+                 -g '*.nomatch' -v "$BENCH_DIR")
+    end=$(/usr/bin/perl -MTime::HiRes=time -e 'printf "%.6f", time')
+    walk_ms=$(echo "$output" | awk '/Directory traversal time:/ {print $4}')
+    /usr/bin/perl -e 'printf "  %-6s traversal %10.1f ms   total %10.1f ms\n", $ARGV[0], $ARGV[1], ($ARGV[3] - $ARGV[2]) * 1000' \
+        "$label" "${walk_ms:-0}" "$start" "$end"
+}
+
+for walker in fts bulk; do
+    echo "$walker:"
+    run "warm" "$walker"
+    if [ "$CAN_PURGE" = "1" ]; then
+        sudo -n /usr/sbin/purge
+        run "cold" "$walker"
+    fi
+done
+
+if [ "$CAN_PURGE" = "0" ]; then
+    echo "(cold cache runs skipped: 'sudo -n purge' is not available)"
+fi
@@ -0,0 +1,57 @@
+#!/bin/bash
+# Builds and runs the hashing hot path microbenchmarks (kernel and compute_buffer_hash
+# throughput, per-file overhead, mmap-vs-read crossover) and prints the results as JSON.
+# Progress goes to stderr, so the results can be redirected to a file and kept:
+#   bench_file_hashing.sh > file_hashing-$(git describe --always).json
+# The per-file and crossover files are created under $TMPDIR; point it at the volume
+# that matters.
+# Usage: bench_file_hashing.sh [max_size_mb] [file_count] [iterations]
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+REPO_DIR="$SCRIPT_DIR/.."
+BLAKE3_DIR="$REPO_DIR/blake3"
+CRC32_DIR="$REPO_DIR/fast-crc32"
+XXHASH_DIR="$REPO_DIR/xxhash"
+YYJSON_DIR="$REPO_DIR/yyjson/src"
+BUILD_DIR="$(mktemp -d -t file_hashing_bench.XXXXXX)"
+WORK_DIR="$(mktemp -d -t file_hashing_bench_files.XXXXXX)"
+trap 'rm -rf "$BUILD_DIR" "$WORK_DIR"' EXIT
+
+CRC_FLAGS=""
+if [ "$(uname -m)" = "x86_64" ]; then
+    CRC_FLAGS="-mcrc32 -mpclmul"
+fi
+REVISION="$(git -C "$REPO_DIR" describe --always --dirty 2>/dev/null || echo unknown)"
+
+# BLAKE3_TESTING exports blake3_dispatch.c's cpu feature mask, which the benchmark
+# narrows to time each blake3 kernel through the public hasher.
+for source in \
+    "$CRC32_DIR/crc32c_arch.c" \
+    "$CRC32_DIR/crc32c_avx512.c" \
+    "$CRC32_DIR/crc32c_combine.c" \
+    "$XXHASH_DIR/xxhash.c" \
+    "$BLAKE3_DIR/blake3.c" \
+    "$BLAKE3_DIR/blake3_dispatch.c" \
+    "$BLAKE3_DIR/blake3_portable.c" \
+    "$BLAKE3_DIR/blake3_arch.c" \
+    "$BLAKE3_DIR/blake3_arch_sse41.c" \
+    "$BLAKE3_DIR/blake3_arch_avx2.c" \
+    "$BLAKE3_DIR/blake3_arch_avx512.c" \
+    "$YYJSON_DIR/yyjson.c"; do
+    "${CC:-cc}" -O3 $CRC_FLAGS -DBLAKE3_TESTING -DBLAKE3_ATOMICS=0 -I "$BLAKE3_DIR" -I "$XXHASH_DIR" -I "$YYJSON_DIR" \
+        -c -o "$BUILD_DIR/$(basename "$source" .c).o" "$source"
+done
+
+"${CXX:-c++}" -std=c++20 -O3 -DBENCH_REVISION="\"$REVISION\"" \
+    -I "$REPO_DIR/fingerprint/include" -I "$REPO_DIR/common/include" -I "$REPO_DIR/replay" \
+    -I "$REPO_DIR/yyjson-cpp/include" -I "$YYJSON_DIR" \
+    -I "$BLAKE3_DIR" -I "$XXHASH_DIR" -o "$BUILD_DIR/file_hashing_bench" \
+    "$SCRIPT_DIR/bench/file_hashing_bench.cpp" \
+    "$REPO_DIR/replay/FingerprintStore.cpp" \
+    "$REPO_DIR/fingerprint/json_serialization.cpp" \
+    "$REPO_DIR/common/LogStream.cpp" \
+    "$BUILD_DIR"/*.o \
+    -framework CoreFoundation
+
+"$BUILD_DIR/file_hashing_bench" "$WORK_DIR" "$@"
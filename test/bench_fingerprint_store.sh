@@ -0,0 +1,44 @@
+#!/bin/bash
+# Builds and runs the FingerprintStore probe latency benchmark (cold, warm and
+# prefetched lookups at 200k, 2M and 20M entries by default) and prints the results as
+# JSON. Progress goes to stderr, so the results can be redirected to a file and kept:
+#   bench_fingerprint_store.sh > fingerprint_store-$(git describe --always).json
+# The stores are built under $TMPDIR; the 20M-entry one is a 1 GB file.
+# Usage: bench_fingerprint_store.sh [probes] [iterations] [entries ...]
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+REPO_DIR="$SCRIPT_DIR/.."
+BLAKE3_DIR="$REPO_DIR/blake3"
+CRC32_DIR="$REPO_DIR/fast-crc32"
+XXHASH_DIR="$REPO_DIR/xxhash"
+YYJSON_DIR="$REPO_DIR/yyjson/src"
+BUILD_DIR="$(mktemp -d -t fingerprint_store_bench.XXXXXX)"
+WORK_DIR="$(mktemp -d -t fingerprint_store_bench_stores.XXXXXX)"
+trap 'rm -rf "$BUILD_DIR" "$WORK_DIR"' EXIT
+
+CRC_FLAGS=""
+if [ "$(uname -m)" = "x86_64" ]; then
+    CRC_FLAGS="-mcrc32 -mpclmul"
+fi
+REVISION="$(git -C "$REPO_DIR" describe --always --dirty 2>/dev/null || echo unknown)"
+
+for source in \
+    "$CRC32_DIR/crc32c_arch.c" \
+    "$CRC32_DIR/crc32c_avx512.c" \
+    "$YYJSON_DIR/yyjson.c"; do
+    "${CC:-cc}" -O3 $CRC_FLAGS -I "$YYJSON_DIR" -c -o "$BUILD_DIR/$(basename "$source" .c).o" "$source"
+done
+
+"${CXX:-c++}" -std=c++20 -O3 -DBENCH_REVISION="\"$REVISION\"" \
+    -I "$REPO_DIR/fingerprint/include" -I "$REPO_DIR/common/include" -I "$REPO_DIR/replay" \
+    -I "$REPO_DIR/yyjson-cpp/include" -I "$YYJSON_DIR" \
+    -I "$BLAKE3_DIR" -I "$XXHASH_DIR" -o "$BUILD_DIR/fingerprint_store_bench" \
+    "$SCRIPT_DIR/bench/fingerprint_store_bench.cpp" \
+    "$REPO_DIR/replay/FingerprintStore.cpp" \
+    "$REPO_DIR/fingerprint/json_serialization.cpp" \
+    "$REPO_DIR/common/LogStream.cpp" \
+    "$BUILD_DIR"/*.o \
+    -framework CoreFoundation
+
+"$BUILD_DIR/fingerprint_store_bench" "$WORK_DIR" "$@"
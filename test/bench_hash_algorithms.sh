@@ -0,0 +1,32 @@
+#!/bin/bash
+# Builds and runs the crc32c / blake3 / xxh3 comparison against the vendored sources.
+# Usage: bench_hash_algorithms.sh [large_size_mb] [iterations]
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+REPO_DIR="$SCRIPT_DIR/.."
+BLAKE3_DIR="$REPO_DIR/blake3"
+CRC32_DIR="$REPO_DIR/fast-crc32"
+XXHASH_DIR="$REPO_DIR/xxhash"
+BENCH_BIN="$(mktemp -t hash_algorithms_bench.XXXXXX)"
+trap 'rm -f "$BENCH_BIN"' EXIT
+
+CRC_FLAGS=""
+if [ "$(uname -m)" = "x86_64" ]; then
+    CRC_FLAGS="-mcrc32 -mpclmul"
+fi
+
+"${CC:-cc}" -O3 $CRC_FLAGS -I "$BLAKE3_DIR" -I "$XXHASH_DIR" -o "$BENCH_BIN" \
+    "$SCRIPT_DIR/bench/hash_algorithms_bench.c" \
+    "$CRC32_DIR/crc32c_arch.c" \
+    "$CRC32_DIR/crc32c_avx512.c" \
+    "$XXHASH_DIR/xxhash.c" \
+    "$BLAKE3_DIR/blake3.c" \
+    "$BLAKE3_DIR/blake3_dispatch.c" \
+    "$BLAKE3_DIR/blake3_portable.c" \
+    "$BLAKE3_DIR/blake3_arch.c" \
+    "$BLAKE3_DIR/blake3_arch_sse41.c" \
+    "$BLAKE3_DIR/blake3_arch_avx2.c" \
+    "$BLAKE3_DIR/blake3_arch_avx512.c"
+
+"$BENCH_BIN" "$@"
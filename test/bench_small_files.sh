@@ -0,0 +1,59 @@
+#!/bin/bash
+# Times fingerprint over a tree of many small files, with a warm and a cold page cache,
+# for the default read/hash pipeline and for a single reader and hasher (the shape of
+# the per-file open/read/close path that replay's TaskFingerprint runs serially).
+# Cold runs flush the unified buffer cache with purge, which needs sudo; without it
+# only warm numbers are printed.
+# Usage: bench_small_files.sh [/path/to/fingerprint] [file_count] [file_size_bytes]
+set -euo pipefail
+
+SCRIPT_DIR="$(cd "$(dirname "$0")" && pwd)"
+FINGERPRINT_BIN="${1:-${FINGERPRINT_BIN:-${SCRIPT_DIR}/../build/Release/fingerprint}}"
+FILE_COUNT="${2:-100000}"
+FILE_SIZE="${3:-2048}"
+
+BENCH_DIR="$(mktemp -d -t fingerprint_small_files.XXXXXX)"
+trap 'rm -rf "$BENCH_DIR"' EXIT
+
+echo "Creating $FILE_COUNT files of $FILE_SIZE bytes in $BENCH_DIR"
+/usr/bin/perl -e '
+    my ($dir, $count, $size) = @ARGV;
+    for my $i (0 .. $count - 1) {
+        my $sub = sprintf("%s/d%03d", $dir, $i % 1000);
+        mkdir $sub unless -d $sub;
+        open(my $fh, ">", "$sub/f$i.txt") or die "$sub/f$i.txt: $!";
+        print $fh substr(("$i " x $size), 0, $size);
+        close($fh);
+    }' "$BENCH_DIR" "$FILE_COUNT" "$FILE_SIZE"
+
+CAN_PURGE=0
+if sudo -n /usr/sbin/purge 2>/dev/null; then
+    CAN_PURGE=1
+fi
+
+run() {
+    local label="$1"
+    shift
+    local start end
+    start=$(/usr/bin/perl -MTime::HiRes=time -e 'printf "%.6f", time')
+    "$FINGERPRINT_BIN" --xattr=off "$@" "$BENCH_DIR" > /dev/null
+    end=$(/usr/bin/perl -MTime::HiRes=time -e 'printf "%.6f", time')
+    /usr/bin/perl -e 'printf "  %-28s %10.1f ms\n", $ARGV[0], ($ARGV[2] - $ARGV[1]) * 1000' "$label" "$start" "$end"
+}
+
+for config in "pipeline (default)|" "single reader and hasher|--io-depth=1 --hash-jobs=1"; do
+    label="${config%%|*}"
+    args="${config#*|}"
+    echo "$label:"
+    # shellcheck disable=SC2086
+    run "warm" $args
+    if [ "$CAN_PURGE" = "1" ]; then
+        sudo -n /usr/sbin/purge
+        # shellcheck disable=SC2086
+        run "cold" $args
+    fi
+done
+
+if [ "$CAN_PURGE" = "0" ]; then
+    echo "(cold cache runs skipped: 'sudo -n purge' is not available)"
+fi
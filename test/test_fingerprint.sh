@@ -233,9 +233,17 @@ test_glob_numeric_ranges
 test_glob_complex_patterns
 test_list_output_format
 test_large_file
+test_large_file_parallel_hash
+test_read_pipeline_streamed_file
+test_sparse_file_hash
+test_hard_links_hashed_once
+test_matched_files_shards
+test_directory_walkers_agree
+test_directory_walkers_stay_on_device
 test_snapshot_tsv
 test_snapshot_json
 test_snapshot_plist
+test_snapshot_binary
 test_compare_previous_identical
 test_compare_previous_modified
 test_compare_previous_added_removed
@@ -247,6 +255,8 @@ test_compare_single_no_snapshot_json
 test_compare_single_no_snapshot_plist
 test_compare_single_no_snapshot_identical
 test_compare_different_hash_algorithm
+test_compare_tree_mode
+test_compare_tree_matches_flat
 
 test_exclude_basic_glob
 test_exclude_literal_dir
@@ -254,6 +264,7 @@ test_exclude_changing_excluded_file
 test_exclude_changing_kept_file
 test_exclude_relative_to_search_dir
 test_exclude_relative_glob_in_search_dir
+test_exclude_split_traversal
 
 test_regex_basic_pattern
 test_regex_alternation
@@ -72,7 +72,7 @@ test_symlinks() {
 # Test 9: CRC32C vs BLAKE3
 # ============================================================================
 test_hash_algorithms() {
-    log_test "Hash algorithms (CRC32C vs BLAKE3)"
+    log_test "Hash algorithms (CRC32C vs BLAKE3 vs XXH3)"
     log_info "Testing different hash algorithms produce different results"
     
     echo "hash test" > "$TEST_DIR/hash_file.txt"
@@ -87,8 +87,15 @@ test_hash_algorithms() {
     local output_blake=$(${FINGERPRINT_BIN} --hash=blake3 "$TEST_DIR/hash_file.txt" 2>&1)
     local fp_blake=$(echo "$output_blake" | /usr/bin/grep "Fingerprint:" | /usr/bin/awk '{print $2}')
     
+    log_info "Computing fingerprint with --hash=xxh3"
+    log_cmd "${FINGERPRINT_BIN} --hash=xxh3 \"$TEST_DIR/hash_file.txt\""
+    local output_xxh3=$(${FINGERPRINT_BIN} --hash=xxh3 "$TEST_DIR/hash_file.txt" 2>&1)
+    local fp_xxh3=$(echo "$output_xxh3" | /usr/bin/grep "Fingerprint:" | /usr/bin/awk '{print $2}')
+
     assert_not_equal "$fp_crc" "$fp_blake" "CRC32C and BLAKE3 should produce different results"
-    log_info "CRC32C: $fp_crc, BLAKE3: $fp_blake"
+    assert_not_equal "$fp_crc" "$fp_xxh3" "CRC32C and XXH3 should produce different results"
+    assert_not_equal "$fp_blake" "$fp_xxh3" "BLAKE3 and XXH3 should produce different results"
+    log_info "CRC32C: $fp_crc, BLAKE3: $fp_blake, XXH3: $fp_xxh3"
     
     # Verify both are valid hex
     if [[ "$fp_crc" =~ ^[0-9a-f]{16}$ ]]; then
@@ -102,6 +109,16 @@ test_hash_algorithms() {
     else
         log_fail "Invalid BLAKE3 fingerprint format"
     fi
+
+    if [[ "$fp_xxh3" =~ ^[0-9a-f]{16}$ ]]; then
+        log_pass "XXH3 fingerprint format valid"
+    else
+        log_fail "Invalid XXH3 fingerprint format"
+    fi
+
+    # the xattr cache of each algorithm lives under its own name
+    local xattr_names=$(xattr "$TEST_DIR/hash_file.txt" 2>/dev/null)
+    assert_contains "$xattr_names" "public.fingerprint.xxh3" "XXH3 hash should be cached in its own xattr"
 }
 
 # ============================================================================
@@ -350,3 +367,202 @@ test_large_file() {
         log_fail "Failed to process large file"
     fi
 }
+
+# ============================================================================
+# Test: Large files hashed in parallel ranges match the single-pass hash
+# ============================================================================
+test_large_file_parallel_hash() {
+    log_test "Large file parallel hashing is bit-identical to a single pass"
+    log_info "A 40MB file is split into 4MB ranges hashed on several cores; the per-file"
+    log_info "hashes must equal the single-pass values so xattr records and manifests stay valid"
+
+    # 41952000 bytes: 10 full ranges plus a tail that is not a whole number of
+    # 1KB BLAKE3 chunks. Every 4-byte word differs, so a misplaced range shows.
+    /usr/bin/perl -e 'for $i (0..10487999) { print pack("N", $i) }' > "$TEST_DIR/parallel_hash.bin"
+
+    local crc_output=$(${FINGERPRINT_BIN} --hash=crc32c -l "$TEST_DIR/parallel_hash.bin" 2>&1)
+    local crc_hash=$(echo "$crc_output" | /usr/bin/grep "parallel_hash.bin" | /usr/bin/awk '{print $1}')
+    assert_equal "81a4bd07" "$crc_hash" "CRC32C of the large file should match the single-pass value"
+
+    local blake_output=$(${FINGERPRINT_BIN} --hash=blake3 -l "$TEST_DIR/parallel_hash.bin" 2>&1)
+    local blake_hash=$(echo "$blake_output" | /usr/bin/grep "parallel_hash.bin" | /usr/bin/awk '{print $1}')
+    assert_equal "95e0fb7ef6f401fa" "$blake_hash" "BLAKE3 of the large file should match the single-pass value"
+
+    local xxh3_output=$(${FINGERPRINT_BIN} --hash=xxh3 -l "$TEST_DIR/parallel_hash.bin" 2>&1)
+    local xxh3_hash=$(echo "$xxh3_output" | /usr/bin/grep "parallel_hash.bin" | /usr/bin/awk '{print $1}')
+    assert_equal "aa5f1de6861b913d" "$xxh3_hash" "XXH3 of the large file should match the single-pass value"
+}
+
+test_read_pipeline_streamed_file() {
+    log_test "Files larger than one read buffer are streamed through the pipeline with unchanged hashes"
+    log_info "A 3.5MB file is read in 1MB pooled buffers and hashed piece by piece; with a 2 buffer"
+    log_info "pool and single reader and hasher the pieces must still be hashed in order"
+
+    # 3670404 bytes: three full 1MB buffers plus a tail that is not a whole BLAKE3 chunk
+    /usr/bin/perl -e 'for $i (0..917600) { print pack("N", $i) }' > "$TEST_DIR/streamed.bin"
+
+    local crc_output=$(${FINGERPRINT_BIN} --xattr=off --hash=crc32c -l "$TEST_DIR/streamed.bin" 2>&1)
+    local crc_hash=$(echo "$crc_output" | /usr/bin/grep "streamed.bin" | /usr/bin/awk '{print $1}')
+    assert_equal "0e5c9f24" "$crc_hash" "CRC32C of the streamed file should match the single-pass value"
+
+    crc_output=$(${FINGERPRINT_BIN} --xattr=off --hash=crc32c --read-memory=2 --io-depth=1 --hash-jobs=1 -l "$TEST_DIR/streamed.bin" 2>&1)
+    crc_hash=$(echo "$crc_output" | /usr/bin/grep "streamed.bin" | /usr/bin/awk '{print $1}')
+    assert_equal "0e5c9f24" "$crc_hash" "CRC32C should not depend on pipeline limits"
+
+    local blake_output=$(${FINGERPRINT_BIN} --xattr=off --hash=blake3 --read-memory=2 --io-depth=1 --hash-jobs=1 -l "$TEST_DIR/streamed.bin" 2>&1)
+    local blake_hash=$(echo "$blake_output" | /usr/bin/grep "streamed.bin" | /usr/bin/awk '{print $1}')
+    assert_equal "81d3e3a1633867ed" "$blake_hash" "BLAKE3 of the streamed file should match the single-pass value"
+
+    local xxh3_output=$(${FINGERPRINT_BIN} --xattr=off --hash=xxh3 --read-memory=2 --io-depth=1 --hash-jobs=1 -l "$TEST_DIR/streamed.bin" 2>&1)
+    local xxh3_hash=$(echo "$xxh3_output" | /usr/bin/grep "streamed.bin" | /usr/bin/awk '{print $1}')
+    assert_equal "01368e457add7e0a" "$xxh3_hash" "XXH3 of the streamed file should match the single-pass value"
+
+    ${FINGERPRINT_BIN} --io-depth=0 "$TEST_DIR/streamed.bin" >/dev/null 2>&1
+    assert_not_equal "0" "$?" "A non-positive --io-depth should be rejected"
+}
+
+test_sparse_file_hash() {
+    log_test "Holes of a sparse file hash the same as the zeros they read as"
+    log_info "A 64MB file that is mostly holes, with data inside one range and across another,"
+    log_info "must fingerprint like a dense copy of the same bytes with every algorithm"
+
+    # truncate extends the file with a hole; the two writes allocate only their own blocks
+    /usr/bin/perl -e '
+        open(my $fh, ">", $ARGV[0]) or die "$ARGV[0]: $!";
+        truncate($fh, 64 * 1024 * 1024 + 1234);
+        seek($fh, 5000000, 0);
+        print $fh "data inside the second range";
+        seek($fh, 40 * 1024 * 1024 - 1000, 0);
+        print $fh pack("N", $_) for 0..300000;
+        close($fh);' "$TEST_DIR/sparse.bin"
+    /bin/cat "$TEST_DIR/sparse.bin" > "$TEST_DIR/dense.bin"
+    log_info "Allocated KB, sparse and dense: $(/usr/bin/du -k "$TEST_DIR/sparse.bin" "$TEST_DIR/dense.bin" | /usr/bin/awk '{print $1}' | /usr/bin/tr '\n' ' ')"
+
+    local algorithm
+    for algorithm in crc32c blake3 xxh3; do
+        local output=$(${FINGERPRINT_BIN} --xattr=off --hash=$algorithm -l "$TEST_DIR/sparse.bin" "$TEST_DIR/dense.bin" 2>&1)
+        local sparse_hash=$(echo "$output" | /usr/bin/grep "sparse.bin" | /usr/bin/awk '{print $1}')
+        local dense_hash=$(echo "$output" | /usr/bin/grep "dense.bin" | /usr/bin/awk '{print $1}')
+        assert_equal "$dense_hash" "$sparse_hash" "$algorithm of the sparse file should match its dense copy"
+    done
+}
+
+test_hard_links_hashed_once() {
+    log_test "Hard links of one file are hashed once per run"
+    log_info "Paths with the same device, inode, size, mtime and ctime take the hash of the"
+    log_info "first one instead of reading the content again; -v reports how many did"
+
+    /bin/mkdir -p "$TEST_DIR/links"
+    /bin/dd if=/dev/urandom of="$TEST_DIR/links/original.bin" bs=1024 count=3072 2>/dev/null
+    /bin/ln "$TEST_DIR/links/original.bin" "$TEST_DIR/links/link_1.bin"
+    /bin/ln "$TEST_DIR/links/original.bin" "$TEST_DIR/links/link_2.bin"
+    /bin/cp "$TEST_DIR/links/original.bin" "$TEST_DIR/links/copy.bin"
+
+    local algorithm
+    for algorithm in crc32c blake3 xxh3; do
+        local output=$(${FINGERPRINT_BIN} -v --xattr=off --hash=$algorithm "$TEST_DIR/links" 2>&1)
+        assert_contains "$output" "Hash dedupe by (device, inode): 2 files, 6 MB" "$algorithm: two of the three links should reuse the first one's hash"
+
+        local listing=$(${FINGERPRINT_BIN} --xattr=off --hash=$algorithm -l "$TEST_DIR/links" 2>&1)
+        local copy_hash=$(echo "$listing" | /usr/bin/grep "copy.bin" | /usr/bin/awk '{print $1}')
+        local link_hash
+        for link_hash in $(echo "$listing" | /usr/bin/grep -E "original.bin|link_[12].bin" | /usr/bin/awk '{print $1}'); do
+            assert_equal "$copy_hash" "$link_hash" "$algorithm: every link should carry the content hash of a separate copy"
+        done
+    done
+}
+
+test_matched_files_shards() {
+    log_test "Matched files collected in per-thread shards are all merged"
+    log_info "Every hashed file is appended to its worker's shard; the merge before sorting"
+    log_info "must see all of them, and the fingerprint must not depend on the shard layout"
+
+    /bin/mkdir -p "$TEST_DIR/shards/a" "$TEST_DIR/shards/b"
+    for i in $(seq 1 150); do
+        echo "content $i" > "$TEST_DIR/shards/a/file_$i.txt"
+        echo "other $i" > "$TEST_DIR/shards/b/file_$i.txt"
+    done
+
+    local output=$(${FINGERPRINT_BIN} -v --xattr=off "$TEST_DIR/shards" 2>&1)
+    assert_contains "$output" "Matched files collection: 300 files" "All 300 files should be merged from the shards"
+    assert_contains "$output" "time saved: " "The collection line should report the time saved over the serial queue"
+
+    local fp_parallel=$(echo "$output" | /usr/bin/grep "Fingerprint:" | /usr/bin/awk '{print $2}')
+    local fp_single=$(${FINGERPRINT_BIN} --xattr=off --hash-jobs=1 --io-depth=1 "$TEST_DIR/shards" 2>&1 | /usr/bin/grep "Fingerprint:" | /usr/bin/awk '{print $2}')
+    assert_equal "$fp_parallel" "$fp_single" "Fingerprint should not depend on how files were spread over shards"
+}
+
+test_directory_walkers_agree() {
+    log_test "Bulk and fts directory walkers match the same files"
+    log_info "getattrlistbulk listings must deliver the same entries and stat fields as fts:"
+    log_info "nested directories, symlinks and a fifo (skipped by both), with and without a glob"
+
+    /bin/mkdir -p "$TEST_DIR/walkers/a/b/c" "$TEST_DIR/walkers/d"
+    for i in $(seq 1 20); do
+        echo "top $i" > "$TEST_DIR/walkers/top_$i.txt"
+        echo "deep $i" > "$TEST_DIR/walkers/a/b/c/deep_$i.txt"
+        echo "data $i" > "$TEST_DIR/walkers/d/data_$i.dat"
+    done
+    /bin/ln -s ../top_1.txt "$TEST_DIR/walkers/d/link.txt"
+    /bin/ln -s missing.txt "$TEST_DIR/walkers/a/dangling.txt"
+    /usr/bin/mkfifo "$TEST_DIR/walkers/a/pipe"
+
+    local list_fts=$(${FINGERPRINT_BIN} --xattr=off --walker=fts -l "$TEST_DIR/walkers" 2>&1)
+    local list_bulk=$(${FINGERPRINT_BIN} --xattr=off --walker=bulk -l "$TEST_DIR/walkers" 2>&1)
+    assert_equal "$list_fts" "$list_bulk" "Both walkers should list the same files with the same hashes"
+
+    list_fts=$(${FINGERPRINT_BIN} --xattr=off --walker=fts -g '*.txt' -l "$TEST_DIR/walkers" 2>&1)
+    list_bulk=$(${FINGERPRINT_BIN} --xattr=off --walker=bulk -g '*.txt' -l "$TEST_DIR/walkers" 2>&1)
+    assert_equal "$list_fts" "$list_bulk" "Both walkers should match the same files for a glob"
+
+    # the bulk walker drops rejected names before decoding them; symlinks rejected by the
+    # filters are still collected, so chains resolve the same way
+    list_fts=$(${FINGERPRINT_BIN} --xattr=off --walker=fts -g '*.dat' -r 'deep_1[0-9]' -l "$TEST_DIR/walkers" 2>&1)
+    list_bulk=$(${FINGERPRINT_BIN} --xattr=off --walker=bulk -g '*.dat' -r 'deep_1[0-9]' -l "$TEST_DIR/walkers" 2>&1)
+    assert_equal "$list_fts" "$list_bulk" "Both walkers should match the same files for a glob and a regex"
+    assert_not_equal "" "$list_bulk" "The glob and regex should match some files"
+
+    # the xattr cache written after an fts walk must be valid for the stat fields of a bulk walk
+    local fp_fts=$(${FINGERPRINT_BIN} --walker=fts "$TEST_DIR/walkers" 2>&1 | /usr/bin/grep "Fingerprint:" | /usr/bin/awk '{print $2}')
+    local fp_bulk=$(${FINGERPRINT_BIN} --walker=bulk "$TEST_DIR/walkers" 2>&1 | /usr/bin/grep "Fingerprint:" | /usr/bin/awk '{print $2}')
+    assert_equal "$fp_fts" "$fp_bulk" "Fingerprint should not depend on the walker when using cached xattrs"
+
+    ${FINGERPRINT_BIN} --walker=readdir "$TEST_DIR/walkers" >/dev/null 2>&1
+    assert_not_equal "0" "$?" "An unknown --walker should be rejected"
+}
+
+test_directory_walkers_stay_on_device() {
+    log_test "Bulk and fts directory walkers do not descend into a mounted filesystem"
+    log_info "A disk image is attached on a directory of the tree: both walkers must stop at it,"
+    log_info "and the subtree hand-off must not pass it to another walk"
+
+    /bin/mkdir -p "$TEST_DIR/xdev/tree/mnt" "$TEST_DIR/xdev/tree/sub"
+    for i in $(seq 1 20); do
+        echo "outside $i" > "$TEST_DIR/xdev/tree/sub/outside_$i.txt"
+    done
+
+    # hdiutil attaches an image for the user without sudo
+    if ! /usr/bin/hdiutil create -quiet -size 1m -fs HFS+ -volname fpxdev "$TEST_DIR/xdev/image.dmg" \
+        || ! /usr/bin/hdiutil attach -quiet -nobrowse -mountpoint "$TEST_DIR/xdev/tree/mnt" "$TEST_DIR/xdev/image.dmg"; then
+        log_pass "Skipped: cannot attach a disk image here"
+        return
+    fi
+    echo "inside" > "$TEST_DIR/xdev/tree/mnt/inside.txt"
+
+    local list_fts=$(${FINGERPRINT_BIN} --xattr=off --walker=fts -l "$TEST_DIR/xdev/tree" 2>&1)
+    local list_bulk=$(${FINGERPRINT_BIN} --xattr=off --walker=bulk -l "$TEST_DIR/xdev/tree" 2>&1)
+    local list_bulk_one=$(${FINGERPRINT_BIN} --xattr=off --walker=bulk --hash-jobs=1 -l "$TEST_DIR/xdev/tree" 2>&1)
+
+    /usr/bin/hdiutil detach -quiet "$TEST_DIR/xdev/tree/mnt" || /usr/bin/hdiutil detach -quiet -force "$TEST_DIR/xdev/tree/mnt"
+
+    assert_contains "$list_fts" "outside_20.txt" "fts should list the files outside the mount"
+    local run
+    for run in "fts|$list_fts" "bulk|$list_bulk" "bulk, one walk|$list_bulk_one"; do
+        if output_not_contains "${run#*|}" "inside.txt"; then
+            log_pass "${run%%|*} should not descend into the mounted filesystem"
+        else
+            log_fail "${run%%|*} descended into the mounted filesystem"
+        fi
+    done
+    assert_equal "$list_fts" "$list_bulk" "Both walkers should list the same files across a mount point"
+}
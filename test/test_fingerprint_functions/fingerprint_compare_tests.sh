@@ -338,3 +338,102 @@ test_compare_different_hash_algorithm() {
 }
 
 
+
+# ============================================================================
+# Tree mode: per-directory hashes and subtree skipping in compare
+# ============================================================================
+test_compare_tree_mode() {
+    log_test "Tree mode: directory hashes are location independent and unchanged subtrees are skipped"
+    log_info "Fingerprint a tree in two locations, then compare tree snapshots after one file changes"
+
+    /bin/mkdir -p "$TEST_DIR/tree_a/src/foo" "$TEST_DIR/tree_a/src/bar" "$TEST_DIR/tree_a/docs"
+    echo "foo a" > "$TEST_DIR/tree_a/src/foo/a.txt"
+    echo "foo b" > "$TEST_DIR/tree_a/src/foo/b.txt"
+    echo "bar c" > "$TEST_DIR/tree_a/src/bar/c.txt"
+    echo "docs"  > "$TEST_DIR/tree_a/docs/d.txt"
+    echo "top"   > "$TEST_DIR/tree_a/src.txt"
+    /bin/cp -R "$TEST_DIR/tree_a" "$TEST_DIR/tree_b"
+
+    local fp_a=$(${FINGERPRINT_BIN} --xattr=off -F tree "$TEST_DIR/tree_a" 2>&1 | /usr/bin/grep "Fingerprint:" | /usr/bin/awk '{print $2}')
+    local fp_b=$(${FINGERPRINT_BIN} --xattr=off -F tree "$TEST_DIR/tree_b" 2>&1 | /usr/bin/grep "Fingerprint:" | /usr/bin/awk '{print $2}')
+    assert_equal "$fp_a" "$fp_b" "Tree fingerprint should not depend on the directory location"
+
+    /bin/mv "$TEST_DIR/tree_b/src/foo/b.txt" "$TEST_DIR/tree_b/src/foo/b2.txt"
+    fp_b=$(${FINGERPRINT_BIN} --xattr=off -F tree "$TEST_DIR/tree_b" 2>&1 | /usr/bin/grep "Fingerprint:" | /usr/bin/awk '{print $2}')
+    assert_not_equal "$fp_a" "$fp_b" "Renaming a file should change the tree fingerprint"
+
+    ${FINGERPRINT_BIN} --xattr=off -F tree -s "$TEST_DIR/tree_base.tsv" "$TEST_DIR/tree_a" > /dev/null 2>&1
+    if /usr/bin/grep -q "^$TEST_DIR/tree_a/src/foo/"$'\t' "$TEST_DIR/tree_base.tsv"; then
+        log_pass "TSV snapshot records directory hashes"
+    else
+        log_fail "TSV snapshot should contain a 'dir/<TAB>hash' row for src/foo"
+    fi
+
+    # a content change in src/foo and an mtime-only change in src/bar: recorded directory
+    # hashes cover mtimes, so only docs is unchanged and skipped
+    echo "foo a changed" > "$TEST_DIR/tree_a/src/foo/a.txt"
+    /usr/bin/touch -t 202001010000 "$TEST_DIR/tree_a/src/bar/c.txt"
+
+    log_cmd "${FINGERPRINT_BIN} --xattr=off -F tree -v -c \"$TEST_DIR/tree_base.tsv\" \"$TEST_DIR/tree_a\""
+    local output=$(${FINGERPRINT_BIN} --xattr=off -F tree -v -c "$TEST_DIR/tree_base.tsv" "$TEST_DIR/tree_a" 2>&1)
+    assert_contains "$output" "src/foo/a.txt" "Changed file in a changed subtree should be reported"
+    assert_contains "$output" "src/bar/c.txt" "An mtime-only change should be reported in tree mode too"
+    assert_contains "$output" "Skipped 1 file(s) in 1 unchanged subtree(s)" "Files of unchanged subtrees should be skipped"
+    if output_contains "$output" "docs/d.txt"; then
+        log_fail "Files in subtrees with unchanged hashes should not be compared"
+        log_info "Output: $output"
+    else
+        log_pass "Unchanged subtree docs was not descended into"
+    fi
+
+    # the same comparison from JSON snapshots
+    ${FINGERPRINT_BIN} --xattr=off -F tree -s "$TEST_DIR/tree_b1.json" "$TEST_DIR/tree_b" > /dev/null 2>&1
+    echo "docs changed" > "$TEST_DIR/tree_b/docs/d.txt"
+    /usr/bin/touch -t 202001010000 "$TEST_DIR/tree_b/src/foo/a.txt"
+    ${FINGERPRINT_BIN} --xattr=off -F tree -s "$TEST_DIR/tree_b2.json" "$TEST_DIR/tree_b" > /dev/null 2>&1
+    output=$(${FINGERPRINT_BIN} -v -c "$TEST_DIR/tree_b1.json" -c "$TEST_DIR/tree_b2.json" 2>&1)
+    assert_contains "$output" "docs/d.txt" "Changed file should be reported from JSON tree snapshots"
+    assert_contains "$output" "src/foo/a.txt" "An mtime-only change should be reported from JSON tree snapshots"
+    assert_contains "$output" "Skipped 1 file(s) in 1 unchanged subtree(s)" "Unchanged src/bar should be skipped in JSON tree snapshots"
+}
+
+# ============================================================================
+# Tree mode: skipping unchanged subtrees never changes what compare reports
+# ============================================================================
+test_compare_tree_matches_flat() {
+    log_test "Tree mode: compare reports the same changes and exit status as default mode"
+    log_info "Snapshot a tree in tree and default mode, chmod one file, and compare each pair"
+
+    /bin/mkdir -p "$TEST_DIR/tree_flat/src/foo" "$TEST_DIR/tree_flat/docs"
+    echo "foo a" > "$TEST_DIR/tree_flat/src/foo/a.txt"
+    echo "foo b" > "$TEST_DIR/tree_flat/src/foo/b.txt"
+    echo "docs"  > "$TEST_DIR/tree_flat/docs/d.txt"
+    /bin/chmod 0644 "$TEST_DIR/tree_flat/src/foo/a.txt"
+
+    local ext
+    for ext in tsv json plist fpsnap; do
+        ${FINGERPRINT_BIN} --xattr=off -F tree -s "$TEST_DIR/tree_flat_tree1.$ext" "$TEST_DIR/tree_flat" > /dev/null 2>&1
+        ${FINGERPRINT_BIN} --xattr=off -s "$TEST_DIR/tree_flat_default1.$ext" "$TEST_DIR/tree_flat" > /dev/null 2>&1
+    done
+
+    /bin/chmod 0755 "$TEST_DIR/tree_flat/src/foo/a.txt"
+
+    for ext in tsv json plist fpsnap; do
+        ${FINGERPRINT_BIN} --xattr=off -F tree -s "$TEST_DIR/tree_flat_tree2.$ext" "$TEST_DIR/tree_flat" > /dev/null 2>&1
+        ${FINGERPRINT_BIN} --xattr=off -s "$TEST_DIR/tree_flat_default2.$ext" "$TEST_DIR/tree_flat" > /dev/null 2>&1
+
+        # the file report, without the "Fingerprint runs:" block of snapshot parameters
+        local tree_output tree_status default_output default_status
+        tree_output=$(${FINGERPRINT_BIN} -c "$TEST_DIR/tree_flat_tree1.$ext" -c "$TEST_DIR/tree_flat_tree2.$ext" 2>&1)
+        tree_status=$?
+        default_output=$(${FINGERPRINT_BIN} -c "$TEST_DIR/tree_flat_default1.$ext" -c "$TEST_DIR/tree_flat_default2.$ext" 2>&1)
+        default_status=$?
+        tree_output=$(echo "$tree_output" | /usr/bin/sed '/^Fingerprint runs:/,/^$/d')
+        default_output=$(echo "$default_output" | /usr/bin/sed '/^Fingerprint runs:/,/^$/d')
+
+        assert_contains "$tree_output" "src/foo/a.txt" "chmod-only change should be reported from $ext tree snapshots"
+        assert_contains "$tree_output" "mode:" "chmod-only change should be reported as a mode change ($ext)"
+        assert_equal "$default_output" "$tree_output" "Tree and default mode should report the same changes ($ext)"
+        assert_equal "$default_status" "$tree_status" "Tree and default mode should exit with the same status ($ext)"
+    done
+}
\ No newline at end of file
@@ -183,3 +183,35 @@ test_exclude_relative_glob_in_search_dir() {
         log_fail "readme.txt should be present (only gen/*.gen is excluded)"
     fi
 }
+
+test_exclude_split_traversal() {
+    log_test "Exclude: subtree walks split across workers keep root-relative excludes"
+    log_info "A wide tree is walked as subtrees on several workers; relative literal and glob"
+    log_info "excludes below the first level must still match relative to the searched directory"
+
+    for d in 0 1 2 3 4 5 6 7 8 9; do
+        for n in 0 1 2 3 4; do
+            /bin/mkdir -p "$TEST_DIR/excl_split/src/d$d/n$n"
+            for f in 0 1 2 3; do
+                echo "d$d n$n f$f" > "$TEST_DIR/excl_split/src/d$d/n$n/f$f.txt"
+            done
+            echo "skip" > "$TEST_DIR/excl_split/src/d$d/n$n/x.skip"
+        done
+    done
+
+    # 200 .txt files; d3 prunes 20, d5/n2 prunes 4, d7/*/f0.txt drops 5, *.skip drops the rest
+    log_cmd "${FINGERPRINT_BIN} -l -e d3 -e d5/n2 -e 'd7/*/f0.txt' -e '*.skip' \"$TEST_DIR/excl_split/src\""
+    local output=$(${FINGERPRINT_BIN} -l --xattr=off -e d3 -e d5/n2 -e 'd7/*/f0.txt' -e '*.skip' "$TEST_DIR/excl_split/src" 2>&1)
+    local count=$(echo "$output" | /usr/bin/grep -c "\.txt$")
+    assert_equal "171" "$count" "Split traversal should match exactly the non-excluded files"
+
+    if output_not_contains "$output" "x.skip"; then
+        log_pass "Basename exclude applied in every subtree walk"
+    else
+        log_fail "Should exclude x.skip in every subtree"
+    fi
+
+    local fp_split=$(echo "$output" | /usr/bin/grep "Fingerprint:" | /usr/bin/awk '{print $2}')
+    local fp_single=$(${FINGERPRINT_BIN} --xattr=off --hash-jobs=1 -e d3 -e d5/n2 -e 'd7/*/f0.txt' -e '*.skip' "$TEST_DIR/excl_split/src" 2>&1 | /usr/bin/grep "Fingerprint:" | /usr/bin/awk '{print $2}')
+    assert_equal "$fp_split" "$fp_single" "Fingerprint should not depend on how the traversal was split"
+}
@@ -94,3 +94,53 @@ test_snapshot_plist() {
     fi
 }
 
+
+# ============================================================================
+# Snapshot - binary format
+# ============================================================================
+test_snapshot_binary() {
+    log_test "Snapshot - binary format (.fpsnap)"
+    log_info "Save binary snapshots, compare them with each other and with JSON, reject a corrupted one"
+
+    /bin/mkdir -p "$TEST_DIR/fpsnap_tree/sub"
+    echo "one"   > "$TEST_DIR/fpsnap_tree/one.txt"
+    echo "two"   > "$TEST_DIR/fpsnap_tree/sub/two.txt"
+    echo "three" > "$TEST_DIR/fpsnap_tree/sub/three.txt"
+
+    log_cmd "${FINGERPRINT_BIN} --xattr=off -s \"$TEST_DIR/base.fpsnap\" \"$TEST_DIR/fpsnap_tree\""
+    ${FINGERPRINT_BIN} --xattr=off -s "$TEST_DIR/base.fpsnap" "$TEST_DIR/fpsnap_tree" > /dev/null 2>&1
+    if [ -f "$TEST_DIR/base.fpsnap" ]; then
+        log_pass "Binary snapshot file created"
+    else
+        log_fail "Failed to create binary snapshot"
+        return
+    fi
+
+    local output=$(${FINGERPRINT_BIN} --xattr=off -c "$TEST_DIR/base.fpsnap" "$TEST_DIR/fpsnap_tree" 2>&1)
+    assert_contains "$output" "identical" "Unchanged tree should compare identical to its binary snapshot"
+
+    ${FINGERPRINT_BIN} --xattr=off -s "$TEST_DIR/base_fpsnap.json" "$TEST_DIR/fpsnap_tree" > /dev/null 2>&1
+
+    echo "two changed" > "$TEST_DIR/fpsnap_tree/sub/two.txt"
+    /bin/rm "$TEST_DIR/fpsnap_tree/one.txt"
+    echo "four" > "$TEST_DIR/fpsnap_tree/four.txt"
+    ${FINGERPRINT_BIN} --xattr=off -s "$TEST_DIR/next.fpsnap" "$TEST_DIR/fpsnap_tree" > /dev/null 2>&1
+
+    output=$(${FINGERPRINT_BIN} -c "$TEST_DIR/base.fpsnap" -c "$TEST_DIR/next.fpsnap" 2>&1)
+    assert_contains "$output" "crc32c hash:" "Modified file should be reported between binary snapshots"
+    assert_contains "$output" "removed" "Removed file should be reported between binary snapshots"
+    assert_contains "$output" "added" "Added file should be reported between binary snapshots"
+
+    output=$(${FINGERPRINT_BIN} -c "$TEST_DIR/base_fpsnap.json" -c "$TEST_DIR/next.fpsnap" 2>&1)
+    assert_contains "$output" "sub/two.txt" "A JSON snapshot should compare with a binary one"
+
+    # flip one byte inside the file records
+    /usr/bin/printf '\xff' | /bin/dd of="$TEST_DIR/next.fpsnap" bs=1 seek=80 conv=notrunc 2>/dev/null
+    output=$(${FINGERPRINT_BIN} --verify-snapshot -c "$TEST_DIR/base.fpsnap" -c "$TEST_DIR/next.fpsnap" 2>&1)
+    assert_contains "$output" "checksum mismatch" "Corrupted binary snapshot should be rejected under --verify-snapshot"
+
+    # a truncated snapshot is caught by the size check, without --verify-snapshot
+    /usr/bin/head -c 100 "$TEST_DIR/base.fpsnap" > "$TEST_DIR/short.fpsnap"
+    output=$(${FINGERPRINT_BIN} -c "$TEST_DIR/short.fpsnap" -c "$TEST_DIR/base.fpsnap" 2>&1)
+    assert_contains "$output" "inconsistent" "Truncated binary snapshot should be rejected"
+}
@@ -41,6 +41,18 @@ Scenarios:
   29. per-step keys: "cache": false opts out and stores nothing, "cache": true on a
       non-cacheable action is ignored with a verbose note, and a string "cache", a
       string "env" or an undefined "env" name are all hard errors
+  30. a declared directory large enough to be hashed in parallel hits under every memo
+      backend and misses after one file in it is edited
+  31. the run's path memo serves repeated declarations, and a task writing under a
+      memoized directory makes later consumers see the write
+  32. --cache-artifacts: deleted outputs and inputs changed back are restored without
+      executing, a dry run reports RESTORE, --cache-refresh still executes, a zero limit
+      evicts everything, and a move is never stored
+  33. glob expansion reuses the directory listings stored by the previous run, re-reads
+      only a directory that changed, and a new or deleted match still misses
+  34. a file reached by several paths in one run is read once: hard links under one
+      declared directory, and a shared header declared by several tasks under
+      different paths
 
 Usage: python3 test_replay_cache.py [/path/to/replay]
 Exit:  0 = all checks passed, 1 = one or more failures
@@ -52,6 +64,7 @@ import shutil
 import subprocess
 import sys
 import tempfile
+import time
 from pathlib import Path
 
 SCRIPT_DIR     = Path(__file__).parent.resolve()
@@ -1262,6 +1275,300 @@ def test_per_step_cache_and_env_keys():
               "NO_SUCH_VAR_FOR_REPLAY_TEST" in r10.stderr and "not defined" in r10.stderr, r10.stderr)
 
 
+def test_large_declared_directory():
+    print("\n=== Scenario 30: a declared directory large enough to be hashed in parallel ===")
+    with tempfile.TemporaryDirectory() as td:
+        d = Path(td)
+        tree = d / "tree"
+        # Well past the parallel threshold, in several subdirectories so the chunks
+        # straddle directory boundaries, and with hard links that land in other chunks.
+        for i in range(1200):
+            sub = tree / f"sub{i % 7}"
+            sub.mkdir(parents=True, exist_ok=True)
+            (sub / f"f{i:04}.txt").write_text(f"payload {i}")
+        os.link(tree / "sub0" / "f0000.txt", tree / "sub6" / "zz_link.txt")
+        out = d / "out.txt"
+        playlist = d / "pl.json"
+        playlist.write_text(json.dumps([
+            {"action": "execute", "tool": "/bin/sh",
+             "arguments": ["-c", f"cat {tree}/sub3/*.txt > {out}"],
+             "inputs": [str(tree)], "outputs": [str(out)]},
+        ]))
+
+        for memo in ("sidecar", "xattr", "off"):
+            cache = d / f"cache_{memo}"
+            r1 = cached(playlist, cache, "--cache-memo", memo)
+            check(f"{memo}: run 1 executes", summary(r1) == (0, 1, 0), r1.stderr)
+            # The rollup of a fanned-out pass must be the same value every time, or the
+            # task could never hit.
+            r2 = cached(playlist, cache, "--cache-memo", memo)
+            check(f"{memo}: unchanged tree hits", summary(r2) == (1, 0, 0), r2.stderr)
+
+        (tree / "sub5" / "f1000.txt").write_text("payload edited")
+        r3 = cached(playlist, d / "cache_off", "--cache-memo", "off")
+        check("one file edited deep in the tree re-runs", summary(r3) == (0, 1, 0), r3.stderr)
+        r4 = cached(playlist, d / "cache_off", "--cache-memo", "off")
+        check("and hits again after that", summary(r4) == (1, 0, 0), r4.stderr)
+
+
+def memo_reuses(proc: subprocess.CompletedProcess) -> int:
+    """The 'P paths from the run memo' count of the summary line. -1 if absent."""
+    for line in proc.stderr.splitlines():
+        if line.startswith("cache: ") and " paths from the run memo" in line:
+            return int(line.split(" paths from the run memo")[0].split()[-1])
+    return -1
+
+
+def test_run_memo_invalidated_by_owner():
+    print("\n=== Scenario 31: the run's path memo, and a task writing under a memoized path ===")
+    with tempfile.TemporaryDirectory() as td:
+        d = Path(td)
+        tree = d / "tree"
+        tree.mkdir()
+        (tree / "a.txt").write_text("a")
+        cache = d / "cache"
+        playlist = d / "pl.json"
+
+        def consumer(name):
+            return {"action": "execute", "tool": "/bin/sh",
+                    "arguments": ["-c", f"cat {tree}/*.txt > {d}/{name}"],
+                    "inputs": [str(tree)], "outputs": [str(d / name)]}
+
+        # c1 memoizes tree/, the producer then writes into it, and c2 must see that write:
+        # a c2 served the memo from before it would store a world_in without b.txt, and
+        # miss on the next run. c3 declares the same tree again and takes c2's memo.
+        playlist.write_text(json.dumps([
+            consumer("o1.txt"),
+            {"action": "execute", "tool": "/bin/sh",
+             "arguments": ["-c", f"echo b > {tree}/b.txt"],
+             "outputs": [str(tree / "b.txt")]},
+            consumer("o2.txt"),
+            consumer("o3.txt"),
+        ]))
+
+        r1 = cached(playlist, cache, "-s")
+        check("run 1 executes all four", summary(r1) == (0, 4, 0), r1.stderr)
+        check("c2 read the producer's file", (d / "o2.txt").read_text() == "ab\n")
+        check("a repeated declaration is served from the run memo", memo_reuses(r1) >= 1, r1.stderr)
+
+        r2 = cached(playlist, cache, "-s")
+        check("run 2 hits all four (nothing stored a stale world_in)", summary(r2) == (4, 0, 0), r2.stderr)
+        check("unchanged declarations are reused", memo_reuses(r2) >= 2, r2.stderr)
+
+        (tree / "a.txt").write_text("a2")
+        r3 = cached(playlist, cache, "-s")
+        check("an edit between runs is seen by every consumer", summary(r3) == (1, 3, 0), r3.stderr)
+
+
+def restored(proc: subprocess.CompletedProcess) -> int:
+    """The 'R restored' count of the summary line. -1 if absent."""
+    for line in proc.stderr.splitlines():
+        if line.startswith("cache: ") and " restored, " in line:
+            return int(line.split(" restored, ")[0].split()[-1])
+    return -1
+
+
+def test_artifact_store():
+    print("\n=== Scenario 32: --cache-artifacts restores outputs instead of executing ===")
+    with tempfile.TemporaryDirectory() as td:
+        d = Path(td)
+        src = d / "in.txt"
+        src.write_text("v1")
+        build = d / "build"
+        out = build / "out.txt"
+        log = d / "log.txt"
+        cache = d / "cache"
+        playlist = d / "pl.json"
+        playlist.write_text(json.dumps([
+            {"action": "execute", "tool": "/bin/sh",
+             "arguments": ["-c", f"echo ran >> {log}; mkdir -p {build}; cat {src} > {out}; chmod 755 {out}"],
+             "inputs": [str(src)], "outputs": [str(out)]},
+        ]))
+
+        def runs():
+            return log.read_text().count("ran")
+
+        r1 = cached(playlist, cache, "--cache-artifacts")
+        check("run 1 executes", summary(r1) == (0, 1, 0) and restored(r1) == 0, r1.stderr)
+        check("run 1 stored the output",
+              any((cache / "artifacts" / "objects").rglob("*")), r1.stderr)
+
+        shutil.rmtree(build)
+        r2 = cached(playlist, cache, "--cache-artifacts", "-v")
+        check("a deleted output is restored, not executed",
+              summary(r2) == (0, 0, 0) and restored(r2) == 1 and runs() == 1, r2.stderr)
+        check("verbose names the restore", "cache: RESTORED (output missing)" in r2.stderr, r2.stderr)
+        check("the restored output has its content and mode",
+              out.read_text() == "v1" and (out.stat().st_mode & 0o777) == 0o755)
+
+        r3 = cached(playlist, cache, "--cache-artifacts")
+        check("a restored task is stored and hits next", summary(r3) == (1, 0, 0), r3.stderr)
+
+        src.write_text("v2")
+        r4 = cached(playlist, cache, "--cache-artifacts")
+        check("new inputs execute", summary(r4) == (0, 1, 0) and runs() == 2, r4.stderr)
+        src.write_text("v1")
+        r5 = cached(playlist, cache, "--cache-artifacts")
+        check("inputs changed back are restored",
+              restored(r5) == 1 and runs() == 2 and out.read_text() == "v1", r5.stderr)
+
+        shutil.rmtree(build)
+        r6 = cached(playlist, cache, "--cache-artifacts", "--dry-run")
+        check("dry run reports RESTORE and writes nothing",
+              "[cache] RESTORE (output missing)" in r6.stdout and not build.exists(), r6.stdout)
+
+        r7 = cached(playlist, cache, "--cache-artifacts", "--cache-refresh")
+        check("--cache-refresh executes instead of restoring",
+              summary(r7) == (0, 1, 0) and restored(r7) == 0 and runs() == 3, r7.stderr)
+
+        r8 = cached(playlist, cache, "--cache-artifacts-limit", "0", "--cache-refresh")
+        check("a zero limit evicts every object",
+              r8.returncode == 0 and not [p for p in (cache / "artifacts" / "objects").rglob("*") if p.is_file()],
+              r8.stderr)
+        shutil.rmtree(build)
+        r9 = cached(playlist, cache, "--cache-artifacts")
+        check("an evicted output executes again", restored(r9) == 0 and runs() == 5, r9.stderr)
+
+        r10 = cached(playlist, cache, "--cache-artifacts-limit", "-1")
+        check("a limit that is not a size is an error",
+              r10.returncode != 0 and "--cache-artifacts-limit" in r10.stderr, r10.stderr)
+
+        # A move owns its source as an exclusive input: putting the destination back
+        # without removing the source would not be what the move did.
+        (d / "m.txt").write_text("m")
+        moves = d / "moves.json"
+        moves.write_text(json.dumps([
+            {"action": "move", "from": str(d / "m.txt"), "to": str(d / "moved.txt")},
+        ]))
+        mcache = d / "mcache"
+        m1 = cached(moves, mcache, "--cache-artifacts")
+        check("a move executes", summary(m1) == (0, 1, 0), m1.stderr)
+        check("and is not stored", not (mcache / "artifacts" / "records").exists(), m1.stderr)
+
+
+def listings(proc: subprocess.CompletedProcess) -> tuple:
+    """(reused, read) from the -v 'listings: N directories reused, M read' line. (-1,-1) if absent."""
+    for line in proc.stderr.splitlines():
+        if line.startswith("listings: ") and " directories reused, " in line:
+            parts = line.split()
+            return (int(parts[1]), int(parts[4]))
+    return (-1, -1)
+
+
+def test_directory_listing_store():
+    print("\n=== Scenario 33: glob inputs expanded from stored directory listings ===")
+    with tempfile.TemporaryDirectory() as td:
+        d = Path(td)
+        src = d / "src"
+        (src / "a").mkdir(parents=True)
+        (src / "b" / "c").mkdir(parents=True)
+        (src / "a" / "x.cpp").write_text("x")
+        (src / "b" / "c" / "y.cpp").write_text("y")
+        (src / "readme.txt").write_text("r")
+        cache = d / "cache"
+        playlist = d / "pl.json"
+        playlist.write_text(json.dumps([
+            {"action": "execute", "tool": "/bin/sh",
+             "arguments": ["-c", f"ls {src}/*/*.cpp {src}/*/*/*.cpp > {d}/out.txt"],
+             "inputs": [f"{src}/**/*.cpp"], "outputs": [str(d / "out.txt")]},
+        ]))
+
+        # A directory changed within two seconds of being read is not stored, and the
+        # tree above was just created.
+        time.sleep(2.5)
+
+        r0 = cached(playlist, d / "dry", "--dry-run")
+        check("a dry run stores no listings",
+              not list((d / "dry").glob("listings-*")), r0.stderr)
+
+        r1 = cached(playlist, cache, "-v")
+        check("run 1 executes and reads the four directories",
+              summary(r1) == (0, 1, 0) and listings(r1) == (0, 4), r1.stderr)
+        check("the listings are stored beside the sidecar",
+              len(list(cache.glob("listings-*.bin"))) == 1, r1.stderr)
+
+        r2 = cached(playlist, cache, "-v")
+        check("run 2 hits without reading a directory",
+              summary(r2) == (1, 0, 0) and listings(r2) == (4, 0), r2.stderr)
+
+        (src / "b" / "c" / "z.cpp").write_text("z")
+        r3 = cached(playlist, cache, "-v")
+        check("a new match misses, and only its directory is read again",
+              summary(r3) == (0, 1, 0) and listings(r3) == (3, 1), r3.stderr)
+
+        (src / "a" / "x.cpp").unlink()
+        r4 = cached(playlist, cache)
+        check("a deleted match misses", summary(r4) == (0, 1, 0), r4.stderr)
+        r5 = cached(playlist, cache)
+        check("and hits after that", summary(r5) == (1, 0, 0), r5.stderr)
+
+        r6 = cached(playlist, cache, "-v", "--cache-memo-refresh")
+        check("--cache-memo-refresh reads every directory again",
+              summary(r6) == (1, 0, 0) and listings(r6) == (0, 4), r6.stderr)
+
+        r7 = cached(playlist, d / "cache_off", "-v", "--cache-memo", "off")
+        check("--cache-memo off keeps no listings",
+              listings(r7) == (-1, -1) and not list((d / "cache_off").glob("listings-*")), r7.stderr)
+
+
+def deduped(proc: subprocess.CompletedProcess) -> tuple:
+    """(files, bytes) from the -v 'fingerprint: N files (B bytes) took the hash' line. (-1,-1) if absent."""
+    for line in proc.stderr.splitlines():
+        if line.startswith("fingerprint: ") and " took the hash " in line:
+            parts = line.split()
+            return (int(parts[1]), int(parts[3].lstrip("(")))
+    return (-1, -1)
+
+
+def test_hash_dedup_by_inode():
+    print("\n=== Scenario 34: one read per file identity in a run ===")
+    with tempfile.TemporaryDirectory() as td:
+        d = Path(td)
+        inc = d / "inc"
+        inc.mkdir()
+        header = "#pragma once\nint shared(void);\n"
+        (inc / "shared.h").write_text(header)
+        os.link(inc / "shared.h", inc / "shared_link.h")
+        (inc / "other.h").write_text("int other(void);\n")
+
+        def consumer(name, declared):
+            return {"action": "execute", "tool": "/bin/sh",
+                    "arguments": ["-c", f"ls {declared} > {d}/{name}"],
+                    "inputs": [str(declared)], "outputs": [str(d / name)]}
+
+        # The directory holds the header twice, as two hard links: the second is not read.
+        links = d / "links.json"
+        links.write_text(json.dumps([consumer("o_dir.txt", inc)]))
+        for memo in ("sidecar", "xattr", "off"):
+            cache = d / f"links_{memo}"
+            r1 = cached(links, cache, "-v", "--cache-memo", memo)
+            check(f"{memo}: a hard link under a declared directory takes the first link's hash",
+                  summary(r1) == (0, 1, 0) and deduped(r1) == (1, len(header)), r1.stderr)
+            r2 = cached(links, cache, "-v", "--cache-memo", memo)
+            check(f"{memo}: and hits on the next run", summary(r2) == (1, 0, 0), r2.stderr)
+
+        # Three tasks declare the header under three different paths, so the run's path
+        # memo, which is keyed by the declared path, serves none of them: the identity
+        # memo does. Concurrent tasks may wait for the owner; the count is the same.
+        shared = d / "shared.json"
+        shared.write_text(json.dumps([
+            consumer("o1.txt", inc / "shared.h"),
+            consumer("o2.txt", inc / "shared_link.h"),
+            consumer("o3.txt", inc / "shared.h"),
+        ]))
+        cache = d / "shared_cache"
+        r1 = cached(shared, cache, "-v", "--cache-memo", "off")
+        check("a header declared under two paths is read once per run",
+              summary(r1) == (0, 3, 0) and deduped(r1)[0] >= 1, r1.stderr)
+        r2 = cached(shared, cache, "-v", "--cache-memo", "off")
+        check("and the tasks hit on the next run", summary(r2) == (3, 0, 0), r2.stderr)
+
+        # The identity includes mtime and ctime: a rewrite between runs is read again.
+        (inc / "shared.h").write_text(header.replace("shared", "changed"))
+        r3 = cached(shared, cache, "-v", "--cache-memo", "off")
+        check("a rewritten header misses for every task", summary(r3) == (0, 3, 0), r3.stderr)
+
+
 if not REPLAY.exists():
     print(f"error: replay binary not found at {REPLAY}")
     sys.exit(1)
@@ -1298,6 +1605,11 @@ test_created_directory_replaced_by_symlink()
 test_env_name_group_move_is_not_a_miss()
 test_unreadable_dir_under_glob_is_not_no_matches()
 test_per_step_cache_and_env_keys()
+test_large_declared_directory()
+test_run_memo_invalidated_by_owner()
+test_artifact_store()
+test_directory_listing_store()
+test_hash_dedup_by_inode()
 
 print(f"\n{'='*40}")
 print(f"  Passed: {_pass}  Failed: {_fail}")
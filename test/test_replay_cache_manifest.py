@@ -14,6 +14,11 @@ Scenarios:
   6. invalid --cache-format / --cache-hash / --cache-memo values are rejected
   7. --dry-run --cache writes no manifest
   8. --help documents the cache options
+  ...
+ 13. --cache-format binary: a mapped table plus an append-only journal - created on the
+     first run, untouched (bytes, inode and mtime) by a run that changes nothing, one
+     journal batch per changed run, pruned through the journal, and rebuilt when the
+     table or journal is corrupt
 
 Usage: python3 test_replay_cache_manifest.py [/path/to/replay]
 Exit:  0 = all checks passed, 1 = one or more failures
@@ -25,6 +30,7 @@ import plistlib
 import subprocess
 import sys
 import tempfile
+import time
 from pathlib import Path
 
 SCRIPT_DIR     = Path(__file__).parent.resolve()
@@ -572,6 +578,7 @@ def test_valid_option_values_run() -> None:
         ["--cache-memo", "xattr"],
         ["--cache-memo", "off"],
         ["--cache-memo-refresh"],
+        ["--cache-format", "binary"],
     ]
     for extra in variants:
         with tempfile.TemporaryDirectory() as td:
@@ -735,6 +742,199 @@ def test_concurrent_keys_do_not_clobber() -> None:
             check(f"warm {key} hits", len(hits) == 1, warm.stderr)
 
 
+# ---------------------------------------------------------------------------
+# Scenario 13: the binary manifest format
+# ---------------------------------------------------------------------------
+
+BINARY_TABLE_MAGIC = b"RPLYMFS\x01"
+JOURNAL_HEADER_BYTES = 32
+
+
+def binary_files(cache_dir: Path) -> tuple:
+    """(table, journal) paths of the single binary manifest in cache_dir; either may not exist."""
+    tables = sorted(cache_dir.glob("*.replay-cache.bin"))
+    assert len(tables) == 1, f"expected one binary table, found {tables}"
+    return tables[0], tables[0].with_suffix(".jrnl")
+
+
+def summary(stderr: str) -> tuple:
+    """(hits, executed, failed) from the end-of-run summary line, or None."""
+    for line in stderr.splitlines():
+        if line.startswith("cache: ") and " hits, " in line:
+            parts = line.split()
+            return (int(parts[1]), int(parts[3]), int(parts[5]))
+    return None
+
+
+def run_binary(cache_dir: Path, playlist: Path, *extra) -> subprocess.CompletedProcess:
+    return run(["--cache-format", "binary", "--cache-dir", cache_dir, "--verbose"]
+               + list(extra) + [playlist])
+
+
+def test_binary_manifest() -> None:
+    print("\n--- Scenario 13a: --cache-format binary writes a table and reads it back ---")
+
+    with tempfile.TemporaryDirectory() as td:
+        td = Path(td)
+        playlist = write_playlist(td)
+        cache_dir = td / "cache"
+
+        result = run_binary(cache_dir, playlist)
+        check("cold binary run exits 0", result.returncode == 0, result.stderr[:300])
+        check("cold binary run executes all three", summary(result.stderr) == (0, 3, 0),
+              result.stderr[:300])
+        table, journal = binary_files(cache_dir)
+        check("table starts with its magic", table.read_bytes()[:8] == BINARY_TABLE_MAGIC,
+              repr(table.read_bytes()[:16]))
+        check("the first publish writes the table, not a journal", not journal.exists(),
+              str(list(cache_dir.iterdir())))
+        first = table.read_bytes()
+        first_stat = table.stat()
+
+        # mtimes have to be able to tell a rewrite apart
+        time.sleep(1.1)
+        result = run_binary(cache_dir, playlist)
+        check("warm binary run hits all three", summary(result.stderr) == (3, 0, 0),
+              result.stderr[:300])
+        check("warm binary run reports three loaded entries", loaded_count(result.stderr) == 3,
+              result.stderr[:300])
+        check("a run that changes nothing leaves the table byte-identical",
+              table.read_bytes() == first)
+        check("a run that changes nothing writes no journal", not journal.exists())
+        warm_stat = table.stat()
+        check("a run that changes nothing does not replace or touch the table",
+              (warm_stat.st_ino, warm_stat.st_mtime_ns) == (first_stat.st_ino, first_stat.st_mtime_ns),
+              f"inode {first_stat.st_ino} -> {warm_stat.st_ino}, "
+              f"mtime {first_stat.st_mtime_ns} -> {warm_stat.st_mtime_ns}")
+        leftovers = [p.name for p in cache_dir.iterdir() if p.name.endswith(".tmp")]
+        check("no temp files left behind", not leftovers, str(leftovers))
+
+
+def test_binary_journal() -> None:
+    print("\n--- Scenario 13b: binary changes are appended to the journal ---")
+
+    with tempfile.TemporaryDirectory() as td:
+        td = Path(td)
+        playlist = write_playlist(td)
+        cache_dir = td / "cache"
+        target = td / "out" / "a.txt"
+
+        run_binary(cache_dir, playlist)
+        table, journal = binary_files(cache_dir)
+        first = table.read_bytes()
+
+        # An entry rewritten with identical fields is not a change, and timestamps have a
+        # one-second resolution, so keep each re-execution in a later second than the last.
+        time.sleep(1.1)
+        target.unlink()
+        result = run_binary(cache_dir, playlist)
+        check("removing one output re-executes exactly that action",
+              summary(result.stderr) == (2, 1, 0), result.stderr[:300])
+        check("the table is not rewritten for one change", table.read_bytes() == first)
+        check("the change went to the journal", journal.exists(), str(list(cache_dir.iterdir())))
+        one_batch = journal.stat().st_size
+        journal_mtime = journal.stat().st_mtime_ns
+
+        time.sleep(1.1)
+        result = run_binary(cache_dir, playlist)
+        check("the journaled entry is read back: all hit", summary(result.stderr) == (3, 0, 0),
+              result.stderr[:300])
+        check("journaled entries count as loaded", loaded_count(result.stderr) == 3,
+              result.stderr[:300])
+        check("a hit-only run does not append", journal.stat().st_size == one_batch)
+        check("a hit-only run does not touch the journal", journal.stat().st_mtime_ns == journal_mtime)
+
+        time.sleep(1.1)
+        target.unlink()
+        result = run_binary(cache_dir, playlist)
+        check("second change re-executes one action", summary(result.stderr) == (2, 1, 0),
+              result.stderr[:300])
+        check("one changed action appends one equally sized batch",
+              journal.stat().st_size - one_batch == one_batch - JOURNAL_HEADER_BYTES,
+              f"{one_batch} then {journal.stat().st_size}")
+        check("the table is still untouched", table.read_bytes() == first)
+
+
+def test_binary_prune() -> None:
+    print("\n--- Scenario 13c: binary entries of removed steps are pruned ---")
+
+    with tempfile.TemporaryDirectory() as td:
+        td = Path(td)
+        playlist = write_playlist(td)
+        cache_dir = td / "cache"
+        run_binary(cache_dir, playlist)
+
+        steps = json.loads(playlist.read_text())
+        playlist.write_text(json.dumps(steps[:2]))
+        result = run_binary(cache_dir, playlist)
+        check("remaining steps hit", summary(result.stderr) == (2, 0, 0), result.stderr[:300])
+        check("all three entries were loaded", loaded_count(result.stderr) == 3,
+              result.stderr[:300])
+
+        result = run_binary(cache_dir, playlist)
+        check("the removed step's entry is gone", loaded_count(result.stderr) == 2,
+              result.stderr[:300])
+        check("still all hits after the prune", summary(result.stderr) == (2, 0, 0),
+              result.stderr[:300])
+
+
+def test_binary_corruption() -> None:
+    print("\n--- Scenario 13d: a corrupt binary table or journal is treated as empty ---")
+
+    damages = {
+        "flipped byte": lambda data: data[:len(data) // 2] + bytes([data[len(data) // 2] ^ 0x40])
+                                     + data[len(data) // 2 + 1:],
+        "truncated": lambda data: data[:len(data) // 2],
+        "empty": lambda data: b"",
+        "json text": lambda data: b'{"version": 1}',
+    }
+    for name, damage in damages.items():
+        with tempfile.TemporaryDirectory() as td:
+            td = Path(td)
+            playlist = write_playlist(td)
+            cache_dir = td / "cache"
+            run_binary(cache_dir, playlist)
+            table, _ = binary_files(cache_dir)
+            table.write_bytes(damage(table.read_bytes()))
+
+            result = run_binary(cache_dir, playlist)
+            check(f"{name} table: exits 0", result.returncode == 0, result.stderr[:300])
+            check(f"{name} table: nothing loaded", loaded_count(result.stderr) == 0,
+                  result.stderr[:300])
+            check(f"{name} table: everything re-executes", summary(result.stderr) == (0, 3, 0),
+                  result.stderr[:300])
+            result = run_binary(cache_dir, playlist)
+            check(f"{name} table: rebuilt, next run hits", summary(result.stderr) == (3, 0, 0),
+                  result.stderr[:300])
+
+    with tempfile.TemporaryDirectory() as td:
+        td = Path(td)
+        playlist = write_playlist(td)
+        cache_dir = td / "cache"
+        run_binary(cache_dir, playlist)
+        table, journal = binary_files(cache_dir)
+
+        # A journal that names no table this one can read adds nothing; the table still hits.
+        journal.write_bytes(b"\0" * 200)
+        result = run_binary(cache_dir, playlist)
+        check("garbage journal: table entries still hit", summary(result.stderr) == (3, 0, 0),
+              result.stderr[:300])
+
+        # A batch torn mid-write ends the journal there; what came before it still counts.
+        # The complete batch is a prune, so whether it was read shows in the loaded count.
+        journal.unlink()
+        steps = json.loads(playlist.read_text())
+        playlist.write_text(json.dumps(steps[:2]))
+        run_binary(cache_dir, playlist)
+        good = journal.read_bytes()
+        journal.write_bytes(good + good[JOURNAL_HEADER_BYTES:JOURNAL_HEADER_BYTES + 40])
+        result = run_binary(cache_dir, playlist)
+        check("torn journal tail: the complete batch before it is still read",
+              loaded_count(result.stderr) == 2, result.stderr[:300])
+        check("torn journal tail: remaining steps hit", summary(result.stderr) == (2, 0, 0),
+              result.stderr[:300])
+
+
 # ---------------------------------------------------------------------------
 # Main
 # ---------------------------------------------------------------------------
@@ -765,6 +965,10 @@ test_multiple_playlist_keys()
 test_manifest_is_stable()
 test_concurrent_processes()
 test_concurrent_keys_do_not_clobber()
+test_binary_manifest()
+test_binary_journal()
+test_binary_prune()
+test_binary_corruption()
 
 print(f"\n{'='*40}")
 print(f"  Passed: {_pass}  Failed: {_fail}")
@@ -21,7 +21,7 @@ Scenarios:
   3.  a flipped byte inside the slots is caught: 0 hits, correct output, rebuilt
   4.  a chopped trailer is treated as an empty store, run still correct
   5.  a store from another machine is ignored
-  6.  --cache-hash crc32c and blake3 keep separate stores, neither invalidating
+  6.  --cache-hash crc32c, blake3 and xxh3 keep separate stores, neither invalidating
       the other
   7.  --cache-memo off writes no store and no xattrs
   8.  --cache-memo xattr writes xattrs and no store
@@ -54,6 +54,14 @@ Scenarios:
       public.fingerprint.* one the other tools would trust in place of reading it -
       and replay still catches a rotted index, because what it verifies is the
       trailer inside the file rather than any record beside it
+  23. concurrent runs over disjoint trees append to one journal side by side, and
+      every record survives
+  24. --cache-defer-compaction appends past the journal budget, and a separate
+      --cache-compact pass folds the journal into the table
+  25. --cache-memo-stats writes the probe histogram, load, timings and save route,
+      and -v prints the same report
+  26. --cache-memo-populate reads the same store to the same hits, and is refused
+      with a memo backend that has no index
 
 Usage: python3 test_replay_fingerprint_store.py [/path/to/replay]
 Exit:  0 = all checks passed, 1 = one or more failures
@@ -73,7 +81,7 @@ REPO_DIR       = SCRIPT_DIR.parent
 DEFAULT_REPLAY = REPO_DIR / "build" / "Release" / "replay"
 REPLAY         = Path(sys.argv[1]) if len(sys.argv) > 1 else DEFAULT_REPLAY
 
-XATTR_NAMES = ("public.fingerprint.crc32c", "public.fingerprint.blake3")
+XATTR_NAMES = ("public.fingerprint.crc32c", "public.fingerprint.blake3", "public.fingerprint.xxh3")
 # replay's own name for the index's self-record. Deliberately not one of the above:
 # those carry a trust rule (inode+size+mtime match => skip reading the file) that an
 # index cannot honour, because bit rot moves none of the three.
@@ -146,7 +154,7 @@ def summary(proc: subprocess.CompletedProcess) -> tuple:
 
 
 def memo(proc: subprocess.CompletedProcess) -> tuple:
-    """'memo: N hits, M computed, store PATH (T table, J journalled)', printed only
+    """'memo: N hits, M computed, store PATH (T table, J journalled in B bytes)', printed only
     under --verbose. (-1, -1, '') if absent."""
     for line in proc.stderr.splitlines():
         if line.startswith("memo: ") and " hits, " in line:
@@ -156,7 +164,7 @@ def memo(proc: subprocess.CompletedProcess) -> tuple:
 
 
 def memo_sources(proc: subprocess.CompletedProcess) -> tuple:
-    """The '(T table, J journalled)' tail of the memo line: where the entries this
+    """The '(T table, J journalled ...)' tail of the memo line: where the entries this
     run could see came from. (-1, -1) if absent."""
     for line in proc.stderr.splitlines():
         if line.startswith("memo: ") and " table, " in line:
@@ -568,7 +576,7 @@ def test_foreign_host():
 
 
 def test_algorithm_split():
-    print("\n=== Scenario 6: crc32c and blake3 keep separate stores ===")
+    print("\n=== Scenario 6: crc32c, blake3 and xxh3 keep separate stores ===")
     with tempfile.TemporaryDirectory() as td:
         d = Path(td).resolve()
         playlist, src, out, _ = make_tree(d, 2)
@@ -588,10 +596,17 @@ def test_algorithm_split():
         check("the crc32c store was left untouched", digest(crc_store) == crc_digest,
               str(crc_store))
 
-        r3 = run(["--cache", "--cache-dir", cache, "-v", playlist])
-        check("switching back to crc32c hits its own store", memo(r3)[0] > 0,
+        r3 = run(["--cache", "--cache-dir", cache, "--cache-hash", "xxh3", "-v", playlist])
+        check("xxh3 run exits 0", r3.returncode == 0, r3.stderr)
+        check("xxh3 gets a third store file", len(store_paths(cache)) == 3,
+              str(store_paths(cache)))
+        check("the xxh3 run started with an empty memo", memo(r3)[0] == 0,
               f"{memo(r3)} in: {r3.stderr}")
 
+        r4 = run(["--cache", "--cache-dir", cache, "-v", playlist])
+        check("switching back to crc32c hits its own store", memo(r4)[0] > 0,
+              f"{memo(r4)} in: {r4.stderr}")
+
 
 def test_memo_off():
     print("\n=== Scenario 7: --cache-memo off writes no store and no xattrs ===")
@@ -883,9 +898,10 @@ def journalled_tree(d: Path, count: int = 3):
 
 def test_torn_journal_is_repaired():
     print("\n=== Scenario 14: a journal torn by a crash is repaired in place ===")
-    # A batch is only as good as its checksum, and a reader stops at the first one
-    # that fails - so a tail half-written by a crash would hide every batch after
-    # it. The repair rewrites the journal from the batches that did verify rather
+    # A batch is only as good as its checksum, and a tail half-written by a crash
+    # would cost every later reader a scan past it. Without the lock a short tail
+    # may be another run's append in flight, so the repair happens under the
+    # exclusive lock, rewriting the journal from the batches that did verify rather
     # than falling back on rewriting the whole table.
     with tempfile.TemporaryDirectory() as td:
         d = Path(td).resolve()
@@ -1303,6 +1319,182 @@ def test_load_factor_forces_compaction():
         check("and nothing is recomputed", memo(r2)[1] == 0, f"{memo(r2)} in: {r2.stderr}")
 
 
+def test_concurrent_runs_append_side_by_side():
+    print("\n=== Scenario 23: concurrent runs append to one journal side by side ===")
+    # Appends hold the store lock shared and go out as one O_APPEND write each, so
+    # two playlists finishing together both land their batch without either one
+    # rewriting the table, and neither batch tears the other.
+    with tempfile.TemporaryDirectory() as td:
+        d = Path(td).resolve()
+        tasks = 20
+        pl_a, src, out, _ = big_tree(d, tasks, "a", 0)
+        pl_b, _, _, _ = big_tree(d, tasks, "b", 100)
+        cache = d / "cache"
+        args = ["--cache", "--cache-dir", cache, "-v"]
+
+        run(args + [pl_a])
+        run(args + [pl_b])
+        table = store_path(cache)
+        table_digest = digest(table)
+        before = read_journal(cache)
+        check("the second playlist went to the journal", len(before.batches) == 1,
+              f"batches={before.batches}")
+
+        changed = 5
+        for i in range(changed):
+            (src / f"in{i}.txt").write_text(f"payload {i} v2 longer")
+            (src / f"in{100 + i}.txt").write_text(f"payload {100 + i} v2 longer")
+        procs = [
+            subprocess.Popen([str(REPLAY)] + [str(a) for a in args + [pl]],
+                             stdout=subprocess.PIPE, stderr=subprocess.PIPE, text=True)
+            for pl in (pl_a, pl_b)
+        ]
+        results = [p.communicate(timeout=120) + (p.returncode,) for p in procs]
+        for name, (_stdout, stderr, code) in zip(("a", "b"), results):
+            check(f"playlist {name} exits 0", code == 0, stderr)
+            check(f"playlist {name} appended its own records",
+                  f"appended {changed * 2} records" in stderr, stderr)
+
+        check("the table was left byte-identical", digest(table) == table_digest, str(table))
+        after = read_journal(cache)
+        check("both batches verify, one after the other",
+              len(after.batches) == len(before.batches) + 2 and after.trailing == 0,
+              f"batches={after.batches} trailing={after.trailing}")
+
+        for name, pl in (("a", pl_a), ("b", pl_b)):
+            r = run(args + [pl])
+            check(f"playlist {name} hits everything afterwards",
+                  summary(r) == (tasks, 0, 0), r.stderr)
+            check("and recomputes nothing", memo(r)[1] == 0, f"{memo(r)} in: {r.stderr}")
+
+
+def test_deferred_compaction():
+    print("\n=== Scenario 24: deferred compaction appends, and --cache-compact folds ===")
+    # The same over-budget change that makes Scenario 16 rewrite the table is
+    # appended instead under --cache-defer-compaction, and the rewrite happens in a
+    # separate --cache-compact pass that needs no playlist.
+    with tempfile.TemporaryDirectory() as td:
+        d = Path(td).resolve()
+        tasks = 140
+        playlist, src, out, _ = big_tree(d, tasks)
+        cache = d / "cache"
+        args = ["--cache", "--cache-dir", cache, "-v"]
+
+        run(args + [playlist])
+        table = store_path(cache)
+        cold = Store(table)
+        budget = max(64, cold.capacity // JOURNAL_SHARE)
+        cold_digest = digest(table)
+
+        changed = (budget // 2) + 4
+        for i in range(changed):
+            (src / f"in{i}.txt").write_text(f"payload {i} v2 longer")
+        r = run(args + ["--cache-defer-compaction", playlist])
+        check("the deferred run exits 0", r.returncode == 0, r.stderr)
+        check("it appended past the budget instead of rewriting",
+              f"appended {changed * 2} records" in r.stderr and "rewrote the store" not in r.stderr,
+              r.stderr)
+        check("the table was left byte-identical", digest(table) == cold_digest, str(table))
+        jrnl = read_journal(cache)
+        check("the journal holds the whole change", jrnl.entries == changed * 2,
+              str(jrnl.batches))
+
+        r2 = run(args + [playlist])
+        check("the next run reads the oversized journal back", memo(r2)[1] == 0,
+              f"{memo(r2)} in: {r2.stderr}")
+        check("and reports its size",
+              f"journalled in {len(jrnl.raw)} bytes" in r2.stderr, r2.stderr)
+
+        rc = run(["--cache-compact", "--cache-dir", cache, "-v"])
+        check("--cache-compact without a playlist exits 0", rc.returncode == 0, rc.stderr)
+        check("it rewrote the table and says how long that took",
+              "rewrote the store" in rc.stderr and " ms, folding in a " in rc.stderr, rc.stderr)
+        check("and cleared the journal", journal_path(cache) is None,
+              str(sorted(cache.iterdir())))
+        folded = Store(table)
+        check("the compacted table verifies and holds every file",
+              folded.crc_ok and folded.count == tasks * 2, f"count={folded.count}")
+
+        folded_digest = digest(table)
+        rc2 = run(["--cache-compact", "--cache-dir", cache, "-v"])
+        check("compacting a store with no journal leaves it alone",
+              "nothing to compact" in rc2.stderr and digest(table) == folded_digest, rc2.stderr)
+
+        r3 = run(args + [playlist])
+        check("every task hits after the compaction", summary(r3) == (tasks, 0, 0), r3.stderr)
+        check("and nothing is recomputed", memo(r3)[1] == 0, f"{memo(r3)} in: {r3.stderr}")
+
+
+def test_memo_stats_report():
+    print("\n=== Scenario 25: --cache-memo-stats reports the tables, timings and save route ===")
+    # The histogram describes the table as the run opened it, so a cold run reports
+    # an empty one and the next run the table the cold run wrote.
+    with tempfile.TemporaryDirectory() as td:
+        d = Path(td).resolve()
+        tasks = 40
+        playlist, src, out, _ = big_tree(d, tasks)
+        cache = d / "cache"
+        stats = d / "memo-stats.json"
+        args = ["--cache", "--cache-dir", cache, "--cache-memo-stats", stats, "-v"]
+
+        r = run(args + [playlist])
+        check("the cold run exits 0", r.returncode == 0, r.stderr)
+        cold = json.loads(stats.read_text())
+        check("it rewrote the table and counts what it wrote",
+              cold["save"]["route"] == "table-rewritten" and
+              cold["save"]["bytes_written"] == store_path(cache).stat().st_size, str(cold["save"]))
+        check("and opened an empty table", cold["table"]["entries"] == 0, str(cold["table"]))
+        check("-v prints the timings", "memo: open " in r.stderr and " bytes written)" in r.stderr,
+              r.stderr)
+
+        r2 = run(args + [playlist])
+        steady = json.loads(stats.read_text())
+        check("a steady run saves nothing", steady["save"] == {"route": "unchanged", "bytes_written": 0},
+              str(steady["save"]))
+        table = steady["table"]
+        check("it opened every file", table["entries"] == tasks * 2, str(table))
+        check("every entry lands in one probe bucket",
+              sum(table["probe_lengths"].values()) == table["entries"], str(table))
+        check("the load factor matches the counts",
+              abs(table["load_factor"] - table["entries"] / table["capacity"]) < 1e-9, str(table))
+        check("-v prints the histogram", "memo: table probe lengths 1:" in r2.stderr, r2.stderr)
+
+        (src / "in0.txt").write_text("payload 0 v2")
+        run(args + [playlist])
+        changed = json.loads(stats.read_text())
+        check("a small change is appended", changed["save"]["route"] == "appended" and
+              changed["save"]["bytes_written"] > 0, str(changed["save"]))
+
+        rc = run(["--cache-compact", "--cache-dir", cache, "--cache-memo-stats", stats])
+        compacted = json.loads(stats.read_text())
+        check("--cache-compact reports its pass too", rc.returncode == 0 and
+              compacted["journal"]["entries"] == 2 and compacted["timing_ms"]["compact"] > 0,
+              f"{compacted} {rc.stderr}")
+
+
+def test_memo_populate():
+    print("\n=== Scenario 26: --cache-memo-populate only changes how the index is read ===")
+    with tempfile.TemporaryDirectory() as td:
+        d = Path(td).resolve()
+        playlist, src, out, _ = make_tree(d, 3)
+        cache = d / "cache"
+        args = ["--cache", "--cache-dir", cache, "-v"]
+
+        run(args + [playlist])
+        r = run(args + ["--cache-memo-populate", playlist])
+        check("a populated run exits 0", r.returncode == 0, r.stderr)
+        check("every task hits", summary(r) == (3, 0, 0), r.stderr)
+        check("and every file comes from the index", memo(r)[1] == 0, f"{memo(r)} in: {r.stderr}")
+
+        (src / "in0.txt").write_text("payload 0 v2")
+        r2 = run(args + ["--cache-memo-populate", playlist])
+        check("a changed file is still noticed", summary(r2) == (2, 1, 0), r2.stderr)
+
+        r3 = run(["--cache-memo", "off", "--cache-memo-populate", "--cache-dir", cache, playlist])
+        check("it is refused without the sidecar",
+              r3.returncode != 0 and "--cache-memo-populate only applies" in r3.stderr, r3.stderr)
+
+
 def test_checksum_xattr_mirror():
     print("\n=== Scenario 22: the index records its own checksum, under its own name ===")
     # The record says what the index contained when it was published, which is a
@@ -1433,6 +1625,10 @@ def main() -> int:
     test_pre_nonce_table_upgrades_once()
     test_changed_existing_files_stay_in_journal()
     test_checksum_xattr_mirror()
+    test_concurrent_runs_append_side_by_side()
+    test_deferred_compaction()
+    test_memo_stats_report()
+    test_memo_populate()
 
     print("\n========================================")
     print(f"  Passed: {_pass}  Failed: {_fail}")